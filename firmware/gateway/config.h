@@ -22,15 +22,20 @@
 
 // Communication and sensor settings
 
-// s, time between each node's communication period
-#define COMM_PERIOD_PADDING 3
+// ms, margin between the comm periods of consecutive nodes, which absorbs the clock offset between
+// the gateway and its nodes
+#define COMM_PERIOD_PADDING 500
 // s, time between communication times for every nodes
 #define DEFAULT_COMM_INTERVAL (60 * 60)
 
 #define WAKE_BEFORE_COMM_PERIOD                                                                    \
-    5 // s, time before comm period when gateway should wake from deep sleep
+    5000 // ms, time before comm period when gateway should wake from deep sleep
 #define WAKE_COMM_PERIOD(X) ((X) - WAKE_BEFORE_COMM_PERIOD)
 #define LISTEN_COMM_PERIOD(X) ((X) - COMM_PERIOD_PADDING)
+// ms, time between the beacon of a comm period and the pre-listen for its first slot, which covers
+// the BEACON_GUARD of the nodes
+#define BEACON_LEAD 3000
+#define BEACON_TIME(X) (LISTEN_COMM_PERIOD(X) - BEACON_LEAD)
 
 #define UPLOAD_EVERY                                                                               \
     3 // amount of times the gateway will communicate with the nodes before uploading data to the
@@ -48,8 +53,16 @@
 #define SENSOR_DATA_TIMEOUT 6000 // ms
 #define SENSOR_DATA_ATTEMPTS 1
 
+#define DEFAULT_ENTRY_LENGTH                                                                       \
+    32 // bytes, assumed length of a node's sensor data entries until the first are received
+
+#define ADR_MARGIN                                                                                 \
+    10 // dB, margin above the demodulation floor with which the settings of nodes are chosen
+
 #define MAX_SENSORDATA_FILESIZE 512 * 1024 // bytes
 
-#define MAX_SENSOR_NODES 20
+#define NVS_PARTITION_SIZE (96 * 1024) // bytes, size of the nvs partition in partitions.csv
+
+#define MAX_SENSOR_NODES 512 // see NodeTable
 
 #endif
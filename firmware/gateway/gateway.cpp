@@ -1,7 +1,10 @@
 #include "gateway.h"
 #include "HTTPClient.h"
+#include <algorithm>
+#include <bitset>
 #include <cstring>
 #include <esp_sntp.h>
+#include <limits>
 
 using namespace mirra;
 
@@ -10,25 +13,323 @@ void Node::timeConfig(Message<TIME_CONFIG>& m)
     this->sampleInterval = m.getSampleInterval();
     this->sampleRounding = m.getSampleRounding();
     this->sampleOffset = m.getSampleOffset();
-    this->lastCommTime = m.getCTime();
+    this->lastCommTime = static_cast<uint32_t>(m.getCTime() / 1000);
     this->commInterval = m.getCommInterval();
-    this->nextCommTime = m.getCommTime();
+    setNextCommTime(m.getCommTime());
     this->maxMessages = m.getMaxMessages();
+    this->settings = m.getSettings();
+    this->shortAddress = m.getShortAddress();
+    this->unsynced = false;
     if (this->errors > 0)
         this->errors--;
 }
 
-void Node::naiveTimeConfig(uint32_t cTime)
+void Node::keepTimeConfig(uint32_t cTime)
 {
-    while (this->nextCommTime <= cTime)
-        this->nextCommTime += commInterval;
+    this->lastCommTime = cTime;
+    this->nextCommTime += commInterval;
+    if (this->errors > 0)
+        this->errors--;
+}
+
+void Node::naiveTimeConfig(uint64_t cTime)
+{
+    uint64_t nextCommTime{getNextCommTime()};
+    while (nextCommTime <= cTime)
+        nextCommTime += commInterval * 1000ULL;
+    setNextCommTime(nextCommTime);
+    this->maxMessages = getFallbackMessages(this->maxMessages, this->settings);
+    this->settings = LoRaModule::defaultSettings;
+    this->unsynced = true;
     this->errors++;
 }
 
-Message<TIME_CONFIG> Node::currentTimeConfig(const MACAddress& src, uint32_t cTime)
+void Node::updateEntryLength(const Message<SENSOR_DATA_BATCH>& m)
+{
+    if (m.getNEntries() == 0)
+        return;
+    constexpr size_t frameOverhead{MessageHeader::maxLength - Message<SENSOR_DATA_BATCH>::capacity};
+    size_t dataLength{m.getLength() - frameOverhead};
+    this->entryLength = std::max<uint32_t>(this->entryLength,
+                                           (dataLength + m.getNEntries() - 1) / m.getNEntries());
+}
+
+void Node::updateLinkQuality(float rssi, float snr)
+{
+    this->rssi = rssi;
+    this->snr = snr;
+    float pathLoss{mirra::getPathLoss(settings, rssi, snr)};
+    // the estimate follows a weakening link faster than a strengthening one
+    float weight{pathLoss > this->pathLoss ? 0.5f : 0.25f};
+    if (this->pathLoss == 0)
+        this->pathLoss = pathLoss;
+    else
+        this->pathLoss += weight * (pathLoss - this->pathLoss);
+}
+
+void Node::updateTurnaround(uint32_t turnaround)
+{
+    // a reply later than a frame timeout is a retransmission after a timeout of the node
+    if (turnaround >= getFrameTimeout(settings))
+        return;
+    float weight{turnaround > this->turnaround ? 0.5f : 0.25f};
+    this->turnaround += weight * (turnaround - this->turnaround);
+}
+
+uint32_t Node::getDrainMessages(uint32_t maxMessages, const PHYSettings& settings,
+                                const PHYSettings& drainSettings) const
+{
+    const uint32_t slotLength{getSlotLength(maxMessages, settings)};
+    uint32_t drainMessages{maxMessages * drainSettings.bandwidth / settings.bandwidth};
+    while (drainMessages > maxMessages && getSlotLength(drainMessages, drainSettings) > slotLength)
+        drainMessages--;
+    return drainMessages;
+}
+
+namespace
+{
+/// @brief Converts a value to an integer amount of tenths, saturated to the range of T.
+template <class T> T toTenths(float value)
+{
+    return static_cast<T>(std::clamp<long>(std::lround(value * 10), std::numeric_limits<T>::min(),
+                                           std::numeric_limits<T>::max()));
+}
+}
+
+Node::Node(const Record& record)
+    : mac{record.mac}, sampleInterval{record.sampleInterval},
+      sampleRounding{record.sampleRounding}, sampleOffset{record.sampleOffset},
+      lastCommTime{record.lastCommTime}, commInterval{record.commInterval},
+      nextCommTime{record.nextCommTime}, maxMessages{record.maxMessages}, errors{record.errors},
+      entryLength{record.entryLength}, settings{record.settings}, rssi{record.rssi / 10.0f},
+      snr{record.snr / 10.0f}, pathLoss{record.pathLoss / 10.0f},
+      turnaround{record.turnaround / 10.0f}, shortAddress{record.shortAddress},
+      unsynced{record.unsynced}, drift{record.drift / 10.0f}, nextCommTimeMs{record.nextCommTimeMs}
+{
+}
+
+Node::Record Node::toRecord() const
+{
+    return Record{mac,
+                  sampleInterval,
+                  sampleRounding,
+                  sampleOffset,
+                  lastCommTime,
+                  commInterval,
+                  nextCommTime,
+                  maxMessages,
+                  static_cast<uint16_t>(std::min<uint32_t>(errors, UINT16_MAX)),
+                  static_cast<uint16_t>(entryLength),
+                  settings,
+                  toTenths<int16_t>(rssi),
+                  toTenths<int16_t>(snr),
+                  toTenths<int16_t>(pathLoss),
+                  toTenths<uint16_t>(turnaround),
+                  shortAddress,
+                  unsynced,
+                  toTenths<int16_t>(drift),
+                  nextCommTimeMs};
+}
+
+Message<TIME_CONFIG> Node::currentTimeConfig(const MACAddress& src, uint64_t cTime,
+                                             uint64_t beaconTime)
 {
     return Message<TIME_CONFIG>(src, mac, cTime, sampleInterval, sampleRounding, sampleOffset,
-                                commInterval, nextCommTime, maxMessages);
+                                commInterval, getNextCommTime(), beaconTime, maxMessages, settings,
+                                shortAddress);
+}
+
+NodeTable::NodeTable() : index(indexSize, 0) {}
+
+uint32_t NodeTable::hash(const void* data, size_t size, uint32_t hash)
+{
+    // FNV-1a
+    const uint8_t* bytes{static_cast<const uint8_t*>(data)};
+    for (size_t i{0}; i < size; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+size_t NodeTable::probe(const MACAddress& mac) const
+{
+    size_t entry{hash(mac.getAddress(), MACAddress::length) & (indexSize - 1)};
+    while (index[entry] != 0 && records[index[entry] - 1].getMACAddress() != mac)
+        entry = (entry + 1) & (indexSize - 1);
+    return entry;
+}
+
+Node* NodeTable::find(const MACAddress& mac)
+{
+    size_t entry{probe(mac)};
+    return index[entry] == 0 ? nullptr : &records[index[entry] - 1];
+}
+
+Node* NodeTable::insert(const Node& node)
+{
+    size_t entry{probe(node.getMACAddress())};
+    if (index[entry] != 0)
+        return &(records[index[entry] - 1] = node);
+    if (full())
+        return nullptr;
+    records.push_back(node);
+    index[entry] = static_cast<uint16_t>(records.size());
+    return &records.back();
+}
+
+void NodeTable::remove(const MACAddress& mac)
+{
+    size_t hole{probe(mac)};
+    if (index[hole] == 0)
+        return;
+    const size_t slot{index[hole] - 1u};
+    // the entries after the hole that cannot be found past it anymore are shifted back into it
+    for (size_t entry{(hole + 1) & (indexSize - 1)}; index[entry] != 0;
+         entry = (entry + 1) & (indexSize - 1))
+    {
+        const MACAddress& other{records[index[entry] - 1].getMACAddress()};
+        size_t home{hash(other.getAddress(), MACAddress::length) & (indexSize - 1)};
+        if (((entry - home) & (indexSize - 1)) >= ((entry - hole) & (indexSize - 1)))
+        {
+            index[hole] = index[entry];
+            hole = entry;
+        }
+    }
+    index[hole] = 0;
+    if (slot + 1 < records.size())
+    {
+        records[slot] = records.back();
+        index[probe(records.back().getMACAddress())] = static_cast<uint16_t>(slot + 1);
+    }
+    records.pop_back();
+}
+
+uint64_t NodeTable::getFirstCommTime() const
+{
+    uint64_t first{static_cast<uint64_t>(-1)};
+    for (const Node& n : records)
+        first = std::min(first, n.getNextCommTime());
+    return first;
+}
+
+std::vector<Node*> NodeTable::sortByNextCommTime()
+{
+    std::vector<Node*> sorted;
+    sorted.reserve(records.size());
+    for (Node& n : records)
+        sorted.push_back(&n);
+    std::sort(sorted.begin(), sorted.end(), [](const Node* a, const Node* b) {
+        return a->getNextCommTime() < b->getNextCommTime();
+    });
+    return sorted;
+}
+
+size_t NodeTable::serialise(size_t blob, Node::Record* blobRecords) const
+{
+    const size_t first{blob * recordsPerBlob};
+    const size_t count{std::min(recordsPerBlob, records.size() - first)};
+    for (size_t i{0}; i < count; i++)
+        blobRecords[i] = records[first + i].toRecord();
+    return count;
+}
+
+uint32_t NodeTable::getChecksum(const Node::Record* blobRecords, size_t count)
+{
+    return hash(blobRecords, count * sizeof(Node::Record), hash(&count, sizeof(count)));
+}
+
+void NodeTable::getBlobKey(char* key, size_t blob)
+{
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "nodes%u", static_cast<unsigned int>(blob));
+}
+
+void NodeTable::load()
+{
+    records.clear();
+    std::fill(index.begin(), index.end(), 0);
+    storedBlobs = 0;
+    fs::NVS nvs{"nodetable"};
+    // read as a plain blob, so that no header is written if there is none
+    Header header{0, 0, 0};
+    nvs.getBlob("header", &header, sizeof(header));
+    if (header.version == 0)
+    {
+        // nodes stored before the table, each keyed by its MAC address (up to its first 0 byte)
+        fs::NVS legacy{"nodes"};
+        for (const char* key : legacy)
+            insert(legacy.getValue<Node>(key));
+        if (!store())
+            return;
+        for (const Node& n : records)
+        {
+            char key[MACAddress::length + 1]{0};
+            strncpy(key, reinterpret_cast<const char*>(n.getMACAddress().getAddress()),
+                    MACAddress::length);
+            legacy.eraseKey(key);
+        }
+        return;
+    }
+    if (header.version != currentVersion || header.recordSize > sizeof(Node::Record))
+        return;
+    const size_t count{std::min<size_t>(header.count, capacity)};
+    std::unique_ptr<uint8_t[]> buffer{new uint8_t[recordsPerBlob * header.recordSize]};
+    std::unique_ptr<Node::Record[]> blobRecords{new Node::Record[recordsPerBlob]};
+    for (size_t blob{0}; blob * recordsPerBlob < count; blob++)
+    {
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        getBlobKey(key, blob);
+        const size_t blobCount{std::min(recordsPerBlob, count - blob * recordsPerBlob)};
+        if (!nvs.getBlob(key, buffer.get(), blobCount * header.recordSize))
+            break;
+        for (size_t i{0}; i < blobCount; i++)
+        {
+            // fields missing from records stored before they were added keep their defaults
+            Node::Record record{Node().toRecord()};
+            std::memcpy(&record, &buffer[i * header.recordSize], header.recordSize);
+            insert(Node(record));
+        }
+        // blobs of records of another size are written anew on the next store
+        if (header.recordSize == sizeof(Node::Record) && storedBlobs == blob &&
+            records.size() == blob * recordsPerBlob + blobCount)
+            checksums[storedBlobs++] = getChecksum(blobRecords.get(),
+                                                   serialise(blob, blobRecords.get()));
+    }
+}
+
+bool NodeTable::store()
+{
+    fs::NVS nvs{"nodetable"};
+    fs::NVS::Transaction transaction{nvs};
+    const size_t blobs{(records.size() + recordsPerBlob - 1) / recordsPerBlob};
+    std::unique_ptr<Node::Record[]> blobRecords{new Node::Record[recordsPerBlob]};
+    for (size_t blob{0}; blob < blobs; blob++)
+    {
+        const size_t count{serialise(blob, blobRecords.get())};
+        const uint32_t checksum{getChecksum(blobRecords.get(), count)};
+        if (blob < storedBlobs && checksums[blob] == checksum)
+            continue;
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        getBlobKey(key, blob);
+        const size_t first{blob * recordsPerBlob};
+        if (!nvs.setBlob(key, blobRecords.get(), count * sizeof(Node::Record)))
+        {
+            // the header is left as is, and the blob written anew on the next store
+            LOG_ERROR("Could not store nodes ", first + 1, " to ", first + count, " of ",
+                      records.size(), " in NVS.");
+            storedBlobs = std::min(storedBlobs, blob);
+            return false;
+        }
+        checksums[blob] = checksum;
+    }
+    for (size_t blob{blobs}; blob < storedBlobs; blob++)
+    {
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        getBlobKey(key, blob);
+        nvs.eraseKey(key);
+    }
+    storedBlobs = blobs;
+    nvs.getValue<Header>("header", Header{0, 0, 0}) =
+        Header{currentVersion, sizeof(Node::Record), static_cast<uint16_t>(records.size())};
+    return true;
 }
 
 RTC_DATA_ATTR bool initialBoot{true};
@@ -46,21 +347,19 @@ RTC_DATA_ATTR uint32_t sampleRounding{DEFAULT_SAMPLE_ROUNDING};
 RTC_DATA_ATTR uint32_t sampleOffset{DEFAULT_SAMPLE_OFFSET};
 RTC_DATA_ATTR uint32_t commInterval{DEFAULT_COMM_INTERVAL};
 
-// TODO: Instead of using this lambda to determine if a node is lost, use a bool stored in each node
-// that signifies if a node is ' well-scheduled ', implying both that the node is not lost and that
-// it follows the scheduled comm time of the previous node tightly (i.e., without scheduling gaps).
-// Removal of a node would imply loss of well-scheduledness of all following nodes, and changing of
-// the comm period would imply loss of well-scheduledness for all nodes. Currently only the latter
-// portion of this functionality is available with just the isLost lambda, During the comm period, a
-// node that is not 'well-scheduled' would be scheduled so that it would become so.
+// A node is lost when it follows a comm interval other than the current one, i.e. after the comm
+// interval was changed. Lost nodes are not part of the schedule until their next comm period, in
+// which they are given a slot like any other node (see SlotScheduler).
 
 auto lambdaIsLost = [](const Node& e) { return e.getCommInterval() != commInterval; };
 
 Gateway::Gateway(const MIRRAPins& pins) : MIRRAModule(pins)
 {
+    // the clock of the gateway is the reference of its nodes, so it is kept exact to the ms
+    syncTime(true);
     if (initialBoot)
     {
-        Log::info("First boot.");
+        LOG_INFO("First boot.");
         Commands(this).rtcUpdateTime();
         initialBoot = false;
     }
@@ -69,8 +368,9 @@ Gateway::Gateway(const MIRRAPins& pins) : MIRRAModule(pins)
 
 void Gateway::wake()
 {
-    Log::debug("Running wake()...");
-    if (!nodes.empty() && rtc.getSysTime() >= (WAKE_COMM_PERIOD(nodes[0].getNextCommTime()) - 3))
+    LOG_DEBUG("Running wake()...");
+    if (!nodes.empty() && rtc.getSysTimeMs() + 3000 >=
+                              WAKE_COMM_PERIOD(BEACON_TIME(nodes.getFirstCommTime())))
         commPeriod();
     // send data to server only every UPLOAD_EVERY comm periods
     if (commPeriods >= UPLOAD_EVERY)
@@ -79,207 +379,354 @@ void Gateway::wake()
     }
     Serial.printf("Welcome! This is Gateway %s\n", lora.getMACAddress().toString());
     commandEntry.prompt(Commands(this));
-    Log::debug("Entering deep sleep...");
+    LOG_DEBUG("Entering deep sleep...");
     if (nodes.empty())
         deepSleep(commInterval);
     else
-        deepSleepUntil(WAKE_COMM_PERIOD(nodes[0].getNextCommTime()));
+        deepSleepUntil(WAKE_COMM_PERIOD(BEACON_TIME(nodes.getFirstCommTime())));
 }
 
 std::optional<std::reference_wrapper<Node>> Gateway::macToNode(const MACAddress& mac)
 {
-    for (Node& n : nodes)
+    if (Node* n{nodes.find(mac)})
+        return std::make_optional(std::ref(*n));
+    return std::nullopt;
+}
+
+uint16_t Gateway::allocateShortAddress() const
+{
+    std::bitset<CompactHeader::maxAddress + 1> assigned;
+    for (const Node& n : nodes)
+        assigned.set(n.getShortAddress());
+    for (uint16_t address{1}; address <= CompactHeader::maxAddress; address++)
     {
-        if (mac == n.getMACAddress())
-            return std::make_optional(std::ref(n));
+        if (!assigned.test(address))
+            return address;
     }
-    return std::nullopt;
+    return 0;
 }
 
 void Gateway::discovery()
 {
-    Log::info("Starting discovery...");
+    LOG_INFO("Starting discovery...");
     while (true)
     {
-        if (nodes.size() >= MAX_SENSOR_NODES)
+        if (nodes.full())
         {
-            Log::info("Could not run discovery because maximum amount of nodes has been reached.");
+            LOG_INFO("Could not run discovery because maximum amount of nodes has been reached.");
             return;
         }
-        Log::info("Awaiting discovery message...");
+        LOG_INFO("Awaiting discovery message...");
         auto hello{lora.listenMessage<HELLO>(DISCOVERY_TIMEOUT, pins.bootPin)};
         if (!hello)
         {
             if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_EXT1)
             {
-                Log::info("Discovery aborted with BOOT button.");
+                LOG_INFO("Discovery aborted with BOOT button.");
                 return;
             }
             continue;
         }
         MACAddress candidate = hello->getSource();
-        Log::info("Node found at ", candidate.toString());
+        LOG_INFO("Node found at ", candidate.toString());
 
         auto duplicate{macToNode(candidate)};
 
-        uint32_t cTime{rtc.getSysTime()};
-        Log::debug("Sending time config message to ", candidate.toString());
+        uint64_t cTime{getSendTime()};
+        LOG_DEBUG("Sending time config message to ", candidate.toString());
         if (duplicate)
         {
-            lora.sendMessage(duplicate->get().currentTimeConfig(lora.getMACAddress(), cTime));
+            lora.sendMessage(duplicate->get().currentTimeConfig(
+                lora.getMACAddress(), cTime, BEACON_TIME(nodes.getFirstCommTime())));
         }
         else
         {
-            uint32_t commTime{std::all_of(nodes.cbegin(), nodes.cend(), lambdaIsLost)
-                                  ? cTime + commInterval
-                                  : nextScheduledCommTime()};
-            Message<TIME_CONFIG> timeConfig{
-                lora.getMACAddress(), candidate,      cTime,
-                sampleInterval,       sampleRounding, sampleOffset,
-                commInterval,         commTime,       MAX_MESSAGES(commInterval, sampleInterval)};
-            Log::debug("Time config constructed. cTime = ", cTime,
-                       " sampleInterval = ", sampleInterval, " sampleRounding = ", sampleRounding,
-                       " sampleOffset = ", sampleOffset, " commInterval = ", commInterval,
-                       " comTime = ", commTime);
-            nodes.emplace_back(timeConfig);
+            uint32_t maxMessages{MAX_MESSAGES(commInterval, sampleInterval)};
+            uint64_t commTime{cTime + commInterval * 1000ULL};
+            // the comm period of the node is preceded by the beacon of the first slot
+            uint64_t beaconTime{BEACON_TIME(commTime)};
+            if (!std::all_of(nodes.begin(), nodes.end(), lambdaIsLost))
+            {
+                beaconTime = BEACON_TIME(nodes.getFirstCommTime());
+                commTime = nextScheduledCommTime(
+                    Node().getSlotLength(maxMessages, LoRaModule::defaultSettings));
+                if (commTime == static_cast<uint64_t>(-1))
+                {
+                    LOG_INFO("Could not register node because the comm interval is fully "
+                             "scheduled.");
+                    return;
+                }
+            }
+            Message<TIME_CONFIG> timeConfig{lora.getMACAddress(),
+                                            candidate,
+                                            cTime,
+                                            sampleInterval,
+                                            sampleRounding,
+                                            sampleOffset,
+                                            commInterval,
+                                            commTime,
+                                            beaconTime,
+                                            maxMessages,
+                                            LoRaModule::defaultSettings,
+                                            allocateShortAddress()};
+            LOG_DEBUG("Time config constructed. cTime = ", static_cast<uint32_t>(cTime / 1000),
+                      " sampleInterval = ", sampleInterval, " sampleRounding = ", sampleRounding,
+                      " sampleOffset = ", sampleOffset, " commInterval = ", commInterval,
+                      " comTime = ", static_cast<uint32_t>(commTime / 1000));
+            nodes.insert(Node(timeConfig));
             lora.sendMessage(timeConfig);
         }
         auto timeAck{
             lora.receiveMessage<ACK_TIME>(TIME_CONFIG_TIMEOUT, TIME_CONFIG_ATTEMPTS, candidate)};
         if (!timeAck)
         {
-            Log::error("Error while receiving ack to time config message from ",
-                       candidate.toString(), ". Aborting discovery.");
+            LOG_ERROR("Error while receiving ack to time config message from ",
+                      candidate.toString(), ". Aborting discovery.");
             if (!duplicate)
-                nodes.pop_back();
+                nodes.remove(candidate);
             return;
         }
 
-        Log::info("Node ", timeAck->getSource().toString(), " has been registered.");
+        Node& node{duplicate ? duplicate->get() : *nodes.find(candidate)};
+        if (auto turnaround{lora.getTurnaround()})
+            node.updateTurnaround(*turnaround);
+        node.setDrift(timeAck->getDrift());
+        LOG_INFO("Node ", timeAck->getSource().toString(), " has been registered.");
         storeNodes();
     }
 }
 
 void Gateway::loadNodes()
 {
-    Log::debug("Recovering nodes from file...");
-    fs::NVS nvsNodes{"nodes"};
-    for (const char* nodeMac : nvsNodes)
-    {
-        nodes.push_back(nvsNodes.getValue<Node>(nodeMac));
-    }
-    Log::debug(nodes.size(), " nodes found in NVS.");
+    LOG_DEBUG("Recovering nodes from file...");
+    nodes.load();
+    LOG_DEBUG(nodes.size(), " nodes found in NVS.");
 }
 
 void Gateway::storeNodes()
 {
-    fs::NVS nvsNodes{"nodes"};
-    for (const Node& node : nodes)
-    {
-        Node defaultNode;
-        char key[7]{0};
-        strncpy(key, reinterpret_cast<const char*>(node.getMACAddress().getAddress()),
-                MACAddress::length);
-        nvsNodes.getValue<Node>(key, defaultNode) = node;
-    }
+    nodes.store();
 }
 
 void Gateway::commPeriod()
 {
-    Log::info("Starting comm period...");
-    std::vector<Message<SENSOR_DATA>> data;
-    size_t expectedMessages{0};
-    for (const Node& n : nodes)
-        expectedMessages += n.getMaxMessages();
-    data.reserve(expectedMessages);
-    auto lambdaByNextCommTime = [](const Node& a, const Node& b) {
-        return a.getNextCommTime() < b.getNextCommTime();
-    };
-    std::sort(nodes.begin(), nodes.end(), lambdaByNextCommTime);
-    uint32_t farCommTime = -1;
-    for (Node& n : nodes)
+    LOG_INFO("Starting comm period...");
+    // received data is written to the file as it arrives, and made durable after each slot
+    SensorFile file{};
+    // the next comm period starts one comm interval after this one, with the slots packed in the
+    // order of this one
+    SlotScheduler schedule{nodes.empty() ? 0 : nodes.getFirstCommTime() + commInterval * 1000ULL,
+                           commInterval * 1000};
+    sendBeacon();
+    uint64_t farCommTime = -1;
+    for (Node* node : nodes.sortByNextCommTime())
     {
+        Node& n{*node};
         if (n.getNextCommTime() > farCommTime)
             break;
-        farCommTime = n.getNextCommTime() +
-                      2 * (COMM_PERIOD_LENGTH(MAX_MESSAGES(commInterval, n.getSampleInterval())) +
-                           COMM_PERIOD_PADDING);
-        if (!nodeCommPeriod(n, data))
-            n.naiveTimeConfig(rtc.getSysTime());
+        farCommTime = n.getNextCommTime() + 2 * n.getSlotLength();
+        const uint64_t scheduled{schedule.getEnd()};
+        lora.startSession(n.getMACAddress(), n.getShortAddress(), false);
+        bool success{nodeCommPeriod(n, file, schedule)};
+        lora.endSession();
+        file.flush();
+        if (!success)
+        {
+            n.naiveTimeConfig(rtc.getSysTimeMs());
+            // the node might have missed its new slot, so its naive slot is kept free as well. If
+            // that overlaps with the slots of the nodes before it, the node is moved to a new slot,
+            // which it learns from the next beacon
+            if (n.getNextCommTime() >= scheduled)
+            {
+                schedule.occupy(n.getNextCommTime(), n.getSlotLength());
+            }
+            else if (n.getShortAddress() != 0 && schedule.fits(n.getSlotLength()))
+            {
+                n.setNextCommTime(schedule.reserve(n.getSlotLength()));
+                LOG_INFO("Node ", n.getMACAddress().toString(), " is moved to a new slot.");
+            }
+            else
+            {
+                LOG_ERROR("Slot of node ", n.getMACAddress().toString(),
+                          " overlaps with the slots scheduled before it.");
+            }
+        }
     }
-    std::sort(nodes.begin(), nodes.end(), lambdaByNextCommTime);
+    file.logStats();
+    lora.configure(LoRaModule::defaultSettings);
     if (nodes.empty())
     {
-        Log::info("No comm periods performed because no nodes have been registered.");
+        LOG_INFO("No comm periods performed because no nodes have been registered.");
     }
     else
     {
         storeNodes();
     }
-    SensorFile file{};
-    for (const Message<SENSOR_DATA>& m : data)
+    commPeriods++;
+}
+
+void Gateway::sendBeacon()
+{
+    if (nodes.empty())
+        return;
+    lora.configure(LoRaModule::defaultSettings);
+    lightSleepUntil(BEACON_TIME(nodes.getFirstCommTime()));
+    Message<BEACON> beacon{lora.getMACAddress(), getSendTime()};
+    // only the nodes that missed their last time config listen for the beacon on purpose, so only
+    // their slots are sent along
+    for (const Node& n : nodes)
     {
-        file.push(m);
+        if (n.isUnsynced() && n.getShortAddress() != 0 &&
+            !beacon.push(n.getShortAddress(), n.getNextCommTime()))
+        {
+            LOG_ERROR("Not all slots fit in the beacon.");
+            break;
+        }
     }
-    commPeriods++;
+    LOG_INFO("Sending beacon...");
+    lora.sendMessage(beacon);
 }
 
-uint32_t Gateway::nextScheduledCommTime()
+uint64_t Gateway::nextScheduledCommTime(uint32_t slotLength)
 {
-    for (size_t i{1}; i <= nodes.size(); i++)
+    uint64_t start{static_cast<uint64_t>(-1)};
+    for (const Node& n : nodes)
     {
-        const Node& n{nodes[nodes.size() - i]};
         if (!lambdaIsLost(n))
-            return n.getNextCommTime() + COMM_PERIOD_LENGTH(n.getMaxMessages()) +
-                   COMM_PERIOD_PADDING;
+            start = std::min(start, n.getNextCommTime());
+    }
+    if (start == static_cast<uint64_t>(-1))
+    {
+        LOG_ERROR("Next scheduled comm time was asked but all nodes are lost!");
+        return -1;
     }
-    Log::error("Next scheduled comm time was asked but all nodes are lost!");
-    return -1;
+    SlotScheduler schedule{start, commInterval * 1000};
+    for (const Node& n : nodes)
+    {
+        if (!lambdaIsLost(n))
+            schedule.occupy(n.getNextCommTime(), n.getSlotLength());
+    }
+    if (!schedule.fits(slotLength))
+        return -1;
+    return schedule.reserve(slotLength);
 }
 
-bool Gateway::nodeCommPeriod(Node& n, std::vector<Message<SENSOR_DATA>>& data)
+bool Gateway::nodeCommPeriod(Node& n, SensorFile& file, SlotScheduler& schedule)
 {
-    uint32_t cTime{rtc.getSysTime()};
+    uint64_t cTime{rtc.getSysTimeMs()};
     if (cTime > n.getNextCommTime())
     {
-        Log::error("Node ", n.getMACAddress().toString(),
-                   "'s comm time was faultily scheduled before this gateway's comm period. "
-                   "Skipping communication with this node.");
+        LOG_ERROR("Node ", n.getMACAddress().toString(),
+                  "'s comm time was faultily scheduled before this gateway's comm period. "
+                  "Skipping communication with this node.");
         return false;
     }
+    lora.configure(n.getSettings());
     lightSleepUntil(
         LISTEN_COMM_PERIOD(n.getNextCommTime()));  // light sleep until scheduled comm period
-    uint32_t listenMs{COMM_PERIOD_PADDING * 1000}; // pre-listen in anticipation of message
-    size_t messagesReceived{0};
+    uint32_t listenMs{COMM_PERIOD_PADDING};        // pre-listen in anticipation of message
+    // waits are cut off where the pre-listen for the next node starts, so as not to miss it
+    const uint64_t slotEnd{n.getNextCommTime() + n.getSlotLength() - COMM_PERIOD_PADDING};
+    auto slotTimeout = [&](uint32_t timeoutMs, uint32_t listenMs = 0) -> uint32_t {
+        uint32_t remainingMs{
+            static_cast<uint32_t>(slotEnd - std::min(rtc.getSysTimeMs(), slotEnd))};
+        return std::min(timeoutMs, remainingMs - std::min(remainingMs, listenMs));
+    };
+    size_t entriesReceived{0};
+    // the node sends its data in bursts, each of which is acked selectively as a whole
+    FrameReceiver frames{};
+    const uint32_t frameTimeout{getFrameTimeout(n.getSettings())};
+    bool inBurst{false};
+    bool poll{false};
+    uint64_t firstFrameTime{0};
+    auto receiveFrame = [&](Message<SENSOR_DATA_BATCH>& sensorData) {
+        if (firstFrameTime == 0)
+            firstFrameTime = rtc.getSysTimeMs() - lora.getMessageAge();
+        if (auto turnaround{lora.getTurnaround()})
+            n.updateTurnaround(*turnaround);
+        poll = sensorData.isPoll();
+        if (!frames.receive(sensorData))
+        {
+            LOG_DEBUG("Discarded retransmission of frame ",
+                      static_cast<uint32_t>(sensorData.getSeq()), ".");
+            return;
+        }
+        LOG_INFO("Sensor data received from ", n.getMACAddress().toString(), " with length ",
+                 sensorData.getLength(), " holding ", sensorData.getNEntries(), " entries");
+        file.push(sensorData);
+        n.updateEntryLength(sensorData);
+        n.updateLinkQuality(lora.getRSSI(), lora.getSNR());
+        entriesReceived += sensorData.getNEntries();
+    };
     while (true)
     {
-        Log::debug("Awaiting data from ", n.getMACAddress().toString(), " ...");
-        auto sensorData{lora.receiveMessage<SENSOR_DATA>(SENSOR_DATA_TIMEOUT, SENSOR_DATA_ATTEMPTS,
-                                                         n.getMACAddress(), listenMs)};
+        LOG_DEBUG("Awaiting data from ", n.getMACAddress().toString(), " ...");
+        auto result{lora.receiveAny(
+            slotTimeout(inBurst ? frameTimeout : SENSOR_DATA_TIMEOUT, listenMs) + listenMs,
+            n.getMACAddress(), receiveFrame)};
         listenMs = 0;
-        if (!sensorData)
+        if (result == LoRaModule::RECEIVED)
+        {
+            inBurst = true;
+            if (!poll)
+                continue;
+        }
+        else if (result == LoRaModule::CRC_MISMATCH)
         {
-            Log::error("Error while awaiting/receiving data from ", n.getMACAddress().toString(),
-                       ". Skipping communication with this node.");
+            // the corrupted frame is nacked once the burst ends
+            inBurst = true;
+            continue;
+        }
+        else if (!inBurst)
+        {
+            LOG_ERROR("Error while awaiting/receiving data from ", n.getMACAddress().toString(),
+                      ". Skipping communication with this node.");
             return false;
         }
-        Log::info("Sensor data received from ", n.getMACAddress().toString(), " with length ",
-                  sensorData->getLength());
-        data.push_back(*sensorData);
-        messagesReceived++;
-        if (sensorData->isLast() || messagesReceived >= n.getMaxMessages())
+        // the burst ended with its poll frame, or with the frame timeout if that was lost
+        inBurst = false;
+        if (frames.isComplete())
         {
-            Log::debug("Last message received.");
+            LOG_DEBUG("Last message received.");
             break;
         }
-        Log::debug("Sending data ACK to ", n.getMACAddress().toString(), " ...");
-        lora.sendMessage(Message<ACK_DATA>(lora.getMACAddress(), n.getMACAddress()));
-    }
-    uint32_t commTime{n.getNextCommTime() + commInterval};
-    if (lambdaIsLost(n) && !(std::all_of(nodes.cbegin(), nodes.cend(), lambdaIsLost)))
-        commTime = nextScheduledCommTime();
-    Log::info("Sending time config message to ", n.getMACAddress().toString(), " ...");
-    cTime = rtc.getSysTime();
+        LOG_DEBUG("Sending data ACK to ", n.getMACAddress().toString(), " ...");
+        lora.sendMessage(frames.getAck(lora.getMACAddress(), n.getMACAddress()));
+    }
+    uint32_t maxMessages{MAX_MESSAGES(commInterval, n.getSampleInterval())};
+    PHYSettings settings{adaptSettings(n.getPathLoss(), ADR_MARGIN, MAX_AIRTIME)};
+    uint32_t slotLength{n.getSlotLength(maxMessages, settings)};
+    // a node that sent as many entries as it could likely has a backlog, which it can drain at a
+    // higher bandwidth by sending more entries in the same slot, so that the schedule is unchanged
+    if (entriesReceived >= n.getMaxMessages())
+    {
+        PHYSettings drainSettings{adaptSettings(n.getPathLoss(), ADR_MARGIN, MAX_AIRTIME, true)};
+        uint32_t drainMessages{n.getDrainMessages(maxMessages, settings, drainSettings)};
+        if (drainSettings.bandwidth > settings.bandwidth && drainMessages > maxMessages)
+        {
+            LOG_INFO("Node ", n.getMACAddress().toString(), " drains its backlog at ",
+                     static_cast<uint32_t>(drainSettings.bandwidth), " kHz.");
+            settings = drainSettings;
+            maxMessages = drainMessages;
+        }
+    }
+    if (!schedule.fits(slotLength))
+        LOG_ERROR("Slot of node ", n.getMACAddress().toString(),
+                  " does not fit in the comm interval anymore.");
+    uint64_t commTime{schedule.reserve(slotLength)};
+    // the address is kept even if the node misses it, as the node follows the gateway in using it
+    if (n.getShortAddress() == 0)
+        n.setShortAddress(allocateShortAddress());
+    // a node whose configuration is unchanged is spared the time config if its clock is still in
+    // sync, i.e. its first frame started within a quarter of the padding of the start of its slot:
+    // the last frame is then acked like any other, after which the node follows its schedule by
+    // itself
+    bool keep{!n.isUnsynced() && n.getShortAddress() != 0 &&
+              commTime == n.getNextCommTime() + commInterval * 1000ULL &&
+              maxMessages == n.getMaxMessages() && settings == n.getSettings() &&
+              firstFrameTime + COMM_PERIOD_PADDING / 4 >= n.getNextCommTime() &&
+              firstFrameTime <= n.getNextCommTime() + COMM_PERIOD_PADDING / 4};
+    cTime = getSendTime();
     Message<TIME_CONFIG> timeConfig{lora.getMACAddress(),
                                     n.getMACAddress(),
                                     cTime,
@@ -288,25 +735,72 @@ bool Gateway::nodeCommPeriod(Node& n, std::vector<Message<SENSOR_DATA>>& data)
                                     n.getSampleOffset(),
                                     commInterval,
                                     commTime,
-                                    MAX_MESSAGES(commInterval, n.getSampleInterval())};
-    lora.sendMessage(timeConfig);
-    auto timeAck =
-        lora.receiveMessage<ACK_TIME>(TIME_CONFIG_TIMEOUT, TIME_CONFIG_ATTEMPTS, n.getMACAddress());
-    if (!timeAck)
-    {
-        Log::error("Error while receiving ack to time config message from ",
-                   n.getMACAddress().toString(), ". Skipping communication with this node.");
-        return false;
+                                    BEACON_TIME(schedule.getStart()),
+                                    maxMessages,
+                                    settings,
+                                    n.getShortAddress()};
+    if (keep)
+    {
+        LOG_INFO("Configuration of node ", n.getMACAddress().toString(),
+                 " is unchanged, sending data ACK ...");
+        lora.sendMessage(frames.getAck(lora.getMACAddress(), n.getMACAddress()));
+    }
+    else
+    {
+        LOG_INFO("Sending time config message to ", n.getMACAddress().toString(), " ...");
+        lora.sendMessage(timeConfig);
+    }
+    size_t attempts{0};
+    while (true)
+    {
+        bool acked{false};
+        poll = false;
+        // the node acks right away, or sends its poll frame again after its reply timeout, so that
+        // a lost ack is repeated well within the slot
+        auto result{lora.receiveAny(
+            slotTimeout(getRetryDuration(n.getSettings())), n.getMACAddress(),
+            [&](Message<ACK_TIME>& ack) {
+                acked = true;
+                n.setDrift(ack.getDrift());
+            },
+            // a node that missed the time config retransmits its last burst, up to its poll frame
+            [&](Message<SENSOR_DATA_BATCH>& sensorData) { poll = sensorData.isPoll(); })};
+        if (result == LoRaModule::RECEIVED)
+        {
+            if (auto turnaround{lora.getTurnaround()})
+                n.updateTurnaround(*turnaround);
+            if (acked)
+                break;
+            if (!poll)
+                continue;
+        }
+        if (attempts++ >= TIME_CONFIG_ATTEMPTS)
+        {
+            LOG_ERROR("Error while receiving ack to time config message from ",
+                      n.getMACAddress().toString(), ". Skipping communication with this node.");
+            return false;
+        }
+        if (result == LoRaModule::RECEIVED)
+        {
+            lora.resendMessage();
+        }
+        else
+        {
+            lora.sendRepeat(n.getMACAddress());
+        }
     }
-    Log::info("Communication with node ", n.getMACAddress().toString(),
-              " successful: ", messagesReceived, " messages received");
-    n.timeConfig(timeConfig);
+    LOG_INFO("Communication with node ", n.getMACAddress().toString(),
+             " successful: ", entriesReceived, " entries received");
+    if (keep)
+        n.keepTimeConfig(static_cast<uint32_t>(cTime / 1000));
+    else
+        n.timeConfig(timeConfig);
     return true;
 }
 
 void Gateway::wifiConnect(const char* SSID, const char* password)
 {
-    Log::info("Connecting to WiFi with SSID: ", SSID);
+    LOG_INFO("Connecting to WiFi with SSID: ", SSID);
     WiFi.begin(SSID, password);
     for (size_t i = 10; i > 0 && WiFi.status() != WL_CONNECTED; i--)
     {
@@ -316,10 +810,10 @@ void Gateway::wifiConnect(const char* SSID, const char* password)
     Serial.print('\n');
     if (WiFi.status() != WL_CONNECTED)
     {
-        Log::error("Could not connect to WiFi.");
+        LOG_ERROR("Could not connect to WiFi.");
         return;
     }
-    Log::info("Connected to WiFi.");
+    LOG_INFO("Connected to WiFi.");
 }
 
 void Gateway::wifiConnect()
@@ -350,7 +844,7 @@ char* Gateway::createTopic(char* topic, const MACAddress& nodeMAC)
 
 void Gateway::uploadPeriod()
 {
-    Log::info("Commencing upload to MQTT server...");
+    LOG_INFO("Commencing upload to MQTT server...");
     wifiConnect();
     SensorFile file{};
     if (WiFi.status() == WL_CONNECTED)
@@ -364,41 +858,45 @@ void Gateway::uploadPeriod()
             if (!entry)
                 break; // no more unuploaded entries remaining
             char topic[topicSize];
-            createTopic(topic, entry->source);
+            createTopic(topic, entry->getSource());
+            uint8_t payload[sizeof(SensorFile::DataEntry)];
+            size_t payloadSize{entry->copyTo(payload)};
 
             if (mqtt.clientConnect())
             {
-                if (mqtt.mqtt.publish(topic, reinterpret_cast<uint8_t*>(&entry), entry->getSize()))
+                if (mqtt.mqtt.publish(topic, payload, payloadSize))
                 {
-                    Log::debug("MQTT message successfully published.");
+                    LOG_DEBUG("MQTT message successfully published.");
                     file.setUploaded();
                     messagesPublished++;
                 }
                 else
                 {
-                    Log::error("Error while publishing to MQTT server. State: ", mqtt.mqtt.state());
+                    LOG_ERROR("Error while publishing to MQTT server. State: ", mqtt.mqtt.state());
                     nErrors++;
                 }
             }
             else
             {
-                Log::error("Error while connecting to MQTT server. Aborting upload. State: ",
-                           mqtt.mqtt.state());
+                LOG_ERROR("Error while connecting to MQTT server. Aborting upload. State: ",
+                          mqtt.mqtt.state());
                 break;
             }
             if (nErrors >= MAX_MQTT_ERRORS)
             {
-                Log::error("Too many errors while publishing to MQTT server. Aborting upload.");
+                LOG_ERROR("Too many errors while publishing to MQTT server. Aborting upload.");
                 break;
             }
         }
         mqtt.mqtt.disconnect();
         WiFi.disconnect();
-        Log::info("MQTT upload finished with ", messagesPublished, " messages sent.");
+        LOG_INFO("MQTT upload finished with ", messagesPublished, " messages sent.");
+        file.flush();
+        file.logStats();
     }
     else
     {
-        Log::error("WiFi not connected. Aborting upload to MQTT server...");
+        LOG_ERROR("WiFi not connected. Aborting upload to MQTT server...");
     }
     commPeriods = 0;
 }
@@ -407,20 +905,20 @@ void Gateway::parseNodeUpdate(char* update)
 {
     if (strlen(update) < (MACAddress::stringLength + 2 + 2 + 1))
     {
-        Log::error("Update string '", update, "' has invalid length.");
+        LOG_ERROR("Update string '", update, "' has invalid length.");
         return;
     }
     auto node{macToNode(MACAddress::fromString(update))};
     if (!node)
     {
-        Log::error("Could not deduce node from update string.");
+        LOG_ERROR("Could not deduce node from update string.");
         return;
     }
     char* timeString{&update[MACAddress::stringLength - 1]};
     uint32_t sampleInterval, sampleRounding, sampleOffset;
     if (sscanf(timeString, "/%u/%u/%u", &sampleInterval, &sampleRounding, &sampleOffset) != 3)
     {
-        Log::error("Could not deduce updated timings from update string '", update, "'.");
+        LOG_ERROR("Could not deduce updated timings from update string '", update, "'.");
         return;
     }
     node->get().setSampleInterval(sampleInterval);
@@ -463,7 +961,10 @@ CommandCode Gateway::Commands::rtcUpdateTime()
     parent->wifiConnect();
     if (WiFi.status() == WL_CONNECTED)
     {
-        Log::info("Fetching NTP time.");
+        LOG_INFO("Fetching NTP time.");
+        // SNTP sets the system time, so the local time is followed with the monotonic clock
+        const uint64_t localTime{parent->rtc.getSysTimeMs()};
+        const unsigned long start{millis()};
         sntp_setoperatingmode(SNTP_OPMODE_POLL);
         sntp_setservername(0, NTP_URL);
         sntp_set_sync_interval(15000);
@@ -473,10 +974,13 @@ CommandCode Gateway::Commands::rtcUpdateTime()
             delay(500);
             Serial.print(".");
         }
-        Serial.println("\nWriting time to RTC...");
-        parent->rtc.writeTime(parent->rtc.getSysTime());
-        Log::info("RTC and system time updated.");
+        const uint64_t ntpTime{parent->rtc.getSysTimeMs()};
         sntp_stop();
+        // the NTP time is taken as a correction of the local time, and the RTC set to it on the
+        // edge of a second before the next deep sleep (see MIRRAModule::writeRTC)
+        parent->rtc.setSysTimeMs(localTime + (millis() - start));
+        parent->correctTime(ntpTime);
+        LOG_INFO("System time updated, RTC is updated before deep sleep.");
     }
     WiFi.disconnect();
     return COMMAND_SUCCESS;
@@ -647,15 +1151,20 @@ CommandCode Gateway::Commands::printSchedule()
 {
     constexpr size_t timeLength{sizeof("0000-00-00 00:00:00")};
     char buffer[timeLength]{0};
-    Serial.println("MAC\tNEXT COMM TIME\tSAMPLE INTERVAL\tMAX MESSAGES");
+    Serial.println("MAC\tADDRESS\tNEXT COMM TIME\tSAMPLE INTERVAL\tMAX MESSAGES\tSLOT LENGTH (MS)"
+                   "\tSF\tBW\tPOWER\tRSSI\tSNR\tDRIFT (PPM)");
     for (const Node& n : parent->nodes)
     {
         tm time;
-        time_t nextNodeCommTime{static_cast<time_t>(n.getNextCommTime())};
+        time_t nextNodeCommTime{static_cast<time_t>(n.getNextCommTime() / 1000)};
         gmtime_r(&nextNodeCommTime, &time);
         strftime(buffer, timeLength, "%F %T", &time);
-        Serial.printf("%s\t%s\t%u\t%u\n", n.getMACAddress().toString(), buffer,
-                      n.getSampleInterval(), n.getMaxMessages());
+        const PHYSettings& settings{n.getSettings()};
+        Serial.printf("%s\t%u\t%s\t%u\t%u\t%u\t%u\t%u\t%i\t%.1f\t%.1f\t%.1f\n",
+                      n.getMACAddress().toString(), n.getShortAddress(), buffer,
+                      n.getSampleInterval(), n.getMaxMessages(), n.getSlotLength(),
+                      settings.spreadingFactor, settings.bandwidth, settings.power, n.getRSSI(),
+                      n.getSNR(), n.getDrift());
     }
     return COMMAND_SUCCESS;
 }
@@ -664,7 +1173,8 @@ CommandCode Gateway::Commands::testMQTT(uint32_t timestamp, uint32_t value)
 {
     using DataEntry = SensorFile::DataEntry;
     SensorValue sensorValue{0, 0, static_cast<float>(value)};
-    DataEntry::SensorValueArray sensorValues = {sensorValue};
+    DataEntry::SensorValues sensorValues;
+    sensorValues.push(sensorValue);
     DataEntry entry{MACAddress{}, timestamp, DataEntry::Flags{1, 0}, sensorValues};
 
     Serial.println("Commencing upload to MQTT server...");
@@ -1,14 +1,20 @@
 #ifndef __GATEWAY_H__
 #define __GATEWAY_H__
 
+#include "LinkAdaptation.h"
 #include "MIRRAModule.h"
 #include "PubSubClient.h"
+#include "SelectiveRepeat.h"
+#include "SlotScheduler.h"
 #include "WiFiClientSecure.h"
 #include "config.h"
+#include <array>
+#include <cmath>
 #include <vector>
 
-#define COMM_PERIOD_LENGTH(MAX_MESSAGES)                                                           \
-    ((MAX_MESSAGES * SENSOR_DATA_TIMEOUT + TIME_CONFIG_TIMEOUT) / 1000)
+#define SLOT_LENGTH(DURATION_MS) ((DURATION_MS) + COMM_PERIOD_PADDING)
+// µs, longest time on air of a message for which the reply still arrives within a receive attempt
+#define MAX_AIRTIME (((SENSOR_DATA_TIMEOUT / (SENSOR_DATA_ATTEMPTS + 1)) - RX_SETUP_TIME) * 1000)
 #define IDEAL_MESSAGES(COMM_INTERVAL, SAMP_INTERVAL) (COMM_INTERVAL / SAMP_INTERVAL)
 #define MAX_MESSAGES(COMM_INTERVAL, SAMP_INTERVAL) ((3 * COMM_INTERVAL / (2 * SAMP_INTERVAL)) + 1)
 
@@ -26,23 +32,90 @@ private:
     uint32_t sampleOffset{0};
     uint32_t lastCommTime{0};
     uint32_t commInterval{0};
+    /// @brief The start of the node's next comm period, in s and the ms after it (see
+    /// nextCommTimeMs).
     uint32_t nextCommTime{0};
     uint32_t maxMessages{0};
     uint32_t errors{0};
+    /// @brief Length in bytes of the longest sensor data entry received from the node, 0 if none
+    /// has been received yet.
+    uint32_t entryLength{0};
+    /// @brief The settings the node communicates with in its comm period.
+    PHYSettings settings{LoRaModule::defaultSettings};
+    /// @brief RSSI (dBm) and SNR (dB) of the last message received from the node.
+    float rssi{0}, snr{0};
+    /// @brief Smoothed estimate of the path loss in dB between the node and the gateway, 0 if no
+    /// message has been received from the node yet.
+    float pathLoss{0};
+    /// @brief Smoothed estimate of the turnaround of the node's replies in ms (see
+    /// LoRaModule::getTurnaround).
+    float turnaround{RX_SETUP_TIME};
+    /// @brief The short address of the node (see CompactHeader), 0 if none is assigned yet. Kept
+    /// after the fields above, as is every field after it, so that nodes stored before it was
+    /// added load with none.
+    uint16_t shortAddress{0};
+    /// @brief Whether the node missed its last time config, after which it listens for the beacon
+    /// (see Message<BEACON>).
+    bool unsynced{false};
+    /// @brief Drift in ppm of the node's clock, as last reported by the node (see
+    /// Message<ACK_TIME>).
+    float drift{0};
+    /// @brief The ms after the second of nextCommTime at which the node's next comm period starts.
+    uint16_t nextCommTimeMs{0};
 
 public:
+    /// @brief The fields of a node as stored in NVS (see NodeTable): packed, such that it holds no
+    /// indeterminate padding, and with the estimates narrowed to tenths of their unit. Fields are
+    /// only added at the end, so that records stored before they were added load with defaults.
+    struct Record
+    {
+        MACAddress mac;
+        uint32_t sampleInterval, sampleRounding, sampleOffset, lastCommTime, commInterval;
+        uint32_t nextCommTime, maxMessages;
+        /// @brief Saturated at UINT16_MAX.
+        uint16_t errors;
+        uint16_t entryLength;
+        PHYSettings settings;
+        /// @brief In tenths of dBm and dB.
+        int16_t rssi, snr, pathLoss;
+        /// @brief In tenths of ms.
+        uint16_t turnaround;
+        uint16_t shortAddress;
+        bool unsynced;
+        /// @brief In tenths of ppm.
+        int16_t drift;
+        uint16_t nextCommTimeMs;
+    } __attribute__((packed));
+
     Node() {}
     Node(Message<TIME_CONFIG>& m) : mac{m.getDest()} { timeConfig(m); }
+    explicit Node(const Record& record);
+    /// @return The record to store the node as.
+    Record toRecord() const;
     /// @brief Configures the Node with a time config message, the same way the actual module would
     /// do.
     /// @param m Time Config message used to saturate the representation's attributes.
     void timeConfig(Message<TIME_CONFIG>& m);
     /// @brief Configures the Node as if the time config message was missed, the same way the actual
-    /// module would do.
-    void naiveTimeConfig(uint32_t cTime);
+    /// module would do, which includes falling back to the default settings.
+    /// @param cTime The current time (UNIX epoch, ms).
+    void naiveTimeConfig(uint64_t cTime);
+    /// @brief Configures the Node as if it received a time config equal to its current
+    /// configuration, which the gateway spares it (see Gateway::nodeCommPeriod).
+    void keepTimeConfig(uint32_t cTime);
+    /// @brief Updates the length of the node's entries with the entries in a received message.
+    void updateEntryLength(const Message<SENSOR_DATA_BATCH>& m);
+    /// @brief Updates the link quality of the node with a message received from it.
+    /// @param rssi The RSSI of the message in dBm.
+    /// @param snr The SNR of the message in dB.
+    void updateLinkQuality(float rssi, float snr);
+    /// @brief Updates the turnaround of the node with the turnaround of a reply received from it.
+    void updateTurnaround(uint32_t turnaround);
+    void setDrift(float drift) { this->drift = drift; }
 
     /// @return A Time Config message that yields the same exact configuration as this node.
-    Message<TIME_CONFIG> currentTimeConfig(const MACAddress& src, uint32_t cTime);
+    Message<TIME_CONFIG> currentTimeConfig(const MACAddress& src, uint64_t cTime,
+                                           uint64_t beaconTime);
 
     const MACAddress& getMACAddress() const { return mac; }
     uint32_t getSampleInterval() const { return sampleInterval; }
@@ -50,12 +123,138 @@ public:
     uint32_t getSampleOffset() const { return sampleOffset; }
     uint32_t getLastCommTime() const { return lastCommTime; }
     uint32_t getCommInterval() const { return commInterval; }
-    uint32_t getNextCommTime() const { return nextCommTime; }
+    /// @return The start of the node's next comm period (UNIX epoch, ms).
+    uint64_t getNextCommTime() const
+    {
+        return static_cast<uint64_t>(nextCommTime) * 1000 + nextCommTimeMs;
+    }
     uint32_t getMaxMessages() const { return maxMessages; }
+    const PHYSettings& getSettings() const { return settings; }
+    float getRSSI() const { return rssi; }
+    float getSNR() const { return snr; }
+    float getPathLoss() const { return pathLoss; }
+    uint32_t getTurnaround() const { return static_cast<uint32_t>(std::ceil(turnaround)); }
+    uint16_t getShortAddress() const { return shortAddress; }
+    bool isUnsynced() const { return unsynced; }
+    float getDrift() const { return drift; }
+    /// @return The length in ms of the node's slot in the gateway's comm period, when it sends up
+    /// to the given amount of entries with the given settings.
+    uint32_t getSlotLength(uint32_t maxMessages, const PHYSettings& settings) const
+    {
+        uint32_t length{entryLength > 0 ? entryLength : DEFAULT_ENTRY_LENGTH};
+        return SLOT_LENGTH(getCommPeriodDuration(maxMessages, length, settings, getTurnaround()));
+    }
+    uint32_t getSlotLength() const { return getSlotLength(maxMessages, settings); }
+    /// @return The amount of entries the node can send with the given drain settings in the slot in
+    /// which it sends the given amount of entries with the given settings. The amount is limited
+    /// such that the node's fallback (see getFallbackMessages) fits in the slot as well.
+    uint32_t getDrainMessages(uint32_t maxMessages, const PHYSettings& settings,
+                              const PHYSettings& drainSettings) const;
 
     void setSampleInterval(uint32_t sampleInterval) { this->sampleInterval = sampleInterval; }
     void setSampleRounding(uint32_t sampleRounding) { this->sampleRounding = sampleRounding; }
     void setSampleOffset(uint32_t sampleOffset) { this->sampleOffset = sampleOffset; }
+    void setShortAddress(uint16_t shortAddress) { this->shortAddress = shortAddress; }
+    void setNextCommTime(uint64_t nextCommTime)
+    {
+        this->nextCommTime = static_cast<uint32_t>(nextCommTime / 1000);
+        this->nextCommTimeMs = static_cast<uint16_t>(nextCommTime % 1000);
+    }
+};
+
+/// @brief The nodes of the gateway, held as a single array of Node records in no particular order,
+/// with an open-addressing index (linear probing) from their MAC addresses to their slots in the
+/// array. The records are stored in NVS as a header and blobs of a fixed amount of records each,
+/// of which only the blobs that changed are written.
+class NodeTable
+{
+public:
+    /// @brief Maximum amount of nodes.
+    static constexpr size_t capacity{MAX_SENSOR_NODES};
+    /// @brief Bytes of the NVS partition available to keys: each 4 KB page holds 126 entries of 32
+    /// bytes, and one page is kept free for garbage collection.
+    static constexpr size_t nvsSpace{(NVS_PARTITION_SIZE / 4096 - 1) * 126 * 32};
+    static_assert(capacity * sizeof(Node::Record) <= nvsSpace / 2,
+                  "The stored table must leave room in NVS for the other keys and for rewriting "
+                  "a blob, which is written anew before the old one is erased.");
+
+    NodeTable();
+
+    /// @return The node with the given MAC address, nullptr if there is none.
+    Node* find(const MACAddress& mac);
+    /// @brief Adds a node, or replaces the node with the same MAC address.
+    /// @return The node in the table, nullptr if the table is full.
+    Node* insert(const Node& node);
+    /// @brief Removes the node with the given MAC address, if any. The last node of the array is
+    /// moved into its slot.
+    void remove(const MACAddress& mac);
+    size_t size() const { return records.size(); }
+    bool empty() const { return records.empty(); }
+    bool full() const { return records.size() >= capacity; }
+    /// @return The start of the earliest next comm period of the nodes (UNIX epoch, ms), -1 if
+    /// there are no nodes.
+    uint64_t getFirstCommTime() const;
+    /// @return The nodes in the order of their next comm periods.
+    std::vector<Node*> sortByNextCommTime();
+
+    Node* begin() { return records.data(); }
+    Node* end() { return records.data() + records.size(); }
+    const Node* begin() const { return records.data(); }
+    const Node* end() const { return records.data() + records.size(); }
+
+    /// @brief Replaces the nodes with the nodes stored in NVS. Nodes stored one blob per node, as
+    /// before the table, are imported, and erased once the table is stored.
+    void load();
+    /// @brief Writes the blobs of the nodes that changed since they were last loaded or stored to
+    /// NVS, and commits them.
+    /// @return Whether all nodes were stored. If not, the stored table is left at its last count.
+    bool store();
+
+private:
+    /// @brief The nodes. Pointers to them are invalidated by insert and remove.
+    std::vector<Node> records;
+    /// @brief Amount of entries of the index: a power of two of at least twice the capacity, so
+    /// that probe sequences stay short.
+    static constexpr size_t indexSize{[] {
+        size_t size{1};
+        while (size < 2 * capacity)
+            size *= 2;
+        return size;
+    }()};
+    static_assert(capacity < UINT16_MAX, "Index entries hold slots as 16-bit values.");
+    /// @brief The slot of a node plus one per entry, 0 for an empty entry.
+    std::vector<uint16_t> index;
+
+    static uint32_t hash(const void* data, size_t size, uint32_t hash = 2166136261u);
+    /// @return The entry of the index that holds the given MAC address, or otherwise the empty
+    /// entry at which it is to be added.
+    size_t probe(const MACAddress& mac) const;
+
+    struct Header
+    {
+        /// @brief Version of the layout of the stored table, 0 if none is stored.
+        uint8_t version;
+        /// @brief Size of a record when it was stored (see Node::Record).
+        uint16_t recordSize;
+        uint16_t count;
+    } __attribute__((packed));
+    static constexpr uint8_t currentVersion{2};
+    /// @brief Amount of records per blob, which keeps a blob within a single NVS page.
+    static constexpr size_t recordsPerBlob{16};
+    static_assert(recordsPerBlob * sizeof(Node::Record) <= 125 * 32,
+                  "A blob must fit in the entries of a page that follow its header entry.");
+    static constexpr size_t maxBlobs{(capacity + recordsPerBlob - 1) / recordsPerBlob};
+    /// @brief Amount of blobs stored, and the checksums of their contents when they were last
+    /// loaded or stored.
+    size_t storedBlobs{0};
+    std::array<uint32_t, maxBlobs> checksums{};
+
+    /// @brief Serialises the nodes of the given blob into records.
+    /// @return The amount of records written.
+    size_t serialise(size_t blob, Node::Record* blobRecords) const;
+    /// @return The checksum of the given records of a blob.
+    static uint32_t getChecksum(const Node::Record* blobRecords, size_t count);
+    static void getBlobKey(char* key, size_t blob);
 };
 
 class Gateway : public MIRRAModule
@@ -87,7 +286,8 @@ private:
         /// @brief Convenience command that configures WiFi, RTC and server settings.
         CommandCode setup();
         /// @brief Prints scheduling information about the connected nodes, including MAC address,
-        /// next comm time, sample interval and max number of messages per comm period.
+        /// next comm time, sample interval, max number of messages per comm period, the length
+        /// of their slot in the comm period, their LoRa settings and link quality.
         CommandCode printSchedule();
         /// @brief  Uploads a single dummy message with configurable timestamp and sensor value to
         /// the MQTT server.
@@ -136,11 +336,13 @@ private:
         bool clientConnect();
     };
 
-    std::vector<Node> nodes;
+    NodeTable nodes;
     /// @brief Returns the local node corresponding to the MAC address.
     /// @param mac The MAC address string in the "00:00:00:00:00:00" format.
     /// @return A reference to the matching node. Disenaged if no match is found.
     std::optional<std::reference_wrapper<Node>> macToNode(const MACAddress& mac);
+    /// @return The lowest short address not assigned to any node, 0 if all are assigned.
+    uint16_t allocateShortAddress() const;
 
     /// @brief Sends a single discovery message, storing the new node and configuring its timings if
     /// there is a response.
@@ -150,21 +352,31 @@ private:
     /// objects through deep sleep.
     void loadNodes();
     /// @brief Updates the nodes stored on the local NVS filesystem. Used to retain the Nodes
-    /// objects through deep sleep.
+    /// objects through deep sleep. Only the nodes that changed are written.
     void storeNodes();
 
     /// @brief Initiates a gateway-wide communication period.
     void commPeriod();
-    /// @brief Retrieves, if possible, the next scheduled start time for a node communication
-    /// period.
-    /// @return The next scheduled comm period if it exists, else -1.
-    uint32_t nextScheduledCommTime();
+    /// @brief Broadcasts the beacon of the communication period (see Message<BEACON>) at its
+    /// beacon time, before its first slot.
+    void sendBeacon();
+    /// @return The time (UNIX epoch, ms) at which the transmission of a message sent right away
+    /// starts, which is the time a time config or beacon carries (see LoRaModule::sendMessage).
+    uint64_t getSendTime() { return rtc.getSysTimeMs() + RX_SETUP_TIME; }
+    /// @brief Retrieves, if possible, the start time of a slot for a node communication period
+    /// right after the slots of the scheduled nodes.
+    /// @param slotLength The length of the slot.
+    /// @return The start of the slot if there are scheduled nodes and the slot fits in their comm
+    /// interval, else -1.
+    uint64_t nextScheduledCommTime(uint32_t slotLength);
     /// @brief Initiates a comm period with a node, retrieving its sensor data and updating its
     /// timings.
     /// @param n The node to communicate with.
-    /// @param data Vector to store the data in.
+    /// @param file File to write the received data to. It is not flushed.
+    /// @param schedule The schedule of the next comm period, in which the node's next slot is
+    /// reserved.
     /// @return Whether the communication period was successful or not.
-    bool nodeCommPeriod(Node& n, std::vector<Message<SENSOR_DATA>>& data);
+    bool nodeCommPeriod(Node& n, SensorFile& file, SlotScheduler& schedule);
 
     static constexpr size_t topicSize =
         sizeof(TOPIC_PREFIX) + MACAddress::stringLength + MACAddress::stringLength;
@@ -0,0 +1,568 @@
+#include "FlashEmulator.h"
+
+#include "nvs_flash.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace mirra::fs::emulator;
+
+namespace
+{
+struct EmulatedPartition
+{
+    esp_partition_t part;
+    std::vector<uint8_t> data;
+    std::vector<uint32_t> sectorErases;
+    FlashStats stats;
+    std::FILE* backing{nullptr};
+
+    EmulatedPartition(const char* label, size_t size)
+        : part{ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_UNDEFINED, 0,
+               static_cast<uint32_t>(size)},
+          data(size, 0xFF), sectorErases(size / sectorSize, 0)
+    {
+        std::strncpy(part.label, label, sizeof(part.label) - 1);
+    }
+    ~EmulatedPartition()
+    {
+        if (backing != nullptr)
+            std::fclose(backing);
+    }
+
+    /// @brief Mirrors the given range of the partition to the backing file, if there is one.
+    void persist(size_t offset, size_t size)
+    {
+        if (backing == nullptr)
+            return;
+        std::fseek(backing, offset, SEEK_SET);
+        std::fwrite(&data[offset], 1, size, backing);
+        std::fflush(backing);
+    }
+};
+
+struct NVSEntry
+{
+    nvs_type_t type;
+    std::vector<uint8_t> data;
+};
+using NVSNamespace = std::map<std::string, NVSEntry>;
+
+struct Emulator
+{
+    bool configured{false};
+    std::string directory;
+    std::map<std::string, size_t> partitionSizes{{"logs", 1380 * 1024}, {"data", 1380 * 1024}};
+    std::map<std::string, std::unique_ptr<EmulatedPartition>> partitions;
+
+    bool nvsLoaded{false};
+    std::map<std::string, NVSNamespace> nvs;
+    std::vector<std::string> handles;
+    NVSStats nvsStats;
+
+    void configure()
+    {
+        if (configured)
+            return;
+        const char* env{std::getenv("MIRRA_FLASH_DIR")};
+        if (env != nullptr)
+            directory = env;
+        configured = true;
+    }
+    std::string backingPath(const char* name) const { return directory + "/" + name + ".bin"; }
+
+    EmulatedPartition* findPartition(const char* label)
+    {
+        configure();
+        auto found{partitions.find(label)};
+        if (found != partitions.end())
+            return found->second.get();
+        auto size{partitionSizes.find(label)};
+        if (size == partitionSizes.end())
+            return nullptr;
+        auto& partition{partitions[label]};
+        partition = std::make_unique<EmulatedPartition>(label, size->second);
+        if (!directory.empty())
+        {
+            std::string path{backingPath(label)};
+            partition->backing = std::fopen(path.c_str(), "r+b");
+            if (partition->backing != nullptr)
+            {
+                std::fread(partition->data.data(), 1, partition->data.size(), partition->backing);
+            }
+            else
+            {
+                partition->backing = std::fopen(path.c_str(), "w+b");
+                partition->persist(0, partition->data.size());
+            }
+        }
+        return partition.get();
+    }
+
+    void loadNVS()
+    {
+        configure();
+        if (nvsLoaded)
+            return;
+        nvsLoaded = true;
+        if (directory.empty())
+            return;
+        std::FILE* file{std::fopen(backingPath("nvs").c_str(), "rb")};
+        if (file == nullptr)
+            return;
+        char ns[NVS_KEY_NAME_MAX_SIZE], key[NVS_KEY_NAME_MAX_SIZE];
+        uint8_t type;
+        uint32_t length;
+        while (std::fread(ns, sizeof(ns), 1, file) == 1 &&
+               std::fread(key, sizeof(key), 1, file) == 1 &&
+               std::fread(&type, sizeof(type), 1, file) == 1 &&
+               std::fread(&length, sizeof(length), 1, file) == 1)
+        {
+            NVSEntry& entry{nvs[ns][key]};
+            entry.type = static_cast<nvs_type_t>(type);
+            entry.data.resize(length);
+            std::fread(entry.data.data(), 1, length, file);
+        }
+        std::fclose(file);
+    }
+
+    void storeNVS()
+    {
+        if (directory.empty())
+            return;
+        std::FILE* file{std::fopen(backingPath("nvs").c_str(), "wb")};
+        if (file == nullptr)
+            return;
+        for (const auto& [nsName, entries] : nvs)
+        {
+            for (const auto& [keyName, entry] : entries)
+            {
+                char ns[NVS_KEY_NAME_MAX_SIZE]{0}, key[NVS_KEY_NAME_MAX_SIZE]{0};
+                std::strncpy(ns, nsName.c_str(), sizeof(ns) - 1);
+                std::strncpy(key, keyName.c_str(), sizeof(key) - 1);
+                uint8_t type{static_cast<uint8_t>(entry.type)};
+                uint32_t length{static_cast<uint32_t>(entry.data.size())};
+                std::fwrite(ns, sizeof(ns), 1, file);
+                std::fwrite(key, sizeof(key), 1, file);
+                std::fwrite(&type, sizeof(type), 1, file);
+                std::fwrite(&length, sizeof(length), 1, file);
+                std::fwrite(entry.data.data(), 1, length, file);
+            }
+        }
+        std::fclose(file);
+    }
+
+    NVSNamespace* fromHandle(nvs_handle_t handle)
+    {
+        if (handle == 0 || handle > handles.size() || handles[handle - 1].empty())
+            return nullptr;
+        return &nvs[handles[handle - 1]];
+    }
+};
+
+Emulator& instance()
+{
+    static Emulator instance{};
+    return instance;
+}
+
+EmulatedPartition* fromPartition(const esp_partition_t* partition)
+{
+    if (partition == nullptr)
+        return nullptr;
+    return instance().findPartition(partition->label);
+}
+
+esp_err_t nvsSet(nvs_handle_t handle, const char* key, nvs_type_t type, const void* value,
+                 size_t length)
+{
+    NVSNamespace* ns{instance().fromHandle(handle)};
+    if (ns == nullptr)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    if (key == nullptr || std::strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    const uint8_t* bytes{static_cast<const uint8_t*>(value)};
+    instance().nvsStats.sets++;
+    NVSEntry& entry{(*ns)[key]};
+    if (entry.type == type && entry.data.size() == length &&
+        std::equal(entry.data.begin(), entry.data.end(), bytes))
+        return ESP_OK;
+    instance().nvsStats.writes++;
+    entry.type = type;
+    entry.data.assign(bytes, bytes + length);
+    return ESP_OK;
+}
+
+esp_err_t nvsGet(nvs_handle_t handle, const char* key, nvs_type_t type, void* value,
+                 size_t* length)
+{
+    NVSNamespace* ns{instance().fromHandle(handle)};
+    if (ns == nullptr)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    auto found{ns->find(key)};
+    if (found == ns->end() || found->second.type != type)
+        return ESP_ERR_NVS_NOT_FOUND;
+    const std::vector<uint8_t>& data{found->second.data};
+    if (value == nullptr)
+    {
+        *length = data.size();
+        return ESP_OK;
+    }
+    if (*length < data.size())
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    std::memcpy(value, data.data(), data.size());
+    *length = data.size();
+    return ESP_OK;
+}
+
+template <class T> esp_err_t nvsGetIntegral(nvs_handle_t handle, const char* key, nvs_type_t type,
+                                            T* value)
+{
+    size_t length{sizeof(T)};
+    return nvsGet(handle, key, type, value, &length);
+}
+}
+
+struct nvs_opaque_iterator_t
+{
+    std::vector<nvs_entry_info_t> entries;
+    size_t index{0};
+};
+
+void mirra::fs::emulator::setBackingDirectory(const char* path)
+{
+    instance().directory = path == nullptr ? "" : path;
+    instance().configured = true;
+}
+
+void mirra::fs::emulator::addPartition(const char* label, size_t size)
+{
+    instance().partitions.erase(label);
+    instance().partitionSizes[label] = (size / sectorSize) * sectorSize;
+}
+
+const FlashStats& mirra::fs::emulator::getFlashStats(const char* label)
+{
+    static const FlashStats none{};
+    EmulatedPartition* partition{instance().findPartition(label)};
+    return partition == nullptr ? none : partition->stats;
+}
+
+uint32_t mirra::fs::emulator::getMaxSectorErases(const char* label)
+{
+    EmulatedPartition* partition{instance().findPartition(label)};
+    if (partition == nullptr)
+        return 0;
+    return *std::max_element(partition->sectorErases.begin(), partition->sectorErases.end());
+}
+
+const NVSStats& mirra::fs::emulator::getNVSStats()
+{
+    return instance().nvsStats;
+}
+
+void mirra::fs::emulator::resetStats()
+{
+    for (auto& [label, partition] : instance().partitions)
+    {
+        partition->stats = FlashStats{};
+        std::fill(partition->sectorErases.begin(), partition->sectorErases.end(), 0);
+    }
+    instance().nvsStats = NVSStats{};
+}
+
+void mirra::fs::emulator::eraseAll()
+{
+    for (auto& [label, partition] : instance().partitions)
+    {
+        std::fill(partition->data.begin(), partition->data.end(), 0xFF);
+        partition->persist(0, partition->data.size());
+    }
+    nvs_flash_erase();
+}
+
+const char* esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NVS_NOT_FOUND:
+        return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_INVALID_HANDLE:
+        return "ESP_ERR_NVS_INVALID_HANDLE";
+    case ESP_ERR_NVS_KEY_TOO_LONG:
+        return "ESP_ERR_NVS_KEY_TOO_LONG";
+    case ESP_ERR_NVS_INVALID_LENGTH:
+        return "ESP_ERR_NVS_INVALID_LENGTH";
+    default:
+        return "UNKNOWN ERROR";
+    }
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type,
+                                                esp_partition_subtype_t subtype, const char* label)
+{
+    EmulatedPartition* partition{instance().findPartition(label)};
+    if (partition == nullptr || partition->part.type != type ||
+        (subtype != ESP_PARTITION_SUBTYPE_ANY && partition->part.subtype != subtype))
+        return nullptr;
+    return &partition->part;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst,
+                             size_t size)
+{
+    EmulatedPartition* emulated{fromPartition(partition)};
+    if (emulated == nullptr || dst == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    if (src_offset > emulated->data.size() || size > emulated->data.size() - src_offset)
+        return ESP_ERR_INVALID_SIZE;
+    std::memcpy(dst, &emulated->data[src_offset], size);
+    emulated->stats.reads++;
+    emulated->stats.bytesRead += size;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src,
+                              size_t size)
+{
+    EmulatedPartition* emulated{fromPartition(partition)};
+    if (emulated == nullptr || src == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    if (dst_offset > emulated->data.size() || size > emulated->data.size() - dst_offset)
+        return ESP_ERR_INVALID_SIZE;
+    const uint8_t* bytes{static_cast<const uint8_t*>(src)};
+    for (size_t i{0}; i < size; i++)
+    {
+        uint8_t& stored{emulated->data[dst_offset + i]};
+        if ((bytes[i] & ~stored) != 0)
+            emulated->stats.writeViolations++;
+        stored &= bytes[i];
+    }
+    emulated->persist(dst_offset, size);
+    emulated->stats.writes++;
+    emulated->stats.bytesWritten += size;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size)
+{
+    EmulatedPartition* emulated{fromPartition(partition)};
+    if (emulated == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    if (offset % sectorSize != 0 || size % sectorSize != 0)
+        return ESP_ERR_INVALID_SIZE;
+    if (offset > emulated->data.size() || size > emulated->data.size() - offset)
+        return ESP_ERR_INVALID_SIZE;
+    std::fill_n(&emulated->data[offset], size, 0xFF);
+    for (size_t sector{offset / sectorSize}; sector < (offset + size) / sectorSize; sector++)
+        emulated->sectorErases[sector]++;
+    emulated->persist(offset, size);
+    emulated->stats.erases++;
+    emulated->stats.bytesErased += size;
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_init(void)
+{
+    instance().loadNVS();
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    instance().loadNVS();
+    instance().nvs.clear();
+    instance().storeNVS();
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t* out_handle)
+{
+    if (name == nullptr || std::strlen(name) >= NVS_KEY_NAME_MAX_SIZE)
+        return ESP_ERR_NVS_INVALID_NAME;
+    instance().loadNVS();
+    instance().nvs[name];
+    instance().handles.emplace_back(name);
+    *out_handle = instance().handles.size();
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    if (instance().fromHandle(handle) != nullptr)
+        instance().handles[handle - 1].clear();
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    if (instance().fromHandle(handle) == nullptr)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    instance().nvsStats.commits++;
+    instance().storeNVS();
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_i8(nvs_handle_t handle, const char* key, int8_t value)
+{
+    return nvsSet(handle, key, NVS_TYPE_I8, &value, sizeof(value));
+}
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char* key, uint8_t value)
+{
+    return nvsSet(handle, key, NVS_TYPE_U8, &value, sizeof(value));
+}
+esp_err_t nvs_set_i16(nvs_handle_t handle, const char* key, int16_t value)
+{
+    return nvsSet(handle, key, NVS_TYPE_I16, &value, sizeof(value));
+}
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char* key, uint16_t value)
+{
+    return nvsSet(handle, key, NVS_TYPE_U16, &value, sizeof(value));
+}
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char* key, int32_t value)
+{
+    return nvsSet(handle, key, NVS_TYPE_I32, &value, sizeof(value));
+}
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char* key, uint32_t value)
+{
+    return nvsSet(handle, key, NVS_TYPE_U32, &value, sizeof(value));
+}
+esp_err_t nvs_set_i64(nvs_handle_t handle, const char* key, int64_t value)
+{
+    return nvsSet(handle, key, NVS_TYPE_I64, &value, sizeof(value));
+}
+esp_err_t nvs_set_u64(nvs_handle_t handle, const char* key, uint64_t value)
+{
+    return nvsSet(handle, key, NVS_TYPE_U64, &value, sizeof(value));
+}
+esp_err_t nvs_set_str(nvs_handle_t handle, const char* key, const char* value)
+{
+    return nvsSet(handle, key, NVS_TYPE_STR, value, std::strlen(value) + 1);
+}
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length)
+{
+    return nvsSet(handle, key, NVS_TYPE_BLOB, value, length);
+}
+
+esp_err_t nvs_get_i8(nvs_handle_t handle, const char* key, int8_t* out_value)
+{
+    return nvsGetIntegral(handle, key, NVS_TYPE_I8, out_value);
+}
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char* key, uint8_t* out_value)
+{
+    return nvsGetIntegral(handle, key, NVS_TYPE_U8, out_value);
+}
+esp_err_t nvs_get_i16(nvs_handle_t handle, const char* key, int16_t* out_value)
+{
+    return nvsGetIntegral(handle, key, NVS_TYPE_I16, out_value);
+}
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char* key, uint16_t* out_value)
+{
+    return nvsGetIntegral(handle, key, NVS_TYPE_U16, out_value);
+}
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char* key, int32_t* out_value)
+{
+    return nvsGetIntegral(handle, key, NVS_TYPE_I32, out_value);
+}
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char* key, uint32_t* out_value)
+{
+    return nvsGetIntegral(handle, key, NVS_TYPE_U32, out_value);
+}
+esp_err_t nvs_get_i64(nvs_handle_t handle, const char* key, int64_t* out_value)
+{
+    return nvsGetIntegral(handle, key, NVS_TYPE_I64, out_value);
+}
+esp_err_t nvs_get_u64(nvs_handle_t handle, const char* key, uint64_t* out_value)
+{
+    return nvsGetIntegral(handle, key, NVS_TYPE_U64, out_value);
+}
+esp_err_t nvs_get_str(nvs_handle_t handle, const char* key, char* out_value, size_t* length)
+{
+    return nvsGet(handle, key, NVS_TYPE_STR, out_value, length);
+}
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length)
+{
+    return nvsGet(handle, key, NVS_TYPE_BLOB, out_value, length);
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key)
+{
+    NVSNamespace* ns{instance().fromHandle(handle)};
+    if (ns == nullptr)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    if (ns->erase(key) == 0)
+        return ESP_ERR_NVS_NOT_FOUND;
+    instance().nvsStats.erases++;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+    NVSNamespace* ns{instance().fromHandle(handle)};
+    if (ns == nullptr)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    instance().nvsStats.erases += ns->size();
+    ns->clear();
+    return ESP_OK;
+}
+
+nvs_iterator_t nvs_entry_find(const char* part_name, const char* namespace_name, nvs_type_t type)
+{
+    instance().loadNVS();
+    auto iterator{std::make_unique<nvs_opaque_iterator_t>()};
+    for (const auto& [nsName, entries] : instance().nvs)
+    {
+        if (namespace_name != nullptr && nsName != namespace_name)
+            continue;
+        for (const auto& [keyName, entry] : entries)
+        {
+            if (type != NVS_TYPE_ANY && entry.type != type)
+                continue;
+            nvs_entry_info_t info{};
+            std::strncpy(info.namespace_name, nsName.c_str(), sizeof(info.namespace_name) - 1);
+            std::strncpy(info.key, keyName.c_str(), sizeof(info.key) - 1);
+            info.type = entry.type;
+            iterator->entries.push_back(info);
+        }
+    }
+    if (iterator->entries.empty())
+        return nullptr;
+    return iterator.release();
+}
+
+nvs_iterator_t nvs_entry_next(nvs_iterator_t iterator)
+{
+    if (iterator == nullptr)
+        return nullptr;
+    if (++iterator->index >= iterator->entries.size())
+    {
+        // ESP-IDF v4.4 releases the iterator itself once the end is reached.
+        delete iterator;
+        return nullptr;
+    }
+    return iterator;
+}
+
+void nvs_entry_info(nvs_iterator_t iterator, nvs_entry_info_t* out_info)
+{
+    *out_info = iterator->entries[iterator->index];
+}
+
+void nvs_release_iterator(nvs_iterator_t iterator)
+{
+    delete iterator;
+}
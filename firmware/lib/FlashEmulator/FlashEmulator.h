@@ -0,0 +1,68 @@
+#ifndef __FLASH_EMULATOR_H__
+#define __FLASH_EMULATOR_H__
+
+#include "esp_partition.h"
+#include "nvs.h"
+#include <cstddef>
+#include <cstdint>
+
+/// @brief Host-side emulation of the ESP32's data partitions and NVS, used to build MIRRAFS
+/// natively.
+///
+/// Partitions behave like NOR flash: erasing is only possible per 4 KB sector and sets all bits to
+/// 1, while writing can only clear bits (the stored byte becomes the AND of old and new contents).
+/// Every operation is counted so the wear and throughput of the filesystem can be measured.
+namespace mirra::fs::emulator
+{
+/// @brief Erase granularity of the emulated flash, equal to that of the ESP32's SPI flash.
+static constexpr size_t sectorSize{4096};
+
+/// @brief Operation counters of a single emulated partition.
+struct FlashStats
+{
+    size_t reads{0};
+    size_t bytesRead{0};
+    size_t writes{0};
+    size_t bytesWritten{0};
+    size_t erases{0};
+    size_t bytesErased{0};
+    /// @brief Amount of bytes written that attempted to set a bit that was cleared (i.e. written
+    /// without erasing first). Real flash silently ignores these bits, corrupting the data.
+    size_t writeViolations{0};
+};
+
+/// @brief Operation counters of the emulated NVS.
+struct NVSStats
+{
+    /// @brief Amount of set calls, regardless of whether the stored value changed.
+    size_t sets{0};
+    /// @brief Amount of set calls that actually changed the stored value.
+    size_t writes{0};
+    size_t commits{0};
+    size_t erases{0};
+};
+
+/// @brief Sets the directory in which partition images and the NVS contents are persisted. Must be
+/// called before the first partition or NVS access. If never called, the directory is taken from
+/// the MIRRA_FLASH_DIR environment variable, and if that is unset, everything is kept in RAM only.
+/// @param path Path of an existing directory, or nullptr to keep everything in RAM.
+void setBackingDirectory(const char* path);
+/// @brief Defines (or redefines) a data partition. Defaults mirror partitions.csv. Must be called
+/// before the partition is first looked up, as redefining discards its contents.
+/// @param label Label of the partition, as passed to esp_partition_find_first.
+/// @param size Size of the partition in bytes. Must be a multiple of the sector size.
+void addPartition(const char* label, size_t size);
+
+/// @return The operation counters of the partition with the given label.
+const FlashStats& getFlashStats(const char* label);
+/// @return The highest amount of times any single sector of the given partition was erased.
+uint32_t getMaxSectorErases(const char* label);
+/// @return The operation counters of the NVS.
+const NVSStats& getNVSStats();
+/// @brief Resets all operation counters, leaving the stored contents untouched.
+void resetStats();
+/// @brief Erases all partitions and the NVS, as a fresh chip would be.
+void eraseAll();
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __EMU_NVS_FLASH_H__
+#define __EMU_NVS_FLASH_H__
+
+#include "nvs.h"
+
+// Host replacement for the ESP-IDF NVS flash initialisation API.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+#include "ClockDrift.h"
+#include <cmath>
+#include <cstdlib>
+
+using namespace mirra;
+
+void ClockDrift::correct(uint64_t localTime, uint64_t referenceTime)
+{
+    const int64_t offset{static_cast<int64_t>(localTime - referenceTime)};
+    if (lastCorrection == 0 || referenceTime < lastCorrection ||
+        std::llabs(offset) > maxPPM * 1e-6f * (referenceTime - lastCorrection) + 2 * maxError)
+    {
+        restart(referenceTime);
+        return;
+    }
+    windowOffset += static_cast<int32_t>(offset);
+    lastCorrection = referenceTime;
+    const uint32_t window{static_cast<uint32_t>(referenceTime - windowStart)};
+    if (previousWindow + window >= minWindow)
+    {
+        const float length{static_cast<float>(previousWindow) + window};
+        const float estimate{(previousOffset + windowOffset) * 1e6f / length};
+        ppm = std::abs(estimate) > 2e6f * maxError / length ? estimate : 0;
+    }
+    if (window >= maxWindow)
+    {
+        previousWindow = window;
+        previousOffset = windowOffset;
+        windowStart = referenceTime;
+        windowOffset = 0;
+    }
+}
+
+void ClockDrift::restart(uint64_t referenceTime)
+{
+    // the estimate is kept, but the offsets of the previous window no longer add up with those of
+    // the next one
+    windowStart = referenceTime;
+    windowOffset = 0;
+    previousWindow = 0;
+    previousOffset = 0;
+    lastCorrection = referenceTime;
+}
+
+int32_t ClockDrift::getOffset(uint64_t localTime) const
+{
+    if (lastCorrection == 0 || localTime <= lastCorrection)
+        return 0;
+    return static_cast<int32_t>(std::lround((localTime - lastCorrection) * ppm * 1e-6f));
+}
+
+uint64_t ClockDrift::toLocal(uint64_t referenceTime) const
+{
+    if (lastCorrection == 0 || referenceTime <= lastCorrection)
+        return referenceTime;
+    const float offset{(referenceTime - lastCorrection) * ppm * 1e-6f};
+    return referenceTime + static_cast<int32_t>(std::lround(offset));
+}
@@ -0,0 +1,70 @@
+#ifndef __CLOCK_DRIFT_H__
+#define __CLOCK_DRIFT_H__
+
+#include <cstdint>
+
+namespace mirra
+{
+/// @brief Estimates the drift of the clock of a node relative to the clock of its gateway, from the
+/// corrections applied to it (see Message<TIME_CONFIG> and Message<BEACON>), and predicts the
+/// offset the clock has built up since its last correction. Times are in ms (UNIX epoch).
+///
+/// The clock is read to the ms at every correction, so that the offset it is corrected by is exact
+/// up to the error of the reference time, i.e. the time in flight of the message that carries it.
+/// The offsets corrected within a window of several comm intervals then add up to the offset the
+/// clock built up over the window. The drift is estimated from the current window together with
+/// the previous one, so that the estimate follows slow changes of the drift, e.g. with the
+/// temperature, without falling back to a short window. Plain data, so that it can be kept in RTC
+/// memory.
+class ClockDrift
+{
+    /// @brief Reference time at the start of the window.
+    uint64_t windowStart{0};
+    /// @brief Sum in ms of the offsets corrected within the window, positive if the clock runs
+    /// fast.
+    int32_t windowOffset{0};
+    /// @brief Length in ms and sum of the offsets in ms of the previous window, 0 if there was
+    /// none.
+    uint32_t previousWindow{0};
+    int32_t previousOffset{0};
+    /// @brief Reference time of the last correction, 0 if there was none.
+    uint64_t lastCorrection{0};
+    /// @brief Estimated drift in ppm, positive if the clock runs fast.
+    float ppm{0};
+
+public:
+    /// @brief Records a correction of the clock.
+    /// @param localTime The time the clock reads.
+    /// @param referenceTime The time the clock is corrected to.
+    void correct(uint64_t localTime, uint64_t referenceTime);
+    /// @brief Records a correction of the clock by an unknown offset, e.g. when the clock could not
+    /// be read to the ms, which starts a new window.
+    /// @param referenceTime The time the clock is corrected to.
+    void restart(uint64_t referenceTime);
+    /// @return The offset in ms the clock is estimated to have built up since the last correction,
+    /// when it reads the given time.
+    int32_t getOffset(uint64_t localTime) const;
+    /// @return The time the clock reads at the given reference time, according to the drift since
+    /// the last correction.
+    uint64_t toLocal(uint64_t referenceTime) const;
+    /// @return The reference time at which the clock reads the given time, according to the drift
+    /// since the last correction.
+    uint64_t toReference(uint64_t localTime) const { return localTime - getOffset(localTime); }
+    float getPPM() const { return ppm; }
+
+    /// @brief Error in ms of the reference time, i.e. of the estimate of the time in flight of the
+    /// message that carries it.
+    static constexpr uint32_t maxError{50};
+    /// @brief Length in ms of the windows from which the drift is estimated first, over which the
+    /// error of the reference time at both ends amounts to some 7 ppm. An estimate is only made
+    /// once it stands out from that error.
+    static constexpr uint32_t minWindow{4 * 60 * 60 * 1000};
+    /// @brief Length in ms of the window after which a new one is started.
+    static constexpr uint32_t maxWindow{4 * 24 * 60 * 60 * 1000};
+    /// @brief Largest drift in ppm of a clock. A larger correction is a change of the time, e.g. by
+    /// a command, which starts a new window.
+    static constexpr float maxPPM{1000};
+};
+}
+
+#endif
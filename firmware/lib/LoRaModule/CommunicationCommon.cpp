@@ -1,5 +1,7 @@
 #include "CommunicationCommon.h"
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
 
 char* MACAddress::toString(char* string) const
 {
@@ -19,3 +21,126 @@ MACAddress MACAddress::fromString(char* string)
 }
 const MACAddress MACAddress::broadcast{};
 char MACAddress::strBuffer[MACAddress::stringLength];
+
+namespace
+{
+/// @brief Writes a signed value as a zigzag-encoded varint.
+/// @return The amount of bytes written, or 0 if the value did not fit in the given size.
+size_t writeVarint(uint8_t* buffer, size_t size, int32_t value)
+{
+    uint32_t zigzag{(static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31)};
+    size_t length{0};
+    do
+    {
+        if (length >= size)
+            return 0;
+        buffer[length++] = (zigzag & 0x7F) | (zigzag > 0x7F ? 0x80 : 0);
+        zigzag >>= 7;
+    } while (zigzag != 0);
+    return length;
+}
+
+/// @brief Reads a zigzag-encoded varint.
+/// @return The amount of bytes read, or 0 if the varint did not end within the given size.
+size_t readVarint(const uint8_t* buffer, size_t size, int32_t& value)
+{
+    uint32_t zigzag{0};
+    for (size_t i{0}; i < size && i < Message<SENSOR_DATA_BATCH>::maxTimeSize; i++)
+    {
+        zigzag |= static_cast<uint32_t>(buffer[i] & 0x7F) << (7 * i);
+        if (!(buffer[i] & 0x80))
+        {
+            value = static_cast<int32_t>((zigzag >> 1) ^ -(zigzag & 1));
+            return i + 1;
+        }
+    }
+    return 0;
+}
+}
+
+bool Message<SENSOR_DATA_BATCH>::push(uint32_t time,
+                                      const Message<SENSOR_DATA>::SensorValues& values)
+{
+    return push(time, values.getData(), values.getSize());
+}
+
+bool Message<SENSOR_DATA_BATCH>::push(uint32_t time, const uint8_t* values, size_t valuesSize)
+{
+    if (valuesSize >= sizeof(Message<SENSOR_DATA>::SensorValues))
+        return false;
+    size_t timeSize{writeVarint(&data[size], capacity - size,
+                                static_cast<int32_t>(time - lastTime))};
+    // the values are stored with their size prefix, as in a SensorValues
+    if (timeSize == 0 || size + timeSize + 1 + valuesSize > capacity)
+        return false;
+    data[size + timeSize] = static_cast<uint8_t>(valuesSize);
+    std::memcpy(&data[size + timeSize + 1], values, valuesSize);
+    size += timeSize + 1 + valuesSize;
+    nEntries++;
+    lastTime = time;
+    return true;
+}
+
+Message<SENSOR_DATA_BATCH>::Iterator::Iterator(const Message<SENSOR_DATA_BATCH>* message,
+                                               size_t position)
+    : message{message}, position{position}, next{position}
+{
+    decode();
+}
+
+void Message<SENSOR_DATA_BATCH>::Iterator::decode()
+{
+    if (position >= message->size)
+        return;
+    int32_t delta{0};
+    size_t timeSize{readVarint(&message->data[position], message->size - position, delta)};
+    size_t valuesPosition{position + timeSize};
+    // the first byte of the encoded values is their size
+    if (timeSize == 0 || valuesPosition >= message->size ||
+        message->data[valuesPosition] >= sizeof(entry.values) ||
+        valuesPosition + 1 + message->data[valuesPosition] > message->size)
+    {
+        // malformed entry: end the iteration
+        position = next = message->size;
+        return;
+    }
+    entry.time += delta;
+    std::memcpy(&entry.values, &message->data[valuesPosition], 1 + message->data[valuesPosition]);
+    entry.nValues = entry.values.count();
+    next = valuesPosition + entry.values.getLength();
+}
+
+Message<SENSOR_DATA_BATCH>::Iterator& Message<SENSOR_DATA_BATCH>::Iterator::operator++()
+{
+    position = next;
+    decode();
+    return *this;
+}
+
+bool Message<BEACON>::push(uint16_t shortAddress, uint64_t commTime)
+{
+    if (nSlots >= maxSlots)
+        return false;
+    slots[nSlots++] = Slot{shortAddress, static_cast<int32_t>(commTime - curTime)};
+    return true;
+}
+
+uint64_t Message<BEACON>::getCommTime(uint16_t shortAddress) const
+{
+    for (size_t i{0}; i < nSlots; i++)
+    {
+        if (slots[i].shortAddress == shortAddress)
+            return curTime + slots[i].commOffset;
+    }
+    return 0;
+}
+
+bool Message<ACK_DATA>::acknowledges(uint8_t seq) const
+{
+    constexpr uint8_t seqModulo{Message<SENSOR_DATA_BATCH>::seqModulo};
+    uint8_t distance{static_cast<uint8_t>(static_cast<uint8_t>(seq - base) % seqModulo)};
+    // frames in the half of the sequence space before the base were all received
+    if (distance >= seqModulo / 2)
+        return true;
+    return distance < window && (received & (1 << distance));
+}
@@ -1,9 +1,10 @@
 #ifndef __COMM_COMM_H__
 #define __COMM_COMM_H__
 
+#include <algorithm>
 #include <array>
 
-#include "Sensor.h"
+#include "SensorEncoding.h"
 
 /// @brief Wrapper around std::array that provides an interface for MAC address operations.
 class MACAddress
@@ -49,7 +50,26 @@ private:
     static char strBuffer[stringLength];
 } __attribute__((packed));
 
-/// @brief Enum used to indicate the type of a message. Maximum of 128 available types.
+/// @brief Physical layer settings of the LoRa link between the gateway and a node, which the
+/// gateway assigns to each node through its time config (see LoRaModule::configure).
+struct PHYSettings
+{
+    uint8_t spreadingFactor;
+    /// @brief Bandwidth in kHz.
+    uint16_t bandwidth;
+    /// @brief Output power in dBm.
+    int8_t power;
+
+    bool operator==(const PHYSettings& other) const
+    {
+        return spreadingFactor == other.spreadingFactor && bandwidth == other.bandwidth &&
+               power == other.power;
+    }
+    bool operator!=(const PHYSettings& other) const { return !(*this == other); }
+} __attribute__((packed));
+
+/// @brief Enum used to indicate the type of a message. Maximum of 64 available types, as the
+/// highest bit of the type field marks a CompactHeader.
 enum MessageType : uint8_t
 {
     ERROR = 0,
@@ -60,8 +80,12 @@ enum MessageType : uint8_t
     SENSOR_DATA = 5,
     ACK_DATA = 6,
     REPEAT = 7,
-    ALL = 8
+    ALL = 8,
+    SENSOR_DATA_BATCH = 9,
+    BEACON = 10
 };
+/// @brief The amount of message types, i.e. one more than the highest type above.
+constexpr size_t nMessageTypes{BEACON + 1};
 
 /// @brief Base class providing a common interface between all message types and the header portion
 /// of the message.
@@ -99,7 +123,7 @@ public:
 
     /// @brief Converts this message in-place to a byte buffer.
     /// @return The pointer to the resulting byte buffer.
-    constexpr const uint8_t* toData() const { return reinterpret_cast<const uint8_t*>(this); }
+    const uint8_t* toData() const { return reinterpret_cast<const uint8_t*>(this); }
 
     /// @brief The length of the header in bytes.
     static constexpr size_t headerLength{1 + 2 * sizeof(MACAddress)};
@@ -107,6 +131,45 @@ public:
     static constexpr size_t maxLength{256};
 } __attribute__((packed));
 
+/// @brief Header that replaces the MessageHeader on air in a session between the gateway and a node
+/// (see LoRaModule::startSession). Both MAC addresses are replaced by the short address the gateway
+/// assigned to the node, from which each side derives the addresses of messages from the other.
+class CompactHeader
+{
+private:
+    uint8_t type : 4;
+    /// @brief Highest two bits of the short address.
+    uint8_t addressHigh : 2;
+    /// @brief Always set, at the position of the highest type bit of a MessageHeader.
+    bool compact : 1;
+    bool last : 1;
+    uint8_t addressLow;
+
+public:
+    CompactHeader(MessageType type, bool last, uint16_t address)
+        : type{static_cast<uint8_t>(type)}, addressHigh{static_cast<uint8_t>(address >> 8)},
+          compact{true}, last{last}, addressLow{static_cast<uint8_t>(address)}
+    {}
+
+    MessageType getType() const { return static_cast<MessageType>(type); }
+    bool isLast() const { return last; }
+    uint16_t getAddress() const { return static_cast<uint16_t>(addressHigh << 8 | addressLow); }
+
+    /// @return Whether the packet in the buffer starts with a compact header instead of a
+    /// MessageHeader.
+    static bool isCompact(const uint8_t* data)
+    {
+        return reinterpret_cast<const CompactHeader*>(data)->compact;
+    }
+    /// @return Whether messages of the given type can be sent with a compact header.
+    static constexpr bool fits(MessageType type) { return type < 16; }
+
+    /// @brief The length of the header in bytes.
+    static constexpr size_t length{2};
+    /// @brief The highest short address. Short address 0 means that none is assigned.
+    static constexpr uint16_t maxAddress{(1 << 10) - 1};
+} __attribute__((packed));
+
 /// @brief Final message class.
 /// @tparam T The message type of the message.
 template <MessageType T> class Message : public MessageHeader
@@ -120,33 +183,61 @@ public:
     /// @brief Converts a byte buffer in-place to this message type, without any runtime checking.
     /// @param data The byte buffer to interpret a message from.
     /// @return The resulting message object.
-    constexpr static Message<T>& fromData(uint8_t* data)
+    static Message<T>& fromData(uint8_t* data)
     {
         return *reinterpret_cast<Message<T>*>(data);
     }
 } __attribute__((packed));
 
+/// @brief Configures a node. Times are in ms (UNIX epoch), so that the slots of the nodes are
+/// aligned to the ms (see SlotScheduler).
 template <> class Message<TIME_CONFIG> : public MessageHeader
 {
 private:
-    uint32_t curTime, sampleInterval, sampleRounding, sampleOffset, commInterval, commTime,
-        maxMessages;
+    /// @brief The time at which the transmission of the message starts.
+    uint64_t curTime;
+    uint32_t sampleInterval, sampleRounding, sampleOffset, commInterval;
+    /// @brief The start of the node's next comm period, in ms after curTime.
+    int32_t commOffset;
+    /// @brief The time of the beacon that precedes the node's next comm period (see
+    /// Message<BEACON>), in ms after curTime.
+    int32_t beaconOffset;
+    uint32_t maxMessages;
+    /// @brief The settings the node communicates with from its next comm period on.
+    PHYSettings settings;
+    /// @brief The short address of the node (see CompactHeader), 0 if none is assigned.
+    uint16_t shortAddress;
 
 public:
-    Message(const MACAddress& src, const MACAddress& dest, uint32_t curTime,
+    Message(const MACAddress& src, const MACAddress& dest, uint64_t curTime,
             uint32_t sampleInterval, uint32_t sampleRounding, uint32_t sampleOffset,
-            uint32_t commInterval, uint32_t commTime, uint32_t maxMessages)
+            uint32_t commInterval, uint64_t commTime, uint64_t beaconTime, uint32_t maxMessages,
+            const PHYSettings& settings, uint16_t shortAddress)
         : MessageHeader(TIME_CONFIG, src, dest), curTime{curTime}, sampleInterval{sampleInterval},
           sampleRounding{sampleRounding}, sampleOffset{sampleOffset}, commInterval{commInterval},
-          commTime{commTime}, maxMessages{maxMessages} {};
+          commOffset{static_cast<int32_t>(commTime - curTime)},
+          beaconOffset{static_cast<int32_t>(beaconTime - curTime)}, maxMessages{maxMessages},
+          settings{settings}, shortAddress{shortAddress} {};
 
-    uint32_t getCTime() const { return curTime; }
+    uint64_t getCTime() const { return curTime; }
+    /// @brief Advances the time carried by the message, e.g. when it is resent, while the other
+    /// times stay put.
+    /// @param elapsed The time in ms to advance by.
+    void advanceCTime(uint32_t elapsed)
+    {
+        curTime += elapsed;
+        commOffset -= static_cast<int32_t>(elapsed);
+        beaconOffset -= static_cast<int32_t>(elapsed);
+    }
     uint32_t getSampleInterval() const { return sampleInterval; }
     uint32_t getSampleRounding() const { return sampleRounding; }
     uint32_t getSampleOffset() const { return sampleOffset; }
     uint32_t getCommInterval() const { return commInterval; }
-    uint32_t getCommTime() const { return commTime; }
+    uint64_t getCommTime() const { return curTime + commOffset; }
+    uint64_t getBeaconTime() const { return curTime + beaconOffset; }
     uint32_t getMaxMessages() const { return maxMessages; }
+    const PHYSettings& getSettings() const { return settings; }
+    uint16_t getShortAddress() const { return shortAddress; }
 
     /// @return The messages' length in bytes.
     constexpr size_t getLength() const { return sizeof(*this); }
@@ -155,52 +246,297 @@ public:
     /// @brief Converts a byte buffer in-place to this message type, without any runtime checking.
     /// @param data The byte buffer to interpret a message from.
     /// @return The resulting message object.
-    constexpr static Message<TIME_CONFIG>& fromData(uint8_t* data)
+    static Message<TIME_CONFIG>& fromData(uint8_t* data)
     {
         return *reinterpret_cast<Message<TIME_CONFIG>*>(data);
     }
 } __attribute__((packed));
 
+/// @brief Acknowledges a time config. Reports the drift of the node's clock, as estimated from the
+/// time configs it received (see ClockDrift), so that the gateway can keep track of it.
+template <> class Message<ACK_TIME> : public MessageHeader
+{
+private:
+    /// @brief The drift of the node's clock in 0.1 ppm, positive if it runs fast.
+    int16_t drift;
+
+public:
+    Message(const MACAddress& src, const MACAddress& dest, float drift = 0)
+        : MessageHeader(ACK_TIME, src, dest),
+          drift{static_cast<int16_t>(std::clamp(drift * 10, INT16_MIN + 0.f, INT16_MAX + 0.f))} {};
+
+    /// @return The drift of the node's clock in ppm.
+    float getDrift() const { return drift / 10.f; }
+
+    /// @return The messages' length in bytes.
+    constexpr size_t getLength() const { return sizeof(*this); }
+    /// @return Whether the message's type flag matches the desired type.
+    constexpr bool isValid() const { return isType(ACK_TIME); }
+    /// @brief Converts a byte buffer in-place to this message type, without any runtime checking.
+    /// @param data The byte buffer to interpret a message from.
+    /// @return The resulting message object.
+    static Message<ACK_TIME>& fromData(uint8_t* data)
+    {
+        return *reinterpret_cast<Message<ACK_TIME>*>(data);
+    }
+} __attribute__((packed));
+
+/// @brief Broadcast by the gateway once at the start of each comm cycle, i.e. before the first slot
+/// of its comm period, so that any node awake at that time can correct its clock. Nodes that missed
+/// their last time config listen for it on purpose (see Message<TIME_CONFIG>::getBeaconTime). The
+/// beacon carries the schedule delta of the cycle: the slots of those nodes, which the gateway may
+/// have moved since. Times are in ms (UNIX epoch).
+template <> class Message<BEACON> : public MessageHeader
+{
+public:
+    /// @brief A moved slot.
+    struct Slot
+    {
+        /// @brief The short address of the node the slot belongs to (see CompactHeader).
+        uint16_t shortAddress;
+        /// @brief The new start of the slot, in ms after the time of the beacon.
+        int32_t commOffset;
+    } __attribute__((packed));
+
+private:
+    static constexpr size_t fieldsLength{sizeof(uint64_t) + sizeof(uint8_t)};
+    /// @brief The time at which the transmission of the beacon starts.
+    uint64_t curTime;
+    uint8_t nSlots{0};
+
+public:
+    /// @brief The maximum amount of slots a single beacon holds.
+    static constexpr size_t maxSlots{(maxLength - headerLength - fieldsLength) / sizeof(Slot)};
+
+private:
+    Slot slots[maxSlots];
+
+public:
+    Message(const MACAddress& src, uint64_t curTime)
+        : MessageHeader(BEACON, src, MACAddress::broadcast), curTime{curTime} {};
+
+    /// @brief Appends a moved slot to the beacon, if there is enough space left.
+    /// @return Whether the slot was appended.
+    bool push(uint16_t shortAddress, uint64_t commTime);
+    uint64_t getCTime() const { return curTime; }
+    /// @return The new start of the slot of the node with the given short address, 0 if its slot
+    /// did not move.
+    uint64_t getCommTime(uint16_t shortAddress) const;
+
+    /// @return The messages' length in bytes.
+    constexpr size_t getLength() const
+    {
+        return headerLength + fieldsLength + nSlots * sizeof(Slot);
+    }
+    /// @return Whether the message's type flag matches the desired type.
+    constexpr bool isValid() const { return isType(BEACON); }
+    /// @brief Converts a byte buffer in-place to this message type, without any runtime checking.
+    /// @param data The byte buffer to interpret a message from.
+    /// @return The resulting message object.
+    static Message<BEACON>& fromData(uint8_t* data)
+    {
+        Message<BEACON>& m{*reinterpret_cast<Message<BEACON>*>(data)};
+        m.nSlots = std::min(m.nSlots, static_cast<uint8_t>(maxSlots));
+        return m;
+    }
+} __attribute__((packed));
+
+/// @brief Acknowledges the sensor data frames a node sent in its last burst (see
+/// Message<SENSOR_DATA_BATCH>). Frames that are not acknowledged are retransmitted by the node.
+template <> class Message<ACK_DATA> : public MessageHeader
+{
+private:
+    /// @brief Sequence number of the first frame not received yet. All frames before it were.
+    uint8_t base;
+    /// @brief Bitmap of the frames received after the base: bit i is set if the frame with sequence
+    /// number base + i was received.
+    uint8_t received;
+
+public:
+    /// @brief The maximum amount of frames a node sends before it awaits an ack, which is the range
+    /// of frames covered by the bitmap.
+    static constexpr size_t window{8 * sizeof(received)};
+
+    Message(const MACAddress& src, const MACAddress& dest, uint8_t base, uint8_t received)
+        : MessageHeader(ACK_DATA, src, dest), base{base}, received{received} {};
+
+    uint8_t getBase() const { return base; }
+    /// @return Whether the frame with the given sequence number was received, assuming that it lies
+    /// within the window of the node that sent it.
+    bool acknowledges(uint8_t seq) const;
+
+    /// @return The messages' length in bytes.
+    constexpr size_t getLength() const { return sizeof(*this); }
+    /// @return Whether the message's type flag matches the desired type.
+    constexpr bool isValid() const { return isType(ACK_DATA); }
+    /// @brief Converts a byte buffer in-place to this message type, without any runtime checking.
+    /// @param data The byte buffer to interpret a message from.
+    /// @return The resulting message object.
+    static Message<ACK_DATA>& fromData(uint8_t* data)
+    {
+        return *reinterpret_cast<Message<ACK_DATA>*>(data);
+    }
+} __attribute__((packed));
+
 template <> class Message<SENSOR_DATA> : public MessageHeader
 {
 public:
+    /// @brief Encoded sensor values (see SensorEncoding.h). Sized such that a full set of values
+    /// also fits in a single SENSOR_DATA_BATCH message, along with its framing.
+    using SensorValues = EncodedSensorValues<maxLength - headerLength - 9>;
+
     /// @brief The timestamp associated with the held values (UNIX epoch, seconds).
     uint32_t time;
 
-    /// @brief The amount of values held in the messages' values array.
+    /// @brief The amount of values held in the messages' values.
     uint8_t nValues;
 
-    /// @brief The maximum amount of sensor values that can be held in a single sensor data message.
-    static constexpr size_t maxNValues =
-        (maxLength - headerLength - sizeof(time) - sizeof(nValues)) / sizeof(SensorValue);
+    SensorValues values{};
 
-    struct SensorValueArray : public std::array<SensorValue, Message<SENSOR_DATA>::maxNValues>
-    {
-    } __attribute__((packed));
-    SensorValueArray values{};
+    /// @brief The amount of sensor values that always fit in a single sensor data message,
+    /// regardless of their encoding.
+    static constexpr size_t maxNValues = (sizeof(SensorValues) - 1) / maxEncodedSize;
 
     Message(const MACAddress& src, const MACAddress& dest, uint32_t time, const uint8_t nValues,
-            const std::array<SensorValue, maxNValues> values)
-        : MessageHeader(SENSOR_DATA, src, dest), time{time},
-          nValues{std::min(nValues, static_cast<uint8_t>(maxNValues))}, values{values} {};
+            const SensorValues& values)
+        : MessageHeader(SENSOR_DATA, src, dest), time{time}, nValues{nValues}, values{values} {};
 
     /// @return The messages' length in bytes.
     constexpr size_t getLength() const
     {
-        return headerLength + sizeof(time) + sizeof(nValues) + nValues * sizeof(SensorValue);
+        return headerLength + sizeof(time) + sizeof(nValues) + values.getLength();
     }
     /// @return Whether the message's type flag matches the desired type.
     constexpr bool isValid() const { return isType(SENSOR_DATA); }
     /// @brief Converts a byte buffer in-place to this message type, without any runtime checking.
     /// @param data The byte buffer to interpret a message from.
     /// @return The resulting message object.
-    static constexpr Message<SENSOR_DATA>& fromData(uint8_t* data);
+    static Message<SENSOR_DATA>& fromData(uint8_t* data);
 } __attribute__((packed));
 
-constexpr Message<SENSOR_DATA>& Message<SENSOR_DATA>::fromData(uint8_t* data)
+inline Message<SENSOR_DATA>& Message<SENSOR_DATA>::fromData(uint8_t* data)
 {
     Message<SENSOR_DATA>& m{*reinterpret_cast<Message<SENSOR_DATA>*>(data)};
-    m.nValues = std::min(m.nValues, static_cast<uint8_t>(maxNValues));
+    m.values.sanitize();
+    return m;
+}
+
+/// @brief Sensor data message packing as many data entries as fit in a single frame. All entries
+/// share the source of the message. Each entry is encoded as the difference of its timestamp with
+/// the previous entry's (zigzag varint, the first entry's is relative to 0), followed by its
+/// size-prefixed encoded values.
+///
+/// A node sends its frames in bursts of up to Message<ACK_DATA>::window frames, numbered in order
+/// within its comm period. The last frame of a burst is flagged as poll, to which the gateway
+/// replies with an ack of the frames it received (selective repeat), or with the time config once
+/// it has received all frames up to the one flagged as last. If the configuration of the node is
+/// unchanged, the gateway acks the last frame instead, upon which the node keeps its configuration.
+template <> class Message<SENSOR_DATA_BATCH> : public MessageHeader
+{
+private:
+    /// @brief Length in bytes of the fields that precede the data buffer.
+    static constexpr size_t fieldsLength{3};
+    /// @brief Sequence number of the frame in the comm period, modulo seqModulo.
+    uint8_t seq : 7;
+    /// @brief Poll flag: the frame is the last of its burst.
+    bool poll : 1;
+    /// @brief The amount of entries held in the data buffer.
+    uint8_t nEntries{0};
+    /// @brief The amount of bytes of the data buffer in use.
+    uint8_t size{0};
+    uint8_t data[maxLength - headerLength - fieldsLength];
+    /// @brief The timestamp of the last entry pushed, against which the next one is encoded.
+    /// Follows the data buffer, so that it is never sent. Received messages are only read, hence it
+    /// is left undefined for them.
+    uint32_t lastTime{0};
+
+public:
+    /// @brief A single entry unpacked from the message.
+    struct Entry
+    {
+        uint32_t time;
+        uint8_t nValues;
+        Message<SENSOR_DATA>::SensorValues values;
+    };
+
+    class Iterator
+    {
+        const Message<SENSOR_DATA_BATCH>* message;
+        size_t position;
+        /// @brief Position of the entry following the current one.
+        size_t next;
+        Entry entry{};
+
+        Iterator(const Message<SENSOR_DATA_BATCH>* message, size_t position);
+        /// @brief Decodes the entry at the current position, relative to the previous entry.
+        void decode();
+
+    public:
+        Iterator& operator++();
+        bool operator!=(const Iterator& other) const { return position != other.position; }
+        const Entry& operator*() const { return entry; }
+
+        friend class Message<SENSOR_DATA_BATCH>;
+    };
+
+    Message(const MACAddress& src, const MACAddress& dest, uint8_t seq = 0)
+        : MessageHeader(SENSOR_DATA_BATCH, src, dest), seq{static_cast<uint8_t>(seq % seqModulo)},
+          poll{false} {};
+
+    /// @brief Appends an entry to the message, if there is enough space left.
+    /// @param time The timestamp associated with the values (UNIX epoch, seconds).
+    /// @param values The encoded values of the entry.
+    /// @return Whether the entry was appended.
+    bool push(uint32_t time, const Message<SENSOR_DATA>::SensorValues& values);
+    /// @brief Appends an entry to the message from encoded values held elsewhere, e.g. in a
+    /// SensorFile::EntryView, without copying them into a SensorValues first.
+    /// @param values The encoded values of the entry, without their size prefix.
+    /// @param valuesSize The amount of bytes of encoded values.
+    /// @return Whether the entry was appended.
+    bool push(uint32_t time, const uint8_t* values, size_t valuesSize);
+    /// @return The amount of entries held in the message.
+    size_t getNEntries() const { return nEntries; }
+    uint8_t getSeq() const { return seq; }
+    constexpr bool isPoll() const { return poll; }
+    /// @brief Sets the poll flag of this message.
+    void setPoll(bool poll = true) { this->poll = poll; }
+
+    Iterator begin() const { return Iterator(this, 0); }
+    Iterator end() const { return Iterator(this, size); }
+
+    /// @return The messages' length in bytes.
+    constexpr size_t getLength() const
+    {
+        return headerLength + fieldsLength + size;
+    }
+    /// @return Whether the message's type flag matches the desired type.
+    constexpr bool isValid() const { return isType(SENSOR_DATA_BATCH); }
+    /// @brief Converts a byte buffer in-place to this message type, without any runtime checking.
+    /// @param data The byte buffer to interpret a message from.
+    /// @return The resulting message object.
+    static Message<SENSOR_DATA_BATCH>& fromData(uint8_t* data);
+
+    /// @brief The maximum size of an encoded timestamp difference in bytes.
+    static constexpr size_t maxTimeSize{5};
+    /// @brief The amount of bytes available for entries in a single message.
+    static constexpr size_t capacity{sizeof(data)};
+    /// @brief The amount of distinct sequence numbers. At least twice the window, so that a frame
+    /// that is retransmitted is never mistaken for a new one, and a divisor of 256, so that
+    /// distances between sequence numbers can be taken in uint8_t arithmetic.
+    static constexpr uint8_t seqModulo{128};
+} __attribute__((packed));
+
+static_assert(Message<SENSOR_DATA_BATCH>::maxTimeSize + sizeof(Message<SENSOR_DATA>::SensorValues) <=
+                  Message<SENSOR_DATA_BATCH>::capacity,
+              "Any entry must fit in a single sensor data batch message.");
+static_assert(Message<SENSOR_DATA_BATCH>::seqModulo >= 2 * Message<ACK_DATA>::window &&
+                  256 % Message<SENSOR_DATA_BATCH>::seqModulo == 0,
+              "Sequence numbers must tell retransmitted frames from new ones.");
+
+inline Message<SENSOR_DATA_BATCH>& Message<SENSOR_DATA_BATCH>::fromData(uint8_t* data)
+{
+    Message<SENSOR_DATA_BATCH>& m{*reinterpret_cast<Message<SENSOR_DATA_BATCH>*>(data)};
+    m.size = std::min(m.size, static_cast<uint8_t>(capacity));
     return m;
 }
 
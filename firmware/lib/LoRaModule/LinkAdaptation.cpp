@@ -0,0 +1,63 @@
+#include "LinkAdaptation.h"
+#include "SlotScheduler.h"
+#include <cmath>
+
+using namespace mirra;
+
+float mirra::getRequiredSNR(uint8_t spreadingFactor)
+{
+    return -5.0f - 2.5f * (spreadingFactor - 6);
+}
+
+float mirra::getNoiseFloor(uint16_t bandwidth)
+{
+    return -174.0f + 10.0f * std::log10(bandwidth * 1000.0f) + 6.0f;
+}
+
+float mirra::getPathLoss(const PHYSettings& settings, float rssi, float snr)
+{
+    float signal{snr < 0 ? getNoiseFloor(settings.bandwidth) + snr : rssi};
+    return settings.power - signal;
+}
+
+PHYSettings mirra::adaptSettings(float pathLoss, float margin, uint32_t maxAirtime, bool drain)
+{
+    constexpr uint16_t bandwidths[]{500, 250};
+    const PHYSettings& defaults{LoRaModule::defaultSettings};
+    // lowest output power with which a packet arrives with the margin, if any
+    auto getPower = [&](uint8_t spreadingFactor, uint16_t bandwidth) -> int {
+        float power{getRequiredSNR(spreadingFactor) + margin + getNoiseFloor(bandwidth) + pathLoss};
+        return std::max(static_cast<int>(std::ceil(power)), LORA_MIN_POWER);
+    };
+    if (drain)
+    {
+        for (uint16_t bandwidth : bandwidths)
+        {
+            int power{getPower(defaults.spreadingFactor, bandwidth)};
+            if (power <= LORA_MAX_POWER)
+                return PHYSettings{defaults.spreadingFactor, bandwidth, static_cast<int8_t>(power)};
+        }
+    }
+    PHYSettings robust{defaults.spreadingFactor, defaults.bandwidth, LORA_MAX_POWER};
+    for (uint8_t spreadingFactor{defaults.spreadingFactor}; spreadingFactor <= 12;
+         spreadingFactor++)
+    {
+        PHYSettings settings{spreadingFactor, defaults.bandwidth, LORA_MAX_POWER};
+        if (getTimeOnAir(MessageHeader::maxLength, settings) > maxAirtime)
+            break;
+        robust = settings;
+        int power{getPower(spreadingFactor, defaults.bandwidth)};
+        if (power <= LORA_MAX_POWER)
+        {
+            settings.power = power;
+            return settings;
+        }
+    }
+    return robust;
+}
+
+uint32_t mirra::getFallbackMessages(uint32_t maxMessages, const PHYSettings& settings)
+{
+    uint32_t fallback{maxMessages * LoRaModule::defaultSettings.bandwidth / settings.bandwidth};
+    return std::max<uint32_t>(std::min(fallback, maxMessages), 1);
+}
@@ -0,0 +1,43 @@
+#ifndef __LINK_ADAPTATION_H__
+#define __LINK_ADAPTATION_H__
+
+#include "LoRaModule.h"
+
+namespace mirra
+{
+/// @return The lowest SNR in dB at which the SX1272 demodulates packets sent with the given
+/// spreading factor, as given by its datasheet.
+float getRequiredSNR(uint8_t spreadingFactor);
+/// @return The noise floor in dBm of the SX1272 at the given bandwidth in kHz: the thermal noise
+/// in the bandwidth and a noise figure of 6 dB.
+float getNoiseFloor(uint16_t bandwidth);
+/// @return The path loss in dB of a link, estimated from a packet received over it.
+/// @param settings The settings the packet was sent with.
+/// @param rssi The RSSI of the packet in dBm.
+/// @param snr The SNR of the packet in dB. Below 0 dB, the RSSI of the SX1272 is dominated by
+/// noise, so the signal strength is derived from the SNR instead.
+float getPathLoss(const PHYSettings& settings, float rssi, float snr);
+
+/// @brief Chooses the settings with which a node communicates with the gateway (adaptive data
+/// rate), such that packets arrive with at least the given margin above the demodulation floor.
+///
+/// Normally, the bandwidth is kept at its default and the lowest spreading factor that reaches the
+/// margin is chosen, which gives the shortest time on air, and then the lowest output power.
+/// In drain mode, for nodes with a backlog of entries, a higher bandwidth is chosen if the margin
+/// allows it, which shortens the time on air further at the cost of sensitivity. If no settings
+/// reach the margin, the most robust settings are chosen.
+/// @param pathLoss The path loss of the link in dB (see getPathLoss).
+/// @param margin The margin in dB, which absorbs fading and the error of the path loss estimate.
+/// @param maxAirtime The longest time on air in µs a packet of maximum length may take.
+/// @param drain Whether to use the higher bandwidths as well.
+/// @return The chosen settings.
+PHYSettings adaptSettings(float pathLoss, float margin, uint32_t maxAirtime, bool drain = false);
+
+/// @return The amount of entries a node sends in a comm period with the default settings, after it
+/// failed to receive a time config while it was assigned the given amount with the given settings.
+/// A node that drains its backlog at a higher bandwidth scales the amount of entries back, so that
+/// its comm period still fits in its slot.
+uint32_t getFallbackMessages(uint32_t maxMessages, const PHYSettings& settings);
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include "LoRaModule.h"
 
 #include <Arduino.h>
+#include <cstring>
 #include <logging.h>
 
 using namespace mirra;
@@ -15,46 +16,326 @@ LoRaModule::LoRaModule(const uint8_t csPin, const uint8_t rstPin, const uint8_t
                             LORA_SYNC_WORD, LORA_POWER, LORA_PREAMBLE_LENGHT, LORA_AMPLIFIER_GAIN);
     if (state == RADIOLIB_ERR_NONE)
     {
-        Log::debug("LoRa init successful for ", this->getMACAddress().toString());
+        LOG_DEBUG("LoRa init successful for ", this->getMACAddress().toString());
     }
     else
     {
-        Log::error("LoRa module init failed, code: ", state);
+        LOG_ERROR("LoRa module init failed, code: ", state);
     }
 };
 
-void LoRaModule::sendRepeat(const MACAddress& dest)
+bool LoRaModule::configure(const PHYSettings& settings)
 {
-    Log::debug("Sending REPEAT message to ", dest.toString());
+    if (settings == this->settings)
+        return true;
+    this->listening = false;
+    int state{this->setSpreadingFactor(settings.spreadingFactor)};
+    if (state == RADIOLIB_ERR_NONE)
+        state = this->setBandwidth(settings.bandwidth);
+    if (state == RADIOLIB_ERR_NONE)
+        state = this->setOutputPower(settings.power);
+    if (state != RADIOLIB_ERR_NONE)
+    {
+        LOG_ERROR("Could not apply LoRa settings SF",
+                  static_cast<uint32_t>(settings.spreadingFactor), " BW",
+                  static_cast<uint32_t>(settings.bandwidth), " ",
+                  static_cast<int32_t>(settings.power), " dBm, code: ", state);
+        this->setSpreadingFactor(this->settings.spreadingFactor);
+        this->setBandwidth(this->settings.bandwidth);
+        this->setOutputPower(this->settings.power);
+        return false;
+    }
+    LOG_DEBUG("LoRa settings: SF", static_cast<uint32_t>(settings.spreadingFactor), " BW",
+              static_cast<uint32_t>(settings.bandwidth), " ", static_cast<int32_t>(settings.power),
+              " dBm");
+    this->settings = settings;
+    return true;
+}
+
+void LoRaModule::sendRepeat(const MACAddress& dest, uint32_t delay)
+{
+    LOG_DEBUG("Sending REPEAT message to ", dest.toString());
     auto repeatMessage = Message<REPEAT>(this->mac, dest);
+    lightSleep(delay);
     sendPacket(repeatMessage.toData(), repeatMessage.getLength());
 }
 
 void LoRaModule::sendPacket(const uint8_t* buffer, size_t length)
 {
+    uint8_t packet[MessageHeader::maxLength];
+    if (size_t compactLength{compact(buffer, length, packet)})
+    {
+        buffer = packet;
+        length = compactLength;
+    }
+#if LORA_CAD
+    for (size_t i{0}; i < CAD_ATTEMPTS && this->scanChannel() == RADIOLIB_PREAMBLE_DETECTED; i++)
+    {
+        LOG_DEBUG("Channel busy, backing off...");
+        lightSleep(random(CAD_BACKOFF) + 1);
+    }
+#endif
     esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
     esp_sleep_enable_ext0_wakeup((gpio_num_t)this->DIO0Pin, 1);
+    this->listening = false;
     int state = this->startTransmit(const_cast<uint8_t*>(buffer), length);
     if (state == RADIOLIB_ERR_NONE)
     {
         esp_light_sleep_start();
-        Log::debug("Packet sent!");
+        LOG_DEBUG("Packet sent!");
     }
     else
     {
-        Log::error("Send failed, code: ", state);
+        LOG_ERROR("Send failed, code: ", state);
     }
     this->finishTransmit();
+    this->sendEnd = micros();
+    this->awaitingReply = true;
+    this->turnaround.reset();
 }
 
-void LoRaModule::resendMessage()
+void LoRaModule::resendMessage(uint32_t delay)
 {
     if (sendLength == 0)
     {
-        Log::error("Could not repeat last sent message because no message has been sent yet.");
+        LOG_ERROR("Could not repeat last sent message because no message has been sent yet.");
         esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
         return;
     }
-    Log::debug("Resending last sent message to ", this->getLastDest().toString());
+    LOG_DEBUG("Resending last sent message to ", this->getLastDest().toString());
+    lightSleep(delay);
+    if (reinterpret_cast<MessageHeader*>(this->sendBuffer)->isType(TIME_CONFIG))
+    {
+        // the node sets its clock to the time received, which would otherwise be seconds behind
+        Message<TIME_CONFIG>& timeConfig{Message<TIME_CONFIG>::fromData(this->sendBuffer)};
+        uint32_t elapsed{static_cast<uint32_t>((micros() - this->sendTime) / 1000)};
+        timeConfig.advanceCTime(elapsed);
+        this->sendTime += elapsed * 1000;
+    }
     sendPacket(this->sendBuffer, this->sendLength);
-}
\ No newline at end of file
+}
+
+void LoRaModule::lightSleep(uint32_t ms)
+{
+    if (ms == 0)
+        return;
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+    esp_sleep_enable_timer_wakeup(static_cast<uint64_t>(ms) * 1000);
+    esp_light_sleep_start();
+}
+
+void LoRaModule::measureTurnaround(const MessageHeader& received, size_t length,
+                                   unsigned long receiveEnd)
+{
+    // a message queued before the last message was sent is no reply to it
+    if (!this->awaitingReply || received.getSource() != this->getLastDest() ||
+        static_cast<long>(receiveEnd - this->sendEnd) < 0)
+        return;
+    this->awaitingReply = false;
+    long elapsed{static_cast<long>(receiveEnd - this->getTimeOnAir(length) - this->sendEnd)};
+    this->turnaround = static_cast<uint32_t>(std::max(elapsed, 0L) / 1000);
+    LOG_DEBUG("Reply turnaround: ", *this->turnaround, " ms");
+}
+
+uint32_t LoRaModule::getMessageAge() const { return (micros() - this->receiveStart) / 1000; }
+
+void LoRaModule::startSession(const MACAddress& peer, uint16_t shortAddress, bool compact)
+{
+    this->session = Session{peer, shortAddress, compact && shortAddress != 0};
+}
+
+size_t LoRaModule::compact(const uint8_t* buffer, size_t length, uint8_t* packet) const
+{
+    const MessageHeader& header{*reinterpret_cast<const MessageHeader*>(buffer)};
+    if (!this->session || !this->session->compact || header.getDest() != this->session->peer ||
+        !CompactHeader::fits(header.getType()))
+        return 0;
+    CompactHeader compactHeader{header.getType(), header.isLast(), this->session->shortAddress};
+    std::memcpy(packet, &compactHeader, CompactHeader::length);
+    std::memcpy(packet + CompactHeader::length, buffer + MessageHeader::headerLength,
+                length - MessageHeader::headerLength);
+    return length - MessageHeader::headerLength + CompactHeader::length;
+}
+
+bool LoRaModule::expand(ReceivedPacket& packet) const
+{
+    const CompactHeader compactHeader{*reinterpret_cast<const CompactHeader*>(packet.data)};
+    size_t payloadLength{packet.length - std::min(packet.length, CompactHeader::length)};
+    if (!this->session || this->session->shortAddress == 0 ||
+        compactHeader.getAddress() != this->session->shortAddress ||
+        MessageHeader::headerLength + payloadLength > MessageHeader::maxLength)
+        return false;
+    std::memmove(packet.data + MessageHeader::headerLength, packet.data + CompactHeader::length,
+                 payloadLength);
+    // messages in a session are always from the peer to this device
+    Message<ERROR> header{this->session->peer, this->mac};
+    header.setType(compactHeader.getType());
+    header.setLast(compactHeader.isLast());
+    std::memcpy(packet.data, &header, MessageHeader::headerLength);
+    return true;
+}
+
+bool LoRaModule::enqueue()
+{
+    unsigned long receiveEnd{micros()};
+    ReceivedPacket* packet{this->queue.claim()};
+    if (packet == nullptr)
+    {
+        // the packet is left in the radio, which discards it when it restarts receiving
+        LOG_ERROR("Receive queue full, ", this->queue.getDropped(), " packets dropped so far.");
+        return true;
+    }
+    packet->length = std::min(this->getPacketLength(), MessageHeader::maxLength);
+    std::fill(packet->data, packet->data + MessageHeader::maxLength, 0);
+    int state{this->readData(packet->data, packet->length)};
+    if (state != RADIOLIB_ERR_NONE && state != RADIOLIB_ERR_CRC_MISMATCH)
+    {
+        LOG_ERROR("Reading received data (", packet->length, " bytes) failed, code: ", state);
+        return false;
+    }
+    packet->crcError = state == RADIOLIB_ERR_CRC_MISMATCH;
+    if (!packet->crcError)
+    {
+        bool compact{CompactHeader::isCompact(packet->data)};
+        if (compact && !expand(*packet))
+        {
+            LOG_DEBUG("Message with a compact header discarded because it is not part of the "
+                      "session of this device.");
+            return true;
+        }
+        // the gateway follows the node in using compact headers
+        if (this->session && packet->getHeader().getSource() == this->session->peer)
+            this->session->compact = compact;
+    }
+    packet->rssi = SX1272::getRSSI();
+    packet->snr = SX1272::getSNR();
+    packet->time = receiveEnd;
+    this->queue.commit();
+    LOG_DEBUG("Reading received data (", packet->length, " bytes): ",
+              packet->crcError ? "CRC mismatch" : "success");
+    return true;
+}
+
+LoRaModule::ReceiveResult LoRaModule::receiveDispatched(uint32_t timeoutMs, size_t repeatAttempts,
+                                                        const MACAddress& src, uint32_t listenMs,
+                                                        bool promiscuous, bool abortOnCRCMismatch,
+                                                        const DispatchTable& table, void* handlers)
+{
+    const MACAddress source{src == MACAddress::broadcast && this->sendLength != 0
+                                ? this->getLastDest()
+                                : src};
+    timeoutMs /= repeatAttempts + 1;
+    // the radio keeps listening after a receive, so a message may have arrived since, e.g. a reply
+    // that was sent before this receive started
+    if (this->listening && digitalRead(this->DIO0Pin) && !this->enqueue())
+        return RECEIVE_ERROR;
+    // The timeout is kept as a deadline, so that discarded messages (e.g. to other nodes) do not
+    // extend it.
+    unsigned long deadline{millis() + timeoutMs + listenMs};
+    while (true)
+    {
+        size_t position{this->queue.begin()};
+        while (ReceivedPacket* packet{this->queue.next(position)})
+        {
+            if (micros() - packet->time > RX_QUEUE_LIFETIME * 1000UL)
+            {
+                LOG_DEBUG("Queued message of type ", packet->getHeader().getType(),
+                          " discarded because it was not handled in time.");
+                this->queue.release(*packet);
+                continue;
+            }
+            if (packet->crcError)
+            {
+                this->queue.release(*packet);
+                if (abortOnCRCMismatch)
+                {
+                    LOG_ERROR("Received data (", packet->length, " bytes) has a CRC mismatch.");
+                    return CRC_MISMATCH;
+                }
+                LOG_ERROR("Received data (", packet->length,
+                          " bytes) has a CRC mismatch. Waiting for timeout and possible sending of "
+                          "REPEAT...");
+                continue;
+            }
+            MessageHeader& received{packet->getHeader()};
+            LOG_DEBUG("Message Type: ", received.getType());
+            LOG_DEBUG("Source: ", received.getSource().toString());
+            LOG_DEBUG("Dest: ", received.getDest().toString());
+            if (source != MACAddress::broadcast && source != received.getSource())
+            {
+                char macSrcBuffer[MACAddress::stringLength];
+                LOG_DEBUG("Message from ", received.getSource().toString(),
+                          " discared because it is not the desired source of the message, namely ",
+                          source.toString(macSrcBuffer));
+                this->queue.release(*packet);
+                continue;
+            }
+            if ((!promiscuous) && (received.getDest() != this->mac) &&
+                (received.getDest() != MACAddress::broadcast))
+            {
+                LOG_DEBUG("Message from ", received.getSource().toString(),
+                          " discarded because its destination does not match this device.");
+                this->queue.release(*packet);
+                continue;
+            }
+            if (received.isType(REPEAT))
+            {
+                LOG_DEBUG("Received REPEAT message from ", received.getSource().toString());
+                this->queue.release(*packet);
+                if (this->getLastDest() == received.getSource())
+                {
+                    this->resendMessage();
+                    deadline = millis() + timeoutMs;
+                }
+                continue;
+            }
+            MessageHandler handler{received.getType() < nMessageTypes ? table[received.getType()]
+                                                                      : nullptr};
+            if (handler == nullptr)
+            {
+                LOG_DEBUG("Message of type ", received.getType(),
+                          " kept queued because it is not of a desired type.");
+                continue;
+            }
+            measureTurnaround(received, packet->length, packet->time);
+            this->rssi = packet->rssi;
+            this->snr = packet->snr;
+            this->receiveStart = packet->time - this->getTimeOnAir(packet->length);
+            handler(handlers, packet->data);
+            this->queue.release(*packet);
+            return RECEIVED;
+        }
+
+        LOG_DEBUG("Starting receive ...");
+        int state{this->startReceive()};
+        if (state != RADIOLIB_ERR_NONE)
+        {
+            LOG_ERROR("Receive failed, code: ", state);
+            return RECEIVE_ERROR;
+        }
+        this->listening = true;
+
+        esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+        // When the LoRa module get's a message it will generate an interrupt on DIO0.
+        esp_sleep_enable_ext0_wakeup((gpio_num_t)this->DIO0Pin, 1);
+        // We use the timer wakeup as timeout for receiving a LoRa reply.
+        long remainingMs{static_cast<long>(deadline - millis())};
+        esp_sleep_enable_timer_wakeup(static_cast<uint64_t>(std::max(remainingMs, 0L)) * 1000);
+        esp_light_sleep_start();
+
+        esp_sleep_wakeup_cause_t wakeupCause{esp_sleep_get_wakeup_cause()};
+        if (wakeupCause == ESP_SLEEP_WAKEUP_GPIO || wakeupCause == ESP_SLEEP_WAKEUP_EXT0)
+        {
+            if (!this->enqueue())
+                return RECEIVE_ERROR;
+            continue;
+        }
+        LOG_DEBUG("Receive timeout after ", timeoutMs, "ms with ", repeatAttempts,
+                  " repeat attempts left.");
+        if (repeatAttempts == 0)
+            return TIMEOUT;
+        this->sendRepeat(source);
+        deadline = millis() + timeoutMs;
+        repeatAttempts--;
+    }
+}
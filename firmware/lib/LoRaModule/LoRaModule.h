@@ -1,12 +1,18 @@
 #ifndef __RADIO_H__
 #define __RADIO_H__
 
+#include "PacketQueue.h"
 #include <CommunicationCommon.h>
 #include <RadioLib.h>
 #include <algorithm>
+#include <array>
+#include <cstring>
 #include <functional>
 #include <logging.h>
 #include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 /******************************
  *     LoRa configuration
@@ -20,7 +26,27 @@
 #define LORA_PREAMBLE_LENGHT 8
 #define LORA_AMPLIFIER_GAIN 0 // 0 is automatic
 
-#define SEND_DELAY 500 // ms, time to wait before sending a message
+// ms, time a device needs from the end of its transmission until it listens for the reply, which
+// its peer waits before replying: the SX1272's switch to receive mode and the ESP32's wakeup from
+// light sleep around it, measured at a few ms, with margin.
+#define RX_SETUP_TIME 10
+#define FRAME_GAP 50 // ms, time between the frames of a burst, in which the receiver restarts
+// ms, time a received message that no receive took is kept queued, e.g. one that arrived before
+// the receive that handles its type
+#define RX_QUEUE_LIFETIME 1000
+
+// Channel activity detection (listen before talk) before every transmission, which keeps devices
+// from sending over a packet that is on air. Set through the build flags, e.g. `-DLORA_CAD=1`.
+#ifndef LORA_CAD
+#define LORA_CAD 0
+#endif
+#define CAD_ATTEMPTS 3  // amount of times the channel is found busy before sending regardless
+#define CAD_BACKOFF 100 // ms, maximum random wait after the channel was found busy
+
+// Range of the output power in dBm that can be assigned to nodes. The SX1272's PA_BOOST output
+// supports 2 to 17 dBm, and 20 dBm.
+#define LORA_MIN_POWER 2
+#define LORA_MAX_POWER 14 // 25 mW, the ERP limit of most sub-bands of the EU 868 MHz band
 
 namespace mirra
 {
@@ -32,6 +58,8 @@ private:
 
     /// @brief Local MAC address
     MACAddress mac{};
+    /// @brief Current physical layer settings.
+    PHYSettings settings{defaultSettings};
 
     /// @brief Pin number for SX1272's DIO0 interrupt pin
     const uint8_t DIO0Pin;
@@ -40,6 +68,34 @@ private:
     uint8_t sendBuffer[MessageHeader::maxLength]{0};
     /// @brief  Length of message currently stored in sendBuffer
     size_t sendLength{0};
+    /// @brief Time in µs of the time carried by the message in sendBuffer, if it is a time config,
+    /// so that it is brought up to date when the message is resent (see resendMessage).
+    unsigned long sendTime{0};
+    /// @brief Time in µs at which the last packet was sent, and whether a reply to it may still be
+    /// measured (see getTurnaround).
+    unsigned long sendEnd{0};
+    bool awaitingReply{false};
+    std::optional<uint32_t> turnaround;
+
+    /// @brief Packets read from the radio that were not handled yet.
+    PacketQueue queue;
+    /// @brief Whether the radio was left listening, in which case it may hold a received packet.
+    bool listening{false};
+    /// @brief RSSI and SNR of the last message handled.
+    float rssi{0};
+    float snr{0};
+    /// @brief Time in µs at which the transmission of the last message handled started.
+    unsigned long receiveStart{0};
+
+    /// @brief Session with a peer, in which messages may carry a CompactHeader (see startSession).
+    struct Session
+    {
+        MACAddress peer;
+        uint16_t shortAddress;
+        /// @brief Whether messages to the peer are sent with a compact header.
+        bool compact;
+    };
+    std::optional<Session> session;
 
     /// @return The destination MAC address of the message currently stored in the sendBuffer
     const MACAddress& getLastDest()
@@ -48,6 +104,10 @@ private:
     }
 
 public:
+    /// @brief The settings the module starts with, which are used for discovery and as fallback.
+    static constexpr PHYSettings defaultSettings{LORA_SPREADING_FACTOR,
+                                                 static_cast<uint16_t>(LORA_BANDWIDTH), LORA_POWER};
+
     /// @brief Constructs a LoRaModule with the given pin parameters
     /// @param csPin Chip select pin
     /// @param rstPin Reset pin
@@ -59,26 +119,63 @@ public:
 
     /// @return The local MAC address of this module.
     const MACAddress& getMACAddress() { return mac; }
+    /// @brief Switches the radio to the given physical layer settings.
+    /// @return Whether the settings were applied. If not, the previous settings remain in use.
+    bool configure(const PHYSettings& settings);
+    /// @return The current physical layer settings.
+    const PHYSettings& getSettings() const { return settings; }
 
     /// @brief
     /// @tparam T Type of the message to be sent. Must be of the enum MessageType.
     /// @param message The message to be sent.
-    /// @param delay Delay in ms to wait before sending the message
-    template <class T> void sendMessage(T&& message, uint32_t delay = SEND_DELAY);
+    /// @param delay Delay in ms to wait before sending the message, by default the time the peer
+    /// needs to listen for it after its own transmission.
+    template <class T> void sendMessage(T&& message, uint32_t delay = RX_SETUP_TIME);
     /// @brief Sends a repeat message to the given destination. This function does not modify the
     /// sendBuffer.
     /// @param dest Destination of repeat message
-    void sendRepeat(const MACAddress& dest);
-    /// @brief Sends a packet (~array of bytes).
+    /// @param delay Delay in ms to wait before sending the message.
+    void sendRepeat(const MACAddress& dest, uint32_t delay = RX_SETUP_TIME);
+    /// @brief Sends a packet (~array of bytes), after channel activity detection if LORA_CAD is
+    /// set.
     /// @param buffer The buffer in which the packet to be sent is stored.
     /// @param length The length of the packet in the buffer in bytes.
     void sendPacket(const uint8_t* buffer, size_t length);
     /// @brief Resends the last sent message stored in the sendBuffer. If there is none, does
-    /// nothing.
-    void resendMessage();
+    /// nothing. A time config is resent with its time advanced by the time since it was sent, to
+    /// the ms.
+    /// @param delay Delay in ms to wait before sending the message.
+    void resendMessage(uint32_t delay = RX_SETUP_TIME);
+    /// @return The turnaround of the reply to the last message sent, i.e. the time in ms from the
+    /// end of the message until the start of the reply from its destination, which holds the
+    /// destination's processing and its wait for the RX setup. Disengaged if no reply was received.
+    std::optional<uint32_t> getTurnaround() const { return turnaround; }
+    /// @brief Starts a session between the gateway and one of its nodes, in which messages between
+    /// them may carry a CompactHeader with the node's short address instead of a MessageHeader with
+    /// both MAC addresses. Messages of other devices with a compact header are discarded.
+    ///
+    /// Messages to the peer are sent with a compact header as long as the last message received
+    /// from the peer had one. The node, which knows its short address, thus starts with compact
+    /// headers, while the gateway follows the node, so that a node that has missed its short
+    /// address is still understood.
+    /// @param peer The MAC address of the peer.
+    /// @param shortAddress The short address of the node, 0 if none is assigned.
+    /// @param compact Whether to send messages to the peer with a compact header at first.
+    void startSession(const MACAddress& peer, uint16_t shortAddress, bool compact);
+    /// @brief Ends the session, after which all messages carry a MessageHeader.
+    void endSession() { session.reset(); }
+
+    /// @return The RSSI in dBm of the last message received, as it was measured on its reception.
+    float getRSSI() const { return rssi; }
+    /// @return The SNR in dB of the last message received.
+    float getSNR() const { return snr; }
+    /// @return The time in ms since the transmission of the last message received started, by
+    /// which a time it carries is advanced (see Message<TIME_CONFIG>::getCTime).
+    uint32_t getMessageAge() const;
 
     /// @brief Receives a specific type of message from a specific source. When timing out, sends a
-    /// REPEAT message according to the repeatAttempts parameter.
+    /// REPEAT message according to the repeatAttempts parameter. Messages of other types are kept
+    /// queued for later receives (see RX_QUEUE_LIFETIME).
     /// @tparam T Desired type of the message
     /// @param timeoutMs The amount of time in ms to listen for a message per repeat attempt.
     /// @param repeatAttempts The amount of times to send a repeat message before definitively
@@ -95,8 +192,79 @@ public:
     std::optional<Message<T>> receiveMessage(uint32_t timeoutMs, size_t repeatAttempts = 0,
                                              const MACAddress& src = MACAddress::broadcast,
                                              uint32_t listenMs = 0, bool promiscuous = false);
+    /// @brief Outcome of receiveAny.
+    enum ReceiveResult
+    {
+        RECEIVED,
+        TIMEOUT,
+        /// @brief A packet was received with a CRC mismatch.
+        CRC_MISMATCH,
+        RECEIVE_ERROR
+    };
+    /// @brief Receives a message from a specific source and passes it to the first of the given
+    /// handlers that takes its type, i.e. that is invocable with a `Message<T>&`. The handlers are
+    /// looked up by type in a table built at compile time. Messages of types that no handler takes
+    /// are kept queued for later receives (see RX_QUEUE_LIFETIME). Unlike receiveMessage, no REPEAT
+    /// messages are sent, and a packet received with a CRC mismatch ends the receive, so that the
+    /// caller can request its retransmission right away.
+    /// @param timeoutMs The amount of time in ms to listen for a message.
+    /// @param src Expected source of the message.
+    /// @param handlers The handlers. The message they are passed is only valid during the call.
+    /// @return The outcome of the receive. If RECEIVED, a handler was called.
+    template <class... Handlers>
+    ReceiveResult receiveAny(uint32_t timeoutMs, const MACAddress& src, Handlers&&... handlers);
     template <MessageType T>
     std::optional<Message<T>> listenMessage(uint32_t timeoutMs, uint8_t wakePin);
+
+private:
+    /// @brief Light sleeps for the given time in ms, if any.
+    void lightSleep(uint32_t ms);
+    /// @brief Measures the turnaround of a received message, if it is the reply to the last
+    /// message sent (see getTurnaround).
+    /// @param received The received message.
+    /// @param length The length of the message in bytes.
+    /// @param receiveEnd The time in µs at which the message was received.
+    void measureTurnaround(const MessageHeader& received, size_t length, unsigned long receiveEnd);
+    /// @brief Reads the packet the radio received into the queue, along with its RSSI, SNR and
+    /// time of reception. This is the producer side of the queue.
+    /// @return Whether the packet could be read.
+    bool enqueue();
+    /// @brief Replaces the MessageHeader of a message to the session's peer by a CompactHeader, if
+    /// the session allows it.
+    /// @param buffer The message.
+    /// @param length The length of the message in bytes.
+    /// @param packet Buffer of MessageHeader::maxLength bytes to write the compacted message to.
+    /// @return The length of the compacted message, or 0 if the message is to be sent as is.
+    size_t compact(const uint8_t* buffer, size_t length, uint8_t* packet) const;
+    /// @brief Replaces the CompactHeader of a received packet by a MessageHeader, in place.
+    /// @return Whether the packet belongs to the session.
+    bool expand(ReceivedPacket& packet) const;
+
+    /// @brief Calls the handler of a message type, given the handlers and the message's data.
+    using MessageHandler = void (*)(void* handlers, uint8_t* data);
+    /// @brief Handlers of all message types, indexed by type, null for types without handler.
+    using DispatchTable = std::array<MessageHandler, nMessageTypes>;
+    /// @return Whether any of the handlers in the tuple takes messages of type T.
+    template <class Tuple, MessageType T, size_t... I>
+    static constexpr bool handles(std::index_sequence<I...>);
+    /// @brief Calls the first handler in the tuple that takes messages of type T.
+    template <class Tuple, MessageType T, size_t I = 0>
+    static void dispatch(void* handlers, uint8_t* data);
+    template <class Tuple, MessageType T> static constexpr MessageHandler getHandler();
+    template <class Tuple, size_t... Types>
+    static constexpr DispatchTable makeTable(std::index_sequence<Types...>);
+    /// @brief Implements receiveMessage and receiveAny, by dispatching to the given handlers.
+    /// @param abortOnCRCMismatch Whether to end the receive at a packet with a CRC mismatch.
+    template <class... Handlers>
+    ReceiveResult receive(uint32_t timeoutMs, size_t repeatAttempts, const MACAddress& src,
+                          uint32_t listenMs, bool promiscuous, bool abortOnCRCMismatch,
+                          Handlers&... handlers);
+    /// @brief Implements receive: waits for a queued message that the table has a handler for, and
+    /// calls it with the given handlers (a tuple).
+    ReceiveResult receiveDispatched(uint32_t timeoutMs, size_t repeatAttempts,
+                                    const MACAddress& src, uint32_t listenMs, bool promiscuous,
+                                    bool abortOnCRCMismatch, const DispatchTable& table,
+                                    void* handlers);
 };
 #include "LoRaModule.tpp"
 };
@@ -7,16 +7,13 @@ template <class T> void LoRaModule::sendMessage(T&& message, uint32_t delay)
     // this interrupt is used as wakeup source for the esp_light_sleep.
     char macSrcBuffer[MACAddress::stringLength];
     size_t length = message.getLength();
-    Log::debug("Sending message of type ", message.getType(), " and length ", length, " from ",
-               message.getSource().toString(macSrcBuffer), " to ", message.getDest().toString());
+    LOG_DEBUG("Sending message of type ", message.getType(), " and length ", length, " from ",
+              message.getSource().toString(macSrcBuffer), " to ", message.getDest().toString());
     this->sendLength = length;
-    message.fromData(this->sendBuffer) = std::forward<T>(message);
-    if (delay > 0)
-    {
-        esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
-        esp_sleep_enable_timer_wakeup(delay * 1000);
-        esp_light_sleep_start();
-    }
+    // only the sent bytes are copied, as a message may hold fields past them
+    std::memcpy(this->sendBuffer, message.toData(), length);
+    lightSleep(delay);
+    this->sendTime = micros();
     sendPacket(this->sendBuffer, this->sendLength);
 }
 
@@ -25,110 +22,69 @@ std::optional<Message<T>> LoRaModule::receiveMessage(uint32_t timeoutMs, size_t
                                                      const MACAddress& src, uint32_t listenMs,
                                                      bool promiscuous)
 {
-    auto source{std::cref(src)};
-    if (source.get() == MACAddress::broadcast && this->sendLength != 0)
-        source = std::cref(this->getLastDest());
-    timeoutMs /= repeatAttempts + 1;
-
-    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
-    // When the LoRa module get's a message it will generate an interrupt on DIO0.
-    esp_sleep_enable_ext0_wakeup((gpio_num_t)this->DIO0Pin, 1);
-    // We use the timer wakeup as timeout for receiving a LoRa reply.
-    esp_sleep_enable_timer_wakeup((timeoutMs + listenMs) * 1000);
-    do
-    {
-        Log::debug("Starting receive ...");
-        int state{this->startReceive()};
-
-        if (state != RADIOLIB_ERR_NONE)
-        {
-            Log::error("Receive failed, code: ", state);
-            return std::nullopt;
-        }
-
-        esp_light_sleep_start();
+    static_assert(sizeof(Message<T>) <= MessageHeader::maxLength,
+                  "Messages with fields that are not sent can only be received by reference.");
+    std::optional<Message<T>> received;
+    auto handler = [&](Message<T>& message) { received = message; };
+    receive(timeoutMs, repeatAttempts, src, listenMs, promiscuous, false, handler);
+    return received;
+}
 
-        esp_sleep_wakeup_cause_t wakeupCause{esp_sleep_get_wakeup_cause()};
+template <class... Handlers>
+LoRaModule::ReceiveResult LoRaModule::receiveAny(uint32_t timeoutMs, const MACAddress& src,
+                                                 Handlers&&... handlers)
+{
+    return receive(timeoutMs, 0, src, 0, false, true, handlers...);
+}
 
-        if (wakeupCause == ESP_SLEEP_WAKEUP_GPIO || wakeupCause == ESP_SLEEP_WAKEUP_EXT0)
-        {
-            uint8_t buffer[Message<T>::maxLength]{0};
-            state =
-                this->readData(buffer, std::min(this->getPacketLength(), Message<T>::maxLength));
+template <class Tuple, MessageType T, size_t... I>
+constexpr bool LoRaModule::handles(std::index_sequence<I...>)
+{
+    return (std::is_invocable_v<std::tuple_element_t<I, Tuple>, Message<T>&> || ...);
+}
 
-            if (state == RADIOLIB_ERR_CRC_MISMATCH)
-            {
-                Log::error("Reading received data (", this->getPacketLength(false),
-                           " bytes) failed because of a CRC mismatch. Waiting for timeout and "
-                           "possible sending of REPEAT...");
-                continue;
-            }
-            if (state != RADIOLIB_ERR_NONE)
-            {
-                Log::error("Reading received data (", this->getPacketLength(false),
-                           " bytes) failed, code: ", state);
-                return std::nullopt;
-            }
-            Log::debug("Reading received data (", this->getPacketLength(false), " bytes): success");
-            Message<T>& received{Message<T>::fromData(buffer)};
-            Log::debug("Message Type: ", received.getType());
-            Log::debug("Source: ", received.getSource().toString());
-            Log::debug("Dest: ", received.getDest().toString());
-            if (source.get() != MACAddress::broadcast && source.get() != received.getSource())
-            {
-                char macSrcBuffer[MACAddress::stringLength];
-                Log::debug("Message from ", received.getSource().toString(),
-                           " discared because it is not the desired source of the message, namely ",
-                           source.get().toString(macSrcBuffer));
-                continue;
-            }
+template <class Tuple, MessageType T, size_t I>
+void LoRaModule::dispatch(void* handlers, uint8_t* data)
+{
+    if constexpr (std::is_invocable_v<std::tuple_element_t<I, Tuple>, Message<T>&>)
+        std::get<I>(*static_cast<Tuple*>(handlers))(Message<T>::fromData(data));
+    else
+        dispatch<Tuple, T, I + 1>(handlers, data);
+}
 
-            if ((!promiscuous) && (received.getDest() != this->mac) &&
-                (received.getDest() != MACAddress::broadcast))
-            {
-                Log::debug("Message from ", received.getSource().toString(),
-                           " discarded because its destination does not match this device.");
-                continue;
-            }
-            if (received.isType(REPEAT))
-            {
-                Log::debug("Received REPEAT message from ", received.getSource().toString());
-                if (this->getLastDest() == received.getSource())
-                {
-                    this->resendMessage();
-                    esp_sleep_enable_timer_wakeup(timeoutMs * 1000);
-                }
-                continue;
-            }
-            if (!received.isValid())
-            {
-                Log::debug("Message of type ", received.getType(),
-                           " discarded because message of type ", T, " is desired.");
-                continue;
-            }
+template <class Tuple, MessageType T> constexpr LoRaModule::MessageHandler LoRaModule::getHandler()
+{
+    if constexpr (handles<Tuple, T>(std::make_index_sequence<std::tuple_size_v<Tuple>>{}))
+        return &dispatch<Tuple, T>;
+    else
+        return nullptr;
+}
 
-            return received;
-        }
-        else
-        {
-            Log::debug("Receive timeout after ", timeoutMs, "ms with ", repeatAttempts,
-                       " repeat attempts left.");
-            if (repeatAttempts == 0)
-            {
-                return std::nullopt;
-            }
-            this->sendRepeat(source);
-            esp_sleep_enable_timer_wakeup(timeoutMs * 1000);
-            repeatAttempts--;
-        }
+template <class Tuple, size_t... Types>
+constexpr LoRaModule::DispatchTable LoRaModule::makeTable(std::index_sequence<Types...>)
+{
+    return {getHandler<Tuple, static_cast<MessageType>(Types)>()...};
+}
 
-    } while (repeatAttempts >= 0);
-    return std::nullopt;
+template <class... Handlers>
+LoRaModule::ReceiveResult LoRaModule::receive(uint32_t timeoutMs, size_t repeatAttempts,
+                                              const MACAddress& src, uint32_t listenMs,
+                                              bool promiscuous, bool abortOnCRCMismatch,
+                                              Handlers&... handlers)
+{
+    using Tuple = std::tuple<Handlers&...>;
+    static constexpr DispatchTable table{
+        makeTable<Tuple>(std::make_index_sequence<nMessageTypes>{})};
+    Tuple tuple{handlers...};
+    return receiveDispatched(timeoutMs, repeatAttempts, src, listenMs, promiscuous,
+                             abortOnCRCMismatch, table, &tuple);
 }
 
 template <MessageType T>
 std::optional<Message<T>> LoRaModule::listenMessage(uint32_t timeoutMs, uint8_t wakePin)
 {
+    static_assert(sizeof(Message<T>) <= MessageHeader::maxLength,
+                  "Messages with fields that are not sent can only be received by reference.");
     esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
     // When the LoRa module get's a message it will generate an interrupt on DIO0.
     esp_sleep_enable_ext0_wakeup((gpio_num_t)this->DIO0Pin, 1);
@@ -136,14 +92,15 @@ std::optional<Message<T>> LoRaModule::listenMessage(uint32_t timeoutMs, uint8_t
     esp_sleep_enable_timer_wakeup((timeoutMs)*1000);
     // Also use the wake pin to force wake-up
     esp_sleep_enable_ext1_wakeup(0x1 << wakePin, ESP_EXT1_WAKEUP_ALL_LOW);
-    Log::debug("Starting receive ...");
+    LOG_DEBUG("Starting receive ...");
     int state{this->startReceive()};
 
     if (state != RADIOLIB_ERR_NONE)
     {
-        Log::error("Receive failed, code: ", state);
+        LOG_ERROR("Receive failed, code: ", state);
         return std::nullopt;
     }
+    this->listening = true;
 
     esp_light_sleep_start();
 
@@ -156,26 +113,26 @@ std::optional<Message<T>> LoRaModule::listenMessage(uint32_t timeoutMs, uint8_t
 
         if (state == RADIOLIB_ERR_CRC_MISMATCH)
         {
-            Log::error("Reading received data (", this->getPacketLength(false),
-                       " bytes) failed because of a CRC mismatch. Waiting for timeout and possible "
-                       "sending of REPEAT...");
+            LOG_ERROR("Reading received data (", this->getPacketLength(false),
+                      " bytes) failed because of a CRC mismatch. Waiting for timeout and possible "
+                      "sending of REPEAT...");
             return std::nullopt;
         }
         if (state != RADIOLIB_ERR_NONE)
         {
-            Log::error("Reading received data (", this->getPacketLength(false),
-                       " bytes) failed, code: ", state);
+            LOG_ERROR("Reading received data (", this->getPacketLength(false),
+                      " bytes) failed, code: ", state);
             return std::nullopt;
         }
-        Log::debug("Reading received data (", this->getPacketLength(false), " bytes): success");
+        LOG_DEBUG("Reading received data (", this->getPacketLength(false), " bytes): success");
         Message<T>& received{Message<T>::fromData(buffer)};
-        Log::debug("Message Type: ", received.getType());
-        Log::debug("Source: ", received.getSource().toString());
-        Log::debug("Dest: ", received.getDest().toString());
+        LOG_DEBUG("Message Type: ", received.getType());
+        LOG_DEBUG("Source: ", received.getSource().toString());
+        LOG_DEBUG("Dest: ", received.getDest().toString());
         if (!received.isValid())
         {
-            Log::debug("Message of type ", received.getType(),
-                       " discarded because message of type ", T, " is desired.");
+            LOG_DEBUG("Message of type ", received.getType(),
+                      " discarded because message of type ", T, " is desired.");
             return std::nullopt;
         }
         return received;
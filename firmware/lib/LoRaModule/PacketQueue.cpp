@@ -0,0 +1,50 @@
+#include "PacketQueue.h"
+
+using namespace mirra;
+
+ReceivedPacket* PacketQueue::claim()
+{
+    size_t position{head.load(std::memory_order_relaxed)};
+    if (position - tail.load(std::memory_order_acquire) >= capacity)
+    {
+        dropped++;
+        return nullptr;
+    }
+    ReceivedPacket& packet{packets[position % capacity]};
+    packet.released = false;
+    return &packet;
+}
+
+void PacketQueue::commit()
+{
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+ReceivedPacket* PacketQueue::next(size_t& position)
+{
+    size_t first{tail.load(std::memory_order_relaxed)};
+    size_t last{head.load(std::memory_order_acquire)};
+    if (position - first > last - first)
+        position = first;
+    for (; position != last; position++)
+    {
+        ReceivedPacket& packet{packets[position % capacity]};
+        if (!packet.released)
+        {
+            position++;
+            return &packet;
+        }
+    }
+    return nullptr;
+}
+
+void PacketQueue::release(ReceivedPacket& packet)
+{
+    packet.released = true;
+    size_t position{tail.load(std::memory_order_relaxed)};
+    size_t last{head.load(std::memory_order_acquire)};
+    while (position != last && packets[position % capacity].released)
+        position++;
+    // the slots before the new tail are handed back to the producer
+    tail.store(position, std::memory_order_release);
+}
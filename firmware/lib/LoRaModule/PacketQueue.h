@@ -0,0 +1,72 @@
+#ifndef __PACKET_QUEUE_H__
+#define __PACKET_QUEUE_H__
+
+#include <CommunicationCommon.h>
+#include <array>
+#include <atomic>
+
+namespace mirra
+{
+/// @brief A packet received by the radio, along with its reception metadata.
+struct ReceivedPacket
+{
+    uint8_t data[MessageHeader::maxLength];
+    /// @brief Length of the packet on air, which is shorter than the message in data if it was
+    /// received with a CompactHeader.
+    size_t length;
+    /// @brief Whether the packet was received with a CRC mismatch.
+    bool crcError;
+    /// @brief RSSI in dBm and SNR in dB of the packet.
+    float rssi;
+    float snr;
+    /// @brief Time in µs at which the packet was received.
+    unsigned long time;
+    /// @brief Whether the consumer is done with the packet.
+    bool released;
+
+    MessageHeader& getHeader() { return *reinterpret_cast<MessageHeader*>(data); }
+};
+
+/// @brief Lock-free single-producer single-consumer ring of received packets, which decouples
+/// reading packets from the radio (the producer) from handling them (the consumer).
+///
+/// Packets are read into their slot in place, and handled in place. Unlike a plain FIFO, the
+/// consumer may release packets out of order, e.g. to keep a packet of a type it does not handle
+/// yet queued while it handles the ones after it. A slot is reused once all packets before it have
+/// been released as well. Positions are free-running, so that they wrap around safely.
+class PacketQueue
+{
+public:
+    static constexpr size_t capacity{4};
+
+private:
+    std::array<ReceivedPacket, capacity> packets;
+    /// @brief Position of the next packet to be written, advanced by the producer only.
+    std::atomic<size_t> head{0};
+    /// @brief Position of the oldest packet not released, advanced by the consumer only.
+    std::atomic<size_t> tail{0};
+    /// @brief Amount of packets dropped because the queue was full.
+    size_t dropped{0};
+
+public:
+    /// @brief Producer side: claims the slot to read the next packet into.
+    /// @return The slot, or nullptr if the queue is full, in which case the packet is dropped.
+    ReceivedPacket* claim();
+    /// @brief Producer side: publishes the packet in the claimed slot to the consumer.
+    void commit();
+
+    /// @brief Consumer side: finds the next packet not released yet.
+    /// @param position The position to search from, which is advanced past the returned packet.
+    /// Positions before the tail start the search at the oldest packet.
+    /// @return The packet, or nullptr if there is none.
+    ReceivedPacket* next(size_t& position);
+    /// @brief Consumer side: releases a packet, freeing its slot once all packets before it are
+    /// released as well.
+    void release(ReceivedPacket& packet);
+    /// @return The position of the oldest packet not released.
+    size_t begin() const { return tail.load(std::memory_order_relaxed); }
+    size_t getDropped() const { return dropped; }
+};
+}
+
+#endif
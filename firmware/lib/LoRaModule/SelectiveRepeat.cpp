@@ -0,0 +1,47 @@
+#include "SelectiveRepeat.h"
+#include "SlotScheduler.h"
+
+using namespace mirra;
+
+bool FrameReceiver::receive(const Message<SENSOR_DATA_BATCH>& frame)
+{
+    constexpr uint8_t seqModulo{Message<SENSOR_DATA_BATCH>::seqModulo};
+    uint8_t distance{static_cast<uint8_t>(static_cast<uint8_t>(frame.getSeq() - base) % seqModulo)};
+    // frames before the base, and thus outside the window, were received before
+    if (distance >= Message<ACK_DATA>::window || (received & (1 << distance)))
+        return false;
+    received |= 1 << distance;
+    if (frame.isLast())
+    {
+        lastReceived = true;
+        lastSeq = frame.getSeq();
+    }
+    while (received & 1)
+    {
+        received >>= 1;
+        base = (base + 1) % seqModulo;
+    }
+    return true;
+}
+
+bool FrameReceiver::isComplete() const
+{
+    return lastReceived && base == (lastSeq + 1) % Message<SENSOR_DATA_BATCH>::seqModulo;
+}
+
+uint32_t mirra::getFrameTimeout(const PHYSettings& settings)
+{
+    return 2 * FRAME_GAP + (getTimeOnAir(MessageHeader::maxLength, settings) + 999) / 1000;
+}
+
+uint32_t mirra::getReplyTimeout(const PHYSettings& settings)
+{
+    return getFrameTimeout(settings) + RX_SETUP_TIME + FRAME_GAP +
+           (getTimeOnAir(sizeof(Message<TIME_CONFIG>), settings) + 999) / 1000;
+}
+
+uint32_t mirra::getRetryDuration(const PHYSettings& settings)
+{
+    return getReplyTimeout(settings) +
+           (getTimeOnAir(MessageHeader::maxLength, settings) + 999) / 1000;
+}
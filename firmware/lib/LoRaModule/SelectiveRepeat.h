@@ -0,0 +1,44 @@
+#ifndef __SELECTIVE_REPEAT_H__
+#define __SELECTIVE_REPEAT_H__
+
+#include "LoRaModule.h"
+
+namespace mirra
+{
+/// @brief Keeps track of the sensor data frames the gateway received from a node in its comm
+/// period, from which it acks the node's bursts (selective repeat, see Message<SENSOR_DATA_BATCH>).
+class FrameReceiver
+{
+    /// @brief Sequence number of the first frame not received yet.
+    uint8_t base{0};
+    /// @brief Bitmap of the frames received from the base on, see Message<ACK_DATA>.
+    uint8_t received{0};
+    /// @brief Whether the frame flagged as last was received, and its sequence number.
+    bool lastReceived{false};
+    uint8_t lastSeq{0};
+
+public:
+    /// @brief Registers a received frame.
+    /// @return Whether the frame is new, i.e. not a retransmission of a frame received before.
+    bool receive(const Message<SENSOR_DATA_BATCH>& frame);
+    /// @return Whether all frames up to the one flagged as last were received.
+    bool isComplete() const;
+    /// @return An ack of the frames received so far.
+    Message<ACK_DATA> getAck(const MACAddress& src, const MACAddress& dest) const
+    {
+        return Message<ACK_DATA>(src, dest, base, received);
+    }
+};
+
+/// @return The time in ms the gateway waits for the next frame of a burst after receiving one: the
+/// gap between frames and the time on air of a frame of maximum length.
+uint32_t getFrameTimeout(const PHYSettings& settings);
+/// @return The time in ms a node waits for the reply to a burst. The gateway replies after the
+/// turnaround, or after the frame timeout if it did not receive the poll frame.
+uint32_t getReplyTimeout(const PHYSettings& settings);
+/// @return The time in ms by which a comm period is extended when a single frame of it is lost: the
+/// reply timeout the node waits out and the frame it sends again.
+uint32_t getRetryDuration(const PHYSettings& settings);
+}
+
+#endif
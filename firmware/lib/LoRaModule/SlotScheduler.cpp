@@ -0,0 +1,66 @@
+#include "SlotScheduler.h"
+#include "SelectiveRepeat.h"
+#include <cmath>
+
+using namespace mirra;
+
+uint32_t mirra::getTimeOnAir(size_t length, const PHYSettings& settings)
+{
+    const int sf{settings.spreadingFactor};
+    const double symbolUs{(1 << sf) * 1000.0 / settings.bandwidth};
+    // RadioLib enables the low data rate optimisation for symbols longer than 16 ms
+    const int lowDataRate{symbolUs > 16000 ? 1 : 0};
+    const double payloadBits{8.0 * length - 4 * sf + 28 + 16};
+    const double payloadBlocks{std::ceil(payloadBits / (4 * (sf - 2 * lowDataRate)))};
+    const double payloadSymbols{8 + std::max(payloadBlocks * LORA_CODING_RATE, 0.0)};
+    return static_cast<uint32_t>(
+        std::lround((LORA_PREAMBLE_LENGHT + 4.25 + payloadSymbols) * symbolUs));
+}
+
+uint32_t mirra::getCommPeriodDuration(uint32_t maxMessages, size_t entryLength,
+                                      const PHYSettings& settings, uint32_t turnaroundMs)
+{
+    constexpr size_t capacity{Message<SENSOR_DATA_BATCH>::capacity};
+    // all messages of the comm period carry a compact header instead of a MessageHeader
+    constexpr size_t saving{MessageHeader::headerLength - CompactHeader::length};
+    constexpr size_t frameOverhead{MessageHeader::maxLength - capacity - saving};
+    const uint32_t turnaroundUs{turnaroundMs * 1000};
+    const size_t entriesPerFrame{std::max<size_t>(capacity / std::max<size_t>(entryLength, 1), 1)};
+    size_t remaining{maxMessages};
+    uint32_t durationUs{0};
+    for (size_t frame{1};; frame++)
+    {
+        size_t nEntries{std::min(remaining, entriesPerFrame)};
+        durationUs += getTimeOnAir(frameOverhead + nEntries * entryLength, settings);
+        remaining -= nEntries;
+        if (remaining == 0)
+            break;
+        if (frame % Message<ACK_DATA>::window == 0)
+            // the gateway acks the burst, after which the node sends the next one, or sends a lost
+            // frame of it again
+            durationUs += 2 * turnaroundUs +
+                          getTimeOnAir(sizeof(Message<ACK_DATA>) - saving, settings) +
+                          getRetryDuration(settings) * 1000;
+        else
+            durationUs += FRAME_GAP * 1000;
+    }
+    // the gateway replies to the last burst with a time config, which the node acks
+    durationUs += 2 * turnaroundUs + getTimeOnAir(sizeof(Message<TIME_CONFIG>) - saving, settings) +
+                  getTimeOnAir(sizeof(Message<ACK_TIME>) - saving, settings) +
+                  getRetryDuration(settings) * 1000;
+    return (durationUs + 999) / 1000;
+}
+
+uint64_t SlotScheduler::reserve(uint32_t length)
+{
+    uint64_t slotStart{end};
+    end += length;
+    return slotStart;
+}
+
+bool SlotScheduler::occupy(uint64_t slotStart, uint32_t length)
+{
+    bool free{slotStart >= end};
+    end = std::max(end, slotStart + length);
+    return free;
+}
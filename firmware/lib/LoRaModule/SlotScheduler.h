@@ -0,0 +1,67 @@
+#ifndef __SLOT_SCHEDULER_H__
+#define __SLOT_SCHEDULER_H__
+
+#include "LoRaModule.h"
+
+namespace mirra
+{
+/// @return The time on air in µs of a packet of the given length, sent with the given settings and
+/// the rest of the LoRa configuration of LoRaModule (explicit header, CRC on), as given by the
+/// SX1272 datasheet.
+uint32_t getTimeOnAir(size_t length, const PHYSettings& settings = LoRaModule::defaultSettings);
+
+/// @brief Estimates the duration of the comm period of a node, from the start of its first sensor
+/// data message until the gateway has received the ack to its time config. Entries are packed into
+/// as few sensor data messages as possible, which are sent in bursts of a window each, as the
+/// sensor node does. All messages carry a CompactHeader, as in the session of the comm period.
+/// Every burst, and the time config, is given room to send a lost frame again (see
+/// getRetryDuration).
+/// @param maxMessages The maximum amount of entries the node sends in a comm period.
+/// @param entryLength The length in bytes of a single encoded entry of the node.
+/// @param settings The settings the node communicates with.
+/// @param turnaroundMs The time in ms between receiving a message and sending the reply to it.
+/// @return The duration in ms.
+uint32_t getCommPeriodDuration(uint32_t maxMessages, size_t entryLength,
+                               const PHYSettings& settings = LoRaModule::defaultSettings,
+                               uint32_t turnaroundMs = RX_SETUP_TIME);
+
+/// @brief Packs the comm periods of the nodes of a gateway back-to-back into slots, within a single
+/// comm interval (a cycle). Times are in ms (UNIX epoch), lengths in ms.
+///
+/// Slots are reserved one after the other in order of comm time, as the gateway communicates with
+/// its nodes: a node that leaves the schedule thus frees its slot for the nodes after it in the
+/// next cycle, and a node that joins is appended at the end. Slots that cannot be moved, e.g. the
+/// one of a node that missed its time config, are marked as occupied and packed around.
+class SlotScheduler
+{
+    /// @brief The start of the cycle, i.e. of its first slot.
+    uint64_t start;
+    uint32_t interval;
+    /// @brief The end of the last slot reserved or occupied.
+    uint64_t end;
+
+public:
+    /// @param start The start of the first slot of the cycle to schedule.
+    /// @param interval The comm interval, which bounds the length of the cycle.
+    SlotScheduler(uint64_t start, uint32_t interval) : start{start}, interval{interval}, end{start}
+    {}
+
+    /// @brief Reserves a slot right after the last reserved or occupied slot.
+    /// @param length The length of the slot.
+    /// @return The start of the slot.
+    uint64_t reserve(uint32_t length);
+    /// @brief Marks a slot that was scheduled before as occupied, so that the slots reserved after
+    /// it are packed after it.
+    /// @param slotStart The start of the slot.
+    /// @param length The length of the slot.
+    /// @return Whether the slot is free of the slots reserved or occupied before.
+    bool occupy(uint64_t slotStart, uint32_t length);
+
+    /// @return Whether a slot of the given length can still be reserved within the cycle.
+    bool fits(uint32_t length) const { return end + length <= start + interval; }
+    uint64_t getStart() const { return start; }
+    uint64_t getEnd() const { return end; }
+};
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef __SIM_ARDUINO_H__
+#define __SIM_ARDUINO_H__
+
+#include "HardwareSerial.h"
+#include "LoRaSimulator.h"
+#include "esp_err.h"
+#include "esp_sleep.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// Host replacement for the parts of the Arduino core used by LoRaModule, on the clock of the link
+// simulator.
+
+#define RTC_DATA_ATTR
+
+inline void delay(uint32_t ms)
+{
+    mirra::simulator::delay(static_cast<uint64_t>(ms) * 1000);
+}
+inline unsigned long millis()
+{
+    return mirra::simulator::getTime() / 1000;
+}
+inline unsigned long micros()
+{
+    return mirra::simulator::getTime();
+}
+/// @brief The only pin read is the radio's DIO0 interrupt pin.
+inline int digitalRead(uint8_t pin)
+{
+    return mirra::simulator::getInterrupt() ? 1 : 0;
+}
+inline long random(long howbig)
+{
+    return howbig > 0 ? mirra::simulator::random() % howbig : 0;
+}
+
+inline esp_err_t esp_efuse_mac_get_default(uint8_t* mac)
+{
+    mirra::simulator::getMACAddress(mac);
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __SIM_HARDWARE_SERIAL_H__
+#define __SIM_HARDWARE_SERIAL_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+// Host replacement for the serial port, writing to stdout.
+
+class HardwareSerial
+{
+public:
+    size_t write(const uint8_t* buffer, size_t size)
+    {
+        return std::fwrite(buffer, 1, size, stdout);
+    }
+    size_t write(const char* buffer, size_t size) { return std::fwrite(buffer, 1, size, stdout); }
+    size_t print(const char* string) { return std::fputs(string, stdout) < 0 ? 0 : 1; }
+    size_t println(const char* string) { return std::puts(string) < 0 ? 0 : 1; }
+    template <class... Args> size_t printf(const char* format, Args... args)
+    {
+        int printed{std::printf(format, args...)};
+        return printed < 0 ? 0 : printed;
+    }
+    void flush() { std::fflush(stdout); }
+};
+
+inline HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,767 @@
+#include "LoRaSimulator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace mirra::simulator;
+
+namespace
+{
+constexpr uint64_t never{UINT64_MAX};
+
+/// @brief Supply voltage of the module, in V.
+constexpr double voltage{3.3};
+/// @brief Currents in mA of the ESP32 and SX1272 states, from their datasheets.
+constexpr double activeCurrent{40.0}, lightSleepCurrent{0.8}, deepSleepCurrent{0.01};
+constexpr double rxCurrent{10.5}, standbyCurrent{1.4};
+/// @brief Minimum capture ratio in dB: a packet survives an overlapping packet that is at least
+/// this much weaker at the receiver.
+constexpr float captureThreshold{6};
+/// @brief Noise figure of the receiver in dB.
+constexpr float noiseFigure{6};
+
+/// @return The current in mA drawn by the SX1272 while transmitting at the given power, linearly
+/// interpolated between datasheet values.
+double txCurrent(int8_t power)
+{
+    static constexpr std::pair<double, double> table[]{{7, 18}, {13, 28}, {17, 90}, {20, 125}};
+    if (power <= table[0].first)
+        return table[0].second;
+    for (size_t i{1}; i < std::size(table); i++)
+    {
+        if (power <= table[i].first)
+            return table[i - 1].second + (power - table[i - 1].first) *
+                                             (table[i].second - table[i - 1].second) /
+                                             (table[i].first - table[i - 1].first);
+    }
+    return std::prev(std::end(table))->second;
+}
+
+/// @return The lowest SNR in dB at which packets of the given spreading factor are demodulated.
+float demodulationFloor(uint8_t spreadingFactor)
+{
+    return -5.0f - 2.5f * (std::clamp<uint8_t>(spreadingFactor, 6, 12) - 6);
+}
+
+/// @return The thermal noise in dBm over the given bandwidth in kHz, as seen by the receiver.
+float noiseFloor(float bandwidth)
+{
+    return -174.0f + 10.0f * std::log10(bandwidth * 1000.0f) + noiseFigure;
+}
+
+/// @brief Thrown into a device's function to unwind it when the simulation is stopped.
+struct Stopped
+{
+};
+
+enum class McuState : uint8_t
+{
+    ACTIVE,
+    LIGHT_SLEEP,
+    DEEP_SLEEP
+};
+
+enum class RadioState : uint8_t
+{
+    OFF,
+    STANDBY,
+    TX,
+    RX
+};
+
+struct Transmission
+{
+    size_t sender;
+    RadioConfig config;
+    std::vector<uint8_t> data;
+    uint64_t end;
+    /// @brief Received signal strength at every device in dBm, including fading.
+    std::vector<float> rssi;
+    /// @brief Whether the sender aborted the transmission before its end.
+    bool aborted{false};
+};
+
+struct Device
+{
+    size_t index;
+    std::function<void()> main;
+    std::thread thread;
+    std::condition_variable resume;
+    bool running{false};
+    bool finished{false};
+
+    /// @brief Whether the device is sleeping, and until when at the latest.
+    bool waiting{true};
+    uint64_t wakeTime;
+    bool ready{false};
+
+    uint64_t timer{never};
+    bool radioWakeup{false};
+    WakeupCause cause{WakeupCause::NONE};
+
+    McuState mcu{McuState::ACTIVE};
+    uint64_t mcuSince{0};
+    RadioState radio{RadioState::OFF};
+    uint64_t radioSince{0};
+    RadioConfig config{};
+    /// @brief Time from which the radio detects packets, once it has been set up to receive.
+    uint64_t listening{0};
+    /// @brief Level of the radio's DIO0 interrupt pin.
+    bool interrupt{false};
+
+    /// @brief Transmission being received, if any.
+    std::shared_ptr<Transmission> receiving;
+    bool corrupted{false};
+    std::vector<uint8_t> packet;
+    bool crcError{false};
+    float rssi{0};
+    float snr{0};
+
+    DeviceStats stats;
+
+    /// @brief Drift of the RTC in ppm, positive if it runs fast.
+    double drift{0};
+    /// @brief Offset in µs of the RTC, on top of its drift, since it was last set.
+    int64_t clockOffset{0};
+    /// @brief Offset in µs of the system time from the RTC, since it was last set.
+    int64_t sysOffset{0};
+
+    Device(size_t index, std::function<void()> main, uint64_t start)
+        : index{index}, main{std::move(main)}, wakeTime{start}
+    {
+    }
+};
+
+struct Simulator
+{
+    std::mutex lock;
+    std::condition_variable scheduler;
+    bool stopping{false};
+
+    uint64_t time{0};
+    uint32_t epoch{1704067200}; // 2024-01-01 00:00:00
+    std::mt19937 random{0};
+
+    Link defaultLink{};
+    std::map<std::pair<size_t, size_t>, Link> links;
+    std::vector<std::unique_ptr<Device>> devices;
+    /// @brief Transmissions that have not ended yet, in the order they started.
+    std::vector<std::shared_ptr<Transmission>> transmissions;
+
+    ~Simulator() { stop(); }
+
+    /// @return A uniformly distributed number in [0, 1). Distributions of the standard library are
+    /// avoided, as their output differs between implementations.
+    double uniform() { return random() / 4294967296.0; }
+    /// @return A normally distributed number with mean 0 and standard deviation 1.
+    double gaussian()
+    {
+        double u{1.0 - uniform()}, v{uniform()};
+        return std::sqrt(-2.0 * std::log(u)) * std::cos(2.0 * M_PI * v);
+    }
+
+    const Link& getLink(size_t a, size_t b) const
+    {
+        auto found{links.find({std::min(a, b), std::max(a, b)})};
+        return found != links.end() ? found->second : defaultLink;
+    }
+
+    void setMcu(Device& d, McuState state)
+    {
+        uint64_t elapsed{time - d.mcuSince};
+        switch (d.mcu)
+        {
+        case McuState::ACTIVE:
+            d.stats.activeTime += elapsed;
+            break;
+        case McuState::LIGHT_SLEEP:
+            d.stats.lightSleepTime += elapsed;
+            break;
+        case McuState::DEEP_SLEEP:
+            d.stats.deepSleepTime += elapsed;
+            break;
+        }
+        d.mcu = state;
+        d.mcuSince = time;
+    }
+
+    /// @brief Adds the time since the radio's last state change to the counter of its state.
+    void accountRadio(Device& d)
+    {
+        uint64_t elapsed{time - d.radioSince};
+        switch (d.radio)
+        {
+        case RadioState::OFF:
+            break;
+        case RadioState::STANDBY:
+            d.stats.standbyTime += elapsed;
+            break;
+        case RadioState::TX:
+            d.stats.txTime += elapsed;
+            d.stats.txEnergy += elapsed * txCurrent(d.config.power) * 1e-6 * voltage;
+            break;
+        case RadioState::RX:
+            d.stats.rxTime += elapsed;
+            break;
+        }
+        d.radioSince = time;
+    }
+
+    void setRadio(Device& d, RadioState state)
+    {
+        accountRadio(d);
+        if (d.radio == RadioState::TX)
+        {
+            // leaving TX (or restarting it) aborts the transmission, if it has not ended yet
+            for (auto& t : transmissions)
+            {
+                if (t->sender == d.index)
+                    t->aborted = true;
+            }
+        }
+        d.radio = state;
+        d.receiving.reset();
+    }
+
+    /// @brief Raises the radio interrupt of a device, waking it if it sleeps on it.
+    void raiseInterrupt(Device& d)
+    {
+        d.interrupt = true;
+        if (d.waiting && d.radioWakeup && !d.ready)
+        {
+            d.ready = true;
+            d.cause = WakeupCause::RADIO;
+        }
+    }
+
+    /// @brief Whether a device can receive a transmission, ignoring random loss.
+    bool audible(const Transmission& t, size_t device) const
+    {
+        return !t.aborted && devices[device]->config.matches(t.config) &&
+               t.rssi[device] - noiseFloor(t.config.bandwidth) >=
+                   demodulationFloor(t.config.spreadingFactor);
+    }
+
+    /// @brief Whether a transmission interferes with the reception of another at a device.
+    static bool interferes(const Transmission& interferer, const Transmission& received,
+                           size_t device)
+    {
+        return !interferer.aborted && interferer.config.matches(received.config) &&
+               interferer.rssi[device] > received.rssi[device] - captureThreshold;
+    }
+
+    void startTransmission(size_t sender, const uint8_t* data, size_t length)
+    {
+        Device& s{*devices[sender]};
+        setRadio(s, RadioState::TX);
+        s.interrupt = false;
+        s.stats.packetsSent++;
+        auto t{std::make_shared<Transmission>()};
+        t->sender = sender;
+        t->config = s.config;
+        t->data.assign(data, data + length);
+        t->end = time + getAirtime(s.config, length);
+        t->rssi.resize(devices.size(), -INFINITY);
+        for (size_t i{0}; i < devices.size(); i++)
+        {
+            if (i == sender)
+                continue;
+            const Link& link{getLink(sender, i)};
+            t->rssi[i] = s.config.power - link.pathLoss;
+            if (link.fading > 0)
+                t->rssi[i] += link.fading * gaussian();
+        }
+        for (size_t i{0}; i < devices.size(); i++)
+        {
+            Device& r{*devices[i]};
+            if (i == sender || r.radio != RadioState::RX || time < r.listening)
+                continue;
+            if (r.receiving)
+            {
+                if (interferes(*t, *r.receiving, i))
+                    r.corrupted = true;
+                continue;
+            }
+            if (!r.config.matches(t->config))
+                continue;
+            if (!audible(*t, i) || uniform() < getLink(sender, i).lossRate)
+            {
+                r.stats.packetsLost++;
+                continue;
+            }
+            r.receiving = t;
+            r.corrupted = std::any_of(transmissions.begin(), transmissions.end(),
+                                      [&](const auto& other) { return interferes(*other, *t, i); });
+        }
+        transmissions.push_back(std::move(t));
+    }
+
+    void endTransmission(const std::shared_ptr<Transmission>& t)
+    {
+        Device& s{*devices[t->sender]};
+        if (!t->aborted)
+        {
+            // like the SX1272, return to standby once the packet has been sent
+            setRadio(s, RadioState::STANDBY);
+            raiseInterrupt(s);
+        }
+        for (size_t i{0}; i < devices.size(); i++)
+        {
+            Device& r{*devices[i]};
+            if (r.receiving != t)
+                continue;
+            r.receiving.reset();
+            if (t->aborted)
+            {
+                r.stats.packetsLost++;
+                continue;
+            }
+            r.packet = t->data;
+            r.crcError = r.corrupted;
+            r.rssi = t->rssi[i];
+            r.snr = t->rssi[i] - noiseFloor(t->config.bandwidth);
+            if (r.crcError)
+                r.stats.packetsCollided++;
+            else
+                r.stats.packetsReceived++;
+            raiseInterrupt(r);
+        }
+    }
+
+    /// @brief Hands control to a device, until it sleeps again or its function returns.
+    void resumeDevice(Device& d, std::unique_lock<std::mutex>& held)
+    {
+        d.waiting = false;
+        d.ready = false;
+        d.running = true;
+        d.resume.notify_one();
+        scheduler.wait(held, [&] { return !d.running; });
+    }
+
+    /// @brief Hands control back to the scheduler until the calling device is resumed.
+    void yield(Device& d)
+    {
+        std::unique_lock<std::mutex> held{lock};
+        if (!stopping)
+        {
+            d.waiting = true;
+            d.running = false;
+            scheduler.notify_one();
+            d.resume.wait(held, [&] { return d.running; });
+        }
+        // no throwing while another exception unwinds the device
+        if (stopping && std::uncaught_exceptions() == 0)
+            throw Stopped{};
+    }
+
+    void run(uint64_t until)
+    {
+        std::unique_lock<std::mutex> held{lock};
+        while (!stopping)
+        {
+            uint64_t next{never};
+            for (const auto& t : transmissions)
+                next = std::min(next, t->end);
+            for (const auto& d : devices)
+            {
+                if (d->ready)
+                    next = std::min(next, time);
+                else if (d->waiting && !d->finished)
+                    next = std::min(next, d->wakeTime);
+            }
+            if (next == never || next > until)
+            {
+                if (until != never)
+                    time = std::max(time, until);
+                return;
+            }
+            time = next;
+            for (size_t i{0}; i < transmissions.size();)
+            {
+                if (transmissions[i]->end == time)
+                {
+                    auto t{std::move(transmissions[i])};
+                    transmissions.erase(transmissions.begin() + i);
+                    endTransmission(t);
+                }
+                else
+                {
+                    i++;
+                }
+            }
+            for (auto& d : devices)
+            {
+                if (d->waiting && !d->finished && !d->ready && d->wakeTime == time)
+                {
+                    d->ready = true;
+                    d->cause = WakeupCause::TIMER;
+                }
+            }
+            for (auto& d : devices)
+            {
+                if (d->ready)
+                    resumeDevice(*d, held);
+            }
+        }
+    }
+
+    void stop()
+    {
+        std::unique_lock<std::mutex> held{lock};
+        stopping = true;
+        for (auto& d : devices)
+        {
+            if (!d->finished)
+                resumeDevice(*d, held);
+        }
+        held.unlock();
+        for (auto& d : devices)
+        {
+            if (d->thread.joinable())
+                d->thread.join();
+        }
+    }
+};
+
+Simulator& instance()
+{
+    static Simulator instance{};
+    return instance;
+}
+
+thread_local Device* current{nullptr};
+
+Device& getCurrent()
+{
+    if (current == nullptr)
+        std::terminate(); // device functions are only available on the threads of devices
+    return *current;
+}
+
+/// @return The UNIX time in µs the RTC of the device reads at the given virtual time.
+int64_t getClock(const Device& d, uint64_t time)
+{
+    return static_cast<int64_t>(instance().epoch) * 1000000 + static_cast<int64_t>(time) +
+           static_cast<int64_t>(std::llround(time * d.drift * 1e-6)) + d.clockOffset;
+}
+}
+
+bool RadioConfig::matches(const RadioConfig& other) const
+{
+    return frequency == other.frequency && bandwidth == other.bandwidth &&
+           spreadingFactor == other.spreadingFactor && syncWord == other.syncWord;
+}
+
+double DeviceStats::getEnergy() const
+{
+    // mA * µs = nC, so scaled by 1e-6 to mC, which times V is mJ
+    double charge{activeTime * activeCurrent + lightSleepTime * lightSleepCurrent +
+                  deepSleepTime * deepSleepCurrent + rxTime * rxCurrent +
+                  standbyTime * standbyCurrent};
+    return charge * 1e-6 * voltage + txEnergy;
+}
+
+uint64_t mirra::simulator::getAirtime(const RadioConfig& config, size_t length)
+{
+    const double symbol{std::ldexp(1.0, config.spreadingFactor) / (config.bandwidth * 1e3)};
+    // low data rate optimisation is enabled by RadioLib for symbols longer than 16 ms
+    const int lowDataRate{symbol > 16e-3 ? 1 : 0};
+    const int sf{config.spreadingFactor};
+    const double payloadBits{8.0 * length - 4.0 * sf + 28 + 16};
+    const double payloadSymbols{
+        8 + std::max(std::ceil(payloadBits / (4.0 * (sf - 2 * lowDataRate))) * config.codingRate,
+                     0.0)};
+    return static_cast<uint64_t>(
+        std::llround((config.preambleLength + 4.25 + payloadSymbols) * symbol * 1e6));
+}
+
+void mirra::simulator::setSeed(uint32_t seed)
+{
+    instance().random.seed(seed);
+}
+
+void mirra::simulator::setEpoch(uint32_t epoch)
+{
+    instance().epoch = epoch;
+}
+
+void mirra::simulator::setDefaultLink(const Link& link)
+{
+    instance().defaultLink = link;
+}
+
+void mirra::simulator::setLink(size_t a, size_t b, const Link& link)
+{
+    instance().links[{std::min(a, b), std::max(a, b)}] = link;
+}
+
+size_t mirra::simulator::addDevice(std::function<void()> main, uint64_t start)
+{
+    std::unique_lock<std::mutex> held{instance().lock};
+    auto& d{instance().devices.emplace_back(
+        std::make_unique<Device>(instance().devices.size(), std::move(main),
+                                 std::max(start, instance().time)))};
+    d->mcuSince = d->radioSince = instance().time;
+    Device* device{d.get()};
+    device->thread = std::thread{[device] {
+        current = device;
+        {
+            std::unique_lock<std::mutex> held{instance().lock};
+            device->resume.wait(held, [&] { return device->running; });
+        }
+        if (!instance().stopping)
+        {
+            try
+            {
+                device->main();
+            }
+            catch (const Stopped&)
+            {
+            }
+        }
+        std::unique_lock<std::mutex> held{instance().lock};
+        device->finished = true;
+        device->running = false;
+        instance().scheduler.notify_one();
+    }};
+    return instance().devices.size() - 1;
+}
+
+void mirra::simulator::run(uint64_t until)
+{
+    instance().run(until);
+}
+
+void mirra::simulator::stop()
+{
+    instance().stop();
+}
+
+uint64_t mirra::simulator::getTime()
+{
+    return instance().time;
+}
+
+uint32_t mirra::simulator::getSysTime()
+{
+    if (current == nullptr)
+        return instance().epoch + instance().time / 1000000;
+    return static_cast<uint32_t>(getClock(*current, instance().time) / 1000000);
+}
+
+uint64_t mirra::simulator::getSysTimeMs()
+{
+    if (current == nullptr)
+        return instance().epoch * 1000ULL + instance().time / 1000;
+    return static_cast<uint64_t>(getClock(*current, instance().time) + current->sysOffset) / 1000;
+}
+
+void mirra::simulator::setClockDrift(size_t device, float ppm)
+{
+    instance().devices[device]->drift = ppm;
+}
+
+const DeviceStats& mirra::simulator::getStats(size_t device)
+{
+    Device& d{*instance().devices[device]};
+    instance().setMcu(d, d.mcu);
+    instance().accountRadio(d);
+    return d.stats;
+}
+
+size_t mirra::simulator::getDeviceCount()
+{
+    return instance().devices.size();
+}
+
+size_t mirra::simulator::getDevice()
+{
+    return getCurrent().index;
+}
+
+void mirra::simulator::setSysTime(uint32_t time)
+{
+    Device& d{getCurrent()};
+    // the RTC restarts counting the second it is set to, as the PCF2129 does when written
+    const int64_t offset{static_cast<int64_t>(time) * 1000000 - getClock(d, instance().time)};
+    d.clockOffset += offset;
+    // the system time is kept by the processor, apart from the RTC
+    d.sysOffset -= offset;
+}
+
+void mirra::simulator::setSysTimeMs(uint64_t time)
+{
+    Device& d{getCurrent()};
+    d.sysOffset = static_cast<int64_t>(time) * 1000 - getClock(d, instance().time);
+}
+
+uint64_t mirra::simulator::getSleepTime(uint32_t sysTime)
+{
+    Device& d{getCurrent()};
+    const int64_t remaining{static_cast<int64_t>(sysTime) * 1000000 -
+                            getClock(d, instance().time)};
+    if (remaining <= 0)
+        return 0;
+    return static_cast<uint64_t>(std::ceil(remaining / (1 + d.drift * 1e-6)));
+}
+
+void mirra::simulator::getMACAddress(uint8_t* mac)
+{
+    // locally administered unicast address
+    size_t device{getDevice()};
+    const uint8_t address[6]{0x02, 0x4D, 0x49, static_cast<uint8_t>(device >> 16),
+                             static_cast<uint8_t>(device >> 8), static_cast<uint8_t>(device)};
+    std::copy(std::begin(address), std::end(address), mac);
+}
+
+void mirra::simulator::deepSleep(uint64_t duration)
+{
+    Device& d{getCurrent()};
+    instance().setRadio(d, RadioState::OFF);
+    d.interrupt = false;
+    instance().setMcu(d, McuState::DEEP_SLEEP);
+    d.wakeTime = instance().time + duration;
+    d.radioWakeup = false;
+    instance().yield(d);
+    instance().setMcu(d, McuState::ACTIVE);
+}
+
+void mirra::simulator::delay(uint64_t duration)
+{
+    Device& d{getCurrent()};
+    // busy waiting leaves the wakeup sources and cause of light sleep untouched
+    const bool radioWakeup{d.radioWakeup};
+    const WakeupCause cause{d.cause};
+    d.radioWakeup = false;
+    d.wakeTime = instance().time + duration;
+    instance().yield(d);
+    d.radioWakeup = radioWakeup;
+    d.cause = cause;
+}
+
+uint32_t mirra::simulator::random()
+{
+    return instance().random();
+}
+
+void mirra::simulator::disableWakeups()
+{
+    Device& d{getCurrent()};
+    d.timer = never;
+    d.radioWakeup = false;
+}
+
+void mirra::simulator::enableTimerWakeup(uint64_t duration)
+{
+    getCurrent().timer = duration;
+}
+
+void mirra::simulator::enableRadioWakeup()
+{
+    getCurrent().radioWakeup = true;
+}
+
+bool mirra::simulator::getInterrupt()
+{
+    return getCurrent().interrupt;
+}
+
+void mirra::simulator::lightSleep()
+{
+    Device& d{getCurrent()};
+    if (d.radioWakeup && d.interrupt)
+    {
+        d.cause = WakeupCause::RADIO;
+        return;
+    }
+    d.wakeTime = d.timer == never ? never : instance().time + d.timer;
+    instance().setMcu(d, McuState::LIGHT_SLEEP);
+    instance().yield(d);
+    instance().setMcu(d, McuState::ACTIVE);
+}
+
+WakeupCause mirra::simulator::getWakeupCause()
+{
+    return getCurrent().cause;
+}
+
+void mirra::simulator::configureRadio(const RadioConfig& config)
+{
+    Device& d{getCurrent()};
+    instance().setRadio(d, RadioState::STANDBY);
+    d.config = config;
+}
+
+const RadioConfig& mirra::simulator::getRadioConfig()
+{
+    return getCurrent().config;
+}
+
+void mirra::simulator::startTransmit(const uint8_t* data, size_t length)
+{
+    instance().startTransmission(getDevice(), data, length);
+}
+
+void mirra::simulator::startReceive()
+{
+    Device& d{getCurrent()};
+    instance().setRadio(d, RadioState::RX);
+    d.listening = instance().time + rxSetupTime;
+    d.interrupt = false;
+}
+
+bool mirra::simulator::scanChannel()
+{
+    Device& d{getCurrent()};
+    auto busy = [&] {
+        return std::any_of(instance().transmissions.begin(), instance().transmissions.end(),
+                           [&](const auto& t) { return instance().audible(*t, d.index); });
+    };
+    instance().setRadio(d, RadioState::RX);
+    d.listening = never; // detecting a preamble does not receive the packet
+    bool detected{busy()};
+    delay(static_cast<uint64_t>(2 * std::ldexp(1.0, d.config.spreadingFactor) * 1e3 /
+                                d.config.bandwidth));
+    detected = detected || busy();
+    instance().setRadio(d, RadioState::STANDBY);
+    return detected;
+}
+
+void mirra::simulator::standby()
+{
+    Device& d{getCurrent()};
+    if (d.radio != RadioState::OFF)
+        instance().setRadio(d, RadioState::STANDBY);
+}
+
+size_t mirra::simulator::getPacketLength()
+{
+    return getCurrent().packet.size();
+}
+
+bool mirra::simulator::readPacket(uint8_t* data, size_t length)
+{
+    Device& d{getCurrent()};
+    std::copy_n(d.packet.begin(), std::min(length, d.packet.size()), data);
+    d.interrupt = false;
+    return !d.crcError;
+}
+
+float mirra::simulator::getRSSI()
+{
+    return getCurrent().rssi;
+}
+
+float mirra::simulator::getSNR()
+{
+    return getCurrent().snr;
+}
@@ -0,0 +1,197 @@
+#ifndef __LORA_SIMULATOR_H__
+#define __LORA_SIMULATOR_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+/// @brief Host-side simulation of the LoRa channel between a set of devices, used to run the
+/// communication protocol of gateways and sensor nodes natively.
+///
+/// Every device runs its own function on its own thread, but only one device runs at a time, and
+/// code takes no time: devices advance the shared virtual clock by sleeping until a timer or radio
+/// interrupt, or by deep sleeping. Events at the same time are handled in the order in which the
+/// devices were added, so that a run is fully determined by its seed.
+///
+/// The host replacements of RadioLib.h, esp_sleep.h and Arduino.h in this library drive the radio
+/// and clock of the calling device, so that LoRaModule runs unmodified on top of the simulator.
+/// Every device has an RTC of its own, which may drift from the virtual clock (see setClockDrift).
+///
+/// A packet is received by every device whose radio is listening with the same settings when the
+/// packet starts, as long as its signal to noise ratio is above the demodulation floor of its
+/// spreading factor and it is not lost at random. Packets overlapping at a receiver collide: the
+/// packet being received is corrupted (a CRC error) unless it is at least 6 dB stronger. A radio
+/// only listens rxSetupTime after it was told to, which stands for the switch of the SX1272 to
+/// receive mode and the wakeup of the ESP32 around it.
+namespace mirra::simulator
+{
+/// @brief Settings of a device's radio, as configured through RadioLib.
+struct RadioConfig
+{
+    /// @brief Carrier frequency in MHz.
+    float frequency{866.0};
+    /// @brief Bandwidth in kHz.
+    float bandwidth{125.0};
+    uint8_t spreadingFactor{7};
+    /// @brief Denominator of the coding rate 4/x.
+    uint8_t codingRate{6};
+    uint8_t syncWord{0x12};
+    /// @brief Output power in dBm.
+    int8_t power{10};
+    /// @brief Preamble length in symbols.
+    uint16_t preambleLength{8};
+
+    /// @return Whether a radio with these settings can receive packets sent with the other.
+    bool matches(const RadioConfig& other) const;
+};
+
+/// @brief Propagation of packets between two devices.
+struct Link
+{
+    /// @brief Attenuation in dB of the signal between the devices.
+    float pathLoss{110};
+    /// @brief Standard deviation in dB of the per-packet fading on top of the path loss.
+    float fading{0};
+    /// @brief Probability that a packet is lost regardless of its signal strength, e.g. due to
+    /// interference from outside the network.
+    float lossRate{0};
+};
+
+/// @brief Counters of a single device. Times are in µs of virtual time.
+struct DeviceStats
+{
+    size_t packetsSent{0};
+    /// @brief Packets received intact.
+    size_t packetsReceived{0};
+    /// @brief Packets that started while the device was listening, but were too weak or lost.
+    size_t packetsLost{0};
+    /// @brief Packets received with a CRC error because they overlapped with another packet.
+    size_t packetsCollided{0};
+
+    uint64_t txTime{0};
+    /// @brief Energy in mJ used by transmitting, which depends on the power of each transmission.
+    double txEnergy{0};
+    uint64_t rxTime{0};
+    /// @brief Time the radio was powered but idle.
+    uint64_t standbyTime{0};
+    /// @brief Time the processor was kept awake (see delay).
+    uint64_t activeTime{0};
+    uint64_t lightSleepTime{0};
+    uint64_t deepSleepTime{0};
+
+    /// @return The energy used by the processor and radio in mJ, estimated from datasheet currents.
+    double getEnergy() const;
+};
+
+/// @brief Time in µs from startReceive until the radio detects packets.
+constexpr uint64_t rxSetupTime{5000};
+
+/// @return The time on air in µs of a packet of the given length, in explicit header mode with
+/// CRC, as given by the SX1272 datasheet.
+uint64_t getAirtime(const RadioConfig& config, size_t length);
+
+/// @brief Seeds the random number generator of the channel. Must be called before run.
+void setSeed(uint32_t seed);
+/// @brief Sets the UNIX time in seconds at which the simulation starts (see getSysTime).
+void setEpoch(uint32_t epoch);
+/// @brief Sets the link between devices that have not been given a link of their own.
+void setDefaultLink(const Link& link);
+/// @brief Sets the link between two devices, in both directions.
+void setLink(size_t a, size_t b, const Link& link);
+/// @brief Adds a device, which runs the given function from the given virtual time on. Its MAC
+/// address is derived from its index.
+/// @return The index of the device.
+size_t addDevice(std::function<void()> main, uint64_t start = 0);
+/// @brief Runs the simulation until the given virtual time, or until no device is left waiting
+/// for anything. Can be called again to continue the simulation.
+/// @param until Virtual time in µs since the start of the simulation.
+void run(uint64_t until);
+/// @brief Ends the functions of all devices that have not returned yet, by unwinding them from
+/// their current sleep, and waits for their threads. Stats remain available.
+void stop();
+
+/// @return The virtual time in µs since the start of the simulation.
+uint64_t getTime();
+/// @return The virtual UNIX time in seconds, as the RTC of the calling device reports it, or as an
+/// RTC without drift would outside the threads of devices.
+uint32_t getSysTime();
+/// @return The virtual UNIX time in ms, as the system time of the calling device reports it, or as
+/// a clock without drift would outside the threads of devices. The system time counts at the rate
+/// of the RTC, but is set apart from it (see setSysTimeMs).
+uint64_t getSysTimeMs();
+/// @brief Sets the drift of the RTC of the given device, positive if it runs fast. The RTCs of all
+/// devices start at the epoch.
+void setClockDrift(size_t device, float ppm);
+/// @return The counters of the given device, up to the current virtual time.
+const DeviceStats& getStats(size_t device);
+/// @return The amount of devices added.
+size_t getDeviceCount();
+
+// The following functions act on the calling device.
+
+/// @return The index of the calling device.
+size_t getDevice();
+/// @brief Sets the RTC of the calling device to the start of the given UNIX time in seconds.
+void setSysTime(uint32_t time);
+/// @brief Sets the system time of the calling device to the given UNIX time in ms, as
+/// PCF2129_RTC::setSysTimeMs does. It starts at the time of the RTC.
+void setSysTimeMs(uint64_t time);
+/// @return The time in µs until the RTC of the calling device reads the given UNIX time in seconds,
+/// 0 if it already does.
+uint64_t getSleepTime(uint32_t sysTime);
+/// @brief Writes the MAC address of the calling device into a buffer of 6 bytes.
+void getMACAddress(uint8_t* mac);
+/// @brief Deep sleeps for the given time. The radio is powered off, and must be configured again
+/// afterwards, as the firmware does when it boots from deep sleep.
+void deepSleep(uint64_t duration);
+/// @brief Keeps the processor awake for the given time, as a busy wait would.
+void delay(uint64_t duration);
+/// @return A random number, from the random number generator of the channel.
+uint32_t random();
+
+/// @brief Source that ended the last light sleep.
+enum class WakeupCause : uint8_t
+{
+    NONE,
+    TIMER,
+    RADIO
+};
+/// @brief Disables all wakeup sources of light sleep.
+void disableWakeups();
+/// @brief Wakes from light sleep after the given time, counted from the start of the sleep.
+void enableTimerWakeup(uint64_t duration);
+/// @brief Wakes from light sleep when the radio raises its interrupt (DIO0).
+void enableRadioWakeup();
+/// @return The level of the radio interrupt (DIO0).
+bool getInterrupt();
+/// @brief Light sleeps until one of the enabled wakeup sources triggers. Returns immediately if
+/// the radio interrupt is enabled and already raised.
+void lightSleep();
+WakeupCause getWakeupCause();
+
+/// @brief Powers the radio and applies the given settings, leaving it in standby.
+void configureRadio(const RadioConfig& config);
+/// @return The current settings of the radio.
+const RadioConfig& getRadioConfig();
+/// @brief Starts sending a packet. The radio interrupt is raised once it has been sent.
+void startTransmit(const uint8_t* data, size_t length);
+/// @brief Starts listening for packets. The radio interrupt is raised once one is received.
+void startReceive();
+/// @brief Scans the channel for the preamble of a packet (channel activity detection), which
+/// keeps the processor awake for two symbols.
+/// @return Whether a packet that the radio could receive was on air during the scan.
+bool scanChannel();
+/// @brief Puts the radio in standby, aborting any transmission or reception.
+void standby();
+/// @return The length of the last received packet.
+size_t getPacketLength();
+/// @brief Reads the last received packet and clears the radio interrupt.
+/// @return Whether the packet passed its CRC.
+bool readPacket(uint8_t* data, size_t length);
+/// @return The RSSI in dBm of the last received packet.
+float getRSSI();
+/// @return The SNR in dB of the last received packet.
+float getSNR();
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef __SIM_RADIOLIB_H__
+#define __SIM_RADIOLIB_H__
+
+#include "LoRaSimulator.h"
+#include <Arduino.h>
+#include <cstddef>
+#include <cstdint>
+
+// Host replacement for the parts of RadioLib's SX1272 driver used by LoRaModule, driving the radio
+// of the calling device in the link simulator. Error codes and ranges match RadioLib v6.
+
+#define RADIOLIB_NC (0xFFFFFFFF)
+
+#define RADIOLIB_ERR_NONE (0)
+#define RADIOLIB_ERR_PACKET_TOO_LONG (-4)
+#define RADIOLIB_ERR_CRC_MISMATCH (-7)
+#define RADIOLIB_ERR_INVALID_BANDWIDTH (-8)
+#define RADIOLIB_ERR_INVALID_SPREADING_FACTOR (-9)
+#define RADIOLIB_ERR_INVALID_CODING_RATE (-10)
+#define RADIOLIB_ERR_INVALID_FREQUENCY (-12)
+#define RADIOLIB_ERR_INVALID_OUTPUT_POWER (-13)
+#define RADIOLIB_ERR_INVALID_PREAMBLE_LENGTH (-18)
+#define RADIOLIB_PREAMBLE_DETECTED (-14)
+#define RADIOLIB_CHANNEL_FREE (-15)
+
+class Module
+{
+public:
+    Module(uint32_t cs, uint32_t irq, uint32_t rst, uint32_t gpio = RADIOLIB_NC) {}
+    void setRfSwitchPins(uint32_t rxEn, uint32_t txEn) {}
+};
+
+class SX1272
+{
+    /// @brief Validates a setting and applies it to the simulated radio.
+    template <class F> int16_t set(bool valid, int16_t error, F&& apply)
+    {
+        if (!valid)
+            return error;
+        mirra::simulator::RadioConfig config{mirra::simulator::getRadioConfig()};
+        apply(config);
+        mirra::simulator::configureRadio(config);
+        return RADIOLIB_ERR_NONE;
+    }
+
+public:
+    explicit SX1272(Module* module) {}
+
+    int16_t begin(float freq, float bw, uint8_t sf, uint8_t cr, uint8_t syncWord, int8_t power,
+                  uint16_t preambleLength, uint8_t gain)
+    {
+        mirra::simulator::configureRadio(mirra::simulator::RadioConfig{});
+        int16_t state{RADIOLIB_ERR_NONE};
+        for (int16_t result : {setFrequency(freq), setBandwidth(bw), setSpreadingFactor(sf),
+                               setCodingRate(cr), setSyncWord(syncWord), setOutputPower(power),
+                               setPreambleLength(preambleLength)})
+        {
+            if (state == RADIOLIB_ERR_NONE)
+                state = result;
+        }
+        return state;
+    }
+
+    int16_t setFrequency(float freq)
+    {
+        return set(freq >= 860.0 && freq <= 1020.0, RADIOLIB_ERR_INVALID_FREQUENCY,
+                   [&](auto& config) { config.frequency = freq; });
+    }
+    int16_t setBandwidth(float bw)
+    {
+        return set(bw == 125.0 || bw == 250.0 || bw == 500.0, RADIOLIB_ERR_INVALID_BANDWIDTH,
+                   [&](auto& config) { config.bandwidth = bw; });
+    }
+    int16_t setSpreadingFactor(uint8_t sf)
+    {
+        return set(sf >= 6 && sf <= 12, RADIOLIB_ERR_INVALID_SPREADING_FACTOR,
+                   [&](auto& config) { config.spreadingFactor = sf; });
+    }
+    int16_t setCodingRate(uint8_t cr)
+    {
+        return set(cr >= 5 && cr <= 8, RADIOLIB_ERR_INVALID_CODING_RATE,
+                   [&](auto& config) { config.codingRate = cr; });
+    }
+    int16_t setSyncWord(uint8_t syncWord)
+    {
+        return set(true, RADIOLIB_ERR_NONE, [&](auto& config) { config.syncWord = syncWord; });
+    }
+    int16_t setOutputPower(int8_t power)
+    {
+        return set(power >= -1 && power <= 20, RADIOLIB_ERR_INVALID_OUTPUT_POWER,
+                   [&](auto& config) { config.power = power; });
+    }
+    int16_t setPreambleLength(uint16_t preambleLength)
+    {
+        return set(preambleLength >= 6, RADIOLIB_ERR_INVALID_PREAMBLE_LENGTH,
+                   [&](auto& config) { config.preambleLength = preambleLength; });
+    }
+
+    int16_t startTransmit(uint8_t* data, size_t len, uint8_t addr = 0)
+    {
+        if (len > 255)
+            return RADIOLIB_ERR_PACKET_TOO_LONG;
+        mirra::simulator::startTransmit(data, len);
+        return RADIOLIB_ERR_NONE;
+    }
+    int16_t finishTransmit() { return standby(); }
+    int16_t startReceive()
+    {
+        mirra::simulator::startReceive();
+        return RADIOLIB_ERR_NONE;
+    }
+    int16_t scanChannel()
+    {
+        return mirra::simulator::scanChannel() ? RADIOLIB_PREAMBLE_DETECTED : RADIOLIB_CHANNEL_FREE;
+    }
+    int16_t readData(uint8_t* data, size_t len)
+    {
+        return mirra::simulator::readPacket(data, len == 0 ? getPacketLength() : len)
+                   ? RADIOLIB_ERR_NONE
+                   : RADIOLIB_ERR_CRC_MISMATCH;
+    }
+    size_t getPacketLength(bool update = true) { return mirra::simulator::getPacketLength(); }
+    float getRSSI() { return mirra::simulator::getRSSI(); }
+    float getSNR() { return mirra::simulator::getSNR(); }
+    /// @return The time on air in µs of a packet of the given length.
+    uint32_t getTimeOnAir(size_t len)
+    {
+        return mirra::simulator::getAirtime(mirra::simulator::getRadioConfig(), len);
+    }
+    int16_t standby()
+    {
+        mirra::simulator::standby();
+        return RADIOLIB_ERR_NONE;
+    }
+};
+
+#endif
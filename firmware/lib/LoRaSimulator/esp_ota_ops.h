@@ -0,0 +1,20 @@
+#ifndef __SIM_ESP_OTA_OPS_H__
+#define __SIM_ESP_OTA_OPS_H__
+
+#include <cstdint>
+
+// Host replacement for the application description, used by the logging module to identify the
+// build that wrote its records. Host builds have no ELF SHA-256, and are identified as build 0.
+
+typedef struct
+{
+    uint8_t app_elf_sha256[32];
+} esp_app_desc_t;
+
+inline const esp_app_desc_t* esp_ota_get_app_description()
+{
+    static const esp_app_desc_t description{};
+    return &description;
+}
+
+#endif
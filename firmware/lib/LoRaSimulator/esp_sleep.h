@@ -0,0 +1,72 @@
+#ifndef __SIM_ESP_SLEEP_H__
+#define __SIM_ESP_SLEEP_H__
+
+#include "LoRaSimulator.h"
+#include "esp_err.h"
+#include <cstdint>
+
+// Host replacement for the light sleep API of ESP-IDF, on the clock of the link simulator. The
+// EXT0 wakeup is taken to be on the radio's DIO0 pin, as it is for LoRaModule, while EXT1 wakeups
+// (buttons) never trigger.
+
+typedef int gpio_num_t;
+
+typedef enum
+{
+    ESP_SLEEP_WAKEUP_UNDEFINED,
+    ESP_SLEEP_WAKEUP_ALL,
+    ESP_SLEEP_WAKEUP_EXT0,
+    ESP_SLEEP_WAKEUP_EXT1,
+    ESP_SLEEP_WAKEUP_TIMER,
+    ESP_SLEEP_WAKEUP_TOUCHPAD,
+    ESP_SLEEP_WAKEUP_ULP,
+    ESP_SLEEP_WAKEUP_GPIO,
+    ESP_SLEEP_WAKEUP_UART,
+} esp_sleep_source_t;
+typedef esp_sleep_source_t esp_sleep_wakeup_cause_t;
+
+typedef enum
+{
+    ESP_EXT1_WAKEUP_ALL_LOW = 0,
+    ESP_EXT1_WAKEUP_ANY_HIGH = 1
+} esp_sleep_ext1_wakeup_mode_t;
+
+inline esp_err_t esp_sleep_disable_wakeup_source(esp_sleep_source_t source)
+{
+    mirra::simulator::disableWakeups();
+    return ESP_OK;
+}
+inline esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+    mirra::simulator::enableTimerWakeup(time_in_us);
+    return ESP_OK;
+}
+inline esp_err_t esp_sleep_enable_ext0_wakeup(gpio_num_t gpio_num, int level)
+{
+    if (level == 1)
+        mirra::simulator::enableRadioWakeup();
+    return ESP_OK;
+}
+inline esp_err_t esp_sleep_enable_ext1_wakeup(uint64_t mask, esp_sleep_ext1_wakeup_mode_t mode)
+{
+    return ESP_OK;
+}
+inline esp_err_t esp_light_sleep_start()
+{
+    mirra::simulator::lightSleep();
+    return ESP_OK;
+}
+inline esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause()
+{
+    switch (mirra::simulator::getWakeupCause())
+    {
+    case mirra::simulator::WakeupCause::TIMER:
+        return ESP_SLEEP_WAKEUP_TIMER;
+    case mirra::simulator::WakeupCause::RADIO:
+        return ESP_SLEEP_WAKEUP_EXT0;
+    default:
+        return ESP_SLEEP_WAKEUP_UNDEFINED;
+    }
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __SIM_FREERTOS_SEMPHR_H__
+#define __SIM_FREERTOS_SEMPHR_H__
+
+#include "FreeRTOS.h"
+
+typedef void* SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    static int mutex;
+    return &mutex;
+}
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait)
+{
+    return pdTRUE;
+}
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    return pdTRUE;
+}
+inline void vSemaphoreDelete(SemaphoreHandle_t semaphore) {}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef __SIM_FREERTOS_TASK_H__
+#define __SIM_FREERTOS_TASK_H__
+
+#include "FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void*);
+
+inline BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stackDepth,
+                              void* parameters, UBaseType_t priority, TaskHandle_t* handle)
+{
+    if (handle != nullptr)
+        *handle = nullptr;
+    return pdFAIL;
+}
+inline void vTaskDelete(TaskHandle_t task) {}
+inline uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticksToWait)
+{
+    return 0;
+}
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    return pdPASS;
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __SIM_SOC_MEMORY_LAYOUT_H__
+#define __SIM_SOC_MEMORY_LAYOUT_H__
+
+// Host replacement for the memory layout of the ESP32. Host builds have no flash mapped data, so
+// all log strings are copied into their records.
+
+inline bool esp_ptr_in_drom(const void* p)
+{
+    return false;
+}
+
+#endif
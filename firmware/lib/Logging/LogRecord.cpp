@@ -0,0 +1,240 @@
+#include "LogRecord.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+using namespace mirra;
+
+namespace
+{
+/// @brief Appends formatted text to a line, always leaving room for the terminating newline.
+void append(char* buffer, size_t max, size_t& length, const char* format, ...)
+{
+    if (length + 2 > max)
+        return;
+    va_list args;
+    va_start(args, format);
+    int printed{std::vsnprintf(&buffer[length], max - length - 1, format, args)};
+    va_end(args);
+    if (printed > 0)
+        length = std::min(length + printed, max - 2); // vsnprintf returns the untruncated length
+}
+
+bool readVarint(const uint8_t* record, size_t size, size_t& i, uint32_t& value)
+{
+    value = 0;
+    for (size_t shift{0}; shift < 32 && i < size; shift += 7)
+    {
+        uint8_t byte{record[i++]};
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+constexpr const char* kindToString(LogRecord::Kind kind)
+{
+    switch (kind)
+    {
+    case LogRecord::Kind::ERROR:
+        return "ERROR: ";
+    case LogRecord::Kind::INFO:
+        return "INFO: ";
+    case LogRecord::Kind::DEBUG:
+        return "DEBUG: ";
+    case LogRecord::Kind::BOOT:
+        return "BOOT: ";
+    }
+    return "NONE: ";
+}
+}
+
+LogRecord::Writer::Writer(uint8_t* buffer, Kind kind, uint32_t time) : buffer{buffer}
+{
+    buffer[1] = static_cast<uint8_t>(kind);
+    std::memcpy(&buffer[2], &time, sizeof(time));
+}
+
+bool LogRecord::Writer::reserve(size_t size)
+{
+    // once an argument is dropped, drop all following ones too, so that no gaps appear in the line
+    if (full || this->size + size > maxSize)
+        full = true;
+    return !full;
+}
+
+void LogRecord::Writer::pushVarint(uint32_t value)
+{
+    do
+    {
+        uint8_t byte{static_cast<uint8_t>(value & 0x7F)};
+        value >>= 7;
+        buffer[size++] = value > 0 ? byte | 0x80 : byte;
+    } while (value > 0);
+}
+
+void LogRecord::Writer::pushString(const char* string)
+{
+    if (!reserve(2))
+        return;
+    size_t length{std::strlen(string)};
+    if (size + 2 + length > maxSize)
+    {
+        length = maxSize - size - 2;
+        full = true;
+    }
+    buffer[size++] = 's';
+    buffer[size++] = length;
+    std::memcpy(&buffer[size], string, length);
+    size += length;
+}
+
+void LogRecord::Writer::pushStaticString(const char* string)
+{
+    if (!reserve(1 + 4))
+        return;
+    uint32_t address{static_cast<uint32_t>(reinterpret_cast<uintptr_t>(string))};
+    buffer[size++] = 'p';
+    std::memcpy(&buffer[size], &address, sizeof(address));
+    size += sizeof(address);
+}
+
+void LogRecord::Writer::pushSigned(int32_t value)
+{
+    if (!reserve(1 + 5))
+        return;
+    buffer[size++] = 'i';
+    pushVarint((static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31));
+}
+
+void LogRecord::Writer::pushUnsigned(uint32_t value)
+{
+    if (!reserve(1 + 5))
+        return;
+    buffer[size++] = 'u';
+    pushVarint(value);
+}
+
+void LogRecord::Writer::pushFloat(float value)
+{
+    if (!reserve(1 + sizeof(value)))
+        return;
+    buffer[size++] = 'f';
+    std::memcpy(&buffer[size], &value, sizeof(value));
+    size += sizeof(value);
+}
+
+void LogRecord::Writer::pushChar(char value)
+{
+    if (!reserve(1 + 1))
+        return;
+    buffer[size++] = 'c';
+    buffer[size++] = value;
+}
+
+size_t LogRecord::Writer::finish()
+{
+    buffer[0] = size;
+    return size;
+}
+
+size_t LogRecord::encodeBoot(uint8_t* buffer, uint32_t time, uint32_t build)
+{
+    Writer writer{buffer, Kind::BOOT, time};
+    std::memcpy(&buffer[headerSize], &build, sizeof(build));
+    buffer[0] = bootSize;
+    return bootSize;
+}
+
+uint32_t LogRecord::getBuild(const uint8_t* record)
+{
+    uint32_t build;
+    std::memcpy(&build, &record[headerSize], sizeof(build));
+    return build;
+}
+
+size_t LogRecord::format(const uint8_t* record, char* buffer, size_t max, Resolver resolve,
+                         uint32_t& build)
+{
+    const size_t size{getSize(record)};
+    const Kind kind{getKind(record)};
+    if (size < headerSize || kind > Kind::BOOT || max < 2)
+        return 0;
+    uint32_t recordTime;
+    std::memcpy(&recordTime, &record[2], sizeof(recordTime));
+    time_t ctime{recordTime};
+    tm time;
+    gmtime_r(&ctime, &time);
+    size_t length{std::strftime(buffer, max - 1, "[%F %T]", &time)};
+    append(buffer, max, length, "%s", kindToString(kind));
+    if (kind == Kind::BOOT)
+    {
+        if (size != bootSize)
+            return 0;
+        build = getBuild(record);
+        append(buffer, max, length, "Firmware build %08" PRIx32 ".", build);
+    }
+    for (size_t i{headerSize}; kind != Kind::BOOT && i < size;)
+    {
+        uint32_t value;
+        switch (record[i++])
+        {
+        case 's':
+        {
+            if (i >= size || i + 1 + record[i] > size)
+                return 0;
+            size_t stringLength{record[i++]};
+            append(buffer, max, length, "%.*s", static_cast<int>(stringLength), &record[i]);
+            i += stringLength;
+            break;
+        }
+        case 'p':
+        {
+            if (i + sizeof(value) > size)
+                return 0;
+            std::memcpy(&value, &record[i], sizeof(value));
+            i += sizeof(value);
+            const char* string{resolve != nullptr ? resolve(value, build) : nullptr};
+            if (string != nullptr)
+                append(buffer, max, length, "%s", string);
+            else
+                append(buffer, max, length, "<%08" PRIx32 ">", value);
+            break;
+        }
+        case 'i':
+            if (!readVarint(record, size, i, value))
+                return 0;
+            append(buffer, max, length, "%" PRIi32,
+                   static_cast<int32_t>((value >> 1) ^ (~(value & 1) + 1)));
+            break;
+        case 'u':
+            if (!readVarint(record, size, i, value))
+                return 0;
+            append(buffer, max, length, "%" PRIu32, value);
+            break;
+        case 'f':
+        {
+            float f;
+            if (i + sizeof(f) > size)
+                return 0;
+            std::memcpy(&f, &record[i], sizeof(f));
+            i += sizeof(f);
+            append(buffer, max, length, "%f", f);
+            break;
+        }
+        case 'c':
+            if (i >= size)
+                return 0;
+            append(buffer, max, length, "%c", record[i++]);
+            break;
+        default:
+            return 0;
+        }
+    }
+    buffer[length++] = '\n';
+    return length;
+}
@@ -0,0 +1,85 @@
+#ifndef __MIRRA_LOG_RECORD_H__
+#define __MIRRA_LOG_RECORD_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mirra
+{
+/// @brief Binary encoding of log lines, which defers formatting to when the line is read.
+///
+/// A record is laid out as `[size 1]:[kind 1]:[time 4]:[arguments]`, where the size includes
+/// the whole record. Every argument is stored as `[code 1]:[payload]`, where the code is the
+/// conversion character of the argument's format specifier (see createFormatString):
+/// - `s`: a string, copied into the record as `[length 1]:[characters]`.
+/// - `p`: a string constant in the firmware's flash, stored as its 4-byte address. Such strings
+///   can only be resolved with the firmware build that wrote the record.
+/// - `i`, `u`: a signed (zigzag) or unsigned integer, as a little-endian base-128 varint.
+/// - `f`: a 4-byte float.
+/// - `c`: a single character.
+/// A boot record holds the build ID of the firmware that wrote the records following it as its
+/// only payload, without code.
+class LogRecord
+{
+public:
+    enum class Kind : uint8_t
+    {
+        DEBUG,
+        INFO,
+        ERROR,
+        BOOT
+    };
+    static constexpr size_t maxSize{UINT8_MAX};
+    static constexpr size_t headerSize{1 + 1 + 4};
+    /// @brief Size of a boot record, including the build ID.
+    static constexpr size_t bootSize{headerSize + 4};
+
+    /// @brief Resolves the address of a string constant, as stored by a `p` argument.
+    /// @param build The build ID of the firmware that wrote the record.
+    /// @return The string, or nullptr if it cannot be resolved.
+    using Resolver = const char* (*)(uint32_t address, uint32_t build);
+
+    /// @brief Encodes a record into a buffer of at least maxSize bytes. Arguments that no longer
+    /// fit are dropped, and strings are truncated.
+    class Writer
+    {
+        uint8_t* buffer;
+        size_t size{headerSize};
+        bool full{false};
+
+        bool reserve(size_t size);
+        void pushVarint(uint32_t value);
+
+    public:
+        Writer(uint8_t* buffer, Kind kind, uint32_t time);
+
+        void pushString(const char* string);
+        void pushStaticString(const char* string);
+        void pushSigned(int32_t value);
+        void pushUnsigned(uint32_t value);
+        void pushFloat(float value);
+        void pushChar(char value);
+        /// @brief Completes the record by writing its size.
+        /// @return The size of the record.
+        size_t finish();
+    };
+
+    /// @brief Encodes a boot record into a buffer of at least bootSize bytes.
+    /// @return The size of the record.
+    static size_t encodeBoot(uint8_t* buffer, uint32_t time, uint32_t build);
+    /// @return The size of the record, read from its first byte.
+    static size_t getSize(const uint8_t* record) { return record[0]; }
+    static Kind getKind(const uint8_t* record) { return static_cast<Kind>(record[1]); }
+    /// @return The build ID held by a boot record.
+    static uint32_t getBuild(const uint8_t* record);
+
+    /// @brief Formats a record into a line of text, terminated by a newline.
+    /// @param build The build ID of the firmware that wrote the record, updated when the record
+    /// is a boot record.
+    /// @return The length of the line, or 0 if the record is malformed.
+    static size_t format(const uint8_t* record, char* buffer, size_t max, Resolver resolve,
+                         uint32_t& build);
+};
+}
+
+#endif
@@ -1,34 +1,184 @@
 #include "logging.h"
+#include <esp_ota_ops.h>
+#include <soc/soc_memory_layout.h>
 
 using namespace mirra;
 
+static_assert(static_cast<uint8_t>(Log::Level::DEBUG) ==
+                      static_cast<uint8_t>(LogRecord::Kind::DEBUG) &&
+                  static_cast<uint8_t>(Log::Level::INFO) ==
+                      static_cast<uint8_t>(LogRecord::Kind::INFO) &&
+                  static_cast<uint8_t>(Log::Level::ERROR) ==
+                      static_cast<uint8_t>(LogRecord::Kind::ERROR),
+              "Log levels must be stored as the record kinds of the same name.");
+
+Log::Log() : drainLock{xSemaphoreCreateMutex()}
+{
+    xTaskCreate(drainLoop, "log", 4096, this, tskIDLE_PRIORITY + 1, &drainTask);
+    // mark the build that wrote the records that follow, so that its string constants are only
+    // resolved by the same build
+    uint8_t record[LogRecord::bootSize];
+    enqueue(record, LogRecord::encodeBoot(record, time(nullptr), getBuild()));
+}
+
+Log::~Log()
+{
+    // wait for any drain in progress, so the task is not deleted while writing to the file
+    xSemaphoreTake(drainLock, portMAX_DELAY);
+    if (drainTask != nullptr)
+        vTaskDelete(drainTask);
+    vSemaphoreDelete(drainLock);
+}
+
 Log& Log::getInstance()
 {
     static Log log{};
     return log;
 }
 
-size_t Log::File::cutTail(size_t cutSize)
+uint32_t Log::getBuild()
+{
+    static const uint32_t build{[] {
+        const uint8_t* sha256{esp_ota_get_app_description()->app_elf_sha256};
+        return static_cast<uint32_t>(sha256[0] << 24 | sha256[1] << 16 | sha256[2] << 8 |
+                                     sha256[3]);
+    }()};
+    return build;
+}
+
+bool Log::isStatic(const char* string)
+{
+    return esp_ptr_in_drom(string);
+}
+
+const char* Log::resolve(uint32_t address, uint32_t build)
+{
+    const char* string{reinterpret_cast<const char*>(static_cast<uintptr_t>(address))};
+    if (build != getBuild() || !isStatic(string))
+        return nullptr;
+    return string;
+}
+
+size_t Log::format(const uint8_t* record, char* buffer, size_t max, uint32_t& build)
+{
+    return LogRecord::format(record, buffer, max, resolve, build);
+}
+
+void Log::enqueue(const uint8_t* record, size_t size)
+{
+    portENTER_CRITICAL(&queueLock);
+    if (queued - drained + size > queueSize)
+    {
+        dropped++;
+        portEXIT_CRITICAL(&queueLock);
+        return;
+    }
+    size_t offset{queued % queueSize};
+    size_t toEnd{std::min(size, queueSize - offset)};
+    std::memcpy(&queue[offset], record, toEnd);
+    std::memcpy(queue, &record[toEnd], size - toEnd);
+    queued += size;
+    bool full{queued - drained >= drainThreshold};
+    portEXIT_CRITICAL(&queueLock);
+    if (full && drainTask != nullptr)
+        xTaskNotifyGive(drainTask);
+}
+
+void Log::output(const uint8_t* record, size_t size)
+{
+    file.push(record, size);
+    if (serial == nullptr)
+        return;
+    char line[lineSize];
+    uint32_t build{getBuild()};
+    serial->write(line, format(record, line, sizeof(line), build));
+}
+
+void Log::drain()
+{
+    xSemaphoreTake(drainLock, portMAX_DELAY);
+    portENTER_CRITICAL(&queueLock);
+    size_t end{queued};
+    size_t lost{dropped};
+    dropped = 0;
+    portEXIT_CRITICAL(&queueLock);
+    uint8_t record[LogRecord::maxSize];
+    // only this task advances drained, and enqueue never overwrites bytes not yet drained
+    while (drained != end)
+    {
+        size_t offset{drained % queueSize};
+        size_t size{queue[offset]};
+        size_t toEnd{std::min(size, queueSize - offset)};
+        std::memcpy(record, &queue[offset], toEnd);
+        std::memcpy(&record[toEnd], queue, size - toEnd);
+        output(record, size);
+        portENTER_CRITICAL(&queueLock);
+        drained += size;
+        portEXIT_CRITICAL(&queueLock);
+    }
+    if (lost > 0)
+        output(record, encodeRecord<Level::ERROR>(record, "Dropped ", lost,
+                                                  " log records, as the log queue was full."));
+    xSemaphoreGive(drainLock);
+}
+
+void Log::drainLoop(void* log)
 {
-    static constexpr size_t searchSize{128};
-    uint8_t searchBuffer[searchSize];
     while (true)
     {
-        read(cutSize, &searchBuffer, searchSize);
-        uint8_t* found = reinterpret_cast<uint8_t*>(std::memchr(searchBuffer, '\n', searchSize));
-        if (found == nullptr)
-        {
-            cutSize += searchSize;
-        }
-        else
-        {
-            cutSize += std::distance(searchBuffer, found) + 1;
-            return FIFOFile::cutTail(cutSize);
-        }
+        ulTaskNotifyTake(pdTRUE, drainPeriod);
+        static_cast<Log*>(log)->drain();
+    }
+}
+
+Log::File::File()
+    : FIFOFile("logs", 1), version{nvs.getValue<uint8_t>("version", 0)},
+      level{nvs.getValue("level", Level::INFO)}, build{nvs.getValue<uint32_t>("build", 0)}
+{
+    // no logging here: the log is being constructed
+    if (version != currentVersion)
+    {
+        clear();
+        version = currentVersion;
+    }
+    if (getSize() == 0)
+        build = getBuild();
+}
+
+void Log::File::onCutTail(size_t cutSize)
+{
+    for (size_t cut{0}; cut < cutSize;)
+    {
+        uint8_t record[LogRecord::bootSize];
+        read(cut, record, sizeof(record));
+        size_t size{std::max<size_t>(LogRecord::getSize(record), 1)};
+        // the records following a boot record that is cut were written by its build
+        if (LogRecord::getKind(record) == LogRecord::Kind::BOOT && size == LogRecord::bootSize)
+            build = LogRecord::getBuild(record);
+        cut += size;
     }
 }
 
+size_t Log::File::readRecord(size_t address, uint8_t* record) const
+{
+    if (address >= getSize())
+        return 0;
+    read(address, record, 1);
+    size_t size{std::max<size_t>(LogRecord::getSize(record), 1)};
+    read(address, record, size);
+    return size;
+}
+
+void Log::flush()
+{
+    Log& log{getInstance()};
+    log.drain();
+    log.file.flush();
+}
+
 void Log::close()
 {
-    getInstance().~Log();
+    Log& log{getInstance()};
+    log.drain();
+    log.~Log();
 }
\ No newline at end of file
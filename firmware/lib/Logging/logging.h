@@ -2,9 +2,32 @@
 #define __MIRRA_LOGGING_H__
 
 #include "../MIRRAFS/FS.h"
+#include "LogRecord.h"
 #include <HardwareSerial.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <string_view>
 #include <type_traits>
 
+/// @brief Lowest log level compiled into the firmware: 0 for DEBUG, 1 for INFO and 2 for ERROR.
+/// Log calls below it compile to nothing, including the evaluation of their arguments, and cannot
+/// be enabled through the runtime log level. Set through the build flags, e.g. `-DLOG_MIN_LEVEL=0`.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+/// @brief Logs a message at the given level, if the level is compiled in.
+#define LOG_AT(LEVEL, ...)                                                                         \
+    do                                                                                             \
+    {                                                                                              \
+        if constexpr (mirra::Log::isCompiled(mirra::Log::Level::LEVEL))                            \
+            mirra::Log::getInstance().print<mirra::Log::Level::LEVEL>(__VA_ARGS__);                \
+    } while (0)
+#define LOG_DEBUG(...) LOG_AT(DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(INFO, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(ERROR, __VA_ARGS__)
+
 namespace mirra
 {
 class Log
@@ -18,41 +41,91 @@ public:
     };
 
 private:
-    Log(){};
+    Log();
     Log(const Log&) = delete;
     Log(Log&&) = delete;
     Log& operator=(const Log&) = delete;
     Log& operator=(Log&&) = delete;
-    ~Log() = default;
-
-    /// @brief Buffer in which the final string is constructed and printed from.
-    char buffer[256]{0};
-    /// @brief Prints the preamble portion of the log line.
-    /// @tparam level The level displayed in the preamble.
-    /// @param time The time displayed in the preamble.
-    /// @return The length of the preamble that was printed.
-    template <Log::Level level> size_t printPreamble(const tm& time);
-    /// @return String conversion from a level.
-    static constexpr std::string_view levelToString(Level level);
-    /// @brief Prints to the logging buffer and forwards to (if enabled) the output serial and
-    /// logfile.
-    /// @tparam level Log level of printed message.
-    template <Log::Level level, class... Ts> void print(Ts&&... args);
+    ~Log();
+
+    /// @brief Maximum length of a formatted log line.
+    static constexpr size_t lineSize{256};
+    /// @brief Size of the queue holding records until they are written out.
+    static constexpr size_t queueSize{8 * 1024};
+    /// @brief Amount of queued bytes at which the drain task is woken early: one sector of the log
+    /// file.
+    static constexpr size_t drainThreshold{4 * 1024};
+    /// @brief Time after which queued records are written out, however few there are.
+    static constexpr TickType_t drainPeriod{pdMS_TO_TICKS(1000)};
+
+    /// @brief Ring buffer of records not yet written to the file and serial.
+    uint8_t queue[queueSize];
+    /// @brief Total amount of bytes ever queued and drained. Their difference is the amount of
+    /// bytes in the queue.
+    size_t queued{0};
+    size_t drained{0};
+    /// @brief Amount of records dropped since the last drain because the queue was full.
+    size_t dropped{0};
+    /// @brief Guards the queue counters, as lines may be logged from any task.
+    portMUX_TYPE queueLock = portMUX_INITIALIZER_UNLOCKED;
+    /// @brief Held while draining, so that the file and serial are only written to by one task.
+    SemaphoreHandle_t drainLock;
+    /// @brief Low priority task draining the queue periodically or when it fills up.
+    TaskHandle_t drainTask{nullptr};
+
+    /// @return Build ID of the running firmware: the first bytes of the SHA-256 of its ELF file.
+    static uint32_t getBuild();
+    /// @return Whether a string is a constant in the running firmware's flash, whose address stays
+    /// valid and can be logged instead of its contents.
+    static bool isStatic(const char* string);
+    /// @brief Resolves string constants of records written by the running firmware.
+    static const char* resolve(uint32_t address, uint32_t build);
+    /// @brief Encodes an argument into a record, by the conversion character of its format
+    /// specifier.
+    template <class T> static void encode(LogRecord::Writer& writer, T&& arg);
+    /// @brief Encodes a log line into a record, leaving the formatting for when it is read.
+    /// @param record Buffer of at least LogRecord::maxSize bytes.
+    /// @return The size of the record.
+    template <Log::Level level, class... Ts>
+    static size_t encodeRecord(uint8_t* record, Ts&&... args);
+    /// @brief Appends a record to the queue without blocking, dropping it if the queue is full.
+    void enqueue(const uint8_t* record, size_t size);
+    /// @brief Writes a record to the file, and formatted to the serial.
+    void output(const uint8_t* record, size_t size);
+    /// @brief Writes all queued records to the file and serial.
+    void drain();
+    static void drainLoop(void* log);
 
 public:
+    /// @brief File of log records, see LogRecord. The file is only ever appended to, so that it
+    /// caches a single sector.
     class File final : fs::FIFOFile
     {
-        size_t cutTail(size_t cutSize);
+        /// @brief Version of the layout the stored logs were written with.
+        fs::NVS::Value<uint8_t> version;
+        /// @brief Current version of the layout. Stored logs of other versions are discarded when
+        /// the file is opened.
+        static constexpr uint8_t currentVersion{2};
+
+        void onCutTail(size_t cutSize);
 
     public:
-        File() : FIFOFile("logs"), level{nvs.getValue("level", Level::INFO)} {}
+        File();
         /// @brief Logging level of the logging module. Messages below this level will not be
         /// stored or printed.
         fs::NVS::Value<Level> level;
+        /// @brief Build ID of the firmware that wrote the records preceding the first boot record
+        /// of the file.
+        fs::NVS::Value<uint32_t> build;
         using FIFOFile::getMaxSize;
         using FIFOFile::getSize;
         using FIFOFile::read;
+        /// @brief Reads the record at the given address.
+        /// @param record Buffer of at least LogRecord::maxSize bytes.
+        /// @return The size of the record, or 0 at the end of the file.
+        size_t readRecord(size_t address, uint8_t* record) const;
 
+        using FIFOFile::flush;
         using FIFOFile::push;
     };
 
@@ -63,19 +136,25 @@ public:
 
     /// @brief Singleton global log object
     static Log& getInstance();
-    template <class... Ts> static void debug(Ts... args)
-    {
-        getInstance().print<Level::DEBUG>(args...);
-    }
-    template <class... Ts> static void info(Ts... args)
+    /// @return Whether log calls of the given level are compiled in, see LOG_MIN_LEVEL.
+    static constexpr bool isCompiled(Level level)
     {
-        getInstance().print<Level::INFO>(args...);
-    }
-    template <class... Ts> static void error(Ts... args)
-    {
-        getInstance().print<Level::ERROR>(args...);
+        return static_cast<uint8_t>(level) >= LOG_MIN_LEVEL;
     }
+    /// @brief Encodes a log line and queues it to be written to (if enabled) the output serial and
+    /// logfile. Use the LOG_DEBUG, LOG_INFO and LOG_ERROR macros instead, which leave out calls
+    /// below the compiled log level entirely.
+    /// @tparam level Log level of printed message.
+    template <Log::Level level, class... Ts> void print(Ts&&... args);
 
+    /// @brief Formats a record of the log file into a line of text.
+    /// @param build The build ID of the firmware that wrote the record, updated by boot records.
+    /// @return The length of the line, or 0 if the record is malformed.
+    static size_t format(const uint8_t* record, char* buffer, size_t max, uint32_t& build);
+    /// @brief Writes all queued lines out and flushes the log file to flash.
+    static void flush();
+    /// @brief Writes all queued lines out and closes the log file. To be called before deep
+    /// sleep, after which no more lines can be logged.
     static void close();
 };
 
@@ -1,26 +1,3 @@
-constexpr std::string_view Log::levelToString(Level level)
-{
-    switch (level)
-    {
-    case Level::ERROR:
-        return "ERROR: ";
-    case Level::INFO:
-        return "INFO: ";
-    case Level::DEBUG:
-        return "DEBUG: ";
-    }
-    return "NONE: ";
-}
-
-template <Log::Level level> size_t Log::printPreamble(const tm& time)
-{
-    static constexpr size_t timeLength{sizeof("[0000-00-00 00:00:00]")};
-    strftime(buffer, timeLength, "[%F %T]", &time);
-    constexpr std::string_view levelString{levelToString(level)};
-    strcpy(&buffer[timeLength - 1], levelString.cbegin());
-    return timeLength + levelString.size() - 1;
-}
-
 template <class T> constexpr std::string_view rawTypeToFormatSpecifier();
 template <> constexpr std::string_view rawTypeToFormatSpecifier<const char*>()
 {
@@ -42,6 +19,10 @@ template <> constexpr std::string_view rawTypeToFormatSpecifier<long signed int>
 {
     return "%i";
 }
+template <> constexpr std::string_view rawTypeToFormatSpecifier<long unsigned int>()
+{
+    return "%u";
+}
 template <> constexpr std::string_view rawTypeToFormatSpecifier<signed char>()
 {
     return "%i";
@@ -107,17 +88,41 @@ template <class... Ts> size_t printv(char* buffer, size_t max, Ts&&... args)
     constexpr auto fmt{createFormatString<Ts...>()};
     return std::snprintf(buffer, max, fmt.data(), std::forward<Ts>(args)...);
 }
+template <class T> void Log::encode(LogRecord::Writer& writer, T&& arg)
+{
+    constexpr char code{typeToFormatSpecifier<T>()[1]};
+    if constexpr (code == 's')
+    {
+        if (isStatic(arg))
+            writer.pushStaticString(arg);
+        else
+            writer.pushString(arg);
+    }
+    else if constexpr (code == 'i')
+        writer.pushSigned(static_cast<int32_t>(arg));
+    else if constexpr (code == 'u')
+        writer.pushUnsigned(static_cast<uint32_t>(arg));
+    else if constexpr (code == 'f')
+        writer.pushFloat(arg);
+    else
+    {
+        static_assert(code == 'c', "Log argument type has no record encoding.");
+        writer.pushChar(arg);
+    }
+}
+
+template <Log::Level level, class... Ts> size_t Log::encodeRecord(uint8_t* record, Ts&&... args)
+{
+    LogRecord::Writer writer{record, static_cast<LogRecord::Kind>(level),
+                             static_cast<uint32_t>(time(nullptr))};
+    (encode(writer, std::forward<Ts>(args)), ...);
+    return writer.finish();
+}
+
 template <Log::Level level, class... Ts> void Log::print(Ts&&... args)
 {
     if (level < file.level)
         return;
-    time_t ctime{time(nullptr)};
-    tm* time{gmtime(&ctime)};
-    size_t size{printPreamble<level>(*time)};
-    size += printv(&buffer[size], sizeof(buffer) - size - 1, std::forward<Ts>(args)...);
-    buffer[size] = '\n';
-    size++;
-    file.push(buffer, size);
-    if (serial != nullptr)
-        serial->write(buffer, size);
+    uint8_t record[LogRecord::maxSize];
+    enqueue(record, encodeRecord<level>(record, std::forward<Ts>(args)...));
 }
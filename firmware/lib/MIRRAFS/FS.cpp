@@ -1,4 +1,5 @@
 #include "FS.h"
+#include <algorithm>
 
 using namespace mirra::fs;
 
@@ -16,11 +17,20 @@ NVS::~NVS()
     nvs_close(handle);
 }
 
+NVS::Stats NVS::stats{};
+
 void NVS::commit()
 {
+    if (!pending || transactions > 0)
+        return;
     esp_err_t err = nvs_commit(handle);
     if (err != ESP_OK)
+    {
         printf("Error while committing changes to NVS, code: %i\n", err);
+        return;
+    }
+    pending = false;
+    stats.commits++;
 }
 template <> std::pair<esp_err_t, uint8_t> NVS::get_integral(const char* key) const
 {
@@ -126,11 +136,39 @@ esp_err_t NVS::set_blob(const char* key, const void* value, size_t size)
     return nvs_set_blob(handle, key, value, size);
 }
 
+bool NVS::getBlob(const char* key, void* buffer, size_t size) const
+{
+    size_t storedSize{0};
+    esp_err_t err = nvs_get_blob(handle, key, nullptr, &storedSize);
+    if (err == ESP_OK && storedSize == size)
+        err = get_blob(key, buffer, size);
+    else if (err == ESP_OK)
+        return false;
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND)
+        printf("Error while getting key '%s', code: %s\n", key, esp_err_to_name(err));
+    return err == ESP_OK;
+}
+
+bool NVS::setBlob(const char* key, const void* value, size_t size)
+{
+    esp_err_t err = set_blob(key, value, size);
+    if (err != ESP_OK)
+    {
+        printf("Error while setting key '%s', code: %s\n", key, esp_err_to_name(err));
+        return false;
+    }
+    stats.sets++;
+    pending = true;
+    return true;
+}
+
 void NVS::eraseKey(const char* key)
 {
     esp_err_t err;
     err = nvs_erase_key(handle, key);
-    if (err != ESP_OK)
+    if (err == ESP_OK)
+        pending = true;
+    else if (err != ESP_ERR_NVS_NOT_FOUND)
         printf("Error while erasing key '%s', code: %s\n", key, esp_err_to_name(err));
 }
 
@@ -147,10 +185,10 @@ void NVS::init()
         printf("Error while initialising NVS flash, code: %s\n", esp_err_to_name(err));
 }
 
-Partition::Partition(const char* name)
+Partition::Partition(const char* name, size_t cacheSize)
     : part{esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_UNDEFINED,
                                     name)},
-      maxSize{part->size}, sectorBuffer{new std::array<uint8_t, sectorSize>}
+      maxSize{part->size}, cacheSize{cacheSize}, cache{new Sector[cacheSize]}
 {
     strncpy(this->name, name, partitionNameMaxSize);
 }
@@ -165,57 +203,117 @@ constexpr size_t Partition::toSectorAddress(size_t address)
     return (address / sectorSize) * sectorSize;
 }
 
-void Partition::loadFirstSector(size_t address)
+size_t Partition::Sector::findErasedFrom() const
 {
-    sectorDirty = false;
-    readSector(toSectorAddress(address));
+    size_t offset{sectorSize};
+    while (offset > 0 && data[offset - 1] == 0xFF)
+        offset--;
+    return offset;
 }
 
-bool Partition::inSector(size_t address) const
+Partition::Sector* Partition::find(size_t address) const
 {
-    return (sectorAddress <= address) && (address < (sectorAddress + sectorSize));
+    for (size_t i{0}; i < cacheSize; i++)
+    {
+        if (cache[i].contains(address))
+        {
+            stats.hits++;
+            cache[i].lastUse = ++accesses;
+            return &cache[i];
+        }
+    }
+    stats.misses++;
+    return nullptr;
 }
 
-void Partition::readSector(size_t sectorAddress)
+Partition::Sector& Partition::load(size_t address)
 {
-    flush();
-    esp_err_t err = esp_partition_read(part, sectorAddress, sectorBuffer.get(), sectorSize);
+    if (Sector* sector{find(address)})
+        return *sector;
+    Sector* sector{&cache[0]};
+    for (size_t i{1}; i < cacheSize; i++)
+    {
+        if (cache[i].lastUse < sector->lastUse)
+            sector = &cache[i];
+    }
+    if (sector->address != SIZE_MAX)
+    {
+        stats.evictions++;
+        if (sector->isDirty())
+            writeSector(*sector);
+    }
+    sector->address = toSectorAddress(address);
+    esp_err_t err = esp_partition_read(part, sector->address, sector->data.data(), sectorSize);
     if (err != ESP_OK)
     {
-        printf("Error while reading sector %u from partition '%s', code: %s\n", sectorAddress,
+        printf("Error while reading sector %u from partition '%s', code: %s\n", sector->address,
                getName(), esp_err_to_name(err));
     }
-    this->sectorAddress = sectorAddress;
+    sector->erasedFrom = sector->findErasedFrom();
+    sector->lastUse = ++accesses;
+    return *sector;
 }
 
-void Partition::writeSector()
+bool Partition::onlyClearsBits(const Sector& sector) const
 {
-    esp_err_t err = esp_partition_erase_range(part, sectorAddress, sectorSize);
-    if (err != ESP_OK)
-        printf("Error while erasing sector %u from partition '%s', code: %s\n", sectorAddress,
-               getName(), esp_err_to_name(err));
-    err = esp_partition_write(part, sectorAddress, sectorBuffer.get(), sectorSize);
-    if (err != ESP_OK)
-        printf("Error while writing sector %u from partition '%s', code: %s\n", sectorAddress,
-               getName(), esp_err_to_name(err));
-    sectorDirty = false;
+    static constexpr size_t chunkSize{64};
+    uint8_t flash[chunkSize];
+    const size_t end{std::min(sector.dirtyTo, sector.erasedFrom)};
+    for (size_t offset{sector.dirtyFrom}; offset < end; offset += chunkSize)
+    {
+        size_t toCompare{std::min(chunkSize, end - offset)};
+        if (esp_partition_read(part, sector.address + offset, flash, toCompare) != ESP_OK)
+            return false;
+        for (size_t i{0}; i < toCompare; i++)
+        {
+            if ((sector.data[offset + i] & ~flash[i]) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+void Partition::writeSector(Sector& sector)
+{
+    esp_err_t err;
+    // Appending into erased space or only clearing bits can be written straight to flash: only
+    // when bits have to be set does the whole sector need to be erased and rewritten.
+    if (sector.dirtyFrom < sector.erasedFrom && !onlyClearsBits(sector))
+    {
+        err = esp_partition_erase_range(part, sector.address, sectorSize);
+        if (err != ESP_OK)
+            printf("Error while erasing sector %u from partition '%s', code: %s\n",
+                   sector.address, getName(), esp_err_to_name(err));
+        stats.erases++;
+        sector.dirtyFrom = 0;
+        sector.dirtyTo = sector.erasedFrom = sector.findErasedFrom();
+    }
+    if (sector.isDirty())
+    {
+        err = esp_partition_write(part, sector.address + sector.dirtyFrom,
+                                  &sector.data[sector.dirtyFrom],
+                                  sector.dirtyTo - sector.dirtyFrom);
+        if (err != ESP_OK)
+            printf("Error while writing sector %u from partition '%s', code: %s\n",
+                   sector.address, getName(), esp_err_to_name(err));
+        stats.writes++;
+        stats.bytesWritten += sector.dirtyTo - sector.dirtyFrom;
+        sector.erasedFrom = std::max(sector.erasedFrom, sector.dirtyTo);
+    }
+    sector.dirtyFrom = sectorSize;
+    sector.dirtyTo = 0;
 }
 
 void Partition::read(size_t address, void* buffer, size_t size) const
 {
     while (size > 0)
     {
-        size_t toRead;
-        if (inSector(address)) // if address in sector buffer: read straight from it
-        {
-            toRead = std::min(sectorSize - (address - sectorAddress), size);
-            std::memcpy(buffer, &(*sectorBuffer)[address - sectorAddress], toRead);
-        }
-        else // else (or if not all requested data in sector buffer), read straight from flash
-        {
-            toRead = std::min((address < sectorAddress ? sectorAddress : maxSize) - address, size);
-            esp_partition_read(part, address, buffer, size);
-        }
+        size_t offset{address % sectorSize};
+        size_t toRead{std::min(sectorSize - offset, size)};
+        if (const Sector* sector{find(address)})
+            std::memcpy(buffer, &sector->data[offset], toRead);
+        else // read straight from flash, so that reads never evict the sectors being written to
+            esp_partition_read(part, address, buffer, toRead);
         address = (address + toRead) % getMaxSize();
         buffer = static_cast<uint8_t*>(buffer) + toRead;
         size -= toRead;
@@ -226,70 +324,246 @@ void Partition::write(size_t address, const void* buffer, size_t size)
 {
     while (size > 0)
     {
-        if (!inSector(address))
-            readSector(toSectorAddress(address));
-
-        size_t toWrite = std::min(sectorSize - (address - sectorAddress), size);
-        std::memcpy(&(*sectorBuffer)[address - sectorAddress], buffer, toWrite);
+        Sector& sector{load(address)};
+        size_t offset{address - sector.address};
+        size_t toWrite = std::min(sectorSize - offset, size);
+        std::memcpy(&sector.data[offset], buffer, toWrite);
+        sector.dirtyFrom = std::min(sector.dirtyFrom, offset);
+        sector.dirtyTo = std::max(sector.dirtyTo, offset + toWrite);
         address = (address + toWrite) % getMaxSize();
         buffer = static_cast<const uint8_t*>(buffer) + toWrite;
         size -= toWrite;
-        sectorDirty = true;
+    }
+}
+
+void Partition::discard(size_t address, size_t size)
+{
+    while (size > 0)
+    {
+        Sector& sector{load(address)};
+        size_t from{address - sector.address};
+        size_t toDiscard{std::min(sectorSize - from, size)};
+        // flash past erasedFrom already is erased
+        size_t to{std::min(from + toDiscard, sector.erasedFrom)};
+        if (from < to)
+        {
+            std::fill(&sector.data[from], &sector.data[to], 0xFF);
+            sector.dirtyFrom = std::min(sector.dirtyFrom, from);
+            sector.dirtyTo = std::max(sector.dirtyTo, to);
+        }
+        address = (address + toDiscard) % getMaxSize();
+        size -= toDiscard;
     }
 }
 
 void Partition::flush()
 {
-    if (sectorDirty)
+    for (size_t i{0}; cache && i < cacheSize; i++)
+    {
+        if (cache[i].isDirty())
+            writeSector(cache[i]);
+    }
+}
+
+FIFOFile::FIFOFile(const char* name, size_t cacheSize)
+    : Partition(name, cacheSize), nvs{getName()}, sectors{getMaxSize() / sectorSize}
+{
+    // the state of the file was kept in NVS before it was kept in the sector headers
+    for (const char* key : {"head", "tail", "size"})
+        nvs.eraseKey(key);
+    mount();
+}
+
+size_t FIFOFile::toAddress(uint64_t position) const
+{
+    return (position / sectorDataSize % sectors) * sectorSize + sizeof(SectorHeader) +
+           position % sectorDataSize;
+}
+
+uint16_t FIFOFile::getCheck(uint32_t sequence, uint32_t oldest)
+{
+    uint32_t mixed{(sequence * 0x9E3779B1) ^ oldest};
+    return static_cast<uint16_t>((mixed >> 16) ^ mixed ^ 0x4D46);
+}
+
+std::optional<FIFOFile::SectorHeader> FIFOFile::readHeader(size_t sector) const
+{
+    SectorHeader header{Partition::read<SectorHeader>(sector * sectorSize)};
+    if (header.sequence == UINT32_MAX || header.sequence % sectors != sector ||
+        header.check != getCheck(header.sequence, header.oldest))
+        return std::nullopt;
+    return header;
+}
+
+void FIFOFile::mount()
+{
+    std::optional<SectorHeader> first{readHeader(0)};
+    if (first)
+    {
+        // The sectors up to the last one opened were opened in the current round of the
+        // partition, and the ones after it in the previous round (if at all), so that it is the
+        // last sector with a sequence number of at least that of the first sector.
+        size_t low{0}, high{sectors};
+        while (high - low > 1)
+        {
+            size_t middle{low + (high - low) / 2};
+            std::optional<SectorHeader> header{readHeader(middle)};
+            if (header && header->sequence > first->sequence)
+                low = middle;
+            else
+                high = middle;
+        }
+        headSequence = low == 0 ? first->sequence : readHeader(low)->sequence;
+    }
+    else
+    {
+        // the first sector is either unused or was being erased when the power was cut: fall back
+        // to looking at all sectors
+        for (size_t sector{1}; sector < sectors; sector++)
+        {
+            std::optional<SectorHeader> header{readHeader(sector)};
+            if (header && (headSequence == UINT32_MAX || header->sequence > headSequence))
+                headSequence = header->sequence;
+        }
+        if (headSequence == UINT32_MAX)
+            return; // nothing was ever written
+    }
+    size_t erasedFrom{getErasedFrom((headSequence % sectors) * sectorSize)};
+    headHeader = *readHeader(headSequence % sectors);
+    size_t end{std::max(erasedFrom, sizeof(SectorHeader)) - sizeof(SectorHeader)};
+    for (uint16_t marked : headHeader.ends)
+    {
+        if (marked != none)
+            end = std::max<size_t>(end, marked);
+    }
+    head = uint64_t{headSequence} * sectorDataSize + end;
+    // sectors further back than a round of the partition have been opened again since
+    uint32_t round{static_cast<uint32_t>(sectors - 1)};
+    uint32_t oldest{std::max(headHeader.oldest, headSequence >= round ? headSequence - round : 0)};
+    tail = findRecord(std::min(oldest, headSequence));
+}
+
+uint64_t FIFOFile::findRecord(uint32_t sequence) const
+{
+    for (; sequence != headSequence + 1; sequence++)
     {
-        writeSector();
+        std::optional<SectorHeader> header{readHeader(sequence % sectors)};
+        if (header && header->sequence == sequence && header->firstRecord < sectorDataSize)
+            return std::min(uint64_t{sequence} * sectorDataSize + header->firstRecord, head);
     }
+    return head;
 }
 
-FIFOFile::FIFOFile(const char* name)
-    : Partition(name), nvs{getName()}, head{nvs.getValue<size_t>("head", 0)},
-      tail{nvs.getValue<size_t>("tail", 0)}, size{nvs.getValue<size_t>("size", 0)}
+void FIFOFile::openSector()
 {
-    loadFirstSector(head);
+    uint32_t sequence{headSequence + 1};
+    while (tail / sectorDataSize + sectors <= sequence)
+        cutTail();
+    headSequence = sequence;
+    uint32_t oldest{static_cast<uint32_t>(tail / sectorDataSize)};
+    headHeader = SectorHeader{sequence, oldest, getCheck(sequence, oldest), none, {none, none}};
+    Partition::discard((sequence % sectors) * sectorSize, sectorSize);
+    writeHeader();
+}
+
+void FIFOFile::cutTail()
+{
+    uint64_t cut{findRecord(static_cast<uint32_t>(tail / sectorDataSize) + 1)};
+    onCutTail(cut - tail);
+    tail = cut;
+}
+
+void FIFOFile::writeHeader()
+{
+    Partition::write((headSequence % sectors) * sectorSize, headHeader);
+}
+
+void FIFOFile::markEnd()
+{
+    uint16_t end{static_cast<uint16_t>(head - uint64_t{headSequence} * sectorDataSize)};
+    uint16_t* slot{std::find(std::begin(headHeader.ends), std::end(headHeader.ends), none)};
+    if (slot == std::end(headHeader.ends))
+    {
+        // Rarely needed: as this sets bits again, the sector is erased and rewritten on flush.
+        std::fill(std::begin(headHeader.ends), std::end(headHeader.ends), none);
+        slot = std::begin(headHeader.ends);
+    }
+    *slot = end;
+    writeHeader();
 }
 
 size_t FIFOFile::freeSpace() const
 {
-    return getMaxSize() - size;
+    return (tail / sectorDataSize + sectors) * sectorDataSize - head;
 }
 
 void FIFOFile::read(size_t address, void* buffer, size_t size) const
 {
-    if (address >= this->size)
+    if (address >= getSize())
         return;
-    Partition::read((tail + address) % getMaxSize(), buffer, std::min(size, this->size - address));
+    size = std::min(size, getSize() - address);
+    for (uint64_t position{tail + address}; size > 0;)
+    {
+        size_t toRead{std::min(size, sectorDataSize - position % sectorDataSize)};
+        Partition::read(toAddress(position), buffer, toRead);
+        position += toRead;
+        buffer = static_cast<uint8_t*>(buffer) + toRead;
+        size -= toRead;
+    }
 }
 
 void FIFOFile::push(const void* buffer, size_t size)
 {
-    this->size = (this->size + size) - (freeSpace() < size ? cutTail(size - freeSpace()) : 0);
-    Partition::write(head, buffer, size);
-    head = (head + size) % getMaxSize();
+    if (size == 0)
+        return;
+    const uint8_t* data{static_cast<const uint8_t*>(buffer)};
+    const bool endsErased{data[size - 1] == 0xFF};
+    if (head / sectorDataSize != headSequence)
+        openSector();
+    if (headHeader.firstRecord == none)
+    {
+        headHeader.firstRecord = static_cast<uint16_t>(head % sectorDataSize);
+        writeHeader();
+    }
+    while (size > 0)
+    {
+        if (head / sectorDataSize != headSequence)
+            openSector();
+        size_t toWrite{std::min(size, sectorDataSize - head % sectorDataSize)};
+        Partition::write(toAddress(head), data, toWrite);
+        head += toWrite;
+        data += toWrite;
+        size -= toWrite;
+    }
+    if (endsErased)
+        markEnd();
 }
 
 void FIFOFile::write(size_t address, const void* buffer, size_t size)
 {
-    if (address >= this->size)
+    if (address >= getSize())
         return;
-    Partition::write((tail + address) % getMaxSize(), buffer, std::min(size, this->size - address));
+    size = std::min(size, getSize() - address);
+    for (uint64_t position{tail + address}; size > 0;)
+    {
+        size_t toWrite{std::min(size, sectorDataSize - position % sectorDataSize)};
+        Partition::write(toAddress(position), buffer, toWrite);
+        position += toWrite;
+        buffer = static_cast<const uint8_t*>(buffer) + toWrite;
+        size -= toWrite;
+    }
 }
 
-size_t FIFOFile::cutTail(size_t cutSize)
+void FIFOFile::clear()
 {
-    tail = (tail + cutSize) % getMaxSize();
-    return cutSize;
+    head = tail = uint64_t{static_cast<uint32_t>(headSequence + 1)} * sectorDataSize;
+    openSector();
 }
 
-void FIFOFile::flush()
+void FIFOFile::padSector()
 {
-    head.commit();
-    tail.commit();
-    size.commit();
-    nvs.commit();
-    Partition::flush();
+    if (head % sectorDataSize == 0)
+        return;
+    head += sectorDataSize - head % sectorDataSize;
+    markEnd();
 }
@@ -1,6 +1,8 @@
 #ifndef __MIRRA_FS_H__
 #define __MIRRA_FS_H__
 
+#include <array>
+#include <cstdio>
 #include <cstring>
 #include <esp_partition.h>
 #include <memory>
@@ -13,16 +15,34 @@ namespace mirra::fs
 {
 class NVS
 {
+public:
+    /// @brief Counters of the NVS operations issued by all namespaces since boot.
+    struct Stats
+    {
+        /// @brief Values written to NVS.
+        size_t sets{0};
+        /// @brief Commits of values that were skipped, as the stored value was left unchanged.
+        size_t unchanged{0};
+        /// @brief Changes committed to flash.
+        size_t commits{0};
+    };
+
 private:
     nvs_handle_t handle;
     char name[NVS_KEY_NAME_MAX_SIZE];
+    /// @brief Whether any key was set or erased since the last commit.
+    bool pending{false};
+    /// @brief Amount of open transactions, while which commits are deferred.
+    size_t transactions{0};
+    static Stats stats;
 
     template <class T> std::optional<T> get(const char* key) const;
     template <class T> std::pair<esp_err_t, T> get_integral(const char* key) const;
     esp_err_t get_str(const char* key, char* buffer, size_t size) const;
     esp_err_t get_blob(const char* key, void* buffer, size_t size) const;
 
-    template <class T> void set(const char* key, const T& value);
+    /// @return Whether the value was set.
+    template <class T> bool set(const char* key, const T& value);
     template <class T> esp_err_t set_integral(const char* key, T value);
     esp_err_t set_str(const char* key, const char* value);
     esp_err_t set_blob(const char* key, const void* value, size_t size);
@@ -31,18 +51,46 @@ public:
     NVS(const char* name);
     ~NVS();
 
+    /// @brief Commits the keys set or erased since the last commit, if any. Deferred to the end
+    /// of the outermost Transaction if one is open.
     void commit();
 
+    /// @brief Scope within which the commits of a namespace are coalesced into a single one, made
+    /// when the scope ends.
+    class Transaction
+    {
+        NVS& nvs;
+
+    public:
+        Transaction(NVS& nvs) : nvs{nvs} { nvs.transactions++; }
+        Transaction(const Transaction&) = delete;
+        Transaction& operator=(const Transaction&) = delete;
+        ~Transaction()
+        {
+            if (--nvs.transactions == 0)
+                nvs.commit();
+        }
+    };
+
+    /// @brief Value cached from NVS. Only written back on commit if it differs from the value
+    /// last read or written, as it may be changed through the references handed out.
     template <class T> class Value
     {
         const char* key;
         NVS* nvs;
         T cachedValue;
-
-        Value(const char* key, NVS* nvs) : key{key}, nvs{nvs}, cachedValue{nvs->get<T>(key).value()}
+        /// @brief The value as stored in NVS.
+        T storedValue;
+        /// @brief Whether the key is not stored yet, e.g. when it was defaulted.
+        bool dirty;
+
+        Value(const char* key, NVS* nvs, const std::optional<T>& value)
+            : key{key}, nvs{nvs}, cachedValue{value.value()}, storedValue{cachedValue},
+              dirty{false}
         {}
-        Value(const char* key, NVS* nvs, const T& defaultValue)
-            : key{key}, nvs{nvs}, cachedValue{nvs->get<T>(key).value_or(defaultValue)}
+        Value(const char* key, NVS* nvs, const std::optional<T>& value, const T& defaultValue)
+            : key{key}, nvs{nvs}, cachedValue{value.value_or(defaultValue)},
+              storedValue{cachedValue}, dirty{!value}
         {}
 
     public:
@@ -52,11 +100,16 @@ public:
 
         ~Value() { commit(); };
 
-        void commit() { nvs->set<T>(key, cachedValue); }
+        /// @return Whether the value differs from the one stored in NVS.
+        bool isDirty() const;
+        /// @brief Writes the value to NVS if it is dirty. Only made durable by NVS::commit.
+        void commit();
         T& operator=(const T& other) { return cachedValue = other; }
         T& operator=(T&& other) { return cachedValue = std::move(other); }
         operator T() const { return cachedValue; }
         operator T&() { return cachedValue; }
+        T* operator->() { return &cachedValue; }
+        const T* operator->() const { return &cachedValue; }
         friend class NVS;
     };
 
@@ -83,41 +136,119 @@ public:
         ~Iterator() { nvs_release_iterator(nvsIterator); }
         friend class NVS;
     };
-    template <class T> Value<T> getValue(const char* key) { return Value<T>(key, this); }
+    template <class T> Value<T> getValue(const char* key)
+    {
+        return Value<T>(key, this, get<T>(key));
+    }
     template <class T> Value<T> getValue(const char* key, const T& defaultValue)
     {
-        return Value<T>(key, this, defaultValue);
+        return Value<T>(key, this, get<T>(key), defaultValue);
     }
 
+    /// @brief Reads a blob of the given size, for data too large to be held as a Value.
+    /// @return Whether a blob of that size was found.
+    bool getBlob(const char* key, void* buffer, size_t size) const;
+    /// @brief Writes a blob, for data too large to be held as a Value. Only made durable by
+    /// commit.
+    /// @return Whether the blob was written.
+    bool setBlob(const char* key, const void* value, size_t size);
+    /// @brief Erases a key, if it is stored.
     void eraseKey(const char* key);
-    template <class T> void eraseValue(const Value<T>& value) { return eraseKey(value->key); }
+    template <class T> void eraseValue(const Value<T>& value) { return eraseKey(value.key); }
 
     Iterator begin() const { return Iterator(name); };
     Iterator end() const { return Iterator(nullptr); };
 
     static void init();
+    static const Stats& getStats() { return stats; }
 };
 
 class Partition
 {
-    static constexpr size_t partitionNameMaxSize = 16;
+public:
+    /// @brief Counters of the flash operations issued by a partition, and of the accesses to its
+    /// cache.
+    struct Stats
+    {
+        size_t erases{0};
+        size_t writes{0};
+        size_t bytesWritten{0};
+        /// @brief Accesses to sectors held in the cache.
+        size_t hits{0};
+        /// @brief Accesses to sectors not held in the cache. Reads of these are served straight
+        /// from flash, while writes load the sector into the cache.
+        size_t misses{0};
+        /// @brief Sectors dropped from the cache to make room for another one, which are written
+        /// back to flash first if dirty.
+        size_t evictions{0};
+    };
+    /// @brief Amount of sectors a partition caches by default: enough for a file that is appended
+    /// to at one sector while being updated at another.
+    static constexpr size_t defaultCacheSize{2};
+
+protected:
     static constexpr size_t sectorSize = 4096;
     static constexpr size_t toSectorAddress(size_t address);
 
+private:
+    static constexpr size_t partitionNameMaxSize = 16;
+
+    /// @brief A sector held in the cache, of which a range may differ from flash until it is
+    /// written back.
+    struct Sector
+    {
+        std::array<uint8_t, sectorSize> data;
+        /// @brief Address of the sector, or SIZE_MAX if this entry of the cache is unused.
+        size_t address{SIZE_MAX};
+        /// @brief Offset in the sector from which the flash is known to be erased (all 0xFF), i.e.
+        /// where bytes can be appended without erasing the sector first.
+        size_t erasedFrom{sectorSize};
+        /// @brief Start offset of the range of the sector that differs from flash.
+        size_t dirtyFrom{sectorSize};
+        /// @brief End offset of the range of the sector that differs from flash.
+        size_t dirtyTo{0};
+        /// @brief Value of the access counter of the partition at the last access to the sector,
+        /// to evict the least recently used sector.
+        uint32_t lastUse{0};
+
+        bool contains(size_t address) const
+        {
+            return this->address <= address && address < this->address + sectorSize;
+        }
+        bool isDirty() const { return dirtyFrom < dirtyTo; }
+        /// @return The offset of the trailing run of erased bytes in the sector.
+        size_t findErasedFrom() const;
+    };
+
     const esp_partition_t* part;
     char name[partitionNameMaxSize];
     size_t maxSize;
-    std::unique_ptr<std::array<uint8_t, sectorSize>> sectorBuffer;
-    size_t sectorAddress;
-    bool sectorDirty;
-
-    bool inSector(size_t address) const;
-    void readSector(size_t sectorAddress);
-    void writeSector();
+    size_t cacheSize;
+    std::unique_ptr<Sector[]> cache;
+    mutable uint32_t accesses{0};
+    mutable Stats stats{};
+
+    /// @return The cached sector holding the address, or nullptr if it is not cached.
+    Sector* find(size_t address) const;
+    /// @return The cached sector holding the address. If it is not cached, it is loaded in place
+    /// of the least recently used sector.
+    Sector& load(size_t address);
+    /// @return Whether writing the dirty range only clears bits compared to what is in flash, in
+    /// which case NOR flash can be written to without erasing it first.
+    bool onlyClearsBits(const Sector& sector) const;
+    void writeSector(Sector& sector);
 
 protected:
-    Partition(const char* name);
-    void loadFirstSector(size_t address);
+    /// @param cacheSize Amount of sectors to cache, at least 1.
+    Partition(const char* name, size_t cacheSize = defaultCacheSize);
+    /// @brief Marks a region as holding no data, so that a flush may erase it rather than having
+    /// to preserve its contents. Loads the sectors of the region into the cache.
+    /// @param address Start address of the region.
+    /// @param size Size of the region in bytes.
+    void discard(size_t address, size_t size);
+    /// @return The offset in the sector holding the address from which the flash is known to be
+    /// erased. Loads the sector into the cache.
+    size_t getErasedFrom(size_t address) { return load(address).erasedFrom; }
 
 public:
     Partition(const Partition&) = delete;
@@ -127,6 +258,9 @@ public:
     ~Partition();
 
     size_t getMaxSize() const { return maxSize; };
+    /// @return Counters of the flash operations this partition has issued and of the accesses to
+    /// its cache since it was opened.
+    const Stats& getStats() const { return stats; }
 
     const char* getName() { return name; };
     void read(size_t address, void* buffer, size_t size) const;
@@ -135,46 +269,109 @@ public:
     void write(size_t address, const void* buffer, size_t size);
     template <class T> void write(size_t address, const T& value);
 
+    /// @brief Writes all dirty sectors in the cache back to flash.
     void flush();
 };
+/// @brief Partition used as a ring of sectors, to which records are pushed at the head and from
+/// which the oldest sectors are cut at the tail to make room. Every sector starts with a header
+/// (see SectorHeader) from which the head and tail are found when the file is opened, so that the
+/// state of the file lives in the partition itself: pushing and flushing never write to NVS, and
+/// a file is consistent again after a power cut as soon as it is opened.
 class FIFOFile : protected Partition
 {
+    /// @brief Header at the start of every sector of the file. The sector holding the file's data
+    /// at position `p` (counted from the start of the first sector ever opened) has sequence number
+    /// `p / sectorDataSize` and lives at sector `sequence % sectors` of the partition, so that the
+    /// sectors are opened in order around the partition. The fields that are only known after the
+    /// sector is opened start out erased, and are written without erasing the sector again.
+    struct SectorHeader
+    {
+        uint32_t sequence;
+        /// @brief Sequence number of the oldest sector of the file when this sector was opened.
+        uint32_t oldest;
+        /// @brief Check value of the above fields, to tell headers from other data.
+        uint16_t check;
+        /// @brief Offset in the sector's data of the first record that starts in it, or none.
+        uint16_t firstRecord;
+        /// @brief Offsets in the sector's data at which the data ended in erased bytes (0xFF),
+        /// which cannot be told from the erased flash after them, or none.
+        uint16_t ends[2];
+    };
+    static constexpr uint16_t none{0xFFFF};
+
 protected:
     NVS nvs;
+    /// @brief The amount of bytes of data a sector holds after its header.
+    static constexpr size_t sectorDataSize{sectorSize - sizeof(SectorHeader)};
 
 private:
-    NVS::Value<size_t> head;
-    NVS::Value<size_t> size;
-    NVS::Value<size_t> tail;
+    /// @brief The amount of sectors in the partition.
+    size_t sectors;
+    /// @brief Positions of the head and tail, counted from the start of the first sector ever
+    /// opened.
+    uint64_t head{0};
+    uint64_t tail{0};
+    /// @brief Sequence number of the last sector opened, UINT32_MAX if there is none.
+    uint32_t headSequence{UINT32_MAX};
+    SectorHeader headHeader;
+
+    /// @return The address in the partition of the given position.
+    size_t toAddress(uint64_t position) const;
+    static uint16_t getCheck(uint32_t sequence, uint32_t oldest);
+    /// @return The header of the given sector of the partition, if it holds a valid one.
+    std::optional<SectorHeader> readHeader(size_t sector) const;
+    /// @brief Finds the head and tail from the sector headers.
+    void mount();
+    /// @return The position of the first record in the sectors from the given sequence number up
+    /// to the head, or the head if there is none.
+    uint64_t findRecord(uint32_t sequence) const;
+    /// @brief Opens the sector after the last one opened, cutting the tail if it is in use.
+    void openSector();
+    /// @brief Cuts the oldest sector from the tail, up to the first record after it.
+    void cutTail();
+    void writeHeader();
+    /// @brief Records the position of the head in the header of the last sector opened.
+    void markEnd();
 
 protected:
-    FIFOFile(const char* name);
-    /// @brief Cuts the beginning of the tail to free up space: how this cutting is implemented
-    /// may be overriden.
-    /// @param cutSize Minimal required size of cut in bytes.
-    /// @return Total amount of bytes cut.
-    virtual size_t cutTail(size_t cutSize);
+    FIFOFile(const char* name, size_t cacheSize = defaultCacheSize);
+    /// @return The address in the partition at which the next push will be written.
+    size_t getHead() const { return toAddress(head); }
+    /// @brief Discards the entire contents of the file. The file then starts at the next sector
+    /// boundary.
+    void clear();
+    /// @brief Moves the head to the next sector boundary, leaving the skipped bytes erased. These
+    /// count towards the size of the file.
+    void padSector();
+    /// @brief Called before the tail is cut to make room at the head, e.g. to update state that
+    /// refers to the part of the file that is cut.
+    /// @param cutSize Amount of bytes cut: the rest of the oldest sector, and of any following
+    /// sectors up to the start of the first record in them.
+    virtual void onCutTail(size_t cutSize) {}
 
 public:
     FIFOFile(FIFOFile&&) = default;
     FIFOFile& operator=(FIFOFile&&) = default;
     virtual ~FIFOFile() {};
 
-    size_t getSize() const { return size; }
+    size_t getSize() const { return head - tail; }
+    /// @return The amount of bytes that can be pushed before the tail is cut.
     size_t freeSpace() const;
 
     using Partition::getName;
+    using Partition::getStats;
 
     void read(size_t address, void* buffer, size_t size) const;
     template <class T> T read(size_t address) const;
 
+    /// @brief Appends a record to the file.
     void push(const void* buffer, size_t size);
     template <class T> void push(const T& value);
 
     void write(size_t address, const void* buffer, size_t size);
     template <class T> void write(size_t address, const T& value);
 
-    void flush();
+    using Partition::flush;
 };
 
 #include "./FS.tpp"
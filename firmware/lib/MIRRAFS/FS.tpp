@@ -22,7 +22,7 @@ template <class T> std::optional<T> NVS::get(const char* key) const
     return std::nullopt;
 }
 
-template <class T> void NVS::set(const char* key, const T& value)
+template <class T> bool NVS::set(const char* key, const T& value)
 {
     esp_err_t err;
     if constexpr (std::is_integral_v<T>)
@@ -34,7 +34,36 @@ template <class T> void NVS::set(const char* key, const T& value)
         err = set_blob(key, &value, sizeof(T));
     }
     if (err != ESP_OK)
+    {
         printf("Error while setting key '%s', code: %s\n", key, esp_err_to_name(err));
+        return false;
+    }
+    stats.sets++;
+    pending = true;
+    return true;
+}
+
+template <class T> bool NVS::Value<T>::isDirty() const
+{
+    if (dirty)
+        return true;
+    if constexpr (std::is_integral_v<T>)
+        return cachedValue != storedValue;
+    else // compared as the blob it is stored as
+        return std::memcmp(&cachedValue, &storedValue, sizeof(T)) != 0;
+}
+
+template <class T> void NVS::Value<T>::commit()
+{
+    if (!isDirty())
+    {
+        stats.unchanged++;
+        return;
+    }
+    if (!nvs->set<T>(key, cachedValue))
+        return;
+    storedValue = cachedValue;
+    dirty = false;
 }
 
 template <class T> T Partition::read(size_t address) const
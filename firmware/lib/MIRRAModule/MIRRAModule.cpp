@@ -7,6 +7,9 @@
 
 using namespace mirra;
 
+/// @brief Drift of the RTC, kept over deep sleep.
+RTC_DATA_ATTR ClockDrift clockDrift{};
+
 void MIRRAModule::prepare(const MIRRAPins& pins)
 {
     Serial.begin(115200);
@@ -46,88 +49,266 @@ MIRRAModule::MIRRAModule(const MIRRAPins& pins)
 {
     Log::getInstance().serial = &Serial;
     Serial.println("Logger initialised.");
-    Log::info("Reset reason: ", esp_rom_get_reset_reason(0));
+    LOG_INFO("Reset reason: ", esp_rom_get_reset_reason(0));
+    syncTime(false);
 }
 
-MIRRAModule::SensorFile::SensorFile() : FIFOFile("data"), reader{nvs.getValue<size_t>("reader", 0)}
-{}
+MIRRAModule::SensorFile::SensorFile()
+    : FIFOFile("data"), index{nvs.getValue<UploadIndex>("index", UploadIndex{0, 0, 0, SIZE_MAX})},
+      version{nvs.getValue<uint8_t>("version", 0)}
+{
+    if (version != currentVersion)
+    {
+        if (getSize() > 0)
+            LOG_ERROR("Discarding ", getSize(), " bytes of data entries of version ",
+                      static_cast<uint8_t>(version), ", as the current version is ",
+                      currentVersion, ".");
+        clear();
+        version = currentVersion;
+    }
+    if (index->head != getHead() || index->size != getSize())
+        rebuildIndex();
+}
 
-size_t MIRRAModule::SensorFile::cutTail(size_t cutSize)
+void MIRRAModule::SensorFile::rebuildIndex()
 {
-    size_t removed{0};
-    while (removed < cutSize)
+    LOG_INFO("Rebuilding upload index of data file...");
+    index->reader = getSize();
+    index->unuploaded = 0;
+    for (Iterator it{begin()}; it != end(); ++it)
     {
-        removed += DataEntry::getSize(read<DataEntry::Flags>(removed + DataEntry::flagsPosition));
+        if (index->unuploaded > 0 || !it.block->entry.uploaded)
+        {
+            if (index->unuploaded == 0)
+                index->reader = it.address;
+            index->unuploaded++;
+        }
     }
-    reader = reader < removed ? 0 : reader - removed;
-    return FIFOFile::cutTail(removed);
+    updateIndex();
 }
 
-MIRRAModule::SensorFile::Iterator& MIRRAModule::SensorFile::Iterator::operator++()
+void MIRRAModule::SensorFile::updateIndex()
 {
-    address += DataEntry::getSize(file->read<DataEntry::Flags>(address + DataEntry::flagsPosition));
-    return *this;
+    index->head = getHead();
+    index->size = getSize();
+}
+
+void MIRRAModule::SensorFile::logStats() const
+{
+    const fs::Partition::Stats& stats{getStats()};
+    LOG_DEBUG("Data file: ", stats.erases, " erases, ", stats.writes, " writes of ",
+              stats.bytesWritten, " bytes, cache ", stats.hits, " hits, ", stats.misses,
+              " misses, ", stats.evictions, " evictions.");
+    const fs::NVS::Stats& nvsStats{fs::NVS::getStats()};
+    LOG_DEBUG("NVS: ", nvsStats.sets, " sets, ", nvsStats.unchanged, " unchanged, ",
+              nvsStats.commits, " commits.");
 }
 
-std::optional<size_t> MIRRAModule::SensorFile::getUnuploadedAddress(size_t index)
+void MIRRAModule::SensorFile::loadAppender()
 {
-    size_t address = reader;
-    size_t count{0};
-    while (true)
+    if (appender)
+        return;
+    appender = std::make_unique<BlockCodec>();
+    size_t blockAddress{getSize() - getSize() % BlockCodec::blockSize};
+    if (blockAddress == getSize())
+        return; // the next record starts a new block
+    size_t decodedEnd{blockAddress};
+    Iterator it{blockAddress, this};
+    for (; it.address < getSize() && it.block->address == blockAddress; ++it)
+        decodedEnd = it.next;
+    if (decodedEnd == getSize())
+    {
+        *appender = it.block->codec;
+    }
+    else
     {
-        if (address == getSize())
-            return std::nullopt;
-        DataEntry::Flags flags = read<DataEntry::Flags>(address + DataEntry::flagsPosition);
-        if (!flags.uploaded)
+        LOG_ERROR("Data file block at ", blockAddress, " could only be decoded up to ", decodedEnd,
+                  ", continuing in the next block.");
+        padSector();
+    }
+}
+
+void MIRRAModule::SensorFile::onCutTail(size_t cutSize)
+{
+    // the file only cuts whole sectors, i.e. whole blocks
+    if (index->reader < cutSize)
+    {
+        for (Iterator it{index->reader, this}; it.address < cutSize && index->unuploaded > 0; ++it)
+            index->unuploaded--;
+        index->reader = 0;
+    }
+    else
+    {
+        index->reader = index->reader - cutSize;
+    }
+}
+
+MIRRAModule::SensorFile::Iterator::Iterator(size_t address, const SensorFile* file)
+    : file{file}, address{address}, next{address}
+{
+    if (address >= file->getSize())
+    {
+        this->address = file->getSize();
+        return;
+    }
+    this->address = address - address % BlockCodec::blockSize;
+    decode();
+    while (this->address < address)
+        ++(*this);
+}
+
+void MIRRAModule::SensorFile::Iterator::load(size_t blockAddress)
+{
+    if (!block)
+        block = std::make_unique<Block>();
+    block->address = blockAddress;
+    block->size = std::min(BlockCodec::blockSize, file->getSize() - blockAddress);
+    file->read(blockAddress, block->data.data(), block->size);
+    block->codec.reset();
+}
+
+void MIRRAModule::SensorFile::Iterator::decode()
+{
+    while (address < file->getSize())
+    {
+        if (!block || address < block->address ||
+            address >= block->address + BlockCodec::blockSize)
+            load(address - address % BlockCodec::blockSize);
+        size_t offset{address - block->address};
+        size_t recordSize{offset < block->size
+                              ? block->codec.decode(&block->data[offset], block->size - offset,
+                                                    block->entry)
+                              : 0};
+        if (recordSize > 0)
         {
-            if (count == 0)
-                reader = address;
-            if (count == index)
-                return address;
-            count++;
+            next = address + recordSize;
+            return;
         }
-        address += DataEntry::getSize(flags);
+        address = block->address + BlockCodec::blockSize; // no more records in this block
     }
+    address = next = file->getSize();
+}
+
+MIRRAModule::SensorFile::Iterator& MIRRAModule::SensorFile::Iterator::operator++()
+{
+    address = next;
+    decode();
+    return *this;
 }
 
-std::optional<MIRRAModule::SensorFile::DataEntry>
+size_t MIRRAModule::SensorFile::EntryView::copyTo(uint8_t* buffer) const
+{
+    std::memcpy(buffer, entry->source, BlockCodec::sourceSize);
+    std::memcpy(&buffer[BlockCodec::sourceSize], &entry->time, sizeof(entry->time));
+    DataEntry::Flags flags{static_cast<uint8_t>(entry->countValues()), entry->uploaded};
+    std::memcpy(&buffer[DataEntry::flagsPosition], &flags, sizeof(flags));
+    buffer[DataEntry::valuesPosition] = entry->valuesSize;
+    std::memcpy(&buffer[DataEntry::valuesPosition + sizeof(entry->valuesSize)], entry->values,
+                entry->valuesSize);
+    return getSize();
+}
+
+std::optional<MIRRAModule::SensorFile::EntryView>
 MIRRAModule::SensorFile::getUnuploaded(size_t index)
 {
-    auto address = getUnuploadedAddress(index);
-    if (!address)
+    if (index >= this->index->unuploaded)
+        return std::nullopt;
+    if (!cursor || cursorIndex > index)
+    {
+        cursor = Iterator(this->index->reader, this);
+        cursorIndex = 0;
+    }
+    for (; cursorIndex < index && *cursor != end(); cursorIndex++)
+        ++*cursor;
+    if (!(*cursor != end()))
         return std::nullopt;
-    return read<DataEntry>(*address);
+    return **cursor;
 }
 
 bool MIRRAModule::SensorFile::isLast(size_t index)
 {
-    return !getUnuploadedAddress(index + 1);
+    return index + 1 >= this->index->unuploaded;
 }
 
 void MIRRAModule::SensorFile::push(const Message<SENSOR_DATA>& message)
 {
-    push(DataEntry{message.getSource(), message.time, DataEntry::Flags{message.nValues, false},
+    push(DataEntry{message.getSource(), message.time,
+                   DataEntry::Flags{static_cast<uint8_t>(message.values.count()), false},
                    message.values});
 }
 
+void MIRRAModule::SensorFile::push(const Message<SENSOR_DATA_BATCH>& message)
+{
+    for (const auto& entry : message)
+        push(DataEntry{message.getSource(), entry.time, DataEntry::Flags{entry.nValues, false},
+                       entry.values});
+}
+
+void MIRRAModule::SensorFile::push(const DataEntry& entry)
+{
+    BlockCodec::Entry codecEntry;
+    std::memcpy(codecEntry.source, entry.source.getAddress(), BlockCodec::sourceSize);
+    codecEntry.time = entry.time;
+    codecEntry.uploaded = entry.flags.uploaded;
+    codecEntry.valuesSize = entry.values.getSize();
+    std::memcpy(codecEntry.values, entry.values.getData(), entry.values.getSize());
+
+    // the iterators hold copies of the blocks they decode, which the push may change or cut
+    cursor.reset();
+    uploader.reset();
+    loadAppender();
+    size_t blockOffset{getSize() % BlockCodec::blockSize};
+    if (blockOffset > 0 && blockOffset + BlockCodec::getMaxRecordSize(codecEntry.countValues()) >
+                               BlockCodec::blockSize)
+    {
+        // the record might not fit in the rest of the block: leave it erased, which ends the block
+        padSector();
+        appender->reset();
+    }
+    if (index->unuploaded == 0)
+        index->reader = getSize(); // skip any padding
+    uint8_t record[BlockCodec::maxRecordSize];
+    FIFOFile::push(record, appender->encode(record, codecEntry));
+    index->unuploaded++;
+    updateIndex();
+}
+
 void MIRRAModule::SensorFile::setUploaded()
 {
-    DataEntry::Flags flags = read<DataEntry::Flags>(reader + DataEntry::flagsPosition);
-    flags.uploaded = true;
-    write(reader + DataEntry::flagsPosition, flags);
+    if (index->unuploaded == 0)
+        return;
+    if (!uploader)
+        uploader = Iterator(index->reader, this);
+    Iterator& it{*uploader};
+    if (!(it != end()))
+        return;
+    const uint8_t* record{&it.block->data[it.address - it.block->address]};
+    size_t headerOffset{BlockCodec::getHeaderOffset(record)};
+    write<uint8_t>(it.address + headerOffset, record[headerOffset] & ~BlockCodec::pendingBit);
+    ++it;
+    index->reader = it.address;
+    index->unuploaded--;
+    // the indices of the unuploaded entries count from the reader
+    if (cursor && cursorIndex > 0)
+        cursorIndex--;
+    else if (cursor && *cursor != end())
+        ++*cursor;
 }
 
 void MIRRAModule::SensorFile::flush()
 {
-    reader.commit();
+    index.commit();
+    nvs.commit();
     FIFOFile::flush();
 }
 
 void MIRRAModule::deepSleep(uint32_t sleepTime)
 {
+    if (rtcOutdated)
+        writeRTC();
     if (sleepTime <= 0)
     {
-        Log::error("Sleep time was zero or negative! Sleeping one second to avert crisis.");
+        LOG_ERROR("Sleep time was zero or negative! Sleeping one second to avert crisis.");
         sleepTime = 1;
     }
 
@@ -136,33 +317,74 @@ void MIRRAModule::deepSleep(uint32_t sleepTime)
     // 30s the internal oscillator will be used to wake from deep sleep
     if (sleepTime <= 30)
     {
-        Log::debug("Using internal timer for deep sleep.");
+        LOG_DEBUG("Using internal timer for deep sleep.");
         esp_sleep_enable_timer_wakeup((uint64_t)sleepTime * 1000 * 1000);
     }
     else
     {
-        Log::debug("Using RTC for deep sleep.");
+        LOG_DEBUG("Using RTC for deep sleep.");
         rtc.writeAlarm(rtc.readTimeEpoch() + sleepTime);
         rtc.enableAlarm();
         esp_sleep_enable_ext0_wakeup((gpio_num_t)rtc.getIntPin(), 0);
     }
     esp_sleep_enable_ext1_wakeup((gpio_num_t)_BV(this->pins.bootPin),
                                  ESP_EXT1_WAKEUP_ALL_LOW); // wake when BOOT button is pressed
-    Log::info("Good night.");
+    LOG_INFO("Good night.");
     this->end();
     esp_deep_sleep_start();
 }
 
-void MIRRAModule::deepSleepUntil(uint32_t untilTime)
+void MIRRAModule::syncTime(bool align)
+{
+    if (rtcOutdated)
+        return;
+    const uint64_t rtcTime{static_cast<uint64_t>(align ? rtc.awaitSecond() : rtc.readTimeEpoch()) *
+                           1000};
+    const uint64_t time{clockDrift.toReference(rtcTime)};
+    rtc.setSysTimeMs(time);
+    if (align)
+        rtcOffset = static_cast<int32_t>(rtcTime - time);
+    else
+        rtcOffset.reset();
+}
+
+void MIRRAModule::correctTime(uint64_t time)
+{
+    const uint64_t cTime{rtc.getSysTimeMs()};
+    if (rtcOffset)
+        clockDrift.correct(cTime + *rtcOffset, time);
+    else
+        clockDrift.restart(time);
+    rtc.setSysTimeMs(time);
+    rtcOffset = 0;
+    rtcOutdated = true;
+    LOG_DEBUG("System time corrected by ", static_cast<int32_t>(time - cTime), " ms.");
+}
+
+void MIRRAModule::writeRTC()
 {
-    uint32_t cTime{rtc.getSysTime()};
+    // the RTC restarts counting the second it is set to, so it is set on the edge of that second
+    const uint64_t cTime{rtc.getSysTimeMs()};
+    lightSleep((1000 - cTime % 1000) / 1000.0f);
+    rtc.writeTime(static_cast<uint32_t>(cTime / 1000 + 1));
+    rtcOffset = 0;
+    rtcOutdated = false;
+}
+
+const ClockDrift& MIRRAModule::getClockDrift() const { return clockDrift; }
+
+void MIRRAModule::deepSleepUntil(uint64_t untilTime)
+{
+    uint64_t cTime{rtc.getSysTimeMs()};
     if (untilTime <= cTime)
     {
         deepSleep(0);
     }
     else
     {
-        deepSleep(untilTime - cTime);
+        // the RTC counts the sleep at its own rate
+        deepSleep(static_cast<uint32_t>(
+            (clockDrift.toLocal(untilTime) - clockDrift.toLocal(cTime) + 500) / 1000));
     }
 }
 
@@ -170,31 +392,35 @@ void MIRRAModule::lightSleep(float sleepTime)
 {
     if (sleepTime <= 0)
     {
-        Log::error("Sleep time was zero or negative! Skipping to avert crisis.");
+        LOG_ERROR("Sleep time was zero or negative! Skipping to avert crisis.");
         return;
     }
     esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
-    esp_sleep_enable_timer_wakeup((uint64_t)sleepTime * 1000 * 1000);
+    esp_sleep_enable_timer_wakeup(static_cast<uint64_t>(sleepTime * 1000 * 1000));
     esp_light_sleep_start();
 }
 
-void MIRRAModule::lightSleepUntil(uint32_t untilTime)
+void MIRRAModule::lightSleepUntil(uint64_t untilTime)
 {
-    uint32_t cTime{rtc.getSysTime()};
+    uint64_t cTime{rtc.getSysTimeMs()};
     if (untilTime <= cTime)
     {
         return;
     }
     else
     {
-        lightSleep(untilTime - cTime);
+        lightSleep((untilTime - cTime) / 1000.0f);
     }
 }
 
 CommandCode MIRRAModule::Commands::setLogLevel(const char* arg)
 {
     if (strcmp("DEBUG", arg) == 0)
+    {
+        if constexpr (!Log::isCompiled(Log::Level::DEBUG))
+            Serial.println("DEBUG messages are not compiled into this build (see LOG_MIN_LEVEL).");
         Log::getInstance().file.level = Log::Level::DEBUG;
+    }
     else if (strcmp("INFO", arg) == 0)
         Log::getInstance().file.level = Log::Level::INFO;
     else if (strcmp("ERROR", arg) == 0)
@@ -209,43 +435,64 @@ CommandCode MIRRAModule::Commands::setLogLevel(const char* arg)
 
 CommandCode MIRRAModule::Commands::printLogs()
 {
-    static constexpr size_t bufferSize{256};
-    char buffer[bufferSize];
-    size_t cursor{0};
+    Log::flush();
     const Log::File& file = Log::getInstance().file;
     Serial.printf("Logs: %u out of %u KB.\n", file.getSize() / 1024, file.getMaxSize() / 1024);
-    while (cursor < file.getSize())
-    {
-        file.read(cursor, buffer, bufferSize);
-        Serial.write(buffer, std::min(bufferSize, file.getSize() - cursor));
-        cursor += bufferSize;
-    }
+    uint8_t record[LogRecord::maxSize];
+    char line[256];
+    uint32_t build{file.build};
+    for (size_t address{0}, size; (size = file.readRecord(address, record)) > 0; address += size)
+        Serial.write(line, Log::format(record, line, sizeof(line), build));
     Serial.print('\n');
     return COMMAND_SUCCESS;
 }
 
+CommandCode MIRRAModule::Commands::printLogsRaw()
+{
+    Log::flush();
+    const Log::File& file = Log::getInstance().file;
+    uint8_t record[LogRecord::maxSize];
+    auto printRecord = [&record](size_t size) {
+        for (size_t i = 0; i < size; i++)
+        {
+            Serial.printf("%02X", record[i]);
+        }
+        Serial.print('\n');
+    };
+    // lead with the build of the oldest records, so that the dump can be decoded on its own
+    printRecord(LogRecord::encodeBoot(record, 0, file.build));
+    for (size_t address{0}, size; (size = file.readRecord(address, record)) > 0; address += size)
+        printRecord(size);
+    return COMMAND_SUCCESS;
+}
+
 CommandCode MIRRAModule::Commands::printData()
 {
     SensorFile file{};
     Serial.printf("Data: %u out of %u KB.\n", file.getSize() / 1024, file.getMaxSize() / 1024);
-    for (SensorFile::DataEntry entry : file)
+    for (SensorFile::EntryView entry : file)
     {
-        Serial.printf("%s ", entry.source.toString());
+        Serial.printf("%s ", entry.getSource().toString());
 
-        time_t time = static_cast<time_t>(entry.time);
+        time_t time = static_cast<time_t>(entry.getTime());
         static constexpr size_t timeLength{sizeof("0000-00-00 00:00:00")};
         char timeBuffer[timeLength];
         std::strftime(timeBuffer, timeLength, "%F %T", gmtime(&time));
         Serial.print(timeBuffer);
 
-        if (entry.flags.uploaded)
+        if (entry.isUploaded())
             Serial.print(" UP");
 
         Serial.print("\n");
 
-        for (size_t i = 0; i < entry.flags.nValues; i++)
+        const uint8_t* values{entry.getValues()};
+        const size_t valuesSize{entry.getValuesSize()};
+        for (size_t position{0};
+             position < valuesSize && position + getEncodedSize(values[position]) <= valuesSize;)
         {
-            Serial.printf("%u %f\n", entry.values[i].typeTag, entry.values[i].value);
+            SensorValue value;
+            position += decodeSensorValue(&values[position], value);
+            Serial.printf("%u %f\n", value.typeTag, value.value);
         }
 
         Serial.print("\n");
@@ -256,11 +503,13 @@ CommandCode MIRRAModule::Commands::printData()
 CommandCode MIRRAModule::Commands::printDataRaw()
 {
     SensorFile file{};
-    for (SensorFile::DataEntry entry : file)
+    uint8_t buffer[sizeof(SensorFile::DataEntry)];
+    for (SensorFile::EntryView entry : file)
     {
-        for (size_t i = 0; i < entry.getSize(); i++)
+        size_t size{entry.copyTo(buffer)};
+        for (size_t i = 0; i < size; i++)
         {
-            Serial.printf("%02X", reinterpret_cast<uint8_t*>(&entry)[i]);
+            Serial.printf("%02X", buffer[i]);
         }
         Serial.print('\n');
     }
@@ -279,7 +528,7 @@ CommandCode MIRRAModule::Commands::format()
 CommandCode MIRRAModule::Commands::spam(size_t count)
 {
     for (size_t i = 0; i < count; i++)
-        Log::getInstance().file.push("abcdefghijklmnopqrstuvwxyz\n");
+        LOG_INFO("abcdefghijklmnopqrstuvwxyz");
     Serial.println("Spamming done.");
     return COMMAND_SUCCESS;
 }
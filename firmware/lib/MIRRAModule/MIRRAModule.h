@@ -1,10 +1,12 @@
 #ifndef __MIRRAMODULE_H__
 #define __MIRRAMODULE_H__
 
+#include "ClockDrift.h"
 #include "Commands.h"
 #include "FS.h"
 #include "LoRaModule.h"
 #include "PCF2129_RTC.h"
+#include "SensorCompression.h"
 
 namespace mirra
 {
@@ -47,11 +49,15 @@ protected:
         /// @brief Change the log level.
         /// @param arg String describing the new log level. ("ERROR", "INFO" or "DEBUG")
         CommandCode setLogLevel(const char* arg);
-        /// @brief Prints the stored logs to the serial output.
+        /// @brief Prints the stored logs to the serial output, formatting their records.
         CommandCode printLogs();
+        /// @brief Prints the records of the stored logs to the serial output as a hex dump, one
+        /// record per line, to be formatted on a host by the log_decoder.
+        CommandCode printLogsRaw();
         /// @brief Prints all stored data entries to the serial output in human readable format.
         CommandCode printData();
-        /// @brief Prints all stored data entries to the serial output as a hex dump.
+        /// @brief Prints all stored data entries to the serial output as a hex dump, decompressed into
+        /// the layout they are uploaded in.
         CommandCode printDataRaw();
         /// @brief Formats the module, clearing the entire NVS and filesystem and restarts the
         /// module (effectively a hard reset).
@@ -68,6 +74,7 @@ protected:
                     CommandAliasesPair(&Commands::setLogLevel, "setlog", "setloglevel"),
                     CommandAliasesPair(&Commands::printLogs, "printlog", "printlogs",
                                        "printlogfile"),
+                    CommandAliasesPair(&Commands::printLogsRaw, "printlogsraw", "printlogshex"),
                     CommandAliasesPair(&Commands::printData, "printdata", "printdatafile"),
                     CommandAliasesPair(&Commands::printDataRaw, "printdataraw", "printdatahex"),
                     CommandAliasesPair(&Commands::format, "format"),
@@ -75,11 +82,42 @@ protected:
         }
     };
 
+    /// @brief File of sensor data entries, compressed into blocks of one sector each by
+    /// BlockCodec. Records never span blocks, so that blocks can be decoded and cut from the tail
+    /// independently.
     class SensorFile final : fs::FIFOFile
     {
-        fs::NVS::Value<size_t> reader;
+        static_assert(BlockCodec::blockSize == sectorDataSize, "Blocks must be sector aligned.");
 
-        size_t cutTail(size_t cutSize);
+        /// @brief Tracks the entries not yet uploaded. Entries are always uploaded in order, so
+        /// these form a suffix of the file, starting at the reader.
+        struct UploadIndex
+        {
+            /// @brief Address of the record of the first unuploaded entry.
+            size_t reader;
+            /// @brief Amount of entries from the reader up to the end of the file.
+            size_t unuploaded;
+            /// @brief Head and size of the file at the time the index was last updated. If these
+            /// do not match the file on opening (e.g. after a crash between writing the index and
+            /// flushing the file), the index is stale and rebuilt from the uploaded flags of the
+            /// entries.
+            size_t head;
+            size_t size;
+        };
+        fs::NVS::Value<UploadIndex> index;
+        /// @brief Version of the entry layout the stored entries were written with.
+        fs::NVS::Value<uint8_t> version;
+        /// @brief Current version of the entry layout. Stored entries of other versions are
+        /// discarded when the file is opened.
+        static constexpr uint8_t currentVersion{3};
+        /// @brief Codec state after the last record of the last block, to append records to it.
+        /// Only loaded once something is pushed.
+        std::unique_ptr<BlockCodec> appender;
+
+        void onCutTail(size_t cutSize);
+        void rebuildIndex();
+        void updateIndex();
+        void loadAppender();
 
     public:
         struct DataEntry
@@ -89,69 +127,148 @@ protected:
                 uint8_t nValues : 7;
                 bool uploaded : 1;
             };
-            using SensorValueArray = Message<SENSOR_DATA>::SensorValueArray;
+            using SensorValues = Message<SENSOR_DATA>::SensorValues;
 
             MACAddress source;
             uint32_t time;
             Flags flags;
-            SensorValueArray values;
+            SensorValues values;
 
             static constexpr size_t flagsPosition = sizeof(source) + sizeof(time);
+            static constexpr size_t valuesPosition = flagsPosition + sizeof(flags);
 
-            static constexpr size_t getSize(Flags flags)
+            /// @return The size of the entry when sent, which only includes the values in use.
+            size_t getSize() const { return valuesPosition + values.getLength(); }
+        } __attribute__((packed));
+
+        class Iterator;
+        /// @brief View of the entry an Iterator decoded, which refers to it rather than copying its
+        /// values. Only valid as long as the iterator stays at the entry.
+        class EntryView
+        {
+            const BlockCodec::Entry* entry;
+
+            EntryView(const BlockCodec::Entry& entry) : entry{&entry} {}
+
+        public:
+            MACAddress getSource() const { return MACAddress(entry->source); }
+            uint32_t getTime() const { return entry->time; }
+            bool isUploaded() const { return entry->uploaded; }
+            /// @return The encoded values (see SensorEncoding.h), without their size prefix.
+            const uint8_t* getValues() const { return entry->values; }
+            /// @return The amount of bytes of encoded values.
+            size_t getValuesSize() const { return entry->valuesSize; }
+            /// @return The size of the entry when sent, see DataEntry::getSize.
+            size_t getSize() const
             {
-                return sizeof(source) + sizeof(time) + sizeof(flags) +
-                       flags.nValues * sizeof(SensorValue);
+                return DataEntry::valuesPosition + sizeof(entry->valuesSize) + entry->valuesSize;
             }
-            constexpr size_t getSize() const { return getSize(flags); }
-        } __attribute__((packed));
+            /// @brief Writes the entry in the layout in which it is sent, i.e. that of a DataEntry
+            /// up to the values in use.
+            /// @param buffer Buffer of at least getSize() bytes.
+            /// @return The size of the entry.
+            size_t copyTo(uint8_t* buffer) const;
+
+            friend class Iterator;
+        };
 
         SensorFile();
 
         using FIFOFile::getMaxSize;
         using FIFOFile::getSize;
+        /// @brief Logs the flash operations and cache accesses of the file since it was opened, and
+        /// the NVS operations since boot.
+        void logStats() const;
 
-        using FIFOFile::read;
-
+        /// @brief Decodes the entries of the file in order. Holds a copy of the block being
+        /// decoded.
         class Iterator
         {
-            size_t address;
+            struct Block
+            {
+                std::array<uint8_t, BlockCodec::blockSize> data;
+                size_t address;
+                /// @brief The amount of bytes of the block that are part of the file.
+                size_t size;
+                BlockCodec codec;
+                /// @brief The entry decoded from the record at the iterator's address.
+                BlockCodec::Entry entry;
+            };
             const SensorFile* file;
-            Iterator(size_t address, const SensorFile* file) : address{address}, file{file} {}
+            std::unique_ptr<Block> block;
+            /// @brief Address of the current record, or the size of the file at the end.
+            size_t address;
+            /// @brief Address following the current record.
+            size_t next;
+
+            /// @brief Constructs an iterator to the first record at or after the given address.
+            Iterator(size_t address, const SensorFile* file);
+            void load(size_t blockAddress);
+            /// @brief Decodes the record at the current address, moving on to the next block if
+            /// the current one holds no more records.
+            void decode();
 
         public:
             Iterator& operator++();
             bool operator!=(const Iterator& other) const { return this->address != other.address; }
-            DataEntry operator*() const { return file->read<DataEntry>(address); }
+            EntryView operator*() const { return EntryView(block->entry); }
 
             friend class SensorFile;
         };
 
+    private:
+        /// @brief Iterator at the unuploaded entry last returned by getUnuploaded, and the index
+        /// of that entry, so that consecutive entries are decoded from where it left off.
+        std::optional<Iterator> cursor;
+        size_t cursorIndex{0};
+        /// @brief Iterator at the reader, with which setUploaded moves on to the next entry.
+        std::optional<Iterator> uploader;
+
+    public:
         Iterator begin() const { return Iterator(0, this); };
         Iterator end() const { return Iterator(getSize(), this); };
-        std::optional<size_t> getUnuploadedAddress(size_t index);
-        std::optional<DataEntry> getUnuploaded(size_t index);
+        /// @return A view of the unuploaded entry at the given index, counted from the reader,
+        /// which stays valid until the file is changed or this is called again.
+        std::optional<EntryView> getUnuploaded(size_t index);
         bool isLast(size_t index);
 
         void push(const Message<SENSOR_DATA>& message);
-        void push(const DataEntry& entry) { FIFOFile::push(&entry, entry.getSize()); }
+        /// @brief Pushes all entries of a batch message, with the message's source as their source.
+        void push(const Message<SENSOR_DATA_BATCH>& message);
+        void push(const DataEntry& entry);
         void setUploaded();
 
         void flush();
     };
 
-    /// @brief Enters deep sleep for the specified time.
+    /// @brief Enters deep sleep for the specified time. The RTC is first set to the system time, if
+    /// it was corrected (see correctTime).
     /// @param sleepTime The time in seconds to sleep.
     void deepSleep(uint32_t sleepTime);
-    /// @brief Enters deep sleep until the specified time.
-    /// @param untilTime The time (UNIX epoch, seconds) the module should wake.
-    void deepSleepUntil(uint32_t untilTime);
+    /// @brief Sets the system time to the time of the RTC, corrected by the offset the RTC is
+    /// estimated to have drifted since its last correction (see ClockDrift). The system time then
+    /// counts the ms in between the seconds of the RTC with the ESP32's timer.
+    /// @param align Whether to wait for the edge of the RTC's next second, for up to a second, so
+    /// that the system time is exact to the ms. Otherwise, the system time is up to a second
+    /// behind, and the drift of the RTC is not measured by the corrections that follow until the
+    /// next deep sleep. Does nothing if the system time was corrected since the RTC was last set.
+    void syncTime(bool align);
+    /// @brief Sets the system time to a time just received from the gateway, from which the drift
+    /// of the RTC is estimated. The RTC itself is set before the next deep sleep.
+    /// @param time The time (UNIX epoch, ms) of the gateway.
+    void correctTime(uint64_t time);
+    const ClockDrift& getClockDrift() const;
+
+    /// @brief Enters deep sleep until the specified time, compensated for the drift of the RTC.
+    /// The module wakes within about a second of it, as deep sleep counts whole seconds.
+    /// @param untilTime The time (UNIX epoch, ms) the module should wake.
+    void deepSleepUntil(uint64_t untilTime);
     /// @brief Enters light sleep for the specified time.
     /// @param sleepTime The time in seconds to sleep.
     void lightSleep(float sleepTime);
     /// @brief Enters light sleep until the specified time.
-    /// @param untilTime The time (UNIX epoch, seconds) the module should wake.
-    void lightSleepUntil(uint32_t untilTime);
+    /// @param untilTime The time (UNIX epoch, ms) the module should wake.
+    void lightSleepUntil(uint64_t untilTime);
 
     /// @brief Gracefully shuts down the dependencies. This function can be thought of as a
     /// counterpoint to MIRRAModule::prepare.
@@ -166,6 +283,17 @@ protected:
     LoRaModule lora;
 
     CommandEntry commandEntry;
+
+private:
+    /// @brief Offset in ms of the RTC from the system time, disengaged if the system time was not
+    /// aligned with the RTC since the last deep sleep (see syncTime). 0 once the system time is
+    /// corrected, as the RTC is set to it before the next deep sleep.
+    std::optional<int32_t> rtcOffset;
+    /// @brief Whether the system time was corrected since the RTC was last set (see correctTime).
+    bool rtcOutdated{false};
+    /// @brief Sets the RTC to the system time, on the edge of the next second of the system time,
+    /// as the RTC only counts whole seconds.
+    void writeRTC();
 };
 };
 
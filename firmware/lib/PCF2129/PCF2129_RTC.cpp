@@ -46,6 +46,23 @@ uint32_t PCF2129_RTC::readTimeEpoch()
     return mktime(&now);
 }
 
+uint32_t PCF2129_RTC::awaitSecond()
+{
+    auto readSeconds{[this]() {
+        Wire.beginTransmission(address);
+        Wire.write(PCF2129_SECONDS);
+        Wire.endTransmission();
+        Wire.requestFrom(address, (uint8_t)1);
+        while (!Wire.available())
+            ;
+        return static_cast<uint8_t>(Wire.read() & 0x7F); // (highest bit is the OSF flag)
+    }};
+    uint8_t seconds{readSeconds()};
+    while (readSeconds() == seconds)
+        ;
+    return readTimeEpoch();
+}
+
 void PCF2129_RTC::writeTime(const tm& datetime)
 {
     Wire.beginTransmission(address);
@@ -95,4 +112,17 @@ void PCF2129_RTC::setSysTime()
 {
     timeval ctime{static_cast<time_t>(readTimeEpoch()), 0};
     settimeofday(&ctime, nullptr);
-}
\ No newline at end of file
+}
+uint64_t PCF2129_RTC::getSysTimeMs()
+{
+    timeval ctime;
+    gettimeofday(&ctime, nullptr);
+    return static_cast<uint64_t>(ctime.tv_sec) * 1000 + ctime.tv_usec / 1000;
+}
+
+void PCF2129_RTC::setSysTimeMs(uint64_t timeMs)
+{
+    timeval ctime{static_cast<time_t>(timeMs / 1000),
+                  static_cast<suseconds_t>(timeMs % 1000 * 1000)};
+    settimeofday(&ctime, nullptr);
+}
@@ -43,6 +43,9 @@ public:
     struct tm readTime();
     /// @return Returns the UNIX epoch in seconds as read from the RTC.
     uint32_t readTimeEpoch();
+    /// @brief Waits for the RTC to count its next second, by polling its seconds register.
+    /// @return The UNIX epoch in seconds the RTC counted to.
+    uint32_t awaitSecond();
 
     void enableAlarm();
     /// @brief Writes an alarm to the RTC with the given time. The alarm can't be further away than
@@ -65,6 +68,12 @@ public:
     void setSysTime();
     /// @return The system time.
     uint32_t getSysTime() { return static_cast<uint32_t>(time(nullptr)); }
+    /// @return The system time in ms (UNIX epoch), which the ESP32 counts with its own timer in
+    /// between the seconds of the RTC.
+    uint64_t getSysTimeMs();
+    /// @brief Sets the system time, but not the RTC.
+    /// @param timeMs The time in ms (UNIX epoch).
+    void setSysTimeMs(uint64_t timeMs);
 
     /// @return The pin to which the RTC's interrupt pin is connected.
     uint8_t getIntPin() { return intPin; };
@@ -0,0 +1,434 @@
+#include "SensorCompression.h"
+
+#include <cstring>
+
+/// @brief Writes bit fields, most significant bit first.
+class BlockCodec::BitWriter
+{
+    uint8_t* buffer;
+    size_t position{0};
+
+public:
+    BitWriter(uint8_t* buffer) : buffer{buffer} {}
+
+    void write(uint32_t value, size_t bits)
+    {
+        while (bits > 0)
+        {
+            size_t offset{position % 8};
+            size_t toWrite{bits < 8 - offset ? bits : 8 - offset};
+            uint8_t chunk = (value >> (bits - toWrite)) & ((1 << toWrite) - 1);
+            if (offset == 0)
+                buffer[position / 8] = 0;
+            buffer[position / 8] |= chunk << (8 - offset - toWrite);
+            position += toWrite;
+            bits -= toWrite;
+        }
+    }
+    /// @return The amount of bytes written, including the padding of the last byte.
+    size_t getSize() const { return (position + 7) / 8; }
+};
+
+/// @brief Reads bit fields written by BitWriter, failing rather than reading beyond the buffer.
+class BlockCodec::BitReader
+{
+    const uint8_t* buffer;
+    size_t size;
+    size_t position{0};
+
+public:
+    BitReader(const uint8_t* buffer, size_t size) : buffer{buffer}, size{size} {}
+
+    bool read(uint32_t& value, size_t bits)
+    {
+        if (position + bits > size * 8)
+            return false;
+        value = 0;
+        while (bits > 0)
+        {
+            size_t offset{position % 8};
+            size_t toRead{bits < 8 - offset ? bits : 8 - offset};
+            value = (value << toRead) |
+                    ((buffer[position / 8] >> (8 - offset - toRead)) & ((1 << toRead) - 1));
+            position += toRead;
+            bits -= toRead;
+        }
+        return true;
+    }
+    size_t getSize() const { return (position + 7) / 8; }
+};
+
+namespace
+{
+/// @brief Buckets of the delta-of-delta timestamp encoding: a prefix of n ones and a zero (no
+/// zero for the last bucket) is followed by a signed value of the bucket's width.
+constexpr size_t timeBucketBits[]{7, 9, 12, 32};
+constexpr size_t nTimeBuckets{sizeof(timeBucketBits) / sizeof(timeBucketBits[0])};
+
+size_t countLeadingZeroes(uint32_t value, size_t bits)
+{
+    size_t n{0};
+    for (uint32_t mask = 1u << (bits - 1); mask != 0 && !(value & mask); mask >>= 1)
+        n++;
+    return n;
+}
+
+size_t countTrailingZeroes(uint32_t value)
+{
+    size_t n{0};
+    for (; n < 32 && !(value & (1u << n)); n++)
+        ;
+    return n;
+}
+
+uint32_t mask(size_t bits)
+{
+    return bits >= 32 ? UINT32_MAX : (1u << bits) - 1;
+}
+
+/// @return The width of the fields holding the leading zeroes and meaningful bits of a XOR.
+size_t getWindowFieldBits(size_t valueBits)
+{
+    return valueBits > 16 ? 5 : 4;
+}
+
+int32_t signExtend(uint32_t value, size_t bits)
+{
+    return bits >= 32 ? static_cast<int32_t>(value)
+                      : static_cast<int32_t>(value << (32 - bits)) >> (32 - bits);
+}
+}
+
+size_t BlockCodec::Entry::countValues() const
+{
+    size_t n{0};
+    for (size_t position{0};
+         position < valuesSize && position + getEncodedSize(values[position]) <= valuesSize;
+         position += getEncodedSize(values[position]))
+        n++;
+    return n;
+}
+
+size_t BlockCodec::getHeaderOffset(const uint8_t* record)
+{
+    return (record[0] & defineFlag) ? 1 + sourceSize : 1;
+}
+
+void BlockCodec::reset()
+{
+    for (Source& source : sources)
+        source = Source{{}, false, false, 0, 0, 0};
+    for (Stream& stream : streams)
+        stream = Stream{none, 0, 0, none, none, none, 0, 0};
+    uses = 0;
+}
+
+uint8_t BlockCodec::findSlot(const uint8_t* address, bool& defined) const
+{
+    uint8_t slot{0};
+    for (uint8_t i{0}; i < maxSources; i++)
+    {
+        if (sources[i].defined && std::memcmp(sources[i].address, address, sourceSize) == 0)
+        {
+            defined = true;
+            return i;
+        }
+        if (!sources[i].defined)
+            slot = sources[slot].defined ? i : slot;
+        else if (sources[slot].defined && sources[i].lastUse < sources[slot].lastUse)
+            slot = i;
+    }
+    defined = false;
+    return slot;
+}
+
+void BlockCodec::defineSource(uint8_t slot, const uint8_t* address)
+{
+    Source& source{sources[slot]};
+    std::memcpy(source.address, address, sourceSize);
+    source.defined = true;
+    source.hasTime = false;
+    for (Stream& stream : streams)
+    {
+        if (stream.source == slot)
+            stream.source = none;
+    }
+}
+
+BlockCodec::Stream* BlockCodec::findPosition(uint8_t slot, uint8_t position)
+{
+    for (Stream& stream : streams)
+    {
+        if (stream.source == slot && stream.position == position)
+            return &stream;
+    }
+    return nullptr;
+}
+
+BlockCodec::Stream& BlockCodec::selectStream(uint8_t slot, uint8_t position, bool same,
+                                             uint8_t typeTag, uint8_t instanceTag)
+{
+    Stream* previous{findPosition(slot, position)};
+    if (same)
+        return *previous;
+    if (previous)
+        previous->position = none;
+
+    Stream* selected{nullptr};
+    for (Stream& stream : streams)
+    {
+        if (stream.source == slot && stream.typeTag == typeTag &&
+            stream.instanceTag == instanceTag)
+        {
+            selected = &stream;
+            break;
+        }
+        // otherwise take a free stream, or else the least recently used one
+        if (!selected || (selected->source != none &&
+                          (stream.source == none || stream.lastUse < selected->lastUse)))
+            selected = &stream;
+    }
+    if (selected->source != slot || selected->typeTag != typeTag ||
+        selected->instanceTag != instanceTag)
+        *selected = Stream{slot, typeTag, instanceTag, none, none, none, 0, 0};
+    selected->position = position;
+    return *selected;
+}
+
+size_t BlockCodec::encode(uint8_t* buffer, const Entry& entry)
+{
+    bool defined;
+    uint8_t slot{findSlot(entry.source, defined)};
+    size_t size{0};
+    if (defined)
+    {
+        buffer[size++] = slot;
+    }
+    else
+    {
+        defineSource(slot, entry.source);
+        buffer[size++] = slot | defineFlag;
+        std::memcpy(&buffer[size], entry.source, sourceSize);
+        size += sourceSize;
+    }
+    Source& source{sources[slot]};
+    source.lastUse = uses;
+
+    uint8_t& header{buffer[size++]};
+    header = entry.uploaded ? 0 : pendingBit;
+    BitWriter bits{&buffer[size]};
+
+    if (!source.hasTime)
+    {
+        bits.write(entry.time, 32);
+        source.delta = 0;
+        source.hasTime = true;
+    }
+    else
+    {
+        int32_t delta = static_cast<int32_t>(entry.time - source.time);
+        int32_t deltaOfDelta = static_cast<int32_t>(static_cast<uint32_t>(delta) -
+                                                    static_cast<uint32_t>(source.delta));
+        if (deltaOfDelta == 0)
+        {
+            bits.write(0, 1);
+        }
+        else
+        {
+            for (size_t bucket{0}; bucket < nTimeBuckets; bucket++)
+            {
+                size_t width{timeBucketBits[bucket]};
+                if (bucket + 1 == nTimeBuckets || signExtend(deltaOfDelta & mask(width), width) ==
+                                                      deltaOfDelta)
+                {
+                    bits.write(mask(bucket + 1), bucket + 1); // ones of the prefix
+                    if (bucket + 1 < nTimeBuckets)
+                        bits.write(0, 1);
+                    bits.write(static_cast<uint32_t>(deltaOfDelta) & mask(width), width);
+                    break;
+                }
+            }
+        }
+        source.delta = delta;
+    }
+    source.time = entry.time;
+
+    uint8_t nValues{0};
+    for (size_t position{0};
+         position < entry.valuesSize &&
+         position + getEncodedSize(entry.values[position]) <= entry.valuesSize;
+         position += getEncodedSize(entry.values[position]), nValues++)
+    {
+        const uint8_t* value{&entry.values[position]};
+        size_t valueBits{getValueEncoding(value[0]).getSize() * 8};
+        Stream* previous{findPosition(slot, nValues)};
+        bool same{previous && previous->typeTag == value[0] && previous->instanceTag == value[1]};
+        bits.write(same ? 0 : 1, 1);
+        if (!same)
+        {
+            bits.write(value[0], 8);
+            bits.write(value[1], 8);
+        }
+        Stream& stream{selectStream(slot, nValues, same, value[0], value[1])};
+        stream.lastUse = uses;
+
+        uint32_t raw{0};
+        std::memcpy(&raw, &value[2], valueBits / 8); // little endian
+        uint32_t xored{raw ^ stream.value};
+        if (xored == 0)
+        {
+            bits.write(0, 1);
+        }
+        else
+        {
+            size_t leading{countLeadingZeroes(xored, valueBits)};
+            size_t trailing{countTrailingZeroes(xored)};
+            if (stream.leading != none && leading >= stream.leading &&
+                trailing >= stream.trailing)
+            {
+                bits.write(0b10, 2);
+                bits.write(xored >> stream.trailing, valueBits - stream.leading - stream.trailing);
+            }
+            else
+            {
+                size_t meaningful{valueBits - leading - trailing};
+                bits.write(0b11, 2);
+                bits.write(leading, getWindowFieldBits(valueBits));
+                bits.write(meaningful - 1, getWindowFieldBits(valueBits));
+                bits.write(xored >> trailing, meaningful);
+                stream.leading = leading;
+                stream.trailing = trailing;
+            }
+        }
+        stream.value = raw;
+    }
+    header |= nValues;
+    uses++;
+    return size + bits.getSize();
+}
+
+size_t BlockCodec::decode(const uint8_t* buffer, size_t size, Entry& entry)
+{
+    if (size < 2 || buffer[0] == endCode || (buffer[0] & ~defineFlag) >= maxSources)
+        return 0;
+    uint8_t slot = buffer[0] & ~defineFlag;
+    size_t offset{getHeaderOffset(buffer)};
+    if (offset + 1 > size)
+        return 0;
+    if (buffer[0] & defineFlag)
+        defineSource(slot, &buffer[1]);
+    else if (!sources[slot].defined)
+        return 0;
+    Source& source{sources[slot]};
+    source.lastUse = uses;
+    std::memcpy(entry.source, source.address, sourceSize);
+
+    uint8_t header{buffer[offset++]};
+    entry.uploaded = !(header & pendingBit);
+    uint8_t nValues = header & ~pendingBit;
+    BitReader bits{&buffer[offset], size - offset};
+    uint32_t field;
+
+    if (!source.hasTime)
+    {
+        if (!bits.read(field, 32))
+            return 0;
+        source.time = field;
+        source.delta = 0;
+        source.hasTime = true;
+    }
+    else
+    {
+        size_t bucket{0};
+        for (; bucket < nTimeBuckets; bucket++)
+        {
+            if (!bits.read(field, 1))
+                return 0;
+            if (field == 0)
+                break;
+        }
+        int32_t deltaOfDelta{0};
+        if (bucket > 0)
+        {
+            size_t width{timeBucketBits[bucket - 1]};
+            if (!bits.read(field, width))
+                return 0;
+            deltaOfDelta = signExtend(field, width);
+        }
+        source.delta = static_cast<int32_t>(static_cast<uint32_t>(source.delta) +
+                                            static_cast<uint32_t>(deltaOfDelta));
+        source.time += source.delta;
+    }
+    entry.time = source.time;
+
+    entry.valuesSize = 0;
+    for (uint8_t position{0}; position < nValues; position++)
+    {
+        uint8_t typeTag, instanceTag;
+        if (!bits.read(field, 1))
+            return 0;
+        bool same{field == 0};
+        if (same)
+        {
+            Stream* previous{findPosition(slot, position)};
+            if (!previous)
+                return 0;
+            typeTag = previous->typeTag;
+            instanceTag = previous->instanceTag;
+        }
+        else
+        {
+            if (!bits.read(field, 8))
+                return 0;
+            typeTag = field;
+            if (!bits.read(field, 8))
+                return 0;
+            instanceTag = field;
+        }
+        size_t valueBits{getValueEncoding(typeTag).getSize() * 8};
+        if (entry.valuesSize + 2 + valueBits / 8 > maxValuesSize)
+            return 0;
+        Stream& stream{selectStream(slot, position, same, typeTag, instanceTag)};
+        stream.lastUse = uses;
+
+        if (!bits.read(field, 1))
+            return 0;
+        if (field == 1)
+        {
+            if (!bits.read(field, 1))
+                return 0;
+            size_t leading, trailing;
+            if (field == 0)
+            {
+                if (stream.leading == none)
+                    return 0;
+                leading = stream.leading;
+                trailing = stream.trailing;
+            }
+            else
+            {
+                if (!bits.read(field, getWindowFieldBits(valueBits)))
+                    return 0;
+                leading = field;
+                if (!bits.read(field, getWindowFieldBits(valueBits)))
+                    return 0;
+                if (leading + field + 1 > valueBits)
+                    return 0;
+                trailing = valueBits - leading - (field + 1);
+                stream.leading = leading;
+                stream.trailing = trailing;
+            }
+            if (!bits.read(field, valueBits - leading - trailing))
+                return 0;
+            stream.value ^= field << trailing;
+        }
+
+        uint8_t* value{&entry.values[entry.valuesSize]};
+        value[0] = typeTag;
+        value[1] = instanceTag;
+        std::memcpy(&value[2], &stream.value, valueBits / 8); // little endian
+        entry.valuesSize += 2 + valueBits / 8;
+    }
+    uses++;
+    return offset + bits.getSize();
+}
@@ -0,0 +1,137 @@
+#ifndef __SENSOR_COMPRESSION_H__
+#define __SENSOR_COMPRESSION_H__
+
+#include "SensorEncoding.h"
+#include <cstddef>
+#include <cstdint>
+
+/// @brief Compresses sensor data entries into independently decodable blocks, after Facebook's
+/// Gorilla time series format. Per source, timestamps are stored as the difference between
+/// successive timestamp deltas, and per stream of values (source, type tag, instance tag), each
+/// encoded value (see SensorEncoding.h) is stored as its XOR with the stream's previous value.
+///
+/// A block is a sequence of byte-aligned records, which are bit-packed internally:
+/// `[code 1]:[source 6, only when defining a source]:[header 1]:[bits]`
+/// The code is the slot of the entry's source in the block's source table, optionally flagged
+/// as (re)defining the slot. The header holds the amount of values and a pending flag, which is
+/// cleared once the entry is uploaded. A code of 0xFF (i.e. erased flash) ends the block.
+///
+/// All state is reset at the start of every block, so that blocks can be decoded and discarded
+/// independently. The encoder and decoder update their state in exactly the same way, so the
+/// state tables need not be stored.
+class BlockCodec
+{
+public:
+    /// @brief Size of a block, which fills the data of a sector of the data file after its header
+    /// (see fs::FIFOFile).
+    static constexpr size_t blockSize{4080};
+    static constexpr size_t sourceSize{6};
+    /// @brief Maximum size in bytes of the encoded values of an entry.
+    static constexpr size_t maxValuesSize{UINT8_MAX};
+    /// @brief Code marking the end of the records in a block, as read from erased flash.
+    static constexpr uint8_t endCode{0xFF};
+    /// @brief Bits of the largest timestamp and value encodings, including their control bits.
+    static constexpr size_t maxTimeBits{4 + 32};
+    static constexpr size_t maxValueBits{1 + 16 + 2 + 5 + 5 + 32};
+    /// @brief Bit of the record header that is set as long as the entry has not been uploaded.
+    /// Uploading an entry only clears this bit, so that flash can be updated without erasing.
+    static constexpr uint8_t pendingBit{0x80};
+
+    /// @brief An uncompressed sensor data entry.
+    struct Entry
+    {
+        uint8_t source[sourceSize];
+        uint32_t time;
+        bool uploaded;
+        /// @brief The amount of bytes of encoded values in use.
+        uint8_t valuesSize;
+        /// @brief Encoded values, in the format of EncodedSensorValues.
+        uint8_t values[maxValuesSize];
+
+        /// @return The amount of values held.
+        size_t countValues() const;
+    };
+
+    /// @return The maximum size in bytes of the record of an entry with the given amount of
+    /// values, regardless of the state of the block.
+    static constexpr size_t getMaxRecordSize(size_t nValues)
+    {
+        return 1 + sourceSize + 1 + (maxTimeBits + nValues * maxValueBits + 7) / 8;
+    }
+    /// @brief Maximum size in bytes of any record.
+    static constexpr size_t maxRecordSize{
+        1 + sourceSize + 1 + (maxTimeBits + maxValuesSize / 4 * maxValueBits + 7) / 8};
+
+    /// @param record Pointer to the start of a record.
+    /// @return The offset of the header in the record.
+    static size_t getHeaderOffset(const uint8_t* record);
+
+    BlockCodec() { reset(); }
+
+    /// @brief Resets the state, to be done at the start of every block.
+    void reset();
+    /// @brief Compresses an entry into a record, updating the state.
+    /// @param buffer Buffer to write the record to. Must hold at least
+    /// getMaxRecordSize(entry.countValues()) bytes.
+    /// @return The size of the record in bytes.
+    size_t encode(uint8_t* buffer, const Entry& entry);
+    /// @brief Decompresses a record, updating the state.
+    /// @param buffer Buffer holding the record.
+    /// @param size The amount of bytes available in the buffer.
+    /// @param entry The decompressed entry.
+    /// @return The size of the record in bytes, or 0 if the block ends here, be it through its end
+    /// code or through malformed data.
+    size_t decode(const uint8_t* buffer, size_t size, Entry& entry);
+
+private:
+    static constexpr size_t maxSources{16};
+    static constexpr size_t maxStreams{64};
+    static constexpr uint8_t defineFlag{0x80};
+    static constexpr uint8_t none{0xFF};
+
+    struct Source
+    {
+        uint8_t address[sourceSize];
+        bool defined;
+        bool hasTime;
+        uint16_t lastUse;
+        uint32_t time;
+        int32_t delta;
+    };
+    struct Stream
+    {
+        /// @brief Slot of the source of the stream, or none if the stream is unused.
+        uint8_t source;
+        uint8_t typeTag;
+        uint8_t instanceTag;
+        /// @brief Position of the stream's value in the last entry of its source, or none.
+        uint8_t position;
+        /// @brief Leading and trailing zeroes of the last stored XOR, or none if there is none.
+        uint8_t leading;
+        uint8_t trailing;
+        uint16_t lastUse;
+        uint32_t value;
+    };
+    class BitWriter;
+    class BitReader;
+
+    Source sources[maxSources];
+    Stream streams[maxStreams];
+    /// @brief The amount of records in the block so far, used to find the least recently used
+    /// sources and streams.
+    uint16_t uses{0};
+
+    /// @return The slot to store the given source in: its current slot if it has one, else a free
+    /// or the least recently used one.
+    uint8_t findSlot(const uint8_t* address, bool& defined) const;
+    void defineSource(uint8_t slot, const uint8_t* address);
+    /// @brief Selects the stream of the value at the given position of an entry.
+    /// @param same Whether the value has the same tags as the value at the same position of the
+    /// previous entry of the source, in which case the tags are not used.
+    Stream& selectStream(uint8_t slot, uint8_t position, bool same, uint8_t typeTag,
+                         uint8_t instanceTag);
+    /// @return The stream of the value at the given position in the last entry of the source.
+    Stream* findPosition(uint8_t slot, uint8_t position);
+};
+
+#endif
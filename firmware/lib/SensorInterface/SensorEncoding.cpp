@@ -0,0 +1,130 @@
+#include "SensorEncoding.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+/// @brief Raw fixed point value reserved for NaN.
+constexpr int16_t fixedNaN{INT16_MIN};
+
+int16_t toFixed16(float value, const ValueEncoding& encoding)
+{
+    if (std::isnan(value))
+        return fixedNaN;
+    float raw{std::round((value - encoding.offset) / encoding.scale)};
+    return static_cast<int16_t>(std::fmax(std::fmin(raw, INT16_MAX), INT16_MIN + 1));
+}
+
+float fromFixed16(int16_t raw, const ValueEncoding& encoding)
+{
+    if (raw == fixedNaN)
+        return NAN;
+    return raw * encoding.scale + encoding.offset;
+}
+
+/// @brief Converts to half precision, rounding to nearest and saturating to the largest finite
+/// half precision value rather than overflowing to infinity.
+uint16_t toFloat16(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+    if (((bits >> 23) & 0xFF) == 0xFF) // infinity or NaN
+        return sign | 0x7C00 | (mantissa != 0 ? 0x200 : 0);
+    if (exponent >= 0x1F)
+        return sign | 0x7BFF;
+    if (exponent <= 0) // subnormal
+    {
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        uint32_t shift = 14 - exponent;
+        return sign | ((mantissa + (1 << (shift - 1))) >> shift);
+    }
+    uint16_t half = sign | (exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000)
+        half++; // may carry into the exponent, which is still correctly rounded
+    return (half & 0x7FFF) == 0x7C00 ? sign | 0x7BFF : half;
+}
+
+float fromFloat16(uint16_t half)
+{
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    if (exponent == 0) // zero or subnormal
+    {
+        float value{std::ldexp(static_cast<float>(mantissa), -24)};
+        return sign ? -value : value;
+    }
+    uint32_t bits = sign | (exponent == 0x1F ? 0x7F800000 | (mantissa << 13)
+                                             : ((exponent - 15 + 127) << 23) | (mantissa << 13));
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+}
+
+size_t encodeSensorValue(uint8_t* buffer, const SensorValue& value)
+{
+    const ValueEncoding encoding{getValueEncoding(value.typeTag)};
+    buffer[0] = value.typeTag;
+    buffer[1] = value.instanceTag;
+    switch (encoding.format)
+    {
+    case ValueFormat::FIXED16:
+    {
+        int16_t raw{toFixed16(value.value, encoding)};
+        std::memcpy(&buffer[2], &raw, sizeof(raw));
+        break;
+    }
+    case ValueFormat::FLOAT16:
+    {
+        uint16_t raw{toFloat16(value.value / encoding.scale)};
+        std::memcpy(&buffer[2], &raw, sizeof(raw));
+        break;
+    }
+    case ValueFormat::FLOAT32:
+    {
+        float raw{value.value};
+        std::memcpy(&buffer[2], &raw, sizeof(raw));
+        break;
+    }
+    }
+    return 2 + encoding.getSize();
+}
+
+size_t decodeSensorValue(const uint8_t* buffer, SensorValue& value)
+{
+    const ValueEncoding encoding{getValueEncoding(buffer[0])};
+    value.typeTag = buffer[0];
+    value.instanceTag = buffer[1];
+    switch (encoding.format)
+    {
+    case ValueFormat::FIXED16:
+    {
+        int16_t raw;
+        std::memcpy(&raw, &buffer[2], sizeof(raw));
+        value.value = fromFixed16(raw, encoding);
+        break;
+    }
+    case ValueFormat::FLOAT16:
+    {
+        uint16_t raw;
+        std::memcpy(&raw, &buffer[2], sizeof(raw));
+        value.value = fromFloat16(raw) * encoding.scale;
+        break;
+    }
+    case ValueFormat::FLOAT32:
+    {
+        float raw;
+        std::memcpy(&raw, &buffer[2], sizeof(raw));
+        value.value = raw;
+        break;
+    }
+    }
+    return 2 + encoding.getSize();
+}
@@ -0,0 +1,135 @@
+#ifndef __SENSOR_ENCODING_H__
+#define __SENSOR_ENCODING_H__
+
+#include "Sensor.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/// @brief Formats in which the value of a SensorValue can be stored and transmitted.
+enum class ValueFormat : uint8_t
+{
+    /// @brief IEEE 754 single precision float, for types without a known range.
+    FLOAT32,
+    /// @brief IEEE 754 half precision float of value / scale, for types spanning several orders of
+    /// magnitude.
+    FLOAT16,
+    /// @brief Signed 16-bit fixed point number, value = raw * scale + offset. The lowest raw value
+    /// is reserved for NaN.
+    FIXED16
+};
+
+/// @brief Describes how the values of a sensor type are encoded.
+struct ValueEncoding
+{
+    ValueFormat format;
+    float scale;
+    float offset;
+
+    /// @return The size of an encoded value in bytes, excluding the tags.
+    constexpr size_t getSize() const { return format == ValueFormat::FLOAT32 ? 4 : 2; }
+};
+
+/// @brief Registry of the encoding used for each sensor type, keyed by type tag. Types not listed
+/// here are stored as float32. The backend decodes measurements with a copy of this table
+/// (web/mirra_backend/crud/measurement.py), so both must be changed together.
+/// @param typeTag Type ID of the sensor.
+/// @return The encoding of the sensor type.
+constexpr ValueEncoding getValueEncoding(uint8_t typeTag)
+{
+    switch (typeTag)
+    {
+    case 1: // BATTERY_KEY, V: 1 mV resolution
+        return ValueEncoding{ValueFormat::FIXED16, 0.001f, 0};
+    case 3: // SOIL_MOISTURE_KEY, raw ADC reading (0 - 4095)
+        return ValueEncoding{ValueFormat::FIXED16, 1, 0};
+    case 4:  // SOIL_TEMPERATURE_KEY, °C: 0.01 °C resolution
+    case 12: // TEMP_SHT_KEY, °C
+        return ValueEncoding{ValueFormat::FIXED16, 0.01f, 0};
+    case 13: // HUMI_SHT_KEY, %RH: 0.01 %RH resolution
+        return ValueEncoding{ValueFormat::FIXED16, 0.01f, 0};
+    case 22: // LIGHT_KEY, lux: 0.05 % relative resolution up to 262 klux
+        return ValueEncoding{ValueFormat::FLOAT16, 4, 0};
+    case 100: // RANDOM_KEY (0 - 100)
+        return ValueEncoding{ValueFormat::FIXED16, 1, 0};
+    default:
+        return ValueEncoding{ValueFormat::FLOAT32, 1, 0};
+    }
+}
+
+/// @return The size in bytes of an encoded value of the given type, including its tags.
+constexpr size_t getEncodedSize(uint8_t typeTag)
+{
+    return 2 + getValueEncoding(typeTag).getSize();
+}
+/// @brief Maximum size in bytes of an encoded value, including its tags.
+static constexpr size_t maxEncodedSize{2 + 4};
+
+/// @brief Encodes a value as its type tag, instance tag and value in the format of its type.
+/// @param buffer Buffer to write the encoded value to. Must hold at least getEncodedSize bytes.
+/// @return The amount of bytes written.
+size_t encodeSensorValue(uint8_t* buffer, const SensorValue& value);
+/// @brief Decodes a value encoded with encodeSensorValue.
+/// @param buffer Buffer holding the encoded value.
+/// @param value The decoded value.
+/// @return The amount of bytes read.
+size_t decodeSensorValue(const uint8_t* buffer, SensorValue& value);
+
+/// @brief Size-prefixed buffer of encoded sensor values, stored and transmitted as is.
+/// @tparam capacity Maximum amount of bytes of encoded values held.
+template <size_t capacity> class EncodedSensorValues
+{
+    static_assert(capacity <= UINT8_MAX, "The size prefix is a single byte.");
+
+    /// @brief The amount of bytes in use.
+    uint8_t size{0};
+    uint8_t data[capacity]{};
+
+public:
+    class Iterator
+    {
+        const EncodedSensorValues* values;
+        size_t position;
+        SensorValue value{};
+
+        Iterator(const EncodedSensorValues* values, size_t position);
+        /// @brief Decodes the value at the current position.
+        void decode();
+
+    public:
+        Iterator& operator++();
+        bool operator!=(const Iterator& other) const { return position != other.position; }
+        const SensorValue& operator*() const { return value; }
+
+        friend class EncodedSensorValues;
+    };
+
+    /// @brief Appends a value, if there is enough space left.
+    /// @return Whether the value was appended.
+    bool push(const SensorValue& value);
+    /// @return The amount of values held.
+    size_t count() const;
+    /// @return The size in bytes of the values and their size prefix, i.e. the part of this object
+    /// that is in use.
+    constexpr size_t getLength() const { return sizeof(size) + size; }
+    /// @return The encoded values, without their size prefix.
+    const uint8_t* getData() const { return data; }
+    /// @return The amount of bytes of encoded values held.
+    size_t getSize() const { return size; }
+    /// @brief Replaces the values with already encoded ones.
+    /// @param encoded Buffer holding the encoded values.
+    /// @param encodedSize The amount of bytes of encoded values.
+    /// @return Whether the values fit.
+    bool assign(const uint8_t* encoded, size_t encodedSize);
+    /// @brief Clamps the size prefix to the capacity, for use on untrusted data.
+    constexpr void sanitize() { size = size > capacity ? capacity : size; }
+    /// @brief Removes all values.
+    void clear() { size = 0; }
+
+    Iterator begin() const { return Iterator(this, 0); }
+    Iterator end() const { return Iterator(this, size); }
+} __attribute__((packed));
+
+#include "SensorEncoding.tpp"
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __SENSOR_ENCODING_T__
+#define __SENSOR_ENCODING_T__
+
+template <size_t capacity>
+EncodedSensorValues<capacity>::Iterator::Iterator(const EncodedSensorValues* values,
+                                                  size_t position)
+    : values{values}, position{position}
+{
+    decode();
+}
+
+template <size_t capacity> void EncodedSensorValues<capacity>::Iterator::decode()
+{
+    // a value extending beyond the size can only stem from malformed data: end the iteration
+    if (position >= values->size ||
+        position + getEncodedSize(values->data[position]) > values->size)
+    {
+        position = values->size;
+        return;
+    }
+    decodeSensorValue(&values->data[position], value);
+}
+
+template <size_t capacity>
+typename EncodedSensorValues<capacity>::Iterator&
+EncodedSensorValues<capacity>::Iterator::operator++()
+{
+    position += getEncodedSize(values->data[position]);
+    decode();
+    return *this;
+}
+
+template <size_t capacity> bool EncodedSensorValues<capacity>::push(const SensorValue& value)
+{
+    if (size + getEncodedSize(value.typeTag) > capacity)
+        return false;
+    size += encodeSensorValue(&data[size], value);
+    return true;
+}
+
+template <size_t capacity>
+bool EncodedSensorValues<capacity>::assign(const uint8_t* encoded, size_t encodedSize)
+{
+    if (encodedSize > capacity)
+        return false;
+    std::memcpy(data, encoded, encodedSize);
+    size = encodedSize;
+    return true;
+}
+
+template <size_t capacity> size_t EncodedSensorValues<capacity>::count() const
+{
+    size_t n{0};
+    for (auto it{begin()}; it != end(); ++it)
+        n++;
+    return n;
+}
+
+#endif
@@ -0,0 +1,224 @@
+#include "SensorCompression.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// Host benchmark of the compressed SensorFile format. Packs sensor data entries into blocks the
+// way SensorFile does and reports the compression ratio against the uncompressed entry layouts,
+// along with how long the data partition retains entries at the measured rate.
+//
+// Recorded data can be supplied as the output of the `printdataraw` command (one hex encoded entry
+// per line): `compression_bench dump.txt`. Otherwise, entries are synthesised for a gateway with
+// the given amount of nodes: `compression_bench [days] [nodes]`.
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+/// @brief Size of the data held by the data partition (see partitions.csv), one block per sector.
+constexpr size_t partitionSize{1380 * 1024 / 4096 * BlockCodec::blockSize};
+/// @brief Size of the header of an uncompressed entry (source, time, flags).
+constexpr size_t entryHeaderSize{BlockCodec::sourceSize + 4 + 1};
+/// @brief Size of a value in the layout used before the compact value encoding.
+constexpr size_t floatValueSize{1 + 1 + 4};
+
+/// @brief Reads entries from a `printdataraw` dump, skipping lines that are not entries.
+std::vector<BlockCodec::Entry> readDump(const char* path)
+{
+    std::vector<BlockCodec::Entry> entries;
+    FILE* file{std::fopen(path, "r")};
+    if (!file)
+    {
+        std::perror(path);
+        return entries;
+    }
+    char line[2 * (entryHeaderSize + 1 + BlockCodec::maxValuesSize) + 8];
+    while (std::fgets(line, sizeof(line), file))
+    {
+        uint8_t raw[entryHeaderSize + 1 + BlockCodec::maxValuesSize];
+        size_t size{0};
+        unsigned int byte;
+        while (size < sizeof(raw) && std::sscanf(&line[2 * size], "%2x", &byte) == 1)
+            raw[size++] = byte;
+        if (size < entryHeaderSize + 1 || size != entryHeaderSize + 1 + raw[entryHeaderSize])
+            continue;
+        BlockCodec::Entry entry{};
+        std::memcpy(entry.source, raw, BlockCodec::sourceSize);
+        std::memcpy(&entry.time, &raw[BlockCodec::sourceSize], sizeof(entry.time));
+        entry.uploaded = raw[entryHeaderSize - 1] & 0x80;
+        entry.valuesSize = raw[entryHeaderSize];
+        std::memcpy(entry.values, &raw[entryHeaderSize + 1], entry.valuesSize);
+        entries.push_back(entry);
+    }
+    std::fclose(file);
+    return entries;
+}
+
+/// @brief Synthesises the entries a gateway receives from sensor nodes carrying the default
+/// sensors, sampling every 20 minutes and uploading every 2 hours.
+std::vector<BlockCodec::Entry> synthesise(size_t days, size_t nodes)
+{
+    static constexpr uint32_t start{1700000000};
+    static constexpr uint32_t sampleInterval{20 * 60};
+    static constexpr size_t samplesPerComm{6};
+    std::mt19937 rng{42};
+    std::normal_distribution<float> noise{0, 1};
+    std::vector<BlockCodec::Entry> entries;
+    std::vector<float> battery(nodes, 4.15f), moisture(nodes, 2000);
+    const size_t periods{days * 24 * 3600 / (sampleInterval * samplesPerComm)};
+    for (size_t period{0}; period < periods; period++)
+    {
+        for (size_t node{0}; node < nodes; node++)
+        {
+            for (size_t sample{0}; sample < samplesPerComm; sample++)
+            {
+                BlockCodec::Entry entry{};
+                const uint8_t source[BlockCodec::sourceSize]{0x24, 0x6F, 0x28, 0x00,
+                                                             static_cast<uint8_t>(node >> 8),
+                                                             static_cast<uint8_t>(node)};
+                std::memcpy(entry.source, source, sizeof(source));
+                // sensor nodes wake up to a second late
+                entry.time = start + (period * samplesPerComm + sample) * sampleInterval +
+                             (rng() % 4 == 0 ? 1 : 0);
+                float hour{std::fmod((entry.time - start) / 3600.0f + node * 0.1f, 24.0f)};
+                float day{std::sin((hour - 9) / 24 * 2 * static_cast<float>(M_PI))};
+                battery[node] -= 0.00002f;
+                moisture[node] += noise(rng) * 2;
+
+                EncodedSensorValues<BlockCodec::maxValuesSize> values;
+                values.push(SensorValue{1, 0, battery[node] + noise(rng) * 0.002f});
+                values.push(SensorValue{3, 0, std::round(moisture[node] + noise(rng) * 4)});
+                values.push(SensorValue{4, 0, 14 + 2 * day + noise(rng) * 0.03f});
+                values.push(SensorValue{12, 0, 16 + 8 * day + noise(rng) * 0.1f});
+                values.push(SensorValue{13, 0, 70 - 20 * day + noise(rng) * 0.5f});
+                values.push(
+                    SensorValue{22, 0, std::max(0.0f, 30000 * day) * (1 + noise(rng) * 0.05f)});
+                entry.valuesSize = values.getSize();
+                std::memcpy(entry.values, values.getData(), values.getSize());
+                entries.push_back(entry);
+            }
+        }
+    }
+    return entries;
+}
+
+/// @brief Packs entries into blocks like SensorFile::push.
+/// @return The blocks, concatenated.
+std::vector<uint8_t> compress(const std::vector<BlockCodec::Entry>& entries)
+{
+    std::vector<uint8_t> file;
+    BlockCodec codec;
+    uint8_t record[BlockCodec::maxRecordSize];
+    for (const BlockCodec::Entry& entry : entries)
+    {
+        size_t blockOffset{file.size() % BlockCodec::blockSize};
+        if (blockOffset > 0 && blockOffset + BlockCodec::getMaxRecordSize(entry.countValues()) >
+                                   BlockCodec::blockSize)
+        {
+            file.resize(file.size() + BlockCodec::blockSize - blockOffset, BlockCodec::endCode);
+            codec.reset();
+        }
+        size_t size{codec.encode(record, entry)};
+        file.insert(file.end(), record, record + size);
+    }
+    return file;
+}
+
+/// @brief Decodes all blocks like SensorFile::Iterator.
+/// @return The amount of entries that did not match the original ones.
+size_t verify(const std::vector<uint8_t>& file, const std::vector<BlockCodec::Entry>& entries)
+{
+    size_t mismatches{0};
+    size_t i{0};
+    BlockCodec codec;
+    BlockCodec::Entry entry;
+    for (size_t block{0}; block < file.size(); block += BlockCodec::blockSize)
+    {
+        codec.reset();
+        size_t blockEnd{std::min(block + BlockCodec::blockSize, file.size())};
+        for (size_t address{block}, size;
+             (size = codec.decode(&file[address], blockEnd - address, entry)) > 0; address += size)
+        {
+            if (i >= entries.size())
+                return mismatches + 1;
+            const BlockCodec::Entry& original{entries[i++]};
+            if (std::memcmp(entry.source, original.source, BlockCodec::sourceSize) != 0 ||
+                entry.time != original.time || entry.uploaded != original.uploaded ||
+                entry.valuesSize != original.valuesSize ||
+                std::memcmp(entry.values, original.values, entry.valuesSize) != 0)
+                mismatches++;
+        }
+    }
+    return mismatches + (entries.size() - i);
+}
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<BlockCodec::Entry> entries;
+    if (argc > 1 && std::strtoul(argv[1], nullptr, 10) == 0)
+    {
+        entries = readDump(argv[1]);
+        printf("Read %zu entries from '%s'.\n", entries.size(), argv[1]);
+    }
+    else
+    {
+        const size_t days{argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 30};
+        const size_t nodes{argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10};
+        entries = synthesise(days, nodes);
+        printf("Synthesised %zu entries: %zu days of %zu nodes.\n", entries.size(), days, nodes);
+    }
+    if (entries.empty())
+        return 1;
+
+    size_t values{0}, uncompressed{0}, floatLayout{0};
+    uint32_t first{entries.front().time}, last{entries.front().time};
+    for (const BlockCodec::Entry& entry : entries)
+    {
+        size_t n{entry.countValues()};
+        values += n;
+        uncompressed += entryHeaderSize + 1 + entry.valuesSize;
+        floatLayout += entryHeaderSize + n * floatValueSize;
+        first = std::min(first, entry.time);
+        last = std::max(last, entry.time);
+    }
+
+    auto start{Clock::now()};
+    std::vector<uint8_t> file{compress(entries)};
+    std::chrono::duration<double> encodeTime{Clock::now() - start};
+    start = Clock::now();
+    size_t mismatches{verify(file, entries)};
+    std::chrono::duration<double> decodeTime{Clock::now() - start};
+
+    const size_t n{entries.size()};
+    printf("  values per entry:           %10.2f\n", static_cast<double>(values) / n);
+    printf("  float layout:               %10.2f B/entry\n", static_cast<double>(floatLayout) / n);
+    printf("  encoded layout:             %10.2f B/entry\n", static_cast<double>(uncompressed) / n);
+    printf("  compressed (incl. padding): %10.2f B/entry, %.2f bits/value\n",
+           static_cast<double>(file.size()) / n, 8.0 * file.size() / values);
+    printf("  compression ratio:          %10.2fx vs float layout, %.2fx vs encoded layout\n",
+           static_cast<double>(floatLayout) / file.size(),
+           static_cast<double>(uncompressed) / file.size());
+    printf("  blocks:                     %10zu of %zu bytes\n",
+           (file.size() + BlockCodec::blockSize - 1) / BlockCodec::blockSize,
+           BlockCodec::blockSize);
+    printf("  encode / decode:            %10.1f / %.1f entries/ms\n",
+           n / encodeTime.count() / 1000, n / decodeTime.count() / 1000);
+    if (last > first)
+    {
+        double perDay{static_cast<double>(n) / (last - first) * 86400};
+        printf("  partition retention:        %10.1f days compressed, %.1f days float layout\n",
+               partitionSize / (static_cast<double>(file.size()) / n) / perDay,
+               partitionSize / (static_cast<double>(floatLayout) / n) / perDay);
+    }
+    if (mismatches > 0)
+    {
+        printf("ERROR: %zu entries did not decode to the original entry!\n", mismatches);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+#include "FS.h"
+#include "FlashEmulator.h"
+#include <chrono>
+#include <cstdlib>
+
+// Host benchmark of MIRRAFS against the flash emulator. Replays the storage patterns of the
+// firmware and reports throughput and flash wear per operation:
+//  - sensor entries: one push per sample period, each with its own file object (and thus flush),
+//    like SensorNode::samplePeriod,
+//  - log lines: many pushes per wake, flushed once on Log::close,
+//  - a sequential read-back of the sensor entries, like printData and the upload periods,
+//  - sensor entries received while earlier ones are marked as uploaded, like the gateway's comm
+//    and upload periods, with one and with two sectors cached.
+// Like SensorFile and Log::File, each file keeps a version in NVS, committed when it is closed.
+
+using namespace mirra;
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+/// @brief Cache accesses of the files closed since the last measurement.
+fs::Partition::Stats cacheStats;
+
+class BenchFile final : public fs::FIFOFile
+{
+public:
+    BenchFile(const char* name, size_t cacheSize = defaultCacheSize)
+        : FIFOFile(name, cacheSize), version{nvs.getValue<uint8_t>("version", 1)}
+    {}
+    fs::NVS::Value<uint8_t> version;
+    /// @brief Amount of bytes cut from the tail since the file was opened.
+    size_t cut{0};
+    void onCutTail(size_t cutSize) override { cut += cutSize; }
+    ~BenchFile()
+    {
+        cacheStats.hits += getStats().hits;
+        cacheStats.misses += getStats().misses;
+        cacheStats.evictions += getStats().evictions;
+    }
+};
+
+/// @brief Mirrors the layout of a SensorFile::DataEntry holding nValues sensor values.
+struct Entry
+{
+    uint8_t source[6]{0x24, 0x6F, 0x28, 0x00, 0x00, 0x01};
+    uint32_t time;
+    uint8_t flags;
+    uint8_t values[6 * 40];
+    static constexpr size_t headerSize{sizeof(source) + sizeof(time) + sizeof(flags)};
+} __attribute__((packed));
+
+// Typical timings of the ESP32's SPI NOR flash, used to estimate the on-device cost of the
+// counted operations.
+constexpr double sectorEraseMs{45.0};
+constexpr double pageProgramMs{0.7};
+constexpr size_t pageSize{256};
+
+struct Result
+{
+    double seconds;
+    fs::emulator::FlashStats flash;
+    fs::emulator::NVSStats nvs;
+    /// @brief Commits of NVS values skipped as unchanged.
+    size_t nvsUnchanged;
+    uint32_t maxSectorErases;
+    fs::Partition::Stats cache;
+};
+
+template <class F> Result measure(const char* partition, F&& f)
+{
+    fs::emulator::resetStats();
+    cacheStats = fs::Partition::Stats{};
+    const size_t unchanged{fs::NVS::getStats().unchanged};
+    auto start{Clock::now()};
+    f();
+    std::chrono::duration<double> elapsed{Clock::now() - start};
+    return Result{elapsed.count(),
+                  fs::emulator::getFlashStats(partition),
+                  fs::emulator::getNVSStats(),
+                  fs::NVS::getStats().unchanged - unchanged,
+                  fs::emulator::getMaxSectorErases(partition),
+                  cacheStats};
+}
+
+void report(const char* name, const Result& r, size_t operations, size_t payloadBytes)
+{
+    printf("%s: %zu operations, %zu payload bytes, %.3f s\n", name, operations, payloadBytes,
+           r.seconds);
+    printf("  throughput:          %10.1f ops/s, %10.1f KB/s\n", operations / r.seconds,
+           payloadBytes / r.seconds / 1024);
+    printf("  flash erases:        %10zu (%.4f per op, max %u per sector)\n", r.flash.erases,
+           static_cast<double>(r.flash.erases) / operations, r.maxSectorErases);
+    printf("  flash writes:        %10zu (%.4f per op)\n", r.flash.writes,
+           static_cast<double>(r.flash.writes) / operations);
+    printf("  flash bytes written: %10zu (write amplification %.2f)\n", r.flash.bytesWritten,
+           static_cast<double>(r.flash.bytesWritten) / payloadBytes);
+    printf("  flash bytes read:    %10zu\n", r.flash.bytesRead);
+    double flashMs{r.flash.erases * sectorEraseMs +
+                   static_cast<double>(r.flash.bytesWritten) / pageSize * pageProgramMs};
+    printf("  est. device flash time: %7.2f ms per op\n", flashMs / operations);
+    printf("  NVS sets/writes:     %10zu / %zu, unchanged: %zu, commits: %zu\n", r.nvs.sets,
+           r.nvs.writes, r.nvsUnchanged, r.nvs.commits);
+    printf("  cache hits/misses:   %10zu / %zu, evictions: %zu\n", r.cache.hits, r.cache.misses,
+           r.cache.evictions);
+    if (r.flash.writeViolations > 0)
+        printf("  WARNING: %zu bytes were written without erasing first!\n",
+               r.flash.writeViolations);
+}
+}
+
+int main(int argc, char** argv)
+{
+    const size_t nEntries{argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000};
+    const size_t nValues{argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 6};
+    const size_t nLines{argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 50000};
+    fs::NVS::init();
+
+    Entry entry{};
+    const size_t entrySize{Entry::headerSize + nValues * 6};
+    Result push{measure("data", [&] {
+        for (size_t i{0}; i < nEntries; i++)
+        {
+            entry.time = 1700000000 + i * 1200;
+            entry.flags = nValues;
+            BenchFile file{"data"};
+            file.push(&entry, entrySize);
+        }
+    })};
+    report("sensor entry push", push, nEntries, nEntries * entrySize);
+
+    Result read{measure("data", [&] {
+        BenchFile file{"data"};
+        for (size_t address{0}; address + entrySize <= file.getSize(); address += entrySize)
+            file.read(address, &entry, entrySize);
+    })};
+    size_t stored{BenchFile("data").getSize() / entrySize};
+    report("sensor entry read", read, stored, stored * entrySize);
+
+    static constexpr char line[]{"[2024-01-01 00:00:00]INFO: Sensor data received from "
+                                 "24:6F:28:00:00:01 with length 47\n"};
+    static constexpr size_t linesPerWake{25};
+    Result log{measure("logs", [&] {
+        for (size_t i{0}; i < nLines; i += linesPerWake)
+        {
+            BenchFile file{"logs"};
+            for (size_t j{0}; j < linesPerWake; j++)
+                file.push(line, sizeof(line) - 1);
+        }
+    })};
+    report("log line push", log, nLines, nLines * (sizeof(line) - 1));
+
+    // each comm period, a batch of entries is received and the file flushed, while the entries
+    // received before are marked as uploaded by clearing a bit of each
+    static constexpr size_t entriesPerPeriod{50};
+    for (size_t cacheSize{1}; cacheSize <= 2; cacheSize++)
+    {
+        fs::emulator::addPartition("upload", 64 * 4096);
+        Result upload{measure("upload", [&] {
+            size_t uploaded{0};
+            for (size_t i{0}; i < nEntries; i += entriesPerPeriod)
+            {
+                BenchFile file{"upload", cacheSize};
+                for (size_t j{0}; j < entriesPerPeriod; j++)
+                {
+                    entry.time = 1700000000 + (i + j) * 1200;
+                    entry.flags = nValues | 0x80;
+                    file.cut = 0;
+                    file.push(&entry, entrySize);
+                    uploaded -= std::min(uploaded, file.cut);
+                    if (uploaded + entrySize < file.getSize())
+                    {
+                        file.write<uint8_t>(uploaded + sizeof(entry.source) + sizeof(entry.time),
+                                            nValues);
+                        uploaded += entrySize;
+                    }
+                }
+            }
+        })};
+        char name[48];
+        std::snprintf(name, sizeof(name), "interleaved push/upload, %zu cached", cacheSize);
+        report(name, upload, nEntries, nEntries * entrySize);
+    }
+    return 0;
+}
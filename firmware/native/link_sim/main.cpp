@@ -0,0 +1,1065 @@
+#include "ClockDrift.h"
+#include "LinkAdaptation.h"
+#include "LoRaModule.h"
+#include "LoRaSimulator.h"
+#include "SelectiveRepeat.h"
+#include "SlotScheduler.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <optional>
+#include <set>
+#include <vector>
+
+// Host simulation of the LoRa protocol between a gateway and its sensor nodes, on the simulated
+// channel and clock of lib/LoRaSimulator: `link_sim [days] [nodes] [loss] [seed] [spread]
+// [backlog] [drift]`, where loss is the probability that any packet is lost on its way, the path
+// loss between the gateway and its nodes is spread evenly over a range of spread dB around 110 dB,
+// every node starts with a backlog of entries, as after an outage of the gateway, and the drift of
+// the RTCs of the nodes is spread evenly between -drift and drift ppm.
+//
+// Every device runs the real LoRaModule and messages. The discovery and comm period logic of
+// Gateway (gateway/gateway.cpp) and SensorNode (sensor_node/sensornode.cpp) is mirrored below,
+// without the sensors, the upload to the server and the command prompt, and with the data file
+// replaced by a queue of entries. Changes to the protocol must be made in both places.
+//
+// The simulation is deterministic: the same arguments always give the same results.
+
+using namespace mirra;
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+// Protocol settings, mirroring gateway/config.h, sensor_node/config.h and gateway/gateway.h.
+constexpr uint32_t commPeriodPadding{500}; // ms, COMM_PERIOD_PADDING
+constexpr uint32_t gatewayWakeBefore{5000}; // ms, WAKE_BEFORE_COMM_PERIOD of the gateway
+constexpr uint32_t nodeWakeBefore{3000};    // ms, WAKE_BEFORE_COMM_PERIOD of the sensor node
+constexpr uint32_t beaconLead{3000};        // ms, BEACON_LEAD
+constexpr uint32_t beaconGuard{3000};       // ms, BEACON_GUARD
+constexpr uint32_t commInterval{60 * 60};   // s, DEFAULT_COMM_INTERVAL
+constexpr uint32_t sampleInterval{20 * 60};
+constexpr uint32_t sampleRounding{20 * 60};
+constexpr uint32_t sampleOffset{0};
+constexpr uint32_t discoveryTimeout{5 * 60 * 1000}; // ms
+constexpr uint32_t timeConfigTimeout{6000};         // ms
+constexpr size_t timeConfigAttempts{1};
+constexpr uint32_t sensorDataTimeout{6000}; // ms
+constexpr size_t sensorDataAttempts{1};
+
+constexpr uint32_t defaultEntryLength{32}; // bytes, DEFAULT_ENTRY_LENGTH
+constexpr float adrMargin{10};             // dB, ADR_MARGIN
+constexpr uint32_t maxAirtime{(sensorDataTimeout / (sensorDataAttempts + 1) - RX_SETUP_TIME) *
+                              1000};
+
+uint32_t getSlotLength(uint32_t maxMessages, uint32_t entryLength, const PHYSettings& settings,
+                       uint32_t turnaround)
+{
+    uint32_t durationMs{getCommPeriodDuration(
+        maxMessages, entryLength > 0 ? entryLength : defaultEntryLength, settings, turnaround)};
+    return durationMs + commPeriodPadding;
+}
+/// @brief BEACON_TIME
+constexpr uint64_t getBeaconTime(uint64_t commTime)
+{
+    return commTime - commPeriodPadding - beaconLead;
+}
+constexpr uint32_t getMaxMessages(uint32_t commInterval, uint32_t sampleInterval)
+{
+    return (3 * commInterval / (2 * sampleInterval)) + 1;
+}
+
+/// @brief Time between the boots of consecutive nodes, which discover the gateway one by one.
+constexpr uint32_t discoverySpacing{20}; // s
+/// @brief Amount of times a node attempts discovery, as its operator would retry a failed one.
+/// Failed nodes retry after all nodes have had their turn.
+constexpr uint32_t discoveryAttempts{3};
+
+/// @brief Constructs the LoRaModule of a device, as the firmware does on every boot.
+LoRaModule bootLoRa()
+{
+    return LoRaModule(0, 0, 0, 0, 0);
+}
+
+size_t macToDevice(const MACAddress& mac)
+{
+    const uint8_t* address{mac.getAddress()};
+    return address[3] << 16 | address[4] << 8 | address[5];
+}
+
+/// @brief The drift of the RTC of every device, the offset in ms of its RTC from its system time
+/// if known, and whether its RTC is yet to be set to its system time, as kept by MIRRAModule.
+std::vector<ClockDrift> clockDrifts;
+std::vector<std::optional<int32_t>> rtcOffsets;
+std::vector<bool> rtcOutdated;
+
+// PCF2129_RTC::awaitSecond, MIRRAModule::syncTime, MIRRAModule::correctTime,
+// MIRRAModule::writeRTC, MIRRAModule::deepSleep, MIRRAModule::lightSleepUntil and
+// MIRRAModule::deepSleepUntil
+uint32_t awaitSecond()
+{
+    simulator::delay(simulator::getSleepTime(simulator::getSysTime() + 1));
+    return simulator::getSysTime();
+}
+void syncTime(bool align)
+{
+    const size_t device{simulator::getDevice()};
+    if (rtcOutdated[device])
+        return;
+    const uint64_t rtcTime{static_cast<uint64_t>(align ? awaitSecond() : simulator::getSysTime()) *
+                           1000};
+    const uint64_t time{clockDrifts[device].toReference(rtcTime)};
+    simulator::setSysTimeMs(time);
+    if (align)
+        rtcOffsets[device] = static_cast<int32_t>(rtcTime - time);
+    else
+        rtcOffsets[device].reset();
+}
+void correctTime(uint64_t time)
+{
+    const size_t device{simulator::getDevice()};
+    const uint64_t cTime{simulator::getSysTimeMs()};
+    if (rtcOffsets[device])
+        clockDrifts[device].correct(cTime + *rtcOffsets[device], time);
+    else
+        clockDrifts[device].restart(time);
+    simulator::setSysTimeMs(time);
+    rtcOffsets[device] = 0;
+    rtcOutdated[device] = true;
+}
+void lightSleep(uint64_t sleepTime)
+{
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+    esp_sleep_enable_timer_wakeup(sleepTime);
+    esp_light_sleep_start();
+}
+void writeRTC()
+{
+    const uint64_t cTime{simulator::getSysTimeMs()};
+    lightSleep((1000 - cTime % 1000) * 1000);
+    simulator::setSysTime(static_cast<uint32_t>(cTime / 1000 + 1));
+    rtcOffsets[simulator::getDevice()] = 0;
+    rtcOutdated[simulator::getDevice()] = false;
+}
+void deepSleep(uint32_t sleepTime)
+{
+    if (rtcOutdated[simulator::getDevice()])
+        writeRTC();
+    sleepTime = std::max<uint32_t>(sleepTime, 1);
+    if (sleepTime <= 30)
+        simulator::deepSleep(static_cast<uint64_t>(sleepTime) * 1000 * 1000);
+    else
+        // the alarm of the RTC
+        simulator::deepSleep(simulator::getSleepTime(simulator::getSysTime() + sleepTime));
+    // the constructor of MIRRAModule on boot
+    syncTime(false);
+}
+void lightSleepUntil(uint64_t untilTime)
+{
+    uint64_t cTime{simulator::getSysTimeMs()};
+    if (untilTime > cTime)
+        lightSleep((untilTime - cTime) * 1000);
+}
+void deepSleepUntil(uint64_t untilTime)
+{
+    const ClockDrift& clockDrift{clockDrifts[simulator::getDevice()]};
+    uint64_t cTime{simulator::getSysTimeMs()};
+    if (untilTime <= cTime)
+        deepSleep(0);
+    else
+        deepSleep(static_cast<uint32_t>(
+            (clockDrift.toLocal(untilTime) - clockDrift.toLocal(cTime) + 500) / 1000));
+}
+
+/// @brief Entries received by the gateway, by device and time, as retransmissions can duplicate
+/// entries.
+std::vector<std::set<uint32_t>> delivered;
+/// @brief Entries sampled, pending upload and registered state, by device.
+std::vector<size_t> sampled, pending;
+std::vector<bool> registered;
+/// @brief Amount of entries every node holds at boot.
+size_t backlog{0};
+size_t commPeriodsOk{0}, commPeriodsFailed{0}, drains{0};
+/// @brief Comm periods in which the node kept its configuration, slots moved by the gateway and
+/// beacons received by nodes.
+size_t configsKept{0}, slotsMoved{0}, beaconsReceived{0};
+/// @brief Sum, maximum and amount of the offsets in ms of the first frames of comm periods from the
+/// start of their slots, as the gateway measures them.
+uint64_t slotOffsetSum{0}, maxSlotOffset{0}, slotOffsets{0};
+size_t nNodes{0};
+
+/// @return The time it takes for all nodes to attempt discovery once, in s.
+uint32_t getDiscoveryRound()
+{
+    return nNodes * discoverySpacing;
+}
+
+/// @brief Gateway::Node
+struct Node
+{
+    MACAddress mac{};
+    uint32_t sampleInterval{0}, sampleRounding{0}, sampleOffset{0};
+    uint32_t commInterval{0}, maxMessages{0}, errors{0}, entryLength{0};
+    uint64_t nextCommTime{0};
+    PHYSettings settings{LoRaModule::defaultSettings};
+    float pathLoss{0};
+    float turnaround{RX_SETUP_TIME};
+    uint16_t shortAddress{0};
+    bool unsynced{false};
+    float drift{0};
+
+    Node(Message<TIME_CONFIG>& m) : mac{m.getDest()} { timeConfig(m); }
+    void timeConfig(Message<TIME_CONFIG>& m)
+    {
+        sampleInterval = m.getSampleInterval();
+        sampleRounding = m.getSampleRounding();
+        sampleOffset = m.getSampleOffset();
+        commInterval = m.getCommInterval();
+        nextCommTime = m.getCommTime();
+        maxMessages = m.getMaxMessages();
+        settings = m.getSettings();
+        shortAddress = m.getShortAddress();
+        unsynced = false;
+        if (errors > 0)
+            errors--;
+    }
+    void keepTimeConfig()
+    {
+        nextCommTime += commInterval * 1000ULL;
+        if (errors > 0)
+            errors--;
+    }
+    void naiveTimeConfig(uint64_t cTime)
+    {
+        while (nextCommTime <= cTime)
+            nextCommTime += commInterval * 1000ULL;
+        maxMessages = getFallbackMessages(maxMessages, settings);
+        settings = LoRaModule::defaultSettings;
+        unsynced = true;
+        errors++;
+    }
+    void updateEntryLength(const Message<SENSOR_DATA_BATCH>& m)
+    {
+        if (m.getNEntries() == 0)
+            return;
+        size_t dataLength{m.getLength() -
+                          (MessageHeader::maxLength - Message<SENSOR_DATA_BATCH>::capacity)};
+        entryLength = std::max<uint32_t>(entryLength,
+                                         (dataLength + m.getNEntries() - 1) / m.getNEntries());
+    }
+    void updateLinkQuality(float rssi, float snr)
+    {
+        float pathLoss{getPathLoss(settings, rssi, snr)};
+        float weight{pathLoss > this->pathLoss ? 0.5f : 0.25f};
+        if (this->pathLoss == 0)
+            this->pathLoss = pathLoss;
+        else
+            this->pathLoss += weight * (pathLoss - this->pathLoss);
+    }
+    void updateTurnaround(uint32_t turnaround)
+    {
+        if (turnaround >= getFrameTimeout(settings))
+            return;
+        float weight{turnaround > this->turnaround ? 0.5f : 0.25f};
+        this->turnaround += weight * (turnaround - this->turnaround);
+    }
+    uint32_t getSlotLength(uint32_t maxMessages, const PHYSettings& settings) const
+    {
+        return ::getSlotLength(maxMessages, entryLength, settings,
+                               static_cast<uint32_t>(std::ceil(turnaround)));
+    }
+    uint32_t getSlotLength() const { return getSlotLength(maxMessages, settings); }
+    uint32_t getDrainMessages(uint32_t maxMessages, const PHYSettings& settings,
+                              const PHYSettings& drainSettings) const
+    {
+        const uint32_t slotLength{getSlotLength(maxMessages, settings)};
+        uint32_t drainMessages{maxMessages * drainSettings.bandwidth / settings.bandwidth};
+        while (drainMessages > maxMessages &&
+               getSlotLength(drainMessages, drainSettings) > slotLength)
+            drainMessages--;
+        return drainMessages;
+    }
+    Message<TIME_CONFIG> currentTimeConfig(const MACAddress& src, uint64_t cTime,
+                                           uint64_t beaconTime)
+    {
+        return Message<TIME_CONFIG>(src, mac, cTime, sampleInterval, sampleRounding, sampleOffset,
+                                    commInterval, nextCommTime, beaconTime, maxMessages, settings,
+                                    shortAddress);
+    }
+};
+
+/// @brief Mirror of Gateway.
+class Gateway
+{
+    std::vector<Node> nodes;
+    size_t expectedNodes;
+
+    bool isLost(const Node& n) const { return n.commInterval != commInterval; }
+    uint64_t getSendTime() const { return simulator::getSysTimeMs() + RX_SETUP_TIME; }
+    uint16_t allocateShortAddress() const
+    {
+        for (uint16_t address{1}; address <= CompactHeader::maxAddress; address++)
+        {
+            if (std::none_of(nodes.cbegin(), nodes.cend(),
+                             [&](const Node& n) { return n.shortAddress == address; }))
+                return address;
+        }
+        return 0;
+    }
+    bool allLost() const
+    {
+        return std::all_of(nodes.cbegin(), nodes.cend(), [&](const Node& n) { return isLost(n); });
+    }
+
+    uint64_t nextScheduledCommTime(uint32_t slotLength)
+    {
+        uint64_t start{static_cast<uint64_t>(-1)};
+        for (const Node& n : nodes)
+        {
+            if (!isLost(n))
+                start = std::min(start, n.nextCommTime);
+        }
+        if (start == static_cast<uint64_t>(-1))
+            return -1;
+        SlotScheduler schedule{start, commInterval * 1000};
+        for (const Node& n : nodes)
+        {
+            if (!isLost(n))
+                schedule.occupy(n.nextCommTime, n.getSlotLength());
+        }
+        if (!schedule.fits(slotLength))
+            return -1;
+        return schedule.reserve(slotLength);
+    }
+
+    void discovery(LoRaModule& lora)
+    {
+        while (nodes.size() < expectedNodes)
+        {
+            auto hello{lora.listenMessage<HELLO>(discoveryTimeout, 0)};
+            if (!hello)
+            {
+                // stands in for the BOOT button: no nodes left to discover
+                if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER)
+                    return;
+                continue;
+            }
+            MACAddress candidate{hello->getSource()};
+            auto duplicate{std::find_if(nodes.begin(), nodes.end(),
+                                        [&](const Node& n) { return n.mac == candidate; })};
+            const bool isDuplicate{duplicate != nodes.end()};
+            uint64_t cTime{getSendTime()};
+            if (isDuplicate)
+            {
+                lora.sendMessage(duplicate->currentTimeConfig(
+                    lora.getMACAddress(), cTime, getBeaconTime(nodes[0].nextCommTime)));
+            }
+            else
+            {
+                uint32_t maxMessages{getMaxMessages(commInterval, sampleInterval)};
+                uint64_t commTime{cTime + commInterval * 1000ULL};
+                uint64_t beaconTime{getBeaconTime(commTime)};
+                if (!allLost())
+                {
+                    beaconTime = getBeaconTime(nodes[0].nextCommTime);
+                    commTime = nextScheduledCommTime(::getSlotLength(
+                        maxMessages, 0, LoRaModule::defaultSettings, RX_SETUP_TIME));
+                    if (commTime == static_cast<uint64_t>(-1))
+                        return;
+                }
+                Message<TIME_CONFIG> timeConfig{lora.getMACAddress(),
+                                                candidate,
+                                                cTime,
+                                                sampleInterval,
+                                                sampleRounding,
+                                                sampleOffset,
+                                                commInterval,
+                                                commTime,
+                                                beaconTime,
+                                                maxMessages,
+                                                LoRaModule::defaultSettings,
+                                                allocateShortAddress()};
+                nodes.emplace_back(timeConfig);
+                lora.sendMessage(timeConfig);
+            }
+            auto timeAck{
+                lora.receiveMessage<ACK_TIME>(timeConfigTimeout, timeConfigAttempts, candidate)};
+            if (!timeAck)
+            {
+                if (!isDuplicate)
+                    nodes.pop_back();
+                return;
+            }
+            Node& node{isDuplicate ? *duplicate : nodes.back()};
+            if (auto turnaround{lora.getTurnaround()})
+                node.updateTurnaround(*turnaround);
+            node.drift = timeAck->getDrift();
+            registered[macToDevice(candidate)] = true;
+        }
+    }
+
+    bool nodeCommPeriod(LoRaModule& lora, Node& n, SlotScheduler& schedule)
+    {
+        uint64_t cTime{simulator::getSysTimeMs()};
+        if (cTime > n.nextCommTime)
+            return false;
+        lora.configure(n.settings);
+        lightSleepUntil(n.nextCommTime - commPeriodPadding);
+        uint32_t listenMs{commPeriodPadding};
+        const uint64_t slotEnd{n.nextCommTime + n.getSlotLength() - commPeriodPadding};
+        auto slotTimeout = [&](uint32_t timeoutMs, uint32_t listenMs = 0) -> uint32_t {
+            uint32_t remainingMs{
+                static_cast<uint32_t>(slotEnd - std::min(simulator::getSysTimeMs(), slotEnd))};
+            return std::min(timeoutMs, remainingMs - std::min(remainingMs, listenMs));
+        };
+        size_t entriesReceived{0};
+        FrameReceiver frames{};
+        const uint32_t frameTimeout{getFrameTimeout(n.settings)};
+        bool inBurst{false};
+        bool poll{false};
+        uint64_t firstFrameTime{0};
+        auto receiveFrame = [&](Message<SENSOR_DATA_BATCH>& sensorData) {
+            if (firstFrameTime == 0)
+                firstFrameTime = simulator::getSysTimeMs() - lora.getMessageAge();
+            if (auto turnaround{lora.getTurnaround()})
+                n.updateTurnaround(*turnaround);
+            poll = sensorData.isPoll();
+            if (!frames.receive(sensorData))
+                return;
+            for (const auto& entry : sensorData)
+                delivered[macToDevice(n.mac)].insert(entry.time);
+            n.updateEntryLength(sensorData);
+            n.updateLinkQuality(lora.getRSSI(), lora.getSNR());
+            entriesReceived += sensorData.getNEntries();
+        };
+        while (true)
+        {
+            auto result{lora.receiveAny(
+                slotTimeout(inBurst ? frameTimeout : sensorDataTimeout, listenMs) + listenMs, n.mac,
+                receiveFrame)};
+            listenMs = 0;
+            if (result == LoRaModule::RECEIVED)
+            {
+                inBurst = true;
+                if (!poll)
+                    continue;
+            }
+            else if (result == LoRaModule::CRC_MISMATCH)
+            {
+                inBurst = true;
+                continue;
+            }
+            else if (!inBurst)
+            {
+                return false;
+            }
+            inBurst = false;
+            if (frames.isComplete())
+                break;
+            lora.sendMessage(frames.getAck(lora.getMACAddress(), n.mac));
+        }
+        uint32_t maxMessages{getMaxMessages(commInterval, n.sampleInterval)};
+        PHYSettings settings{adaptSettings(n.pathLoss, adrMargin, maxAirtime)};
+        if (entriesReceived >= n.maxMessages)
+        {
+            PHYSettings drainSettings{adaptSettings(n.pathLoss, adrMargin, maxAirtime, true)};
+            uint32_t drainMessages{n.getDrainMessages(maxMessages, settings, drainSettings)};
+            if (drainSettings.bandwidth > settings.bandwidth && drainMessages > maxMessages)
+            {
+                drains++;
+                settings = drainSettings;
+                maxMessages = drainMessages;
+            }
+        }
+        uint64_t commTime{schedule.reserve(n.getSlotLength(maxMessages, settings))};
+        if (n.shortAddress == 0)
+            n.shortAddress = allocateShortAddress();
+        const int64_t slotOffset{static_cast<int64_t>(firstFrameTime - n.nextCommTime)};
+        bool keep{!n.unsynced && n.shortAddress != 0 &&
+                  commTime == n.nextCommTime + commInterval * 1000ULL &&
+                  maxMessages == n.maxMessages && settings == n.settings &&
+                  std::llabs(slotOffset) <= commPeriodPadding / 4};
+        slotOffsetSum += std::llabs(slotOffset);
+        maxSlotOffset = std::max<uint64_t>(maxSlotOffset, std::llabs(slotOffset));
+        slotOffsets++;
+        cTime = getSendTime();
+        Message<TIME_CONFIG> timeConfig{lora.getMACAddress(),
+                                        n.mac,
+                                        cTime,
+                                        n.sampleInterval,
+                                        n.sampleRounding,
+                                        n.sampleOffset,
+                                        commInterval,
+                                        commTime,
+                                        getBeaconTime(schedule.getStart()),
+                                        maxMessages,
+                                        settings,
+                                        n.shortAddress};
+        if (keep)
+            lora.sendMessage(frames.getAck(lora.getMACAddress(), n.mac));
+        else
+            lora.sendMessage(timeConfig);
+        size_t attempts{0};
+        while (true)
+        {
+            bool acked{false};
+            poll = false;
+            auto result{lora.receiveAny(
+                slotTimeout(getRetryDuration(n.settings)), n.mac,
+                [&](Message<ACK_TIME>& ack) {
+                    acked = true;
+                    n.drift = ack.getDrift();
+                },
+                [&](Message<SENSOR_DATA_BATCH>& sensorData) { poll = sensorData.isPoll(); })};
+            if (result == LoRaModule::RECEIVED)
+            {
+                if (auto turnaround{lora.getTurnaround()})
+                    n.updateTurnaround(*turnaround);
+                if (acked)
+                    break;
+                if (!poll)
+                    continue;
+            }
+            if (attempts++ >= timeConfigAttempts)
+                return false;
+            if (result == LoRaModule::RECEIVED)
+            {
+                lora.resendMessage();
+            }
+            else
+            {
+                lora.sendRepeat(n.mac);
+            }
+        }
+        if (keep)
+        {
+            configsKept++;
+            n.keepTimeConfig();
+        }
+        else
+        {
+            n.timeConfig(timeConfig);
+        }
+        return true;
+    }
+
+    void sendBeacon(LoRaModule& lora)
+    {
+        if (nodes.empty())
+            return;
+        lora.configure(LoRaModule::defaultSettings);
+        lightSleepUntil(getBeaconTime(nodes[0].nextCommTime));
+        Message<BEACON> beacon{lora.getMACAddress(), getSendTime()};
+        for (const Node& n : nodes)
+        {
+            if (n.unsynced && n.shortAddress != 0 && !beacon.push(n.shortAddress, n.nextCommTime))
+                break;
+        }
+        lora.sendMessage(beacon);
+    }
+
+    void commPeriod(LoRaModule& lora)
+    {
+        auto byNextCommTime = [](const Node& a, const Node& b) {
+            return a.nextCommTime < b.nextCommTime;
+        };
+        std::sort(nodes.begin(), nodes.end(), byNextCommTime);
+        SlotScheduler schedule{nodes.empty() ? 0 : nodes[0].nextCommTime + commInterval * 1000ULL,
+                               commInterval * 1000};
+        sendBeacon(lora);
+        uint64_t farCommTime = -1;
+        for (Node& n : nodes)
+        {
+            if (n.nextCommTime > farCommTime)
+                break;
+            farCommTime = n.nextCommTime + 2 * n.getSlotLength();
+            const uint64_t scheduled{schedule.getEnd()};
+            lora.startSession(n.mac, n.shortAddress, false);
+            bool success{nodeCommPeriod(lora, n, schedule)};
+            lora.endSession();
+            if (success)
+            {
+                commPeriodsOk++;
+            }
+            else
+            {
+                commPeriodsFailed++;
+                n.naiveTimeConfig(simulator::getSysTimeMs());
+                if (n.nextCommTime >= scheduled)
+                {
+                    schedule.occupy(n.nextCommTime, n.getSlotLength());
+                }
+                else if (n.shortAddress != 0 && schedule.fits(n.getSlotLength()))
+                {
+                    slotsMoved++;
+                    n.nextCommTime = schedule.reserve(n.getSlotLength());
+                }
+            }
+        }
+        lora.configure(LoRaModule::defaultSettings);
+        std::sort(nodes.begin(), nodes.end(), byNextCommTime);
+    }
+
+public:
+    Gateway(size_t expectedNodes) : expectedNodes{expectedNodes} {}
+
+    void run()
+    {
+        syncTime(false);
+        syncTime(true);
+        {
+            LoRaModule lora{bootLoRa()};
+            const uint32_t discoveryEnd{simulator::getSysTime() +
+                                        discoveryAttempts * getDiscoveryRound() +
+                                        discoverySpacing};
+            while (nodes.size() < expectedNodes && simulator::getSysTime() < discoveryEnd)
+                discovery(lora);
+        }
+        while (true)
+        {
+            if (nodes.empty())
+                deepSleepUntil(simulator::getSysTimeMs() + commInterval * 1000ULL);
+            else
+                deepSleepUntil(getBeaconTime(nodes[0].nextCommTime) - gatewayWakeBefore);
+            syncTime(true);
+            LoRaModule lora{bootLoRa()};
+            if (!nodes.empty() && simulator::getSysTimeMs() + 3000 >=
+                                      getBeaconTime(nodes[0].nextCommTime) - gatewayWakeBefore)
+                commPeriod(lora);
+        }
+    }
+};
+
+/// @brief Mirror of SensorNode.
+class SensorNode
+{
+    struct Entry
+    {
+        uint32_t time;
+        Message<SENSOR_DATA>::SensorValues values;
+    };
+    /// @brief Entries not uploaded yet, oldest first: stands in for the data file.
+    std::deque<Entry> file;
+    size_t device;
+
+    uint32_t sampleInterval{60 * 60}, sampleRounding{60}, sampleOffset{0};
+    uint32_t nextSampleTime{static_cast<uint32_t>(-1)};
+    uint32_t commInterval{0};
+    uint64_t nextCommTime{static_cast<uint64_t>(-1)};
+    uint64_t nextBeaconTime{static_cast<uint64_t>(-1)};
+    bool synced{true};
+    uint32_t maxMessages{0};
+    MACAddress gatewayMAC{};
+    uint16_t shortAddress{0};
+    PHYSettings settings{LoRaModule::defaultSettings};
+
+    /// @brief SensorNode::addSensor, for sensors that all sample on the same schedule.
+    void scheduleSamples()
+    {
+        uint32_t cTime{simulator::getSysTime()};
+        nextSampleTime = (cTime / sampleRounding) * sampleRounding + sampleOffset;
+        while (nextSampleTime <= cTime)
+            nextSampleTime += sampleInterval;
+    }
+
+    void samplePeriod()
+    {
+        // the default sensors of a sensor node, with the size of their encoded values
+        Entry entry{nextSampleTime, {}};
+        float phase{static_cast<float>(nextSampleTime % 86400) / 86400};
+        entry.values.push(SensorValue{1, 0, 4.1f - device * 0.001f});
+        entry.values.push(SensorValue{3, 0, 2000.0f + device});
+        entry.values.push(SensorValue{4, 0, 14 + 2 * phase});
+        entry.values.push(SensorValue{12, 0, 16 + 8 * phase});
+        entry.values.push(SensorValue{13, 0, 70 - 20 * phase});
+        entry.values.push(SensorValue{22, 0, 30000 * phase});
+        file.push_back(entry);
+        sampled[device]++;
+        nextSampleTime += sampleInterval;
+    }
+
+    void timeConfig(LoRaModule& lora, Message<TIME_CONFIG>& m)
+    {
+        correctTime(m.getCTime() + lora.getMessageAge());
+        bool scheduleValid{sampleInterval == m.getSampleInterval() &&
+                           sampleRounding == m.getSampleRounding() &&
+                           sampleOffset == m.getSampleOffset()};
+        sampleInterval = m.getSampleInterval() == 0 ? 60 * 60 : m.getSampleInterval();
+        sampleRounding = m.getSampleRounding() == 0 ? 60 : m.getSampleRounding();
+        sampleOffset = m.getSampleOffset();
+        commInterval = m.getCommInterval();
+        nextCommTime = m.getCommTime();
+        nextBeaconTime = m.getBeaconTime();
+        synced = true;
+        maxMessages = m.getMaxMessages();
+        gatewayMAC = m.getSource();
+        shortAddress = m.getShortAddress();
+        settings = m.getSettings();
+        if (!scheduleValid)
+            scheduleSamples();
+    }
+
+    void keepTimeConfig()
+    {
+        nextCommTime += commInterval * 1000ULL;
+        nextBeaconTime += commInterval * 1000ULL;
+        synced = true;
+    }
+    void naiveTimeConfig(uint64_t cTime)
+    {
+        while (nextCommTime <= cTime)
+            nextCommTime += commInterval * 1000ULL;
+        while (nextBeaconTime <= cTime)
+            nextBeaconTime += commInterval * 1000ULL;
+        maxMessages = getFallbackMessages(maxMessages, settings);
+        settings = LoRaModule::defaultSettings;
+        synced = false;
+    }
+
+    void beaconPeriod(LoRaModule& lora)
+    {
+        uint64_t cTime{simulator::getSysTimeMs()};
+        if (cTime >= nextBeaconTime + beaconGuard)
+        {
+            while (nextBeaconTime + beaconGuard <= cTime)
+                nextBeaconTime += commInterval * 1000ULL;
+            return;
+        }
+        lora.configure(LoRaModule::defaultSettings);
+        lightSleepUntil(nextBeaconTime - beaconGuard);
+        cTime = simulator::getSysTimeMs();
+        auto beacon{lora.receiveMessage<BEACON>(
+            static_cast<uint32_t>(nextBeaconTime + beaconGuard - cTime), 0, gatewayMAC)};
+        nextBeaconTime += commInterval * 1000ULL;
+        if (!beacon)
+            return;
+        beaconsReceived++;
+        correctTime(beacon->getCTime() + lora.getMessageAge());
+        if (uint64_t commTime{beacon->getCommTime(shortAddress)})
+            nextCommTime = commTime;
+    }
+
+    bool discovery(LoRaModule& lora)
+    {
+        lora.sendMessage(Message<HELLO>(lora.getMACAddress(), MACAddress::broadcast));
+        auto timeConfig{lora.receiveMessage<TIME_CONFIG>(timeConfigTimeout, timeConfigAttempts,
+                                                         MACAddress::broadcast)};
+        if (!timeConfig)
+            return false;
+        const MACAddress gateway{timeConfig->getSource()};
+        this->timeConfig(lora, *timeConfig);
+        lora.sendMessage(
+            Message<ACK_TIME>(lora.getMACAddress(), gateway, clockDrifts[device].getPPM()));
+        lora.receiveMessage<REPEAT>(timeConfigTimeout, 0, gateway);
+        return true;
+    }
+
+    void commPeriod(LoRaModule& lora)
+    {
+        uint64_t cTime{simulator::getSysTimeMs()};
+        if (cTime >= nextCommTime + sensorDataTimeout)
+        {
+            naiveTimeConfig(cTime);
+            return;
+        }
+        lora.configure(settings);
+        struct Frame
+        {
+            Message<SENSOR_DATA_BATCH> message;
+            size_t nEntries;
+            bool acked;
+        };
+        std::vector<Frame> window{};
+        uint8_t nextSeq{0};
+        size_t entriesQueued{0};
+        size_t entriesInWindow{0};
+        bool lastQueued{false};
+        bool firstFrame{true};
+        size_t attempts{0};
+        while (true)
+        {
+            while (!lastQueued && window.size() < Message<ACK_DATA>::window)
+            {
+                Message<SENSOR_DATA_BATCH> message{lora.getMACAddress(), gatewayMAC, nextSeq};
+                size_t nEntries{0};
+                while (entriesQueued + nEntries < maxMessages &&
+                       entriesInWindow + nEntries < file.size() &&
+                       message.push(file[entriesInWindow + nEntries].time,
+                                    file[entriesInWindow + nEntries].values))
+                    nEntries++;
+                if (nEntries == 0)
+                    break;
+                entriesQueued += nEntries;
+                entriesInWindow += nEntries;
+                if (entriesQueued >= maxMessages || entriesInWindow == file.size())
+                {
+                    message.setLast();
+                    lastQueued = true;
+                }
+                window.push_back({message, nEntries, false});
+                nextSeq = (nextSeq + 1) % Message<SENSOR_DATA_BATCH>::seqModulo;
+            }
+            if (window.empty())
+                return;
+            auto poll{std::find_if(window.rbegin(), window.rend(),
+                                   [](const Frame& frame) { return !frame.acked; })};
+            bool burstStart{true};
+            for (Frame& frame : window)
+            {
+                if (frame.acked)
+                    continue;
+                frame.message.setPoll(&frame == &*poll);
+                if (firstFrame)
+                {
+                    lightSleepUntil(nextCommTime);
+                    lora.sendMessage(frame.message, 0);
+                    firstFrame = false;
+                }
+                else
+                {
+                    lora.sendMessage(frame.message, burstStart ? RX_SETUP_TIME : FRAME_GAP);
+                }
+                burstStart = false;
+            }
+            bool configured{false};
+            bool progress{false};
+            lora.receiveAny(
+                getReplyTimeout(lora.getSettings()), gatewayMAC,
+                [&](Message<TIME_CONFIG>& message) {
+                    file.erase(file.begin(), file.begin() + entriesInWindow);
+                    timeConfig(lora, message);
+                    configured = true;
+                },
+                [&](Message<ACK_DATA>& ack) {
+                    for (Frame& frame : window)
+                    {
+                        if (!frame.acked && ack.acknowledges(frame.message.getSeq()))
+                        {
+                            frame.acked = true;
+                            progress = true;
+                        }
+                    }
+                });
+            if (configured)
+            {
+                lora.sendMessage(Message<ACK_TIME>(lora.getMACAddress(), gatewayMAC,
+                                                   clockDrifts[device].getPPM()));
+                lora.receiveMessage<REPEAT>(timeConfigTimeout, 0, gatewayMAC);
+                return;
+            }
+            while (!window.empty() && window.front().acked)
+            {
+                file.erase(file.begin(), file.begin() + window.front().nEntries);
+                entriesInWindow -= window.front().nEntries;
+                window.erase(window.begin());
+            }
+            if (lastQueued && window.empty())
+            {
+                keepTimeConfig();
+                lora.sendMessage(Message<ACK_TIME>(lora.getMACAddress(), gatewayMAC,
+                                                   clockDrifts[device].getPPM()));
+                lora.receiveMessage<REPEAT>(timeConfigTimeout, 0, gatewayMAC);
+                return;
+            }
+            if (progress)
+            {
+                attempts = 0;
+                continue;
+            }
+            if (attempts++ >= sensorDataAttempts)
+            {
+                naiveTimeConfig(simulator::getSysTimeMs());
+                return;
+            }
+        }
+    }
+
+public:
+    SensorNode(size_t device) : device{device} {}
+
+    void run()
+    {
+        syncTime(false);
+        for (size_t i{backlog}; i > 0; i--)
+        {
+            nextSampleTime = simulator::getSysTime() - i * sampleInterval;
+            samplePeriod();
+        }
+        scheduleSamples();
+        for (size_t attempt{0}; attempt < discoveryAttempts; attempt++)
+        {
+            if (attempt > 0)
+                deepSleepUntil(simulator::getSysTimeMs() + getDiscoveryRound() * 1000ULL);
+            LoRaModule lora{bootLoRa()};
+            if (discovery(lora))
+                break;
+        }
+        while (true)
+        {
+            uint64_t cTime{simulator::getSysTimeMs()};
+            if ((!synced && cTime >= nextBeaconTime - beaconGuard - nodeWakeBefore) ||
+                cTime >= nextCommTime - nodeWakeBefore)
+                syncTime(true);
+            cTime = simulator::getSysTimeMs();
+            if (!synced && cTime >= nextBeaconTime - beaconGuard - nodeWakeBefore)
+            {
+                LoRaModule lora{bootLoRa()};
+                beaconPeriod(lora);
+            }
+            cTime = simulator::getSysTimeMs();
+            if (cTime >= nextCommTime - nodeWakeBefore)
+            {
+                LoRaModule lora{bootLoRa()};
+                lora.startSession(gatewayMAC, shortAddress, true);
+                commPeriod(lora);
+                lora.endSession();
+            }
+            if (simulator::getSysTime() >= nextSampleTime)
+                samplePeriod();
+            pending[device] = file.size();
+            uint64_t wakeTime{std::min<uint64_t>(nextCommTime - nodeWakeBefore,
+                                                 nextSampleTime * 1000ULL)};
+            if (!synced)
+                wakeTime = std::min<uint64_t>(wakeTime,
+                                              nextBeaconTime - beaconGuard - nodeWakeBefore);
+            deepSleepUntil(wakeTime);
+        }
+    }
+};
+
+/// @return The drift of the RTC of the given node, spread evenly between -drift and drift.
+float getNodeDrift(size_t node, size_t nodes, float drift)
+{
+    return nodes > 1 ? drift * (2.0f * (node - 1) / (nodes - 1) - 1) : drift;
+}
+
+struct Totals
+{
+    simulator::DeviceStats stats;
+    double maxEnergy{0};
+
+    void add(const simulator::DeviceStats& s)
+    {
+        stats.packetsSent += s.packetsSent;
+        stats.packetsReceived += s.packetsReceived;
+        stats.packetsLost += s.packetsLost;
+        stats.packetsCollided += s.packetsCollided;
+        stats.txTime += s.txTime;
+        stats.rxTime += s.rxTime;
+        stats.txEnergy += s.txEnergy;
+        stats.activeTime += s.activeTime;
+        stats.lightSleepTime += s.lightSleepTime;
+        maxEnergy = std::max(maxEnergy, s.getEnergy());
+    }
+};
+
+void printDevice(const char* name, const simulator::DeviceStats& s, double seconds, size_t count)
+{
+    printf("%s:\n", name);
+    printf("  packets sent / received:    %10.1f / %.1f\n",
+           static_cast<double>(s.packetsSent) / count,
+           static_cast<double>(s.packetsReceived) / count);
+    printf("  packets lost / collided:    %10.1f / %.1f\n",
+           static_cast<double>(s.packetsLost) / count,
+           static_cast<double>(s.packetsCollided) / count);
+    printf("  airtime:                    %10.2f s (duty cycle %.4f %%)\n", s.txTime / 1e6 / count,
+           s.txTime / 1e4 / count / seconds);
+    printf("  transmit energy:            %10.2f J\n", s.txEnergy / 1000 / count);
+    printf("  receive time:               %10.2f s\n", s.rxTime / 1e6 / count);
+    printf("  awake time:                 %10.2f s/day\n",
+           (s.activeTime + s.lightSleepTime) / 1e6 / count / (seconds / 86400));
+}
+}
+
+int main(int argc, char** argv)
+{
+    const size_t days{argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 7};
+    const size_t nodes{argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10};
+    const float loss{argc > 3 ? std::strtof(argv[3], nullptr) : 0.0f};
+    const uint32_t seed{argc > 4 ? static_cast<uint32_t>(std::strtoul(argv[4], nullptr, 10)) : 1};
+    const float spread{argc > 5 ? std::strtof(argv[5], nullptr) : 0.0f};
+    backlog = argc > 6 ? std::strtoul(argv[6], nullptr, 10) : 0;
+    const float drift{argc > 7 ? std::strtof(argv[7], nullptr) : 0.0f};
+
+    simulator::setSeed(seed);
+    simulator::Link link{};
+    link.lossRate = loss;
+    simulator::setDefaultLink(link);
+    for (size_t i{1}; i <= nodes; i++)
+    {
+        link.pathLoss = 110 - spread / 2 + (nodes > 1 ? spread * (i - 1) / (nodes - 1) : 0);
+        simulator::setLink(0, i, link);
+    }
+    nNodes = nodes;
+    delivered.resize(nodes + 1);
+    sampled.resize(nodes + 1);
+    pending.resize(nodes + 1);
+    registered.resize(nodes + 1);
+    clockDrifts.resize(nodes + 1);
+    rtcOffsets.resize(nodes + 1);
+    rtcOutdated.resize(nodes + 1);
+
+    Gateway gateway{nodes};
+    std::vector<SensorNode> sensorNodes;
+    sensorNodes.reserve(nodes);
+    simulator::addDevice([&] { gateway.run(); });
+    for (size_t i{1}; i <= nodes; i++)
+    {
+        sensorNodes.emplace_back(i);
+        simulator::addDevice([&node = sensorNodes.back()] { node.run(); },
+                             static_cast<uint64_t>(i * discoverySpacing) * 1000 * 1000);
+        simulator::setClockDrift(i, getNodeDrift(i, nodes, drift));
+    }
+
+    auto start{Clock::now()};
+    const double seconds{days * 24 * 3600.0};
+    simulator::run(static_cast<uint64_t>(seconds * 1e6));
+    simulator::stop();
+    double elapsed{std::chrono::duration<double>(Clock::now() - start).count()};
+
+    printf("Simulated %zu days of a gateway and %zu nodes in %.2f s (loss %.2f, seed %u, spread "
+           "%.0f dB, backlog %zu, drift %.0f ppm).\n",
+           days, nodes, elapsed, loss, seed, spread, backlog, drift);
+    size_t nRegistered{0}, nSampled{0}, nDelivered{0}, nPending{0};
+    float driftError{0}, maxDriftError{0};
+    Totals totals;
+    for (size_t i{1}; i <= nodes; i++)
+    {
+        float error{std::abs(clockDrifts[i].getPPM() - getNodeDrift(i, nodes, drift))};
+        driftError += error / nodes;
+        maxDriftError = std::max(maxDriftError, error);
+        nRegistered += registered[i];
+        nSampled += sampled[i];
+        nDelivered += delivered[i].size();
+        nPending += pending[i];
+        totals.add(simulator::getStats(i));
+    }
+    printf("  nodes discovered:           %10zu of %zu\n", nRegistered, nodes);
+    printf("  node comm periods:          %10zu successful, %zu failed, %zu backlog drains\n",
+           commPeriodsOk, commPeriodsFailed, drains);
+    printf("  configs kept / slots moved: %10zu / %zu, %zu beacons received\n", configsKept,
+           slotsMoved, beaconsReceived);
+    printf("  drift estimate error:       %10.2f ppm (max %.2f ppm)\n", driftError, maxDriftError);
+    printf("  first frame slot offset:    %10.1f ms (max %llu ms)\n",
+           slotOffsets > 0 ? static_cast<double>(slotOffsetSum) / slotOffsets : 0.0,
+           static_cast<unsigned long long>(maxSlotOffset));
+    printf("  entries delivered:          %10zu of %zu sampled (%.2f %%), %zu pending on nodes\n",
+           nDelivered, nSampled, nSampled > 0 ? 100.0 * nDelivered / nSampled : 0.0, nPending);
+
+    const simulator::DeviceStats& gatewayStats{simulator::getStats(0)};
+    printDevice("Gateway", gatewayStats, seconds, 1);
+    printf("  energy:                     %10.1f J (%.3f mA average)\n",
+           gatewayStats.getEnergy() / 1000, gatewayStats.getEnergy() / 3.3 / seconds);
+    if (nodes > 0)
+    {
+        printDevice("Node (average)", totals.stats, seconds, nodes);
+        double energy{0};
+        for (size_t i{1}; i <= nodes; i++)
+            energy += simulator::getStats(i).getEnergy();
+        energy /= nodes;
+        printf("  energy:                     %10.1f J (%.3f mA average, max %.3f mA)\n",
+               energy / 1000, energy / 3.3 / seconds, totals.maxEnergy / 3.3 / seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,190 @@
+#include "LogRecord.h"
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Host decoder of the binary log records stored by the logging module (lib/Logging/LogRecord.h).
+// Formats the output of the `printlogsraw` command (one hex encoded record per line) into the
+// lines `printlogs` prints: `log_decoder dump.txt [firmware.elf]`.
+//
+// String constants are stored as their address in the firmware's flash, and are resolved from
+// the given ELF file of the firmware. Records written by other builds than the given one, as
+// identified by the boot records preceding them, have their string constants printed as addresses.
+
+using namespace mirra;
+
+namespace
+{
+/// @brief Contents of the firmware ELF file.
+std::vector<uint8_t> elf;
+/// @brief Build ID of the firmware ELF file, as stored in boot records.
+uint32_t elfBuild;
+struct Section
+{
+    uint64_t address;
+    uint64_t offset;
+    uint64_t size;
+};
+/// @brief Sections of the ELF file holding data.
+std::vector<Section> sections;
+
+/// @return The first 4 bytes of the SHA-256 of the given data, big endian.
+uint32_t sha256Prefix(const std::vector<uint8_t>& data)
+{
+    static constexpr uint32_t k[64]{
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+        0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+        0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+        0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+        0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+        0xc67178f2};
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    uint32_t h[8]{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    std::vector<uint8_t> message{data};
+    message.push_back(0x80);
+    while (message.size() % 64 != 56)
+        message.push_back(0);
+    for (int i{7}; i >= 0; i--)
+        message.push_back(static_cast<uint64_t>(data.size()) * 8 >> (i * 8));
+    for (size_t chunk{0}; chunk < message.size(); chunk += 64)
+    {
+        uint32_t w[64];
+        for (size_t i{0}; i < 16; i++)
+            w[i] = message[chunk + 4 * i] << 24 | message[chunk + 4 * i + 1] << 16 |
+                   message[chunk + 4 * i + 2] << 8 | message[chunk + 4 * i + 3];
+        for (size_t i{16}; i < 64; i++)
+            w[i] = w[i - 16] + (rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                   w[i - 7] + (rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10));
+        uint32_t a{h[0]}, b{h[1]}, c{h[2]}, d{h[3]}, e{h[4]}, f{h[5]}, g{h[6]}, hh{h[7]};
+        for (size_t i{0}; i < 64; i++)
+        {
+            uint32_t t1{hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                        k[i] + w[i]};
+            uint32_t t2{(rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c))};
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e, h[5] += f, h[6] += g, h[7] += hh;
+    }
+    return h[0];
+}
+
+template <class T> uint64_t readElf(size_t offset)
+{
+    T value{0};
+    if (offset + sizeof(T) <= elf.size())
+        std::memcpy(&value, &elf[offset], sizeof(T));
+    return value;
+}
+
+/// @brief Loads the sections of a little endian ELF file, of either class.
+bool loadElf(const char* path)
+{
+    FILE* file{std::fopen(path, "rb")};
+    if (!file)
+    {
+        std::perror(path);
+        return false;
+    }
+    uint8_t buffer[4096];
+    for (size_t read; (read = std::fread(buffer, 1, sizeof(buffer), file)) > 0;)
+        elf.insert(elf.end(), buffer, buffer + read);
+    std::fclose(file);
+    static constexpr uint8_t magic[]{0x7F, 'E', 'L', 'F'};
+    if (elf.size() < 64 || std::memcmp(elf.data(), magic, sizeof(magic)) != 0 || elf[5] != 1)
+    {
+        std::fprintf(stderr, "'%s' is not a little endian ELF file.\n", path);
+        return false;
+    }
+    const bool is64{elf[4] == 2};
+    const uint64_t headers{is64 ? readElf<uint64_t>(0x28) : readElf<uint32_t>(0x20)};
+    const uint64_t headerSize{readElf<uint16_t>(is64 ? 0x3A : 0x2E)};
+    const uint64_t nHeaders{readElf<uint16_t>(is64 ? 0x3C : 0x30)};
+    for (uint64_t i{0}; i < nHeaders; i++)
+    {
+        size_t header{static_cast<size_t>(headers + i * headerSize)};
+        static constexpr uint32_t progbits{1};
+        if (readElf<uint32_t>(header + 4) != progbits)
+            continue;
+        Section section{is64 ? readElf<uint64_t>(header + 0x10) : readElf<uint32_t>(header + 0x0C),
+                        is64 ? readElf<uint64_t>(header + 0x18) : readElf<uint32_t>(header + 0x10),
+                        is64 ? readElf<uint64_t>(header + 0x20) : readElf<uint32_t>(header + 0x14)};
+        if (section.address != 0 && section.offset + section.size <= elf.size())
+            sections.push_back(section);
+    }
+    elfBuild = sha256Prefix(elf);
+    return true;
+}
+
+const char* resolve(uint32_t address, uint32_t build)
+{
+    if (elf.empty() || build != elfBuild)
+        return nullptr;
+    for (const Section& section : sections)
+    {
+        if (address < section.address || address >= section.address + section.size)
+            continue;
+        size_t offset{static_cast<size_t>(section.offset + address - section.address)};
+        const char* string{reinterpret_cast<const char*>(&elf[offset])};
+        size_t left{static_cast<size_t>(section.address + section.size - address)};
+        return std::memchr(string, '\0', left) != nullptr ? string : nullptr;
+    }
+    return nullptr;
+}
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::fprintf(stderr, "Usage: %s dump.txt [firmware.elf]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+    {
+        if (!loadElf(argv[2]))
+            return 1;
+        std::fprintf(stderr, "Resolving string constants of build %08" PRIx32 ".\n", elfBuild);
+    }
+    FILE* file{std::fopen(argv[1], "r")};
+    if (!file)
+    {
+        std::perror(argv[1]);
+        return 1;
+    }
+    char text[2 * LogRecord::maxSize + 8];
+    uint32_t build{0};
+    size_t records{0}, malformed{0};
+    while (std::fgets(text, sizeof(text), file))
+    {
+        uint8_t record[LogRecord::maxSize];
+        size_t size{0};
+        unsigned int byte;
+        while (size < sizeof(record) && std::sscanf(&text[2 * size], "%2x", &byte) == 1)
+            record[size++] = byte;
+        // skip lines that are not records, such as the command prompt
+        if (size < LogRecord::headerSize || size != LogRecord::getSize(record))
+            continue;
+        char line[256];
+        size_t length{LogRecord::format(record, line, sizeof(line), resolve, build)};
+        if (length == 0)
+            malformed++;
+        std::fwrite(line, 1, length, stdout);
+        records++;
+    }
+    std::fclose(file);
+    std::fprintf(stderr, "Decoded %zu records, of which %zu malformed.\n", records, malformed);
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include "LoRaSimulator.h"
+#include "SlotScheduler.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+// Host check of the slot scheduler with which the gateway packs the comm periods of its nodes
+// (lib/LoRaModule/SlotScheduler.h): `slot_schedule [seed]`. Checks that
+//  - the time on air the slots are sized with matches the simulated channel of lib/LoRaSimulator,
+//  - 20 to 500 nodes registered one by one are packed back-to-back into a single comm interval,
+//    and that nodes are refused once the comm interval is full,
+//  - the schedule stays free of overlaps over many comm periods in which nodes leave, join and
+//    miss their comm period, and is free of gaps after every comm period without misses.
+// The scheduling logic of Gateway::discovery and Gateway::commPeriod is mirrored below. Exits with
+// 1 if any check fails.
+
+using namespace mirra;
+
+namespace
+{
+// Settings mirroring gateway/config.h and gateway/gateway.h.
+constexpr uint32_t commPeriodPadding{500}; // ms, COMM_PERIOD_PADDING
+constexpr uint32_t commInterval{60 * 60};  // s, DEFAULT_COMM_INTERVAL
+constexpr uint32_t intervalMs{commInterval * 1000};
+constexpr uint32_t sampleInterval{20 * 60};
+constexpr uint32_t defaultEntryLength{32}; // bytes, DEFAULT_ENTRY_LENGTH
+constexpr uint32_t maxMessages{(3 * commInterval / (2 * sampleInterval)) + 1};
+/// @brief Length in ms of a slot before slots were sized from the time on air: the timeouts of all
+/// messages of a comm period, and the padding of 3 s of the time base of whole seconds.
+constexpr uint32_t timeoutSlotLength{maxMessages * 6000 + 6000 + 3000};
+
+size_t failures{0};
+
+void check(bool condition, const char* what, size_t nodes)
+{
+    if (condition)
+        return;
+    printf("ERROR: %s (%zu nodes)\n", what, nodes);
+    failures++;
+}
+
+/// @brief SLOT_LENGTH
+uint32_t getSlotLength(uint32_t entryLength)
+{
+    return getCommPeriodDuration(maxMessages, entryLength) + commPeriodPadding;
+}
+
+/// @brief The gateway's view of a node.
+struct Node
+{
+    uint64_t nextCommTime;
+    uint32_t slotLength;
+    /// @brief Length of the node's entries, which the gateway learns in its first comm period.
+    uint32_t entryLength;
+};
+
+/// @brief Gateway::discovery and Gateway::nextScheduledCommTime: registers a node if its slot fits.
+bool join(std::vector<Node>& nodes, uint64_t cTime, uint32_t entryLength)
+{
+    const uint32_t slotLength{getSlotLength(defaultEntryLength)};
+    if (nodes.empty())
+    {
+        nodes.push_back(Node{cTime + intervalMs, slotLength, entryLength});
+        return true;
+    }
+    uint64_t start{static_cast<uint64_t>(-1)};
+    for (const Node& n : nodes)
+        start = std::min(start, n.nextCommTime);
+    SlotScheduler schedule{start, intervalMs};
+    for (const Node& n : nodes)
+        schedule.occupy(n.nextCommTime, n.slotLength);
+    if (!schedule.fits(slotLength))
+        return false;
+    nodes.push_back(Node{schedule.reserve(slotLength), slotLength, entryLength});
+    return true;
+}
+
+/// @brief Gateway::commPeriod, in which every node misses its comm period with the given
+/// probability.
+/// @return The amount of nodes that missed their comm period.
+size_t commPeriod(std::vector<Node>& nodes, std::mt19937& random, double missRate)
+{
+    std::sort(nodes.begin(), nodes.end(),
+              [](const Node& a, const Node& b) { return a.nextCommTime < b.nextCommTime; });
+    SlotScheduler schedule{nodes.front().nextCommTime + intervalMs, intervalMs};
+    std::bernoulli_distribution miss{missRate};
+    size_t misses{0};
+    for (Node& n : nodes)
+    {
+        if (miss(random))
+        {
+            misses++;
+            n.nextCommTime += intervalMs;
+            check(schedule.occupy(n.nextCommTime, n.slotLength),
+                  "slot of a node that missed its comm period overlaps", nodes.size());
+            continue;
+        }
+        n.slotLength = getSlotLength(n.entryLength);
+        n.nextCommTime = schedule.reserve(n.slotLength);
+    }
+    return misses;
+}
+
+/// @brief Checks that no slots overlap and that all slots lie within a single comm interval.
+/// @return The total length of the gaps between slots.
+uint64_t validate(std::vector<Node> nodes)
+{
+    std::sort(nodes.begin(), nodes.end(),
+              [](const Node& a, const Node& b) { return a.nextCommTime < b.nextCommTime; });
+    uint64_t gaps{0};
+    for (size_t i{1}; i < nodes.size(); i++)
+    {
+        const uint64_t end{nodes[i - 1].nextCommTime + nodes[i - 1].slotLength};
+        check(end <= nodes[i].nextCommTime, "slots overlap", nodes.size());
+        if (end < nodes[i].nextCommTime)
+            gaps += nodes[i].nextCommTime - end;
+    }
+    check(nodes.back().nextCommTime + nodes.back().slotLength <=
+              nodes.front().nextCommTime + intervalMs,
+          "slots exceed the comm interval", nodes.size());
+    return gaps;
+}
+
+uint32_t getCycleLength(const std::vector<Node>& nodes)
+{
+    uint64_t start{static_cast<uint64_t>(-1)}, end{0};
+    for (const Node& n : nodes)
+    {
+        start = std::min(start, n.nextCommTime);
+        end = std::max(end, n.nextCommTime + n.slotLength);
+    }
+    return static_cast<uint32_t>(end - start);
+}
+}
+
+int main(int argc, char** argv)
+{
+    const uint32_t seed{argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 1};
+    std::mt19937 random{seed};
+    std::uniform_int_distribution<uint32_t> entryLength{16, defaultEntryLength};
+    const uint64_t epoch{1704067200000};
+
+    size_t mismatches{0};
+    for (size_t length{0}; length <= MessageHeader::maxLength; length++)
+    {
+        if (getTimeOnAir(length) != simulator::getAirtime(simulator::RadioConfig{}, length))
+            mismatches++;
+    }
+    check(mismatches == 0, "time on air differs from the simulated channel", 0);
+    printf("Slot of %u entries of %u bytes: %u ms comm period, %u ms slot (%u ms when sized by "
+           "timeouts).\n",
+           maxMessages, defaultEntryLength, getCommPeriodDuration(maxMessages, defaultEntryLength),
+           getSlotLength(defaultEntryLength), timeoutSlotLength);
+
+    printf("%8s %10s %12s %12s %12s %12s\n", "nodes", "scheduled", "cycle (s)", "per node (s)",
+           "by timeouts", "fit (timeouts)");
+    for (size_t nNodes : {20, 50, 100, 200, 500, 1000})
+    {
+        std::vector<Node> nodes;
+        size_t refused{0};
+        for (size_t i{0}; i < nNodes; i++)
+        {
+            if (!join(nodes, epoch + i * 20000, entryLength(random)))
+                refused++;
+        }
+        check(validate(nodes) == 0, "registered nodes are not packed back-to-back", nNodes);
+        // the slots shrink to the nodes' actual entries in the first comm period
+        commPeriod(nodes, random, 0);
+        check(validate(nodes) == 0, "slots are not packed back-to-back", nNodes);
+        const size_t fitting{intervalMs / getSlotLength(defaultEntryLength)};
+        check(nodes.size() == std::min(nNodes, fitting), "nodes refused while slots were free",
+              nNodes);
+        const uint32_t cycle{getCycleLength(nodes)};
+        printf("%8zu %10zu %12.1f %12.2f %12.1f %12zu\n", nNodes, nodes.size(), cycle / 1000.0,
+               cycle / 1000.0 / nodes.size(), nodes.size() * timeoutSlotLength / 1000.0,
+               std::min<size_t>(nNodes, intervalMs / timeoutSlotLength));
+    }
+
+    // churn: every comm period, some nodes leave, new ones join, and some miss their comm period
+    for (size_t nNodes : {20, 200, 500})
+    {
+        std::vector<Node> nodes;
+        for (size_t i{0}; i < nNodes; i++)
+            join(nodes, epoch, entryLength(random));
+        std::bernoulli_distribution leave{0.02};
+        size_t left{0}, joined{0}, missed{0};
+        for (size_t cycle{0}; cycle < 1000; cycle++)
+        {
+            const size_t before{nodes.size()};
+            nodes.erase(std::remove_if(nodes.begin(), nodes.end(),
+                                       [&](const Node&) { return leave(random); }),
+                        nodes.end());
+            left += before - nodes.size();
+            const uint64_t cTime{nodes.front().nextCommTime - intervalMs / 2};
+            while (nodes.size() < nNodes && join(nodes, cTime, entryLength(random)))
+                joined++;
+            const size_t misses{commPeriod(nodes, random, 0.05)};
+            missed += misses;
+            const uint64_t gaps{validate(nodes)};
+            if (misses == 0)
+                check(gaps == 0, "slots are not packed back-to-back after a comm period", nNodes);
+        }
+        printf("%zu nodes, 1000 comm periods: %zu left, %zu joined, %zu missed, cycle %.1f s\n",
+               nNodes, left, joined, missed, getCycleLength(nodes) / 1000.0);
+    }
+
+    if (failures > 0)
+    {
+        printf("%zu checks failed.\n", failures);
+        return 1;
+    }
+    printf("All checks passed.\n");
+    return 0;
+}
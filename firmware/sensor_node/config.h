@@ -10,8 +10,10 @@
 
 // Communication and sensor settings
 #define WAKE_BEFORE_COMM_PERIOD                                                                    \
-    3 // s, time before comm period when node should wake from deep sleep
+    3000 // ms, time before comm period when node should wake from deep sleep
 #define WAKE_COMM_PERIOD(X) ((X)-WAKE_BEFORE_COMM_PERIOD)
+#define BEACON_GUARD                                                                               \
+    3000 // ms, time before and after the beacon time during which the node listens for the beacon
 
 #define DEFAULT_SAMPLING_INTERVAL                                                                  \
     (60 * 60) // s, default sensor sampling interval to resort to when no communication with gateway
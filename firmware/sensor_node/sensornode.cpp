@@ -17,9 +17,15 @@ RTC_DATA_ATTR uint32_t sampleRounding{DEFAULT_SAMPLING_ROUNDING};
 RTC_DATA_ATTR uint32_t sampleOffset{DEFAULT_SAMPLING_OFFSET};
 RTC_DATA_ATTR uint32_t nextSampleTime = -1;
 RTC_DATA_ATTR uint32_t commInterval;
-RTC_DATA_ATTR uint32_t nextCommTime = -1;
+/// @brief The start of the next comm period and the time of the beacon before it (UNIX epoch, ms).
+RTC_DATA_ATTR uint64_t nextCommTime = -1;
+RTC_DATA_ATTR uint64_t nextBeaconTime = -1;
+/// @brief Whether the last comm period succeeded, else the node listens for the next beacon.
+RTC_DATA_ATTR bool synced{true};
 RTC_DATA_ATTR uint32_t maxMessages;
 RTC_DATA_ATTR MACAddress gatewayMAC;
+RTC_DATA_ATTR uint16_t shortAddress{0};
+RTC_DATA_ATTR PHYSettings phySettings{LoRaModule::defaultSettings};
 
 SensorNode::SensorNode(const MIRRAPins& pins) : MIRRAModule(pins)
 {
@@ -34,50 +40,65 @@ SensorNode::SensorNode(const MIRRAPins& pins) : MIRRAModule(pins)
 
 void SensorNode::wake()
 {
-    Log::debug("Running wake()...");
-    uint32_t cTime{rtc.getSysTime()};
+    LOG_DEBUG("Running wake()...");
+    uint64_t cTime{rtc.getSysTimeMs()};
+    // the clock is corrected and the first frame is sent to the ms, for which the system time is
+    // aligned with the RTC first
+    if ((!synced && cTime >= WAKE_COMM_PERIOD(nextBeaconTime - BEACON_GUARD)) ||
+        cTime >= WAKE_COMM_PERIOD(nextCommTime))
+        syncTime(true);
+    cTime = rtc.getSysTimeMs();
+    if (!synced && cTime >= WAKE_COMM_PERIOD(nextBeaconTime - BEACON_GUARD))
+        beaconPeriod();
+    cTime = rtc.getSysTimeMs();
     if (cTime >= WAKE_COMM_PERIOD(nextCommTime))
+    {
+        lora.startSession(gatewayMAC, shortAddress, true);
         commPeriod();
-    cTime = rtc.getSysTime();
-    if (cTime >= nextSampleTime)
+        lora.endSession();
+    }
+    if (rtc.getSysTime() >= nextSampleTime)
     {
         samplePeriod();
     }
-    cTime = rtc.getSysTime();
-    Log::info("Next sample in ", nextSampleTime - cTime, "s, next comm period in ",
-              nextCommTime - cTime, "s");
+    cTime = rtc.getSysTimeMs();
+    LOG_INFO("Next sample in ", static_cast<uint32_t>(nextSampleTime - cTime / 1000),
+             "s, next comm period in ", static_cast<uint32_t>((nextCommTime - cTime) / 1000), "s");
     Serial.printf("Welcome! This is Sensor Node %s\n", lora.getMACAddress().toString());
     commandEntry.prompt(Commands(this));
-    cTime = rtc.getSysTime();
-    if (cTime >= nextCommTime || cTime >= nextSampleTime)
+    cTime = rtc.getSysTimeMs();
+    if (cTime >= nextCommTime || cTime / 1000 >= nextSampleTime)
         wake();
-    Log::debug("Entering deep sleep...");
-    deepSleepUntil(std::min(WAKE_COMM_PERIOD(nextCommTime), nextSampleTime));
+    LOG_DEBUG("Entering deep sleep...");
+    uint64_t wakeTime{std::min<uint64_t>(WAKE_COMM_PERIOD(nextCommTime), nextSampleTime * 1000ULL)};
+    if (!synced)
+        wakeTime = std::min<uint64_t>(wakeTime, WAKE_COMM_PERIOD(nextBeaconTime - BEACON_GUARD));
+    deepSleepUntil(wakeTime);
 }
 
 void SensorNode::discovery()
 {
-    Log::info("Sending hello message...");
+    LOG_INFO("Sending hello message...");
     lora.sendMessage(Message<HELLO>(lora.getMACAddress(), MACAddress::broadcast));
-    Log::debug("Awaiting time config message...");
+    LOG_DEBUG("Awaiting time config message...");
     auto timeConfig{lora.receiveMessage<TIME_CONFIG>(TIME_CONFIG_TIMEOUT, TIME_CONFIG_ATTEMPTS,
                                                      MACAddress::broadcast)};
     const MACAddress& gatewayMAC{timeConfig->getSource()};
     if (!timeConfig)
     {
-        Log::error("Error while awaiting time config message from gateway. Aborting discovery.");
+        LOG_ERROR("Error while awaiting time config message from gateway. Aborting discovery.");
         return;
     }
     this->timeConfig(*timeConfig);
-    Log::debug("Time config message received. Sending TIME_ACK");
-    lora.sendMessage(Message<ACK_TIME>(lora.getMACAddress(), gatewayMAC));
+    LOG_DEBUG("Time config message received. Sending TIME_ACK");
+    lora.sendMessage(
+        Message<ACK_TIME>(lora.getMACAddress(), gatewayMAC, getClockDrift().getPPM()));
     lora.receiveMessage<REPEAT>(TIME_CONFIG_TIMEOUT, 0, gatewayMAC);
 }
 
 void SensorNode::timeConfig(Message<TIME_CONFIG>& m)
 {
-    rtc.writeTime(m.getCTime());
-    rtc.setSysTime();
+    correctTime(m.getCTime() + lora.getMessageAge());
     bool scheduleValid{sampleInterval == m.getSampleInterval() &&
                        sampleRounding == m.getSampleRounding() &&
                        sampleOffset == m.getSampleOffset()};
@@ -86,16 +107,73 @@ void SensorNode::timeConfig(Message<TIME_CONFIG>& m)
     sampleOffset = m.getSampleOffset();
     commInterval = m.getCommInterval();
     nextCommTime = m.getCommTime();
+    nextBeaconTime = m.getBeaconTime();
+    synced = true;
     maxMessages = m.getMaxMessages();
     gatewayMAC = m.getSource();
+    shortAddress = m.getShortAddress();
+    // applied from the next comm period on, the time config is still acknowledged with the
+    // current settings
+    phySettings = m.getSettings();
     if (!scheduleValid)
     {
         sensorsNextSampleTimes.fill(0);
         initSensors();
         clearSensors();
     }
-    Log::info("Sample interval: ", sampleInterval, ", Comm interval: ", commInterval,
-              ", Max messages: ", maxMessages, ", Gateway MAC: ", gatewayMAC.toString());
+    LOG_INFO("Sample interval: ", sampleInterval, ", Comm interval: ", commInterval,
+             ", Max messages: ", maxMessages, ", Gateway MAC: ", gatewayMAC.toString(),
+             ", Short address: ", static_cast<uint32_t>(shortAddress),
+             ", Spreading factor: ", static_cast<uint32_t>(m.getSettings().spreadingFactor));
+}
+
+void SensorNode::keepTimeConfig()
+{
+    nextCommTime += commInterval * 1000ULL;
+    nextBeaconTime += commInterval * 1000ULL;
+    synced = true;
+    LOG_INFO("Configuration kept, next comm period in ",
+             static_cast<uint32_t>((nextCommTime - rtc.getSysTimeMs()) / 1000), "s");
+}
+
+void SensorNode::naiveTimeConfig(uint64_t cTime)
+{
+    while (nextCommTime <= cTime)
+        nextCommTime += commInterval * 1000ULL;
+    while (nextBeaconTime <= cTime)
+        nextBeaconTime += commInterval * 1000ULL;
+    maxMessages = getFallbackMessages(maxMessages, phySettings);
+    phySettings = LoRaModule::defaultSettings;
+    synced = false;
+}
+
+void SensorNode::beaconPeriod()
+{
+    uint64_t cTime{rtc.getSysTimeMs()};
+    if (cTime >= nextBeaconTime + BEACON_GUARD)
+    {
+        LOG_ERROR("Too late to listen for the beacon. Skipping.");
+        while (nextBeaconTime + BEACON_GUARD <= cTime)
+            nextBeaconTime += commInterval * 1000ULL;
+        return;
+    }
+    lora.configure(LoRaModule::defaultSettings);
+    lightSleepUntil(nextBeaconTime - BEACON_GUARD);
+    LOG_INFO("Awaiting beacon from gateway ", gatewayMAC.toString(), " ...");
+    cTime = rtc.getSysTimeMs();
+    auto beacon{lora.receiveMessage<BEACON>(
+        static_cast<uint32_t>(nextBeaconTime + BEACON_GUARD - cTime), 0, gatewayMAC)};
+    nextBeaconTime += commInterval * 1000ULL;
+    if (!beacon)
+    {
+        LOG_ERROR("Error while awaiting beacon from gateway.");
+        return;
+    }
+    correctTime(beacon->getCTime() + lora.getMessageAge());
+    if (uint64_t commTime{beacon->getCommTime(shortAddress)})
+        nextCommTime = commTime;
+    LOG_INFO("Beacon received, next comm period in ",
+             static_cast<uint32_t>((nextCommTime - rtc.getSysTimeMs()) / 1000), "s");
 }
 
 void SensorNode::addSensor(std::unique_ptr<Sensor>&& sensor)
@@ -144,17 +222,17 @@ void SensorNode::clearSensors()
 
 SensorNode::SensorFile::DataEntry SensorNode::sampleAll()
 {
-    Log::info("Sampling all sensors...");
+    LOG_INFO("Sampling all sensors...");
     for (size_t i{0}; i < nSensors; i++)
     {
         Serial.printf("Starting measurement for %u\n", sensors[i]->getTypeTag());
         sensors[i]->startMeasurement();
     }
-    SensorFile::DataEntry::SensorValueArray values;
+    SensorFile::DataEntry::SensorValues values;
     for (size_t i{0}; i < nSensors; i++)
     {
         Serial.printf("Getting measurement for %u\n", sensors[i]->getTypeTag());
-        values[i] = sensors[i]->getMeasurement();
+        values.push(sensors[i]->getMeasurement());
     }
     return SensorFile::DataEntry{
         lora.getMACAddress(), 0,
@@ -163,19 +241,19 @@ SensorNode::SensorFile::DataEntry SensorNode::sampleAll()
 
 SensorNode::SensorFile::DataEntry SensorNode::sampleScheduled(uint32_t cTime)
 {
-    Log::info("Sampling scheduled sensors...");
+    LOG_INFO("Sampling scheduled sensors...");
     for (size_t i{0}; i < nSensors; i++)
     {
         if (sensors[i]->getNextSampleTime() == cTime)
             sensors[i]->startMeasurement();
     }
-    SensorFile::DataEntry::SensorValueArray values;
+    SensorFile::DataEntry::SensorValues values;
     uint8_t nValues{0};
     for (size_t i{0}; i < nSensors; i++)
     {
         if (sensors[i]->getNextSampleTime() == cTime)
         {
-            values[nValues] = sensors[i]->getMeasurement();
+            values.push(sensors[i]->getMeasurement());
             nValues++;
         }
     }
@@ -210,86 +288,148 @@ void SensorNode::samplePeriod()
 
 void SensorNode::commPeriod()
 {
-    uint32_t cTime{rtc.getSysTime()};
-    if (cTime >= nextCommTime + (SENSOR_DATA_TIMEOUT / 1000))
+    uint64_t cTime{rtc.getSysTimeMs()};
+    if (cTime >= nextCommTime + SENSOR_DATA_TIMEOUT)
     {
-        Log::error("Too late to start comm period. Skipping and assuming next comm period from "
-                   "given interval.");
-        while (nextCommTime <= cTime)
-            nextCommTime += commInterval;
+        LOG_ERROR("Too late to start comm period. Skipping and assuming next comm period from "
+                  "given interval.");
+        naiveTimeConfig(cTime);
         return;
     }
+    lora.configure(phySettings);
     MACAddress _gatewayMAC{gatewayMAC}; // avoid access to slow RTC memory
-    Log::info("Communicating with gateway ", _gatewayMAC.toString(), " ...");
+    LOG_INFO("Communicating with gateway ", _gatewayMAC.toString(), " ...");
     size_t _maxMessages{maxMessages}; // avoid access to slow RTC memory
-    Log::debug("Max messages to send: ", _maxMessages);
+    LOG_DEBUG("Max messages to send: ", _maxMessages);
     SensorFile file{};
-    bool firstMessage{true};
-    for (size_t i{0}; i < _maxMessages; i++)
+    // frames are sent in bursts of up to a window, of which the gateway acks the received frames,
+    // so that only the lost ones are sent again
+    struct Frame
     {
-        auto entry = file.getUnuploaded(0);
-        if (!entry)
-            break;
-
-        Message<SENSOR_DATA> message{entry->source, _gatewayMAC, entry->time, entry->flags.nValues,
-                                     entry->values};
-        if ((i == _maxMessages - 1) || (file.isLast(0)))
+        Message<SENSOR_DATA_BATCH> message;
+        size_t nEntries;
+        bool acked;
+    };
+    std::vector<Frame> window{};
+    uint8_t nextSeq{0};
+    size_t entriesQueued{0};   // entries put in frames in this comm period
+    size_t entriesInWindow{0}; // entries in frames not marked as uploaded yet
+    bool lastQueued{false};
+    bool firstFrame{true};
+    size_t attempts{0};
+    while (true)
+    {
+        while (!lastQueued && window.size() < Message<ACK_DATA>::window)
         {
-            Log::debug("Last sensor data message...");
-            message.setLast();
+            // fill the frame greedily with as many unuploaded entries as fit
+            Message<SENSOR_DATA_BATCH> message{lora.getMACAddress(), _gatewayMAC, nextSeq};
+            size_t nEntries{0};
+            while (entriesQueued + nEntries < _maxMessages)
+            {
+                auto entry = file.getUnuploaded(entriesInWindow + nEntries);
+                if (!entry || !message.push(entry->getTime(), entry->getValues(),
+                                                    entry->getValuesSize()))
+                    break;
+                nEntries++;
+            }
+            if (nEntries == 0)
+                break;
+            entriesQueued += nEntries;
+            entriesInWindow += nEntries;
+            if ((entriesQueued >= _maxMessages) || (file.isLast(entriesInWindow - 1)))
+            {
+                LOG_DEBUG("Last sensor data message...");
+                message.setLast();
+                lastQueued = true;
+            }
+            LOG_DEBUG("Sensor data message ", static_cast<uint32_t>(nextSeq), " holds ", nEntries,
+                      " entries.");
+            window.push_back({message, nEntries, false});
+            nextSeq = (nextSeq + 1) % Message<SENSOR_DATA_BATCH>::seqModulo;
         }
-        if (sendSensorMessage(message, firstMessage))
-            file.setUploaded();
-        firstMessage = false;
-    }
-}
-
-bool SensorNode::sendSensorMessage(Message<SENSOR_DATA>& message, bool firstMessage)
-{
-    Log::debug("Sending data message...");
-    if (firstMessage)
-    {
-        lightSleepUntil(nextCommTime);
-        lora.sendMessage(message, 0); // gateway should already be listening for first message
-    }
-    else
-    {
-        lora.sendMessage(message);
-    }
-    Log::debug("Awaiting acknowledgement...");
-    if (!message.isLast())
-    {
-        auto dataAck{lora.receiveMessage<ACK_DATA>(SENSOR_DATA_TIMEOUT, SENSOR_DATA_ATTEMPTS,
-                                                   message.getDest())};
-        if (dataAck)
+        if (window.empty())
+            return;
+        LOG_DEBUG("Sending data messages...");
+        auto poll{std::find_if(window.rbegin(), window.rend(),
+                               [](const Frame& frame) { return !frame.acked; })};
+        bool burstStart{true};
+        for (Frame& frame : window)
         {
-            return 1;
+            if (frame.acked)
+                continue;
+            frame.message.setPoll(&frame == &*poll);
+            if (firstFrame)
+            {
+                lightSleepUntil(nextCommTime);
+                lora.sendMessage(frame.message, 0); // gateway should already be listening
+                firstFrame = false;
+            }
+            else
+            {
+                lora.sendMessage(frame.message, burstStart ? RX_SETUP_TIME : FRAME_GAP);
+            }
+            burstStart = false;
         }
-        else
+        LOG_DEBUG("Awaiting acknowledgement...");
+        bool configured{false};
+        bool progress{false};
+        lora.receiveAny(
+            getReplyTimeout(lora.getSettings()), _gatewayMAC,
+            [&](Message<TIME_CONFIG>& message) {
+                // the gateway only replies with a time config once it received all frames
+                for (size_t i{0}; i < entriesInWindow; i++)
+                    file.setUploaded();
+                timeConfig(message);
+                configured = true;
+            },
+            [&](Message<ACK_DATA>& ack) {
+                for (Frame& frame : window)
+                {
+                    if (!frame.acked && ack.acknowledges(frame.message.getSeq()))
+                    {
+                        frame.acked = true;
+                        progress = true;
+                    }
+                }
+            });
+        if (configured)
         {
-            Log::error("Error while uploading to gateway.");
-            return 0;
+            lora.sendMessage(
+                Message<ACK_TIME>(lora.getMACAddress(), _gatewayMAC, getClockDrift().getPPM()));
+            lora.receiveMessage<REPEAT>(TIME_CONFIG_TIMEOUT, 0, _gatewayMAC);
+            return;
         }
-    }
-    else
-    {
-        auto timeConfig{lora.receiveMessage<TIME_CONFIG>(TIME_CONFIG_TIMEOUT, TIME_CONFIG_ATTEMPTS,
-                                                         message.getDest())};
-        if (timeConfig)
+        // entries are marked as uploaded in order, so a frame acked out of order waits for the
+        // frames before it
+        while (!window.empty() && window.front().acked)
+        {
+            for (size_t i{0}; i < window.front().nEntries; i++)
+                file.setUploaded();
+            entriesInWindow -= window.front().nEntries;
+            window.erase(window.begin());
+        }
+        if (lastQueued && window.empty())
+        {
+            // the gateway acked the last frame instead of sending a time config
+            keepTimeConfig();
+            lora.sendMessage(
+                Message<ACK_TIME>(lora.getMACAddress(), _gatewayMAC, getClockDrift().getPPM()));
+            lora.receiveMessage<REPEAT>(TIME_CONFIG_TIMEOUT, 0, _gatewayMAC);
+            return;
+        }
+        if (progress)
         {
-            this->timeConfig(*timeConfig);
-            lora.sendMessage(Message<ACK_TIME>(lora.getMACAddress(), message.getDest()));
-            lora.receiveMessage<REPEAT>(TIME_CONFIG_TIMEOUT, 0, gatewayMAC);
-            return 1;
+            attempts = 0;
+            continue;
         }
-        else
+        if (attempts++ >= SENSOR_DATA_ATTEMPTS)
         {
-            Log::error("Error while receiving new time config from gateway. Assuming next comm "
-                       "period from given interval.");
-            while (nextCommTime <= rtc.getSysTime())
-                nextCommTime += commInterval;
-            return 0;
+            LOG_ERROR("Error while uploading to gateway. Assuming next comm period from given "
+                      "interval.");
+            naiveTimeConfig(rtc.getSysTimeMs());
+            return;
         }
+        LOG_ERROR("No acknowledgement received, resending unacknowledged data messages.");
     }
 }
 
@@ -308,11 +448,10 @@ CommandCode SensorNode::Commands::printSample()
 {
     parent->initSensors();
     SensorFile::DataEntry entry{parent->sampleAll()};
-    const auto& values = entry.values;
     Serial.println("TAG\tVALUE");
-    for (size_t i{0}; i < entry.flags.nValues; i++)
+    for (const SensorValue& value : entry.values)
     {
-        Serial.printf("%u\t%f\n", values[i].typeTag, values[i].value);
+        Serial.printf("%u\t%f\n", value.typeTag, value.value);
     }
     parent->clearSensors();
     return COMMAND_SUCCESS;
@@ -1,7 +1,9 @@
 #ifndef __SENSORNODE_H__
 #define __SENSORNODE_H__
 
+#include "LinkAdaptation.h"
 #include "MIRRAModule.h"
+#include "SelectiveRepeat.h"
 #include "config.h"
 #include <vector>
 
@@ -47,6 +49,16 @@ private:
     /// @brief Configures this node with a time config message.
     /// @param m Time Config message used to saturate the communication attributes.
     void timeConfig(Message<TIME_CONFIG>& m);
+    /// @brief Keeps the current configuration for the next comm period, as the gateway only acks
+    /// the data of a node whose configuration is unchanged.
+    void keepTimeConfig();
+    /// @brief Assumes the next comm period from the comm interval after a failed comm period, and
+    /// falls back to the default settings. The node then listens for the next beacon.
+    /// @param cTime The current time (UNIX epoch, ms).
+    void naiveTimeConfig(uint64_t cTime);
+    /// @brief Listens for the beacon of the gateway around its expected time, and corrects the
+    /// clock and comm time of this node with it (see Message<BEACON>).
+    void beaconPeriod();
 
     /// @brief Loads a sensor and its associated scheduled sampling time.
     /// @param sensor Sensor to load.
@@ -70,16 +82,11 @@ private:
     /// @brief Initiates a sampling period.
     void samplePeriod();
 
-    /// @brief Uploads sensor data messages to the gateway, and marks them as uploaded if
-    /// successful.
+    /// @brief Uploads sensor data messages to the gateway in bursts, resending the ones the
+    /// gateway did not acknowledge, and marks their entries as uploaded once acknowledged. The
+    /// gateway replies to the last burst with a time configuration, or with an ack if the
+    /// configuration is unchanged.
     void commPeriod();
-    /// @brief Sends a single sensor message to the gateway, handling both acknowledgement and, if
-    /// it is the last message, time configuration.
-    /// @param message The message to send.
-    /// @param dest The gateway MAC address.
-    /// @param firstMessage Whether the message is the first in the 'conversation' or not.
-    /// @return Whether the sent message was successfully acknowledged or not.
-    bool sendSensorMessage(Message<SENSOR_DATA>& message, bool firstMessage);
 
     std::array<std::unique_ptr<Sensor>, MAX_SENSORS> sensors;
     size_t nSensors{0};
@@ -26,10 +26,9 @@ void setup(void)
 
     printf("AFTER COMMIT:\n");
     {
-        fs::NVS nvs{"logs"};
+        Log::File file{};
 
-        printf("tail: %u, size: %u, head: %u\n", size_t(nvs.getValue<size_t>("tail", 0)),
-               size_t(nvs.getValue<size_t>("size", 0)), size_t(nvs.getValue<size_t>("head", 0)));
+        printf("size: %u\n", file.getSize());
     }
 
     // Restart module
@@ -35,28 +35,64 @@ async def add_measurement(
     return measurement
 
 
+# Mirror of the value encoding registry of the firmware (firmware/lib/SensorInterface/SensorEncoding.h),
+# keyed by sensor key: (struct format, scale, offset). Sensor keys not listed are float32.
+VALUE_ENCODINGS: dict[int, tuple[str, float, float]] = {
+    1: ("<h", 0.001, 0),  # BATTERY_KEY
+    3: ("<h", 1, 0),  # SOIL_MOISTURE_KEY
+    4: ("<h", 0.01, 0),  # SOIL_TEMPERATURE_KEY
+    12: ("<h", 0.01, 0),  # TEMP_SHT_KEY
+    13: ("<h", 0.01, 0),  # HUMI_SHT_KEY
+    22: ("<e", 4, 0),  # LIGHT_KEY
+    100: ("<h", 1, 0),  # RANDOM_KEY
+}
+DEFAULT_VALUE_ENCODING: tuple[str, float, float] = ("<f", 1, 0)
+FIXED_NAN: int = -(2**15)
+
+
+def decode_value(sensor_key: int, data: bytes) -> tuple[float, int]:
+    """
+    Decodes a single value of the given sensor key.
+
+    Returns the value and the amount of bytes it occupied.
+    """
+    fmt, scale, offset = VALUE_ENCODINGS.get(sensor_key, DEFAULT_VALUE_ENCODING)
+    size = struct.calcsize(fmt)
+    raw = struct.unpack(fmt, data[:size])[0]
+    if fmt == "<h":
+        value = float("nan") if raw == FIXED_NAN else raw * scale + offset
+    else:
+        value = raw * scale
+    return value, size
+
+
 async def process_measurement(
     session: AsyncSession, gateway_mac: MACAddress, node_mac: MACAddress, payload: bytes
 ) -> None:
     """
     Message format:
-    `[mac 6]:[timestamp 4]:[flags 1]:[sensorvalue_1 6]:...[sensorvalue_n 6]`
+    `[mac 6]:[timestamp 4]:[flags 1]:[size 1]:[sensorvalue_1]:...[sensorvalue_n]`
 
-    Each sensorvalue has the following format:
-    `[sensor_id 2]:[data 4 (float)]`
+    The size is the amount of bytes of sensor values that follow. Each sensorvalue has the
+    following format:
+    `[sensor_id 1]:[instance_id 1]:[data 2 or 4]`
+
+    The format of the data depends on the sensor id, see `VALUE_ENCODINGS`.
     """
     payload = payload[6:]  # skip over mac
     timestamp: int = struct.unpack("I", payload[:4])[0]
-    payload = payload[5:]  # skip over timestamp, flags
+    size: int = payload[5]
+    payload = payload[6 : 6 + size]  # skip over timestamp, flags, size
     print(f"sensor message: {gateway_mac}-{node_mac}-{timestamp}")
-    instance_tags: dict[int, int] = {}
-    while len(payload) > 0:
+    while len(payload) >= 2:
         sensor_key: int = payload[0]
-        if sensor_key not in instance_tags:
-            instance_tags[sensor_key] = 0
-
-        value: float = struct.unpack("f", payload[2:6])[0]
-        print(f"    sensor value: {sensor_key}-{instance_tags[sensor_key]}: {value}")
+        instance_tag: int = payload[1]
+        try:
+            value, value_size = decode_value(sensor_key, payload[2:])
+        except struct.error:
+            print(f"    truncated sensor value: {sensor_key}-{instance_tag}")
+            break
+        print(f"    sensor value: {sensor_key}-{instance_tag}: {value}")
 
         await add_measurement(
             session,
@@ -64,12 +100,11 @@ async def process_measurement(
             node_mac,
             timestamp,
             sensor_key,
-            instance_tags[sensor_key],
+            instance_tag,
             value,
         )
 
-        instance_tags[sensor_key] += 1
-        payload = payload[6:]  # skip over sensorvalue
+        payload = payload[2 + value_size :]  # skip over sensorvalue
 
 
 def process_measurement_sync(gateway_mac, node_mac, payload) -> None:
@@ -1,17 +1,37 @@
+import math
 import struct
 from random import random
 
 import pytest
 from conftest import gateway_macs, node_macs
 
-from mirra_backend.crud.measurement import process_measurement
+from mirra_backend.crud.measurement import decode_value, process_measurement
 
 
 @pytest.mark.asyncio
 async def test_process_measurement(test_db):
     gateway_mac = gateway_macs[0]
     node_mac = node_macs[0]
-    payload = node_mac.to_bytes() + struct.pack("I", 0) + struct.pack("B", 0)
-    for sensor_key in range(1, 4):
-        payload += struct.pack("Bx", sensor_key) + struct.pack("f", random())
+    values = b""
+    for sensor_key in (1, 4, 22, 7):
+        if sensor_key == 22:
+            values += struct.pack("<BBe", sensor_key, 0, random())
+        elif sensor_key == 7:
+            values += struct.pack("<BBf", sensor_key, 0, random())
+        else:
+            values += struct.pack("<BBh", sensor_key, 0, int(random() * 1000))
+    payload = (
+        node_mac.to_bytes()
+        + struct.pack("I", 0)
+        + struct.pack("B", 4)
+        + struct.pack("B", len(values))
+        + values
+    )
     await process_measurement(test_db, gateway_mac, node_mac, payload)
+
+
+def test_decode_value():
+    assert decode_value(4, struct.pack("<h", 2137)) == (21.37, 2)
+    assert math.isnan(decode_value(4, struct.pack("<h", -(2**15)))[0])
+    assert decode_value(22, struct.pack("<e", 1.5)) == (6.0, 2)
+    assert decode_value(7, struct.pack("<f", 0.5)) == (0.5, 4)